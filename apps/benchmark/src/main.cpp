@@ -0,0 +1,557 @@
+/*
+Entry point of the Benchmark application.
+
+The Benchmark measures the cost of common virt86 operations on every
+virtualization platform available on the system. Each benchmark is repeated a
+number of times and the minimum, average and maximum times are reported.
+Platform startup can only be measured once per process, as platforms are
+singletons.
+
+Usage: virt86-benchmark [iterations]
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/virt86.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cinttypes>
+#include <chrono>
+#include <vector>
+
+#if defined(VIRT86_SNAPSHOT_AVAILABLE)
+#  include <string>
+#  include <thread>
+#  include <sys/mman.h>
+#  include <sys/socket.h>
+#  include <unistd.h>
+#endif
+
+using namespace virt86;
+
+template<class T, size_t N>
+constexpr size_t array_size(T(&)[N]) {
+    return N;
+}
+
+using Clock = std::chrono::steady_clock;
+
+// Accumulates the timings of a benchmark
+struct Timings {
+    std::vector<double> samples;
+
+    void Add(const Clock::duration duration) {
+        samples.push_back(std::chrono::duration<double, std::milli>(duration).count());
+    }
+
+    void Print(const char *name) const {
+        if (samples.empty()) {
+            printf("    %-28s failed\n", name);
+            return;
+        }
+        double min = samples[0], max = samples[0], sum = 0.0;
+        for (auto sample : samples) {
+            if (sample < min) min = sample;
+            if (sample > max) max = sample;
+            sum += sample;
+        }
+        printf("    %-28s min %9.3f ms   avg %9.3f ms   max %9.3f ms\n", name, min, sum / samples.size(), max);
+    }
+};
+
+// Measures the time taken by lazily probed platform features on the first
+// query and once cached
+void benchmarkFeatureQueries(Platform& platform, const int iterations) {
+    printf("  Feature queries:\n");
+
+    Timings first;
+    const auto start = Clock::now();
+    platform.GetSupportedCustomCPUIDs();
+    first.Add(Clock::now() - start);
+    first.Print("Supported CPUIDs (first)");
+
+    Timings cached;
+    for (int i = 0; i < iterations; i++) {
+        const auto start = Clock::now();
+        platform.GetSupportedCustomCPUIDs();
+        cached.Add(Clock::now() - start);
+    }
+    cached.Print("Supported CPUIDs (cached)");
+}
+
+// Measures the time taken to create virtual machines with increasing numbers
+// of virtual processors
+void benchmarkVMCreation(Platform& platform, const int iterations) {
+    static const uint32_t kProcessorCounts[] = { 1, 4, 16, 64 };
+
+    printf("  VM creation:\n");
+    for (auto numProcessors : kProcessorCounts) {
+        if (numProcessors > platform.GetFeatures().maxProcessorsPerVM) {
+            break;
+        }
+
+        VMSpecifications specs = {};
+        specs.numProcessors = numProcessors;
+
+        Timings timings;
+        for (int i = 0; i < iterations; i++) {
+            const auto start = Clock::now();
+            auto opt_vm = platform.CreateVM(specs);
+            const auto end = Clock::now();
+            if (!opt_vm) {
+                break;
+            }
+            timings.Add(end - start);
+            platform.FreeVM(opt_vm->get());
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "%u VCPU%s", numProcessors, (numProcessors == 1) ? "" : "s");
+        timings.Print(name);
+    }
+}
+
+// Measures the time taken to clone a virtual machine whose guest memory is
+// allocated by the platform
+void benchmarkVMCloning(Platform& platform, const int iterations) {
+    static const uint64_t kMemorySize = 64 * 1024 * 1024;
+
+    if (!platform.GetFeatures().vmCloning) {
+        return;
+    }
+
+    printf("  VM cloning (%" PRIu64 " MiB):\n", kMemorySize >> 20);
+
+    VMSpecifications specs = {};
+    specs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(specs);
+    if (!opt_vm) {
+        return;
+    }
+    auto& vm = opt_vm->get();
+
+    void *memory;
+    if (vm.AllocateGuestMemory(0, kMemorySize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, &memory) != MemoryMappingStatus::OK) {
+        platform.FreeVM(vm);
+        return;
+    }
+    for (uint64_t offset = 0; offset < kMemorySize; offset += 0x1000) {
+        static_cast<uint8_t *>(memory)[offset] = static_cast<uint8_t>(offset >> 12);
+    }
+
+    Timings clones;
+    for (int i = 0; i < iterations; i++) {
+        const auto start = Clock::now();
+        auto opt_clone = platform.CloneVM(vm);
+        const auto end = Clock::now();
+        if (!opt_clone) {
+            break;
+        }
+        clones.Add(end - start);
+        platform.FreeVM(opt_clone->get());
+    }
+    clones.Print("Clone");
+
+    platform.FreeVM(vm);
+}
+
+// Measures the throughput of bulk guest memory operations on one thread and
+// on all host processors
+void benchmarkBulkMemory(Platform& platform, const int iterations) {
+    static const uint64_t kMemorySize = 256 * 1024 * 1024;
+
+    if (!platform.GetFeatures().guestMemoryAllocation) {
+        return;
+    }
+
+    printf("  Bulk memory (%" PRIu64 " MiB):\n", kMemorySize >> 20);
+
+    VMSpecifications specs = {};
+    specs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(specs);
+    if (!opt_vm) {
+        return;
+    }
+    auto& vm = opt_vm->get();
+
+    void *memory;
+    if (vm.AllocateGuestMemory(0, kMemorySize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, &memory) != MemoryMappingStatus::OK) {
+        platform.FreeVM(vm);
+        return;
+    }
+    for (uint64_t offset = 0; offset < kMemorySize; offset += 0x1000) {
+        static_cast<uint8_t *>(memory)[offset] = static_cast<uint8_t>(offset >> 12);
+    }
+    std::vector<uint8_t> buffer(kMemorySize);
+
+    BulkMemoryOptions singleThread;
+    singleThread.numThreads = 1;
+    singleThread.nonTemporalThreshold = UINT64_MAX;
+    const BulkMemoryOptions allThreads;
+
+    auto run = [&](const char *name, auto&& operation) {
+        Timings timings;
+        uint64_t bytesPerSecond = 0;
+        size_t threads = 0;
+        for (int i = 0; i < iterations; i++) {
+            BulkMemoryStatistics statistics;
+            if (operation(statistics) != BulkMemoryStatus::OK) {
+                break;
+            }
+            timings.Add(std::chrono::nanoseconds(statistics.elapsedNanos));
+            bytesPerSecond += statistics.bytesPerSecond / iterations;
+            threads = statistics.threads;
+        }
+        timings.Print(name);
+        if (!timings.samples.empty()) {
+            printf("    %-28s %9.1f MiB/s on %zu thread(s)\n", "", bytesPerSecond / 1048576.0, threads);
+        }
+    };
+
+    run("Copy (one thread)", [&](BulkMemoryStatistics& statistics) {
+        return vm.CopyGuestRange(0, kMemorySize, buffer.data(), BulkCopyDirection::GuestToHost, singleThread, &statistics);
+    });
+    run("Copy", [&](BulkMemoryStatistics& statistics) {
+        return vm.CopyGuestRange(0, kMemorySize, buffer.data(), BulkCopyDirection::GuestToHost, allThreads, &statistics);
+    });
+    run("Compare", [&](BulkMemoryStatistics& statistics) {
+        uint64_t firstDifference;
+        return vm.CompareGuestRange(0, kMemorySize, buffer.data(), &firstDifference, allThreads, &statistics);
+    });
+    run("Hash", [&](BulkMemoryStatistics& statistics) {
+        uint64_t hash;
+        return vm.HashGuestRange(0, kMemorySize, &hash, allThreads, &statistics);
+    });
+
+    // Zeroing releases the pages, so touch them again before every run
+    Timings zeroTimings;
+    for (int i = 0; i < iterations; i++) {
+        for (uint64_t offset = 0; offset < kMemorySize; offset += 0x1000) {
+            static_cast<uint8_t *>(memory)[offset] = 1;
+        }
+        const auto start = Clock::now();
+        if (vm.ZeroGuestMemory(0, kMemorySize) != MemoryMappingStatus::OK) {
+            break;
+        }
+        zeroTimings.Add(Clock::now() - start);
+    }
+    zeroTimings.Print("Zero");
+
+    platform.FreeVM(vm);
+}
+
+#if defined(VIRT86_SNAPSHOT_AVAILABLE)
+// Measures the time taken to write a snapshot of a virtual machine and to
+// restore it into a new virtual machine
+void benchmarkSnapshots(Platform& platform, const int iterations) {
+    static const uint64_t kMemorySize = 64 * 1024 * 1024;
+
+    if (!platform.GetFeatures().vpStateSaveRestore) {
+        return;
+    }
+
+    printf("  Snapshots (%" PRIu64 " MiB):\n", kMemorySize >> 20);
+
+    VMSpecifications specs = {};
+    specs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(specs);
+    if (!opt_vm) {
+        return;
+    }
+    auto& vm = opt_vm->get();
+
+    auto memory = static_cast<uint8_t *>(mmap(nullptr, kMemorySize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (memory == MAP_FAILED) {
+        platform.FreeVM(vm);
+        return;
+    }
+    for (uint64_t offset = 0; offset < kMemorySize; offset += 0x1000) {
+        memory[offset] = static_cast<uint8_t>(offset >> 12);
+    }
+    vm.MapGuestMemory(0, kMemorySize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute, memory);
+
+    char path[] = "/tmp/virt86-benchmark-XXXXXX";
+    const int fd = mkstemp(path);
+    if (fd < 0) {
+        platform.FreeVM(vm);
+        munmap(memory, kMemorySize);
+        return;
+    }
+    close(fd);
+
+    Timings writes;
+    snapshot::SnapshotWriter writer;
+    for (int i = 0; i < iterations; i++) {
+        if (writer.Write(vm, path) != snapshot::SnapshotStatus::OK) {
+            break;
+        }
+        writes.Add(std::chrono::nanoseconds(writer.GetStatistics().elapsedNanos));
+    }
+    writes.Print("Write");
+
+    Timings livePauses;
+    Timings liveWrites;
+    for (int i = 0; i < iterations; i++) {
+        if (writer.StartLive(vm, path) != snapshot::SnapshotStatus::OK || writer.FinishLive() != snapshot::SnapshotStatus::OK) {
+            break;
+        }
+        livePauses.Add(std::chrono::nanoseconds(writer.GetStatistics().pauseNanos));
+        liveWrites.Add(std::chrono::nanoseconds(writer.GetStatistics().elapsedNanos));
+    }
+    livePauses.Print("Live write (pause)");
+    liveWrites.Print("Live write (total)");
+
+    Timings restores;
+    for (int i = 0; i < iterations && !writes.samples.empty(); i++) {
+        auto opt_restoredVM = platform.CreateVM(specs);
+        if (!opt_restoredVM) {
+            break;
+        }
+        snapshot::Snapshot snapshot;
+        const auto start = Clock::now();
+        const bool restored = snapshot.Open(path) == snapshot::SnapshotStatus::OK
+            && snapshot.Restore(opt_restoredVM->get()) == snapshot::SnapshotStatus::OK;
+        const auto end = Clock::now();
+        platform.FreeVM(opt_restoredVM->get());
+        if (!restored) {
+            break;
+        }
+        restores.Add(end - start);
+    }
+    restores.Print("Open and restore");
+
+    unlink(path);
+    platform.FreeVM(vm);
+    munmap(memory, kMemorySize);
+}
+
+// Measures the time taken to migrate an idle virtual machine through a Unix
+// socket and the resulting downtime
+void benchmarkMigration(Platform& platform, const int iterations) {
+    static const uint64_t kMemorySize = 64 * 1024 * 1024;
+
+    const auto& features = platform.GetFeatures();
+    if (!features.vpStateSaveRestore || !features.dirtyPageTracking) {
+        return;
+    }
+
+    printf("  Migration (%" PRIu64 " MiB):\n", kMemorySize >> 20);
+
+    VMSpecifications specs = {};
+    specs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(specs);
+    if (!opt_vm) {
+        return;
+    }
+    auto& vm = opt_vm->get();
+
+    auto memory = static_cast<uint8_t *>(mmap(nullptr, kMemorySize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (memory == MAP_FAILED) {
+        platform.FreeVM(vm);
+        return;
+    }
+    for (uint64_t offset = 0; offset < kMemorySize; offset += 0x1000) {
+        memory[offset] = static_cast<uint8_t>(offset >> 12);
+    }
+    vm.MapGuestMemory(0, kMemorySize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute | MemoryFlags::DirtyPageTracking, memory);
+
+    Timings migrations;
+    Timings downtimes;
+    uint64_t bytesPerSecond = 0;
+    for (int i = 0; i < iterations; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+            break;
+        }
+
+        snapshot::MigrationReceiver receiver;
+        snapshot::MigrationStatus receiveStatus;
+        std::thread receiveThread([&] { receiveStatus = receiver.Receive(platform, specs, fds[1]); });
+        snapshot::MigrationSender sender;
+        const auto sendStatus = sender.Send(vm, fds[0], [] {});
+        close(fds[0]);
+        receiveThread.join();
+        close(fds[1]);
+        if (sendStatus != snapshot::MigrationStatus::OK || receiveStatus != snapshot::MigrationStatus::OK) {
+            break;
+        }
+        platform.FreeVM(receiver.GetVirtualMachine()->get());
+
+        migrations.Add(std::chrono::nanoseconds(sender.GetStatistics().elapsedNanos));
+        downtimes.Add(std::chrono::nanoseconds(sender.GetStatistics().downtimeNanos));
+        bytesPerSecond += sender.GetStatistics().bytesPerSecond / iterations;
+    }
+    migrations.Print("Migrate");
+    downtimes.Print("Downtime");
+    if (!migrations.samples.empty()) {
+        printf("    %-28s %9.1f MiB/s\n", "Throughput", bytesPerSecond / 1048576.0);
+    }
+
+    platform.FreeVM(vm);
+    munmap(memory, kMemorySize);
+}
+
+// Measures the time taken to write full and incremental snapshots of a
+// virtual machine into a page store and to restore them
+void benchmarkPageStore(Platform& platform, const int iterations) {
+    static const uint64_t kMemorySize = 64 * 1024 * 1024;
+
+    const auto& features = platform.GetFeatures();
+    if (!features.vpStateSaveRestore || !features.dirtyPageTracking) {
+        return;
+    }
+
+    printf("  Page store (%" PRIu64 " MiB):\n", kMemorySize >> 20);
+
+    VMSpecifications specs = {};
+    specs.numProcessors = 1;
+    auto opt_vm = platform.CreateVM(specs);
+    if (!opt_vm) {
+        return;
+    }
+    auto& vm = opt_vm->get();
+
+    auto memory = static_cast<uint8_t *>(mmap(nullptr, kMemorySize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (memory == MAP_FAILED) {
+        platform.FreeVM(vm);
+        return;
+    }
+    for (uint64_t offset = 0; offset < kMemorySize; offset += 0x1000) {
+        memory[offset] = static_cast<uint8_t>(offset >> 12);
+    }
+    vm.MapGuestMemory(0, kMemorySize, MemoryFlags::Read | MemoryFlags::Write | MemoryFlags::Execute | MemoryFlags::DirtyPageTracking, memory);
+
+    char directory[] = "/tmp/virt86-benchmark-XXXXXX";
+    if (mkdtemp(directory) == nullptr) {
+        platform.FreeVM(vm);
+        munmap(memory, kMemorySize);
+        return;
+    }
+    const std::string fullPath = std::string(directory) + "/full";
+    const std::string incrementalPath = std::string(directory) + "/incremental";
+
+    snapshot::PageStore store;
+    snapshot::PageStoreWriter writer(store);
+    Timings fullWrites;
+    Timings incrementalWrites;
+    uint64_t bytesPerSecond = 0;
+    if (store.Open(directory) == snapshot::SnapshotStatus::OK) {
+        for (int i = 0; i < iterations; i++) {
+            if (writer.Write(vm, fullPath.c_str()) != snapshot::SnapshotStatus::OK) {
+                break;
+            }
+            fullWrites.Add(std::chrono::nanoseconds(writer.GetStatistics().elapsedNanos));
+            bytesPerSecond += writer.GetStatistics().bytesPerSecond / iterations;
+        }
+    }
+    fullWrites.Print("Full write");
+    if (!fullWrites.samples.empty()) {
+        printf("    %-28s %9.1f MiB/s, %" PRIu64 " distinct pages\n", "Throughput", bytesPerSecond / 1048576.0, store.GetPageCount());
+    }
+
+    snapshot::PageStoreSnapshot full;
+    if (!fullWrites.samples.empty() && full.Open(store, fullPath.c_str()) == snapshot::SnapshotStatus::OK) {
+        for (int i = 0; i < iterations; i++) {
+            if (writer.WriteIncremental(vm, full, incrementalPath.c_str()) != snapshot::SnapshotStatus::OK) {
+                break;
+            }
+            incrementalWrites.Add(std::chrono::nanoseconds(writer.GetStatistics().elapsedNanos));
+        }
+    }
+    incrementalWrites.Print("Incremental write");
+
+    Timings restores;
+    for (int i = 0; i < iterations && !incrementalWrites.samples.empty(); i++) {
+        auto opt_restoredVM = platform.CreateVM(specs);
+        if (!opt_restoredVM) {
+            break;
+        }
+        snapshot::PageStoreSnapshot incremental;
+        const auto start = Clock::now();
+        const bool restored = incremental.Open(store, incrementalPath.c_str()) == snapshot::SnapshotStatus::OK
+            && incremental.Restore(opt_restoredVM->get()) == snapshot::SnapshotStatus::OK;
+        const auto end = Clock::now();
+        platform.FreeVM(opt_restoredVM->get());
+        if (!restored) {
+            break;
+        }
+        restores.Add(end - start);
+    }
+    restores.Print("Open and restore");
+
+    full.Close();
+    store.Close();
+    for (const char *name : { "/full", "/incremental", "/pages", "/index" }) {
+        unlink((std::string(directory) + name).c_str());
+    }
+    rmdir(directory);
+    platform.FreeVM(vm);
+    munmap(memory, kMemorySize);
+}
+#endif
+
+int main(int argc, char *argv[]) {
+    printf("virt86 Benchmark " VIRT86_VERSION "\n");
+    printf("Copyright (c) 2019 Ivan Roberto de Oliveira\n");
+    printf("\n");
+
+    int iterations = 10;
+    if (argc > 1) {
+        iterations = atoi(argv[1]);
+        if (iterations <= 0) {
+            printf("Usage: %s [iterations]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    if constexpr (array_size(PlatformFactories) == 0) {
+        printf("No virtualization platforms are available on this system\n");
+        return -1;
+    }
+
+    for (auto& platformFactory : PlatformFactories) {
+        // The first call to the factory initializes the platform
+        Timings startup;
+        const auto start = Clock::now();
+        auto& platform = platformFactory();
+        startup.Add(Clock::now() - start);
+        if (platform.GetInitStatus() != PlatformInitStatus::OK) {
+            continue;
+        }
+
+        printf("%s %s (%d iterations)\n", platform.GetName().c_str(), platform.GetVersion().c_str(), iterations);
+        startup.Print("Platform startup");
+        benchmarkFeatureQueries(platform, iterations);
+        benchmarkVMCreation(platform, iterations);
+        benchmarkVMCloning(platform, iterations);
+        benchmarkBulkMemory(platform, iterations);
+#if defined(VIRT86_SNAPSHOT_AVAILABLE)
+        benchmarkSnapshots(platform, iterations);
+        benchmarkMigration(platform, iterations);
+        benchmarkPageStore(platform, iterations);
+#endif
+        printf("\n");
+    }
+
+    return 0;
+}
@@ -137,19 +137,81 @@ int main() {
         printf("    Unrestricted guest: %s\n", (features.unrestrictedGuest) ? "supported" : "unsuported");
         printf("    Extended Page Tables: %s\n", (features.extendedPageTables) ? "supported" : "unsuported");
         printf("    Guest debugging: %s\n", (features.guestDebugging) ? "available" : "unavailable");
+        printf("    Time sliced execution: %s\n", (features.timeSlicedExecution) ? "supported" : "unsupported");
         printf("    Memory protection: %s\n", (features.guestMemoryProtection) ? "available" : "unavailable");
         printf("    Dirty page tracking: %s\n", (features.dirtyPageTracking) ? "available" : "unavailable");
         printf("    Partial dirty bitmap: %s\n", (features.partialDirtyBitmap) ? "supported" : "unsupported");
+        if (features.kvm.maxDirtyRingSize > 0) {
+            printf("    KVM dirty ring: up to %u entries per VCPU\n", features.kvm.maxDirtyRingSize);
+        }
+        if (features.kvm.manualDirtyLogProtect) {
+            printf("    KVM manual dirty log protection: supported\n");
+        }
+        const auto kvmDisabledExits = BitmaskEnum(features.kvm.disabledExits);
+        if (kvmDisabledExits) {
+            printf("    KVM exits that can be disabled:");
+            if (kvmDisabledExits.AnyOf(KvmDisabledExit::MWAIT)) printf(" MWAIT");
+            if (kvmDisabledExits.AnyOf(KvmDisabledExit::HLT)) printf(" HLT");
+            if (kvmDisabledExits.AnyOf(KvmDisabledExit::PAUSE)) printf(" PAUSE");
+            if (kvmDisabledExits.AnyOf(KvmDisabledExit::CState)) printf(" CState");
+            printf("\n");
+        }
+        if (features.kvm.haltPollControl) {
+            printf("    KVM halt polling control: supported\n");
+        }
         printf("    Large memory allocation: %s\n", (features.largeMemoryAllocation) ? "supported" : "unsuported");
         printf("    Memory aliasing: %s\n", (features.memoryAliasing) ? "supported" : "unsuported");
         printf("    Memory unmapping: %s\n", (features.memoryUnmapping) ? "supported" : "unsuported");
         printf("    Partial unmapping: %s\n", (features.partialUnmapping) ? "supported" : "unsuported");
         printf("    Partial MMIO instructions: %s\n", (features.partialMMIOInstructions) ? "yes" : "no");
         printf("    Guest TSC scaling: %s\n", (features.guestTSCScaling) ? "supported" : "unsupported");
+        printf("    Guest clock control: %s\n", (features.guestClock) ? "supported" : "unsupported");
+        printf("    Platform statistics: %s\n", (features.platformStatistics) ? "available" : "unavailable");
+        printf("    VCPU state save/restore: %s\n", (features.vpStateSaveRestore) ? "supported" : "unsupported");
+        printf("    Guest memory allocation: %s\n", (features.guestMemoryAllocation) ? "supported" : "unsupported");
+        printf("    VM cloning: %s\n", (features.vmCloning) ? "supported" : "unsupported");
+        // The supported KVM paravirtual features are reported in the KVM
+        // CPUID leaves, identified by the "KVMKVMKVM" signature
+        const auto& supportedCPUIDs = platform.GetSupportedCustomCPUIDs();
+        bool kvmSignature = false;
+        KvmParavirtFeature kvmParavirtFeaturesValue = KvmParavirtFeature::None;
+        for (auto& cpuid : supportedCPUIDs) {
+            if (cpuid.function == 0x40000000) {
+                kvmSignature = cpuid.ebx == 0x4b4d564b && cpuid.ecx == 0x564b4d56 && cpuid.edx == 0x0000004d;
+            }
+            else if (cpuid.function == 0x40000001 && kvmSignature) {
+                kvmParavirtFeaturesValue = static_cast<KvmParavirtFeature>(cpuid.eax);
+            }
+        }
+        const auto kvmParavirtFeatures = BitmaskEnum(kvmParavirtFeaturesValue);
+        if (kvmParavirtFeatures) {
+            printf("    KVM paravirtual features:");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::ClockSource)) printf(" ClockSource");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::NopIODelay)) printf(" NopIODelay");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::ClockSource2)) printf(" ClockSource2");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::AsyncPageFault)) printf(" AsyncPageFault");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::StealTime)) printf(" StealTime");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::PVEOI)) printf(" PVEOI");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::PVUnhalt)) printf(" PVUnhalt");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::PVTLBFlush)) printf(" PVTLBFlush");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::AsyncPageFaultVMExit)) printf(" AsyncPageFaultVMExit");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::PVSendIPI)) printf(" PVSendIPI");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::PollControl)) printf(" PollControl");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::PVSchedYield)) printf(" PVSchedYield");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::AsyncPageFaultInt)) printf(" AsyncPageFaultInt");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::MSIExtDestID)) printf(" MSIExtDestID");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::HCMapGPARange)) printf(" HCMapGPARange");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::MigrationControl)) printf(" MigrationControl");
+            if (kvmParavirtFeatures.AnyOf(KvmParavirtFeature::ClockSourceStable)) printf(" ClockSourceStable");
+            printf("\n");
+        }
+        if (features.kvm.enforceParavirtFeatures) {
+            printf("    KVM paravirtual feature enforcement: supported\n");
+        }
         printf("    Custom CPUID results: %s\n", (features.customCPUIDs) ? "supported" : "unsupported");
-        if (features.customCPUIDs && features.supportedCustomCPUIDs.size() > 0) {
+        if (features.customCPUIDs && supportedCPUIDs.size() > 0) {
             printf("       Function        EAX         EBX         ECX         EDX\n");
-            for (auto it = features.supportedCustomCPUIDs.cbegin(); it != features.supportedCustomCPUIDs.cend(); it++) {
+            for (auto it = supportedCPUIDs.cbegin(); it != supportedCPUIDs.cend(); it++) {
                 printf("      0x%08x = 0x%08x  0x%08x  0x%08x  0x%08x\n", it->function, it->eax, it->ebx, it->ecx, it->edx);
             }
         }
@@ -0,0 +1,181 @@
+/*
+Entry point of the Trace Decoder application.
+
+The Trace Decoder reads exit trace dumps produced by
+ExitTraceRing::WriteDump() and prints their records as human-readable text
+or as CSV for further processing.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/virt86.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+#include <vector>
+
+using namespace virt86;
+
+static const char *reasonName(const uint8_t reason) {
+    switch (static_cast<VMExitReason>(reason)) {
+    case VMExitReason::Normal: return "Normal";
+    case VMExitReason::Cancelled: return "Cancelled";
+    case VMExitReason::Interrupt: return "Interrupt";
+    case VMExitReason::PIO: return "PIO";
+    case VMExitReason::MMIO: return "MMIO";
+    case VMExitReason::Step: return "Step";
+    case VMExitReason::SoftwareBreakpoint: return "SoftwareBreakpoint";
+    case VMExitReason::HardwareBreakpoint: return "HardwareBreakpoint";
+    case VMExitReason::HLT: return "HLT";
+    case VMExitReason::CPUID: return "CPUID";
+    case VMExitReason::MSRAccess: return "MSRAccess";
+    case VMExitReason::Exception: return "Exception";
+    case VMExitReason::Shutdown: return "Shutdown";
+    case VMExitReason::Error: return "Error";
+    case VMExitReason::Unhandled: return "Unhandled";
+    case VMExitReason::TimeSliceExpired: return "TimeSliceExpired";
+    default: return "Unknown";
+    }
+}
+
+static void printUsage(const char *program) {
+    printf("Usage: %s [--csv] <dump file>\n", program);
+    printf("\n");
+    printf("  --csv  Print records as comma-separated values\n");
+}
+
+int main(int argc, char *argv[]) {
+    bool csv = false;
+    const char *path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--csv") == 0) {
+            csv = true;
+        }
+        else if (path == nullptr) {
+            path = argv[i];
+        }
+        else {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+    if (path == nullptr) {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return -1;
+    }
+
+    ExitTraceDumpHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, ExitTraceDumpHeader::kMagic, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s is not an exit trace dump\n", path);
+        fclose(file);
+        return -1;
+    }
+    if (header.version != ExitTraceDumpHeader::kVersion || header.recordSize != sizeof(ExitTraceRecord)) {
+        fprintf(stderr, "Unsupported dump version %u (record size %u)\n", header.version, header.recordSize);
+        fclose(file);
+        return -1;
+    }
+
+    // Never trust the record count further than the size of the file allows
+    uint64_t availableRecords = 0;
+    const long headerEnd = ftell(file);
+    if (headerEnd >= 0 && fseek(file, 0, SEEK_END) == 0) {
+        const long fileEnd = ftell(file);
+        if (fileEnd > headerEnd) {
+            availableRecords = static_cast<uint64_t>(fileEnd - headerEnd) / sizeof(ExitTraceRecord);
+        }
+        fseek(file, headerEnd, SEEK_SET);
+    }
+
+    std::vector<ExitTraceRecord> records(static_cast<size_t>(std::min(header.recordCount, availableRecords)));
+    const size_t count = fread(records.data(), sizeof(ExitTraceRecord), records.size(), file);
+    fclose(file);
+    if (count != header.recordCount) {
+        fprintf(stderr, "Dump is truncated: expected %" PRIu64 " records, found %zu\n", header.recordCount, count);
+    }
+
+    if (csv) {
+        printf("sequence,vcpu,tsc_enter,tsc_exit,guest_cycles,handling_cycles,reason,rip,address,size,value,write,failed\n");
+    }
+    else {
+        printf("VCPU %u: %zu records starting at sequence %" PRIu64 "\n", header.vcpuIndex, count, header.firstSequence);
+        printf("%12s %20s %12s %12s  %-18s %-18s %s\n", "Sequence", "TSC", "Guest", "Handling", "Reason", "RIP", "Access");
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const auto& record = records[i];
+        const uint64_t sequence = header.firstSequence + i;
+        const uint64_t guestCycles = record.tscExit - record.tscEnter;
+
+        // Userspace handling lasts until the next execution is requested
+        const bool hasNext = (i + 1 < count);
+        const uint64_t handlingCycles = hasNext ? records[i + 1].tscEnter - record.tscExit : 0;
+
+        const auto flags = BitmaskEnum(record.flags);
+        const bool ripValid = flags.AnyOf(ExitTraceFlags::RIPValid);
+        const bool accessValid = flags.AnyOf(ExitTraceFlags::AccessValid);
+        const bool write = flags.AnyOf(ExitTraceFlags::Write);
+        const bool failed = flags.AnyOf(ExitTraceFlags::Failed);
+        const char *reason = failed ? "Failed" : flags.AnyOf(ExitTraceFlags::ProfilerKick) ? "ProfilerKick" : reasonName(record.reason);
+
+        if (csv) {
+            printf("%" PRIu64 ",%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",", sequence, header.vcpuIndex, record.tscEnter, record.tscExit, guestCycles);
+            if (hasNext) printf("%" PRIu64, handlingCycles);
+            printf(",%s,", reason);
+            if (ripValid) printf("0x%" PRIx64, record.rip);
+            printf(",");
+            if (accessValid) printf("0x%" PRIx64 ",%u,0x%" PRIx64 ",%d", record.address, record.size, record.value, write ? 1 : 0);
+            else printf(",,,");
+            printf(",%d\n", failed ? 1 : 0);
+        }
+        else {
+            printf("%12" PRIu64 " %20" PRIu64 " %12" PRIu64 " ", sequence, record.tscEnter, guestCycles);
+            if (hasNext) printf("%12" PRIu64 "  ", handlingCycles);
+            else printf("%12s  ", "-");
+            printf("%-18s ", reason);
+            if (ripValid) printf("%016" PRIx64 "   ", record.rip);
+            else printf("%-18s ", "-");
+            if (accessValid) {
+                const char *kind;
+                switch (static_cast<VMExitReason>(record.reason)) {
+                case VMExitReason::PIO: kind = "port"; break;
+                case VMExitReason::MSRAccess: kind = "msr"; break;
+                default: kind = "mmio"; break;
+                }
+                printf("%s %s 0x%" PRIx64 " size %u value 0x%" PRIx64, kind, write ? "write" : "read", record.address, record.size, record.value);
+            }
+            printf("\n");
+        }
+    }
+
+    return 0;
+}
@@ -248,6 +248,46 @@ enum class ExtendedVMExit {
     TSCAccess = (1 << 3),     // Supports VM exit on TSC access (RDTSC, RDTSCP, RDMSR, WRMSR)
 };
 
+/**
+ * VM exits that can be disabled on KVM, letting the guest execute the
+ * corresponding instructions without leaving guest mode. Only suitable for
+ * guests whose virtual processors run on dedicated physical cores.
+ */
+enum class KvmDisabledExit {
+    None = 0,           // All exits are enabled
+
+    MWAIT = (1 << 0),   // MONITOR/MWAIT execute natively
+    HLT = (1 << 1),     // HLT executes natively; VMExitReason::HLT is no longer reported
+    PAUSE = (1 << 2),   // PAUSE no longer causes pause-loop exits
+    CState = (1 << 3),  // The guest may enter deep C-states directly
+};
+
+/**
+ * KVM paravirtual features advertised to the guest through CPUID leaf
+ * 0x40000001. The values match the bits in EAX.
+ */
+enum class KvmParavirtFeature : uint32_t {
+    None = 0,                         // No paravirtual features
+
+    ClockSource = (1 << 0),           // kvmclock through the legacy MSRs
+    NopIODelay = (1 << 1),            // Port 0x80 delays are unnecessary
+    ClockSource2 = (1 << 3),          // kvmclock through the new MSRs
+    AsyncPageFault = (1 << 4),        // Asynchronous page faults
+    StealTime = (1 << 5),             // Steal time accounting
+    PVEOI = (1 << 6),                 // Paravirtual end of interrupt
+    PVUnhalt = (1 << 7),              // Paravirtual spinlock kicks
+    PVTLBFlush = (1 << 9),            // Paravirtual TLB flushes
+    AsyncPageFaultVMExit = (1 << 10), // Asynchronous page faults delivered as VM exits to nested hypervisors
+    PVSendIPI = (1 << 11),            // Paravirtual IPIs
+    PollControl = (1 << 12),          // Guest-controlled host halt polling
+    PVSchedYield = (1 << 13),         // Paravirtual scheduler yield
+    AsyncPageFaultInt = (1 << 14),    // Asynchronous page fault completions delivered as interrupts
+    MSIExtDestID = (1 << 15),         // Extended destination IDs in MSI addresses
+    HCMapGPARange = (1 << 16),        // Map GPA range hypercall
+    MigrationControl = (1 << 17),     // Migration control MSR
+    ClockSourceStable = (1 << 24),    // The kvmclock is stable across processors
+};
+
 /**
  * Specifies the features supported by a virtualization platform.
  */
@@ -300,6 +340,12 @@ struct PlatformFeatures {
      */
     bool guestDebugging = false;
 
+    /**
+     * Virtual processors can be run for a bounded amount of time with
+     * VirtualProcessor::RunFor().
+     */
+    bool timeSlicedExecution = false;
+
     /**
      * Guest memory protection is available.
      */
@@ -367,19 +413,84 @@ struct PlatformFeatures {
 
     /**
      * Hypervisor allows custom CPUID results to be configured.
+     * The supported CPUID codes and their default responses can be retrieved
+     * with Platform::GetSupportedCustomCPUIDs().
      */
     bool customCPUIDs = false;
 
     /**
-     * Supported CPUID codes and their default responses. Only valid if custom
-     * CPUIDs are supported. Not all platforms fill this list.
+     * Guest TSC scaling and virtual TSC offset is supported.
      */
-    std::vector<CPUIDResult> supportedCustomCPUIDs;
+    bool guestTSCScaling = false;
 
     /**
-     * Guest TSC scaling and virtual TSC offset is supported.
+     * The guest's paravirtual clock can be read and adjusted with
+     * VirtualMachine::GetGuestClock() and SetGuestClock(), which keeps guest
+     * time stable across snapshots and restores.
      */
-    bool guestTSCScaling = false;
+    bool guestClock = false;
+
+    /**
+     * The hypervisor exposes its own statistics for virtual machines and
+     * virtual processors through GetPlatformStatistics().
+     */
+    bool platformStatistics = false;
+
+    /**
+     * The complete state of virtual processors, including pending events,
+     * the local APIC, the XSAVE area and MSRs, can be captured and restored
+     * with SaveState() and RestoreState().
+     */
+    bool vpStateSaveRestore = false;
+
+    /**
+     * Virtual machines can allocate guest memory that they own with
+     * VirtualMachine::AllocateGuestMemory().
+     */
+    bool guestMemoryAllocation = false;
+
+    /**
+     * Virtual machines can be cloned with Platform::CloneVM(). Guest memory
+     * allocated with VirtualMachine::AllocateGuestMemory() is shared
+     * copy-on-write between a virtual machine and its clones.
+     */
+    bool vmCloning = false;
+
+    /**
+     * KVM-specific features. Only filled in by the KVM platform.
+     */
+    struct {
+        /**
+         * Maximum number of entries in the per-VCPU dirty page rings, or zero
+         * if dirty rings are not supported. See VMSpecifications::kvm.
+         */
+        uint32_t maxDirtyRingSize = 0;
+
+        /**
+         * The set of VM exits that can be disabled with
+         * VMSpecifications::kvm.disabledExits.
+         */
+        KvmDisabledExit disabledExits = KvmDisabledExit::None;
+
+        /**
+         * The halt polling interval can be configured per VM with
+         * VMSpecifications::kvm.haltPollNanoseconds.
+         */
+        bool haltPollControl = false;
+
+        /**
+         * Manual dirty log protection is supported, allowing dirty pages to be
+         * cleared on subranges of memory slots without rereading the entire
+         * slot.
+         */
+        bool manualDirtyLogProtect = false;
+
+        /**
+         * KVM can restrict the guest to the advertised paravirtual features,
+         * injecting #GP on accesses to the MSRs of hidden features.
+         */
+        bool enforceParavirtFeatures = false;
+    } kvm;
 };
 
 }
@@ -387,3 +498,5 @@ struct PlatformFeatures {
 ENABLE_BITMASK_OPERATORS(virt86::FloatingPointExtension)
 ENABLE_BITMASK_OPERATORS(virt86::ExtendedControlRegister)
 ENABLE_BITMASK_OPERATORS(virt86::ExtendedVMExit)
+ENABLE_BITMASK_OPERATORS(virt86::KvmDisabledExit)
+ENABLE_BITMASK_OPERATORS(virt86::KvmParavirtFeature)
@@ -52,6 +52,7 @@ SOFTWARE.
 #include <vector>
 #include <optional>
 #include <memory>
+#include <mutex>
 
 namespace virt86 {
 
@@ -109,6 +110,16 @@ public:
      */
     const PlatformFeatures& GetFeatures() const noexcept { return m_features; }
 
+    /**
+     * Retrieves the CPUID codes supported by the platform and their default
+     * responses. Only valid if custom CPUIDs are supported. Not all platforms
+     * fill this list.
+     *
+     * The list is queried from the hypervisor on the first call and cached
+     * for subsequent calls.
+     */
+    const std::vector<CPUIDResult>& GetSupportedCustomCPUIDs() const;
+
     /**
      * Creates a new virtual machine with the specified parameters.
      *
@@ -117,6 +128,29 @@ public:
      */
     const std::optional<std::reference_wrapper<VirtualMachine>> CreateVM(const VMSpecifications& specifications);
 
+    /**
+     * Creates a new virtual machine that is a copy of the given template
+     * virtual machine, which must have been created with this platform and
+     * must not be running.
+     *
+     * The clone has the same specifications, memory layout, virtual processor
+     * states and guest clock as the template. Guest memory allocated with
+     * VirtualMachine::AllocateGuestMemory() is shared copy-on-write, so that
+     * each clone only consumes memory for the pages it writes to; all other
+     * guest memory is copied.
+     *
+     * The template must outlive every clone made from it. While clones
+     * exist, the template's shared memory must be left untouched: writes to
+     * it, whether by the template's guest, by the host or through
+     * VirtualMachine::DiscardGuestMemory() or
+     * VirtualMachine::ZeroGuestMemory(), show up in every clone in the pages
+     * that clone has not written to yet.
+     *
+     * This is an optional operation, supported by platforms that provide the
+     * VM cloning feature.
+     */
+    const std::optional<std::reference_wrapper<VirtualMachine>> CloneVM(const VirtualMachine& tmpl);
+
     /**
      * Destroys the virtual machine if it was created with this platform.
      *
@@ -141,6 +175,13 @@ protected:
      */
     virtual std::unique_ptr<VirtualMachine> CreateVMImpl(const VMSpecifications& specifications) = 0;
 
+    /**
+     * Queries the CPUID codes supported by the platform and their default
+     * responses. Invoked at most once, on the first call to
+     * GetSupportedCustomCPUIDs().
+     */
+    virtual void LoadSupportedCustomCPUIDs(std::vector<CPUIDResult>& cpuids) const {}
+
     /**
      * The platform's name.
      */
@@ -167,6 +208,12 @@ private:
      * Stores all virtual machines created with this platform
      */
     std::vector<std::unique_ptr<VirtualMachine>> m_vms;
+
+    /**
+     * Lazily loaded list of supported CPUID codes
+     */
+    mutable std::once_flag m_supportedCustomCPUIDsFlag;
+    mutable std::vector<CPUIDResult> m_supportedCustomCPUIDs;
 };
 
 }
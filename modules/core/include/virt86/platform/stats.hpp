@@ -0,0 +1,140 @@
+/*
+Defines the structures used to report statistics collected by the underlying
+hypervisor for virtual machines and virtual processors.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace virt86 {
+
+/**
+ * How the value of a platform statistic evolves over time.
+ */
+enum class PlatformStatisticType {
+    Cumulative,       // Monotonically increasing counter
+    Instant,          // Current value, may increase or decrease
+    Peak,             // Highest value observed so far
+    LinearHistogram,  // Histogram with buckets of equal size
+    LogHistogram,     // Histogram with buckets of exponentially increasing size
+};
+
+/**
+ * The unit of a platform statistic.
+ */
+enum class PlatformStatisticUnit {
+    None,       // Plain count
+    Bytes,      // Amount of memory
+    Seconds,    // Amount of time
+    Cycles,     // Amount of CPU clock cycles
+    Boolean,    // Zero or one
+};
+
+/**
+ * Describes one statistic reported by the hypervisor.
+ */
+struct PlatformStatisticDescriptor {
+    /**
+     * The name of the statistic, as reported by the hypervisor.
+     */
+    std::string name;
+
+    PlatformStatisticType type;
+    PlatformStatisticUnit unit;
+
+    /**
+     * Scale of the values, which must be multiplied by base^exponent to
+     * obtain the amount in the statistic's unit. The base is either 2 or 10.
+     * For example, a value in nanoseconds has base 10 and exponent -9.
+     */
+    uint32_t base;
+    int32_t exponent;
+
+    /**
+     * Index of the first value of this statistic in
+     * PlatformStatistics::values.
+     */
+    size_t index;
+
+    /**
+     * Number of values of this statistic. Histograms have one value per
+     * bucket; all other statistics have a single value.
+     */
+    size_t count;
+
+    /**
+     * Size of each bucket of a linear histogram.
+     */
+    uint32_t bucketSize;
+};
+
+/**
+ * A snapshot of the statistics collected by the hypervisor.
+ *
+ * The schema is decoded once and shared between snapshots taken from the
+ * same virtual machine or virtual processor. Reusing the same object for
+ * periodic snapshots avoids all allocations after the first one.
+ */
+struct PlatformStatistics {
+    /**
+     * Descriptions of the statistics in this snapshot.
+     */
+    std::shared_ptr<const std::vector<PlatformStatisticDescriptor>> schema;
+
+    /**
+     * The values of all statistics, laid out as described by the schema.
+     */
+    std::vector<uint64_t> values;
+
+    /**
+     * Finds the descriptor of the statistic with the given name, or nullptr
+     * if there is no such statistic.
+     */
+    const PlatformStatisticDescriptor *Find(const std::string& name) const noexcept {
+        if (schema) {
+            for (auto& descriptor : *schema) {
+                if (descriptor.name == name) {
+                    return &descriptor;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * Retrieves the first value of the statistic with the given name, or zero
+     * if there is no such statistic.
+     */
+    uint64_t Value(const std::string& name) const noexcept {
+        auto descriptor = Find(name);
+        return (descriptor != nullptr) ? values[descriptor->index] : 0;
+    }
+};
+
+}
@@ -0,0 +1,99 @@
+/*
+Fast non-cryptographic 64-bit hashing, used to checksum and identify blocks of
+guest memory.
+
+The hash function is XXH64, which produces stable results across hosts and
+builds and can therefore be stored in files.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace virt86 {
+
+/**
+ * Computes the 64-bit hash of the given block of memory.
+ */
+uint64_t Hash64(const void *data, const size_t size, const uint64_t seed = 0) noexcept;
+
+/**
+ * A 128-bit hash value.
+ */
+struct Hash128Value {
+    uint64_t low;
+    uint64_t high;
+
+    bool operator==(const Hash128Value& other) const noexcept { return low == other.low && high == other.high; }
+    bool operator!=(const Hash128Value& other) const noexcept { return !(*this == other); }
+};
+
+/**
+ * Computes the 128-bit hash of the given block of memory, suitable for
+ * identifying blocks by their contents. The two halves are the 64-bit hashes
+ * of the block with two different seeds, computed in a single pass over the
+ * data.
+ */
+Hash128Value Hash128(const void *data, const size_t size) noexcept;
+
+/**
+ * Computes the 128-bit hash of the given block of memory with the halves
+ * seeded by the given value. A secret random seed keeps the hashes, and thus
+ * their collisions, unpredictable to whoever controls the data.
+ */
+Hash128Value Hash128(const void *data, const size_t size, const Hash128Value& seed) noexcept;
+
+/**
+ * Computes a 64-bit hash incrementally. Feeding the same bytes in any number
+ * of Update() calls produces the same result as Hash64().
+ */
+class Hasher64 {
+public:
+    explicit Hasher64(const uint64_t seed = 0) noexcept { Reset(seed); }
+
+    /**
+     * Restarts the computation with the given seed.
+     */
+    void Reset(const uint64_t seed = 0) noexcept;
+
+    /**
+     * Feeds a block of memory into the hash.
+     */
+    void Update(const void *data, size_t size) noexcept;
+
+    /**
+     * Computes the hash of all data fed so far. Does not modify the state.
+     */
+    uint64_t Digest() const noexcept;
+
+private:
+    uint64_t m_acc[4];
+    uint64_t m_seed;
+    uint64_t m_totalSize;
+    uint8_t m_buffer[32];
+    size_t m_bufferSize;
+};
+
+}
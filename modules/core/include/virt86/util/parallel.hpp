@@ -0,0 +1,125 @@
+/*
+Spreads work across multiple threads. Work is handed to a pool of threads that
+persists across calls, and batches are handed out dynamically, so that uneven
+batches balance out.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace virt86 {
+
+/**
+ * A process-wide pool of worker threads shared by all ParallelFor() calls.
+ * Threads are created on demand, up to one per host processor, and kept
+ * until the process exits. The pool is never destroyed, so that it remains
+ * usable from static destructors.
+ */
+class WorkerPool {
+public:
+    /**
+     * Retrieves the pool.
+     */
+    static WorkerPool& Instance() noexcept;
+
+    /**
+     * Invokes task(context) on the calling thread and on up to numHelpers
+     * pool threads, and waits for all of them to finish. Helpers that did not
+     * get to start by the time the calling thread is done are not run. The
+     * number of helpers is limited by the size of the pool.
+     *
+     * Returns the number of threads that ran the task, including the calling
+     * thread.
+     */
+    size_t Run(const size_t numHelpers, void (*task)(void *), void *context) noexcept;
+
+    // Prevent copy construction and copy assignment
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // Prevent move construction and move assignment
+    WorkerPool(WorkerPool&&) = delete;
+    WorkerPool&& operator=(WorkerPool&&) = delete;
+
+private:
+    struct Job {
+        void (*task)(void *);
+        void *context;
+        size_t active;
+        size_t started;
+        std::condition_variable done;
+    };
+
+    WorkerPool() noexcept = default;
+
+    void Work() noexcept;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::deque<Job *> m_queue;
+    size_t m_numThreads = 0;
+    const size_t m_maxThreads = std::max(1u, std::thread::hardware_concurrency());
+};
+
+/**
+ * Invokes fn(begin, end) on consecutive batches of at most batchSize items
+ * out of count, spread across up to numThreads threads including the calling
+ * thread. A numThreads of 0 uses one thread per host processor.
+ *
+ * Returns the number of threads that ran, including the calling thread.
+ */
+template<typename Fn>
+size_t ParallelFor(size_t numThreads, const uint64_t count, const uint64_t batchSize, Fn&& fn) {
+    if (numThreads == 0) {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    numThreads = static_cast<size_t>(std::min<uint64_t>(numThreads, (count + batchSize - 1) / batchSize));
+
+    std::atomic<uint64_t> next{ 0 };
+    auto worker = [&] {
+        for (;;) {
+            const uint64_t begin = next.fetch_add(batchSize, std::memory_order_relaxed);
+            if (begin >= count) {
+                break;
+            }
+            fn(begin, std::min(count, begin + batchSize));
+        }
+    };
+
+    if (numThreads <= 1) {
+        worker();
+        return 1;
+    }
+    return WorkerPool::Instance().Run(numThreads - 1, [](void *context) { (*static_cast<decltype(worker) *>(context))(); }, &worker);
+}
+
+}
@@ -0,0 +1,69 @@
+/*
+Static tracepoints (USDT probes) placed in virt86's hot paths.
+
+When virt86 is built with the VIRT86_ENABLE_USDT option on a system that
+provides <sys/sdt.h>, each probe compiles to a single NOP instruction plus
+an ELF note describing its location and arguments. Tools such as bpftrace
+and perf can attach to the probes at runtime; unattached probes have no
+measurable cost and there is no runtime dependency. Without the option, the
+probes compile to nothing and their arguments are not evaluated.
+
+All probes belong to the "virt86" provider. Virtual machines are identified
+by their address and virtual processors by their index within the VM:
+
+  run_entry(vm, vcpu)                         Execution requested
+  run_exit(vm, vcpu, status, reason)          Execution finished
+  pio(vm, vcpu, port, size, write)            PIO exit being handled
+  mmio(vm, vcpu, address, size, write)        MMIO exit being handled
+  interrupt_inject(vm, vcpu, vector)          Pending interrupt injected
+  memory_map(vm, address, size, status)       Guest memory mapped
+  dirty_query(vm, address, size, status)      Dirty pages queried
+  l2p_miss(vm, vcpu, address)                 Linear address translation failed
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#if defined(VIRT86_ENABLE_USDT)
+
+#include <sys/sdt.h>
+
+#define VIRT86_PROBE0(name)                             STAP_PROBE(virt86, name)
+#define VIRT86_PROBE1(name, a1)                         STAP_PROBE1(virt86, name, a1)
+#define VIRT86_PROBE2(name, a1, a2)                     STAP_PROBE2(virt86, name, a1, a2)
+#define VIRT86_PROBE3(name, a1, a2, a3)                 STAP_PROBE3(virt86, name, a1, a2, a3)
+#define VIRT86_PROBE4(name, a1, a2, a3, a4)             STAP_PROBE4(virt86, name, a1, a2, a3, a4)
+#define VIRT86_PROBE5(name, a1, a2, a3, a4, a5)         STAP_PROBE5(virt86, name, a1, a2, a3, a4, a5)
+#define VIRT86_PROBE6(name, a1, a2, a3, a4, a5, a6)     STAP_PROBE6(virt86, name, a1, a2, a3, a4, a5, a6)
+
+#else
+
+#define VIRT86_PROBE0(name)                             do { } while (0)
+#define VIRT86_PROBE1(name, a1)                         do { } while (0)
+#define VIRT86_PROBE2(name, a1, a2)                     do { } while (0)
+#define VIRT86_PROBE3(name, a1, a2, a3)                 do { } while (0)
+#define VIRT86_PROBE4(name, a1, a2, a3, a4)             do { } while (0)
+#define VIRT86_PROBE5(name, a1, a2, a3, a4, a5)         do { } while (0)
+#define VIRT86_PROBE6(name, a1, a2, a3, a4, a5, a6)     do { } while (0)
+
+#endif
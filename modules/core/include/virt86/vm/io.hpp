@@ -36,6 +36,10 @@ using IOWriteFunc_t = void(*)(void *context, uint16_t port, size_t size, uint32_
 using MMIOReadFunc_t = uint64_t(*)(void *context, uint64_t address, size_t size);
 using MMIOWriteFunc_t = void(*)(void *context, uint64_t address, size_t size, uint64_t value);
 
+// MSR callbacks return false to raise a general protection fault in the guest
+using MSRReadFunc_t = bool(*)(void *context, uint32_t msr, uint64_t *value);
+using MSRWriteFunc_t = bool(*)(void *context, uint32_t msr, uint64_t value);
+
 struct IOHandlers {
     IOReadFunc_t IOReadFunc;
     IOWriteFunc_t IOWriteFunc;
@@ -43,12 +47,18 @@ struct IOHandlers {
     MMIOReadFunc_t MMIOReadFunc;
     MMIOWriteFunc_t MMIOWriteFunc;
 
+    MSRReadFunc_t MSRReadFunc;
+    MSRWriteFunc_t MSRWriteFunc;
+
     uint32_t IORead(uint16_t port, size_t size) const noexcept { return IOReadFunc(context, port, size); }
     void IOWrite(uint16_t port, size_t size, uint32_t value) const noexcept { return IOWriteFunc(context, port, size, value); }
 
     uint64_t MMIORead(uint64_t address, size_t size) const noexcept { return MMIOReadFunc(context, address, size); }
     void MMIOWrite(uint64_t address, size_t size, uint64_t value) const noexcept { return MMIOWriteFunc(context, address, size, value); }
 
+    bool MSRRead(uint32_t msr, uint64_t *value) const noexcept { return MSRReadFunc(context, msr, value); }
+    bool MSRWrite(uint32_t msr, uint64_t value) const noexcept { return MSRWriteFunc(context, msr, value); }
+
     void *context;
 };
 
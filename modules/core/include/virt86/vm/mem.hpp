@@ -27,6 +27,7 @@ SOFTWARE.
 
 #include "virt86/util/bitmask_enum.hpp"
 
+#include <cstddef>
 #include <cstdint>
 
 namespace virt86 {
@@ -44,16 +45,67 @@ struct MemoryRegion {
     uint64_t baseAddress = 0;
     uint64_t size = 0;
     void *hostMemory = nullptr;
+    MemoryFlags flags = MemoryFlags::None;
 
     MemoryRegion() = default;
 
-    MemoryRegion(uint64_t baseAddress, uint64_t size, void *hostMemory) noexcept
+    MemoryRegion(uint64_t baseAddress, uint64_t size, void *hostMemory, MemoryFlags flags = MemoryFlags::None) noexcept
         : baseAddress(baseAddress)
         , size(size)
         , hostMemory(hostMemory)
+        , flags(flags)
     {}
 };
 
+/**
+ * The direction of a bulk copy between guest memory and a host buffer.
+ */
+enum class BulkCopyDirection {
+    GuestToHost,
+    HostToGuest,
+};
+
+/**
+ * The size of the blocks that bulk memory operations hand out to threads.
+ * HashGuestRange() hashes blocks of this size independently.
+ */
+constexpr uint64_t kBulkMemoryBlockSize = 1024 * 1024;
+
+/**
+ * Options for bulk guest memory operations.
+ */
+struct BulkMemoryOptions {
+    /**
+     * The maximum number of threads, including the calling thread. 0 uses one
+     * thread per host processor.
+     */
+    size_t numThreads = 0;
+
+    /**
+     * The minimum number of bytes each thread works on. Ranges smaller than
+     * twice this value are handled by the calling thread alone.
+     */
+    uint64_t bytesPerThread = 8 * 1024 * 1024;
+
+    /**
+     * Copies of at least this many bytes use non-temporal stores, which
+     * bypass the cache instead of evicting the working set of the host with
+     * data that will not be read again soon. UINT64_MAX disables them.
+     */
+    uint64_t nonTemporalThreshold = 32 * 1024 * 1024;
+};
+
+/**
+ * Information about a bulk guest memory operation.
+ */
+struct BulkMemoryStatistics {
+    uint64_t bytes = 0;            // Bytes processed
+    uint64_t elapsedNanos = 0;     // Time taken by the operation
+    uint64_t bytesPerSecond = 0;   // Throughput of the operation
+    size_t threads = 0;            // Threads used, including the calling thread
+    bool nonTemporal = false;      // Whether non-temporal stores were used
+};
+
 }
 
 ENABLE_BITMASK_OPERATORS(virt86::MemoryFlags)
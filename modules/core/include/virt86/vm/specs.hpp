@@ -31,10 +31,26 @@ SOFTWARE.
 #include "virt86/platform/features.hpp"
 #include "virt86/vp/cpuid.hpp"
 
+#include <optional>
 #include <vector>
 
 namespace virt86 {
 
+/**
+ * A range of consecutive model specific registers.
+ */
+struct MSRRange {
+    /**
+     * The first MSR in the range.
+     */
+    uint32_t base;
+
+    /**
+     * The number of MSRs in the range.
+     */
+    uint32_t count;
+};
+
 /**
  * Virtual machine specifications.
  */
@@ -56,8 +72,18 @@ struct VMSpecifications {
      */
     std::vector<uint32_t> vmExitCPUIDFunctions;
 
+    /**
+     * MSRs to trigger a VM exit when exit on MSR access is enabled. Accesses
+     * to all other MSRs are handled by the hypervisor. If empty, all MSR
+     * accesses trigger a VM exit. Platforms that cannot filter MSR accesses
+     * exit on all MSRs.
+     */
+    std::vector<MSRRange> vmExitMSRs;
+
     /**
      * Exception codes to trigger a VM exit when exit on exceptions is enabled.
+     * Only the codes listed in PlatformFeatures::exceptionExits are
+     * intercepted; all other exceptions are delivered to the guest.
      */
     ExceptionCode vmExitExceptions;
 
@@ -67,7 +93,9 @@ struct VMSpecifications {
     std::vector<CPUIDResult> CPUIDResults;
 
     /**
-     * Guest TSC frequency to use. A value of zero means no adjustment.
+     * Guest TSC frequency to use, in Hz. A value of zero means no adjustment.
+     * Requires PlatformFeatures::guestTSCScaling; creating a VM with a nonzero
+     * frequency fails on platforms that do not support it.
      */
     uint64_t guestTSCFrequency;
 
@@ -81,6 +109,51 @@ struct VMSpecifications {
          * value of 0xfffbc000.
          */
         uint32_t identityMapPageAddress = 0xfffbc000;
+
+        /**
+         * Number of entries in the per-VCPU dirty page rings. When nonzero,
+         * KVM logs dirty pages into rings that are harvested by
+         * QueryDirtyPages() instead of scanning the dirty bitmap of the whole
+         * memory slot, so that the cost of collecting dirty pages scales with
+         * the number of pages dirtied rather than with the size of the guest.
+         *
+         * Must be a power of two between 256 and the maximum reported in
+         * PlatformFeatures::kvm.maxDirtyRingSize. If the ring cannot be
+         * configured, dirty bitmaps are used instead.
+         */
+        uint32_t dirtyRingSize = 0;
+
+        /**
+         * VM exits to disable, letting idle or spinning virtual processors
+         * stay in guest mode instead of returning to the host. This reduces
+         * wake-up latency for guests with dedicated physical cores, but
+         * lets them monopolize those cores. Exits not listed in
+         * PlatformFeatures::kvm.disabledExits are left enabled.
+         */
+        KvmDisabledExit disabledExits = KvmDisabledExit::None;
+
+        /**
+         * Maximum time in nanoseconds that KVM polls for a wake-up event
+         * before putting a halted virtual processor to sleep. Zero disables
+         * halt polling. If not specified, the host's default is used.
+         * Requires PlatformFeatures::kvm.haltPollControl.
+         */
+        std::optional<uint32_t> haltPollNanoseconds;
+
+        /**
+         * Paravirtual features advertised to the guest in the KVM CPUID
+         * leaves (0x40000000 and 0x40000001), letting it use kvmclock, PV EOI
+         * and PV unhalt instead of trapping on timers, EOIs and halts.
+         * Features not supported by the host, as reported in EAX of leaf
+         * 0x40000001 in Platform::GetSupportedCustomCPUIDs(), are ignored.
+         * If None, the KVM leaves are hidden from the guest. If not
+         * specified, the host's defaults are used. A custom CPUID result for
+         * leaf 0x40000001 takes precedence over this setting.
+         *
+         * When PlatformFeatures::kvm.enforceParavirtFeatures is supported,
+         * the guest is restricted to the advertised features.
+         */
+        std::optional<KvmParavirtFeature> paravirtFeatures;
     } kvm;
 };
 
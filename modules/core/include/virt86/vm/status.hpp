@@ -43,6 +43,20 @@ enum class MemoryMappingStatus {
     OutOfBounds,               // Attempted to allocate GPA range beyond the host's limit
 };
 
+enum class GuestClockStatus {
+    OK,
+
+    Unsupported,               // The guest clock cannot be accessed on this platform
+    Failed,                    // Failed to read or adjust the guest clock
+};
+
+enum class PlatformStatisticsStatus {
+    OK,
+
+    Unsupported,               // The hypervisor does not expose statistics
+    Failed,                    // Failed to read the statistics
+};
+
 enum class DirtyPageTrackingStatus {
     OK,
 
@@ -57,4 +71,12 @@ enum class DirtyPageTrackingStatus {
     Failed,                    // Failed to query dirty pages
 };
 
+enum class BulkMemoryStatus {
+    OK,
+
+    EmptyRange,                // Cannot operate on an empty memory range (size = 0)
+    InvalidRange,              // The range is not entirely mapped to guest memory
+    InvalidArguments,          // Invalid arguments (such as null pointers) were specified
+};
+
 }
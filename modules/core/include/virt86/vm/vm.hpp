@@ -53,6 +53,7 @@ SOFTWARE.
 
 #include "../vp/vp.hpp"
 #include "../platform/features.hpp"
+#include "../platform/stats.hpp"
 
 #include "io.hpp"
 #include "mem.hpp"
@@ -131,10 +132,32 @@ public:
      */
     MemoryMappingStatus UnmapGuestMemory(const uint64_t baseAddress, const uint64_t size);
 
+    /**
+     * Allocates a block of host memory owned by this virtual machine and maps
+     * it to the guest at the specified address. The block is released when
+     * the virtual machine is destroyed. If memory is not null, it receives the
+     * address of the host memory block.
+     *
+     * Memory allocated this way is shared copy-on-write with virtual machines
+     * cloned from this one with Platform::CloneVM().
+     *
+     * This is an optional operation, supported by platforms that provide the
+     * guest memory allocation feature.
+     */
+    MemoryMappingStatus AllocateGuestMemory(const uint64_t baseAddress, const uint64_t size, const MemoryFlags flags, void **memory = nullptr);
+
+    /**
+     * Retrieves the memory regions currently mapped to the guest, along with
+     * the host memory blocks backing them and the flags they were mapped with.
+     */
+    const std::vector<MemoryRegion>& GetMemoryRegions() const noexcept { return m_memoryRegions; }
+
     /**
      * Changes flags for a region of guest memory.
      *
      * The base address and size must be aligned to the page size (4 KiB).
+     * Regions returned by GetMemoryRegions() that are only partially covered
+     * by the range are split at its boundaries.
      *
      * This is an optional operation, supported by platforms that provide the
      * guest memory protection feature.
@@ -163,6 +186,36 @@ public:
      */
     DirtyPageTrackingStatus ClearDirtyPages(const uint64_t baseAddress, const uint64_t size) noexcept;
 
+    /**
+     * Retrieves the current value of the guest's paravirtual clock, in
+     * nanoseconds.
+     *
+     * This is an optional operation, supported by platforms that provide the
+     * guest clock feature.
+     */
+    GuestClockStatus GetGuestClock(uint64_t *nanoseconds) noexcept;
+
+    /**
+     * Sets the guest's paravirtual clock to the specified value, in
+     * nanoseconds. Restoring the value retrieved with GetGuestClock() when
+     * resuming a saved virtual machine keeps guest time monotonic.
+     *
+     * This is an optional operation, supported by platforms that provide the
+     * guest clock feature.
+     */
+    GuestClockStatus SetGuestClock(const uint64_t nanoseconds) noexcept;
+
+    /**
+     * Retrieves the statistics collected by the hypervisor for this virtual
+     * machine, such as page faults, TLB flushes and memory slot updates.
+     * Reusing the same PlatformStatistics object across calls keeps periodic
+     * polling cheap. May be invoked from any thread.
+     *
+     * This is an optional operation, supported by platforms that provide the
+     * platform statistics feature.
+     */
+    PlatformStatisticsStatus GetPlatformStatistics(PlatformStatistics& statistics) noexcept;
+
     /**
      * Reads a portion of physical memory into the specified value.
      */
@@ -173,6 +226,67 @@ public:
      */
     bool MemWrite(const uint64_t paddr, const uint64_t size, const void *value) const noexcept;
 
+    /**
+     * Copies a range of physical memory into a host buffer or a host buffer
+     * into physical memory, spreading large ranges across multiple threads.
+     * The range may span several memory regions, but must be entirely mapped.
+     * Pages written to in regions with dirty page tracking are reported as
+     * dirty.
+     *
+     * Statistics about the operation are stored in statistics, if provided.
+     */
+    BulkMemoryStatus CopyGuestRange(const uint64_t paddr, const uint64_t size, void *buffer, const BulkCopyDirection direction, const BulkMemoryOptions& options = {}, BulkMemoryStatistics *statistics = nullptr) const noexcept;
+
+    /**
+     * Compares a range of physical memory with a host buffer, spreading large
+     * ranges across multiple threads. firstDifference receives the offset of
+     * the first byte that differs, or size if the contents are equal.
+     */
+    BulkMemoryStatus CompareGuestRange(const uint64_t paddr, const uint64_t size, const void *data, uint64_t *firstDifference, const BulkMemoryOptions& options = {}, BulkMemoryStatistics *statistics = nullptr) const noexcept;
+
+    /**
+     * Computes a 64-bit hash of a range of physical memory, spreading large
+     * ranges across multiple threads. The range is split into blocks of
+     * kBulkMemoryBlockSize bytes, each hashed with Hash64(), and the result
+     * is the Hash64() of the block hashes. It does not depend on the number
+     * of threads, but differs from the Hash64() of the whole range.
+     */
+    BulkMemoryStatus HashGuestRange(const uint64_t paddr, const uint64_t size, uint64_t *hash, const BulkMemoryOptions& options = {}, BulkMemoryStatistics *statistics = nullptr) const noexcept;
+
+    /**
+     * Discards the contents of a page-aligned range of physical memory and
+     * releases the host memory backing it where possible. The range may span
+     * several memory regions, but must be entirely mapped.
+     *
+     * Discarded pages read as zeros, except in memory that is privately
+     * mapped from a file or shared with a template virtual machine, where
+     * they revert to the contents of the underlying file or template. Pages
+     * in regions with dirty page tracking are reported dirty.
+     *
+     * The virtual processors should not be running, since the guest may
+     * observe the range while it is being discarded.
+     */
+    MemoryMappingStatus DiscardGuestMemory(const uint64_t baseAddress, const uint64_t size) noexcept;
+
+    /**
+     * Fills a range of physical memory with zeros. Whole pages are discarded
+     * as with DiscardGuestMemory() where that leaves them zero-filled, so that
+     * the host memory backing them is released; any other part of the range
+     * is cleared in place. The range may span several memory regions, but
+     * must be entirely mapped. Pages in regions with dirty page tracking are
+     * reported dirty.
+     *
+     * In memory shared with a template virtual machine, the pages are
+     * replaced with fresh anonymous memory and no longer refer to the
+     * template: a later DiscardGuestMemory() of those pages yields zeros
+     * rather than the template's contents.
+     *
+     * The virtual processors must not be running: guest writes that race
+     * with the range being discarded or replaced may be lost or may survive
+     * the operation, leaving the range partially non-zero.
+     */
+    MemoryMappingStatus ZeroGuestMemory(const uint64_t baseAddress, const uint64_t size) noexcept;
+
     /**
      * Registers a callback function for the I/O read operation.
      * nullptr specifies the no-op handler.
@@ -197,6 +311,26 @@ public:
      */
     void RegisterMMIOWriteCallback(const MMIOWriteFunc_t func) noexcept;
 
+    /**
+     * Registers a callback function for MSR reads that exit to the host.
+     * nullptr specifies the no-op handler.
+     *
+     * Only invoked by platforms that complete MSR accesses on behalf of the
+     * guest. Other platforms report VMExitReason::MSRAccess and leave the
+     * access for the caller to emulate.
+     */
+    void RegisterMSRReadCallback(const MSRReadFunc_t func) noexcept;
+
+    /**
+     * Registers a callback function for MSR writes that exit to the host.
+     * nullptr specifies the no-op handler.
+     *
+     * Only invoked by platforms that complete MSR accesses on behalf of the
+     * guest. Other platforms report VMExitReason::MSRAccess and leave the
+     * access for the caller to emulate.
+     */
+    void RegisterMSRWriteCallback(const MSRWriteFunc_t func) noexcept;
+
     /**
      * Registers a pointer to arbitrary data to be passed down to the I/O
      * callback functions.
@@ -275,6 +409,63 @@ protected:
      */
     virtual DirtyPageTrackingStatus ClearDirtyPagesImpl(const uint64_t baseAddress, const uint64_t size) noexcept;
 
+    /**
+     * Reads the guest's paravirtual clock.
+     */
+    virtual GuestClockStatus GetGuestClockImpl(uint64_t *nanoseconds) noexcept;
+
+    /**
+     * Adjusts the guest's paravirtual clock.
+     */
+    virtual GuestClockStatus SetGuestClockImpl(const uint64_t nanoseconds) noexcept;
+
+    /**
+     * Reads the hypervisor's statistics for this virtual machine.
+     */
+    virtual PlatformStatisticsStatus GetPlatformStatisticsImpl(PlatformStatistics& statistics) noexcept;
+
+    /**
+     * Allocates a page-aligned block of zero-filled host memory owned by this
+     * virtual machine that can be shared copy-on-write with clones. Returns
+     * nullptr on failure.
+     */
+    virtual void *AllocateGuestMemoryImpl(const uint64_t size) noexcept;
+
+    /**
+     * Creates a copy-on-write view owned by this virtual machine of a block
+     * of host memory from another virtual machine of the same platform.
+     * Returns nullptr if the block was not allocated in a way that allows
+     * sharing, in which case it is copied instead.
+     */
+    virtual void *CloneGuestMemoryImpl(const VirtualMachine& source, const void *memory, const uint64_t size) noexcept;
+
+    /**
+     * Releases a block of host memory returned by AllocateGuestMemoryImpl()
+     * or CloneGuestMemoryImpl().
+     */
+    virtual void FreeGuestMemoryImpl(void *memory, const uint64_t size) noexcept;
+
+    /**
+     * Releases the host memory backing a page-aligned block of guest memory.
+     * If zero is true, the block must read as zeros afterwards; otherwise its
+     * contents may revert to those of the file or template it is mapped
+     * from. Returns false if the memory cannot be released this way, in
+     * which case it is cleared in place.
+     */
+    virtual bool DiscardHostMemoryImpl(void *memory, const uint64_t size, const bool zero) noexcept;
+
+    /**
+     * Reports the pages of a page-aligned range of guest memory with dirty
+     * page tracking enabled as dirty, after the host modified them without
+     * going through the guest.
+     *
+     * The dirty log is mutable bookkeeping rather than observable state, so
+     * const methods such as MemWrite() invoke this on every host write.
+     * Implementations must neither block nor allocate, and must tolerate
+     * dirty pages being queried or cleared concurrently.
+     */
+    virtual void MarkDirtyPagesImpl(const uint64_t baseAddress, const uint64_t size) noexcept;
+
     /**
      * Retrieves a pointer to the memory region that contains the given GPA.
      * 
@@ -310,6 +501,22 @@ protected:
 private:
     void SubtractMemoryRange(uint64_t baseAddress, uint64_t size);
 
+    /**
+     * Splits a range of physical memory into spans that are each backed by
+     * contiguous host memory, in ascending order of address. Mappings made
+     * later take precedence over earlier, overlapping ones.
+     *
+     * Returns false if any part of the range is not mapped.
+     */
+    bool ResolveGuestRange(const uint64_t paddr, const uint64_t size, std::vector<MemoryRegion>& spans) const noexcept;
+
+    /**
+     * Copies the guest memory, virtual processor states and guest clock of
+     * the source virtual machine into this freshly created one. Invoked by
+     * Platform::CloneVM().
+     */
+    bool CloneFrom(VirtualMachine& source) noexcept;
+
     /**
      * Stores all virtual processors owned by this virtual machine.
      */
@@ -0,0 +1,208 @@
+/*
+Defines the guest sampling profiler, which periodically samples the
+instruction pointer of virtual processors to find out where guests spend
+their time without instrumenting them.
+
+Samples are taken at the end of executions once the sampling period has
+elapsed. On platforms that support time sliced execution, Run() additionally
+kicks the virtual processor out of the guest once every sampling period, so
+that samples are taken even when the guest rarely exits.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+namespace virt86 {
+
+class VirtualProcessor;
+
+/**
+ * Resolves a guest address into a symbol name. Returns the symbol name and
+ * writes the offset of the address from the start of the symbol to offset,
+ * or returns nullptr if the address cannot be resolved.
+ *
+ * Guest symbols can be resolved against ELF files loaded with the Elf class
+ * from the Linux system module through an adapter that invokes
+ * Elf::LookupSymbol() with the address.
+ */
+using SymbolizeFunc_t = const char *(*)(void *context, uint64_t addressSpace, uint64_t address, uint64_t *offset);
+
+/**
+ * A single entry of a guest profile: the number of samples taken at a given
+ * instruction pointer in a given address space.
+ */
+struct GuestProfileEntry {
+    uint64_t addressSpace;    // CR3 at the time of the samples
+    uint64_t rip;             // Guest instruction pointer
+    uint8_t cpl;              // Current privilege level (from CS)
+    uint64_t count;           // Number of samples
+};
+
+/**
+ * Statistics about the profiler itself.
+ */
+struct GuestProfilerStatistics {
+    uint64_t samples;                         // Number of samples taken
+    uint64_t failedSamples;                   // Number of samples that could not read registers
+    uint64_t droppedSamples;                  // Number of samples at new locations that did not fit in the sample table
+    uint64_t kicks;                           // Number of exits forced by the profiler to take samples
+    std::chrono::nanoseconds samplingTime;    // Total time spent taking samples, across all virtual processors
+    std::chrono::nanoseconds wallTime;        // Time since the profiler was created or reset
+
+    /**
+     * Fraction of wall time spent taking samples. With multiple virtual
+     * processors, this is the overhead summed across all of them.
+     */
+    double Overhead() const noexcept {
+        return (wallTime.count() == 0) ? 0.0 : static_cast<double>(samplingTime.count()) / wallTime.count();
+    }
+};
+
+/**
+ * Samples RIP, CR3 and CS from virtual processors and aggregates the samples
+ * into per-address space histograms.
+ *
+ * A single profiler may be shared by any number of virtual processors; attach
+ * it with VirtualProcessor::SetProfiler(). Samples are recorded on the thread
+ * running each virtual processor.
+ *
+ * Samples are aggregated into a table of distinct locations that is allocated
+ * up front, so that taking a sample never allocates memory. Samples at new
+ * locations are dropped once the table is full.
+ */
+class GuestProfiler {
+public:
+    /**
+     * The default number of distinct locations the profiler can hold.
+     */
+    static constexpr size_t kDefaultMaxLocations = 65536;
+
+    /**
+     * Creates a profiler that samples each virtual processor at most once
+     * every sampling period and aggregates samples at up to maxLocations
+     * distinct locations.
+     */
+    explicit GuestProfiler(const std::chrono::nanoseconds samplingPeriod, const size_t maxLocations = kDefaultMaxLocations);
+
+    GuestProfiler(const GuestProfiler&) = delete;
+    GuestProfiler& operator=(const GuestProfiler&) = delete;
+
+    /**
+     * Retrieves the sampling period.
+     */
+    std::chrono::nanoseconds GetSamplingPeriod() const noexcept { return std::chrono::nanoseconds(m_samplingPeriod.load(std::memory_order_relaxed)); }
+
+    /**
+     * Changes the sampling period. Takes effect after the next sample of each
+     * virtual processor.
+     */
+    void SetSamplingPeriod(const std::chrono::nanoseconds samplingPeriod) noexcept { m_samplingPeriod.store(samplingPeriod.count(), std::memory_order_relaxed); }
+
+    /**
+     * Sets the function used to resolve symbols when writing folded stacks.
+     */
+    void SetSymbolizer(const SymbolizeFunc_t func, void *context) noexcept;
+
+    /**
+     * Samples the given virtual processor. Invoked by the virtual processor
+     * at the end of executions once the sampling period has elapsed. kicked
+     * indicates that the execution was interrupted solely to take the sample.
+     */
+    void Sample(VirtualProcessor& vp, const bool kicked) noexcept;
+
+    /**
+     * Retrieves all samples collected so far, sorted by descending count.
+     */
+    std::vector<GuestProfileEntry> GetProfile() const;
+
+    /**
+     * Retrieves statistics about the profiler's own overhead.
+     */
+    GuestProfilerStatistics GetStatistics() const noexcept;
+
+    /**
+     * Discards all samples and statistics.
+     */
+    void Reset() noexcept;
+
+    /**
+     * Writes the profile in the folded stacks format used by flame graph
+     * tools. Each line has the form:
+     *
+     *   cr3_<address space>;ring<cpl>;<symbol> <count>
+     *
+     * Addresses that cannot be resolved by the symbolizer are written in
+     * hexadecimal.
+     *
+     * Returns true if the output was written successfully.
+     */
+    bool WriteFoldedStacks(std::FILE *file) const;
+
+private:
+    std::atomic<std::chrono::nanoseconds::rep> m_samplingPeriod;
+
+    SymbolizeFunc_t m_symbolizer;
+    void *m_symbolizerContext;
+
+    struct SampleKey {
+        uint64_t addressSpace;
+        uint64_t rip;
+        uint8_t cpl;
+
+        bool operator==(const SampleKey& other) const noexcept {
+            return addressSpace == other.addressSpace && rip == other.rip && cpl == other.cpl;
+        }
+    };
+
+    // An entry of the open-addressed sample table; a count of zero marks an
+    // empty slot
+    struct SampleSlot {
+        SampleKey key;
+        uint64_t count;
+    };
+
+    static size_t HashKey(const SampleKey& key) noexcept {
+        const uint64_t hash = (key.rip ^ (key.addressSpace * 0x9E3779B97F4A7C15ull) ^ key.cpl) * 0xFF51AFD7ED558CCDull;
+        return static_cast<size_t>(hash ^ (hash >> 32));
+    }
+
+    mutable std::mutex m_mutex;
+    std::vector<SampleSlot> m_slots;   // Power of two, kept at most half full
+    size_t m_maxLocations;
+    size_t m_numLocations;
+    uint64_t m_numSamples;
+    uint64_t m_failedSamples;
+    uint64_t m_droppedSamples;
+    uint64_t m_kicks;
+    std::chrono::nanoseconds m_samplingTime;
+    std::chrono::steady_clock::time_point m_startTime;
+};
+
+}
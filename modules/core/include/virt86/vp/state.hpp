@@ -0,0 +1,245 @@
+/*
+Defines the structure that holds the complete state of a virtual processor,
+as captured by VirtualProcessor::SaveState() and applied by
+VirtualProcessor::RestoreState().
+
+The structure is a fixed-size, trivially copyable block with a version and
+size header, which allows it to be stored in files or sent across processes
+as is. Restoring a state is only supported on the same platform that saved it.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/util/bitmask_enum.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace virt86 {
+
+/**
+ * Groups of registers and control state captured in a VPState.
+ */
+enum class VPStateGroup : uint32_t {
+    None = 0,
+
+    Registers = (1 << 0),         // General purpose registers, RIP and RFLAGS
+    SystemRegisters = (1 << 1),   // Segment, table and control registers, EFER and APIC base
+    DebugRegisters = (1 << 2),    // DR0-DR3, DR6 and DR7
+    XSAVE = (1 << 3),             // x87, SSE, AVX and other XSAVE-managed state
+    XCRs = (1 << 4),              // Extended control registers
+    Events = (1 << 5),            // Pending and in-flight exceptions, interrupts and NMIs
+    MPState = (1 << 6),           // Multiprocessor state
+    LAPIC = (1 << 7),             // Local APIC registers
+    MSRs = (1 << 8),              // Model specific registers
+};
+
+/**
+ * Multiprocessor state of a virtual processor.
+ */
+enum class VPMPState : uint32_t {
+    Runnable,        // Running or ready to run
+    Uninitialized,   // Waiting for an INIT signal
+    InitReceived,    // Received an INIT signal and is waiting for a SIPI
+    Halted,          // Halted by a HLT instruction
+    SIPIReceived,    // Received a SIPI
+};
+
+/**
+ * A segment register. The attributes follow the VMX access rights layout,
+ * which matches RegValue::segment.attributes with the addition of the
+ * unusable flag in bit 16.
+ */
+struct VPSegmentState {
+    uint64_t base;
+    uint32_t limit;
+    uint16_t selector;
+    uint16_t reserved;
+    uint32_t attributes;
+    uint32_t reserved2;
+};
+
+/**
+ * The unusable flag of VPSegmentState::attributes.
+ */
+constexpr uint32_t VPSegmentUnusable = (1u << 16);
+
+/**
+ * A descriptor table register.
+ */
+struct VPTableState {
+    uint64_t base;
+    uint16_t limit;
+    uint16_t reserved[3];
+};
+
+/**
+ * Exceptions, interrupts and NMIs that were being delivered or were pending
+ * when the state was saved.
+ */
+struct VPEventState {
+    uint8_t exceptionInjected;
+    uint8_t exceptionVector;
+    uint8_t exceptionHasErrorCode;
+    uint8_t exceptionPending;
+    uint32_t exceptionErrorCode;
+
+    uint8_t interruptInjected;
+    uint8_t interruptVector;
+    uint8_t interruptSoft;
+    uint8_t interruptShadow;   // Interrupts blocked by STI or MOV SS
+
+    uint8_t nmiInjected;
+    uint8_t nmiPending;
+    uint8_t nmiMasked;
+    uint8_t smmValid;          // The SMM fields below are valid
+
+    uint8_t smm;
+    uint8_t smiPending;
+    uint8_t smmInsideNMI;
+    uint8_t latchedInit;
+
+    uint32_t sipiVector;
+};
+
+/**
+ * A model specific register.
+ */
+struct VPMSRState {
+    uint32_t index;
+    uint32_t reserved;
+    uint64_t value;
+};
+
+/**
+ * The complete state of a virtual processor.
+ *
+ * Only the groups listed in the groups field are valid. Interrupts enqueued
+ * with VirtualProcessor::EnqueueInterrupt() that were not yet injected are not
+ * part of the state.
+ */
+struct VPState {
+    /**
+     * The layout version of this structure.
+     */
+    static constexpr uint32_t CurrentVersion = 1;
+
+    /**
+     * Maximum number of MSRs in a state.
+     */
+    static constexpr size_t MaxMSRs = 256;
+
+    /**
+     * Size of the XSAVE area, in bytes.
+     */
+    static constexpr size_t XSAVESize = 4096;
+
+    /**
+     * Size of the local APIC register page, in bytes.
+     */
+    static constexpr size_t LAPICSize = 1024;
+
+    // ----- Header -----------------------------------------------------------
+
+    uint32_t version;     // Must be CurrentVersion
+    uint32_t size;        // Must be sizeof(VPState)
+    VPStateGroup groups;  // Valid groups
+    uint32_t numMSRs;     // Number of valid entries in msrs
+
+    // ----- Registers --------------------------------------------------------
+
+    /**
+     * General purpose registers in encoding order: RAX, RCX, RDX, RBX, RSP,
+     * RBP, RSI, RDI, R8 to R15.
+     */
+    uint64_t gpr[16];
+    uint64_t rip;
+    uint64_t rflags;
+
+    // ----- System registers -------------------------------------------------
+
+    /**
+     * Segment registers in encoding order: ES, CS, SS, DS, FS, GS, followed
+     * by LDTR and TR.
+     */
+    VPSegmentState segments[8];
+    VPTableState gdtr;
+    VPTableState idtr;
+
+    uint64_t cr0;
+    uint64_t cr2;
+    uint64_t cr3;
+    uint64_t cr4;
+    uint64_t cr8;
+    uint64_t efer;
+    uint64_t apicBase;
+
+    // ----- Debug registers --------------------------------------------------
+
+    uint64_t dr[4];
+    uint64_t dr6;
+    uint64_t dr7;
+
+    // ----- Extended control registers ---------------------------------------
+
+    uint64_t xcr0;
+
+    // ----- Events and multiprocessor state ----------------------------------
+
+    VPEventState events;
+    VPMPState mpState;
+    uint32_t numDroppedMSRs;  // Number of MSRs that did not fit in msrs
+
+    // ----- Large blocks -----------------------------------------------------
+
+    /**
+     * The XSAVE area, in the standard (non-compacted) format.
+     */
+    alignas(64) uint8_t xsave[XSAVESize];
+
+    /**
+     * The local APIC register page.
+     */
+    uint8_t lapic[LAPICSize];
+
+    /**
+     * Model specific registers. Only the first numMSRs entries are valid.
+     */
+    VPMSRState msrs[MaxMSRs];
+};
+
+static_assert(std::is_trivially_copyable_v<VPState>, "VPState must be trivially copyable");
+
+/**
+ * MSRs from a VPState that the hypervisor refused to restore.
+ */
+struct VPRejectedMSRs {
+    uint32_t count;                      // Number of valid entries in indices
+    uint32_t indices[VPState::MaxMSRs];
+};
+
+}
+
+ENABLE_BITMASK_OPERATORS(virt86::VPStateGroup)
@@ -0,0 +1,334 @@
+/*
+Defines per-virtual processor execution statistics: VM exit counters and
+latency histograms.
+
+Statistics are only collected when virt86 is built with the
+VIRT86_ENABLE_STATISTICS option. Otherwise, the collector compiles down to
+nothing and no overhead is added to the execution paths.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "status.hpp"
+
+#if defined(VIRT86_ENABLE_STATISTICS)
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace virt86 {
+
+/**
+ * The number of distinct VM exit reasons. Must follow the last value of
+ * VMExitReason.
+ */
+constexpr size_t NumVMExitReasons = static_cast<size_t>(VMExitReason::TimeSliceExpired) + 1;
+
+/**
+ * A log-linear latency histogram with nanosecond resolution.
+ *
+ * Values below 2^SubBucketBits are recorded exactly. Larger values are split
+ * into 2^SubBucketBits linear sub-buckets for every power of two, which bounds
+ * the relative error of any recorded value to 1/2^SubBucketBits (12.5%) while
+ * covering the entire 64-bit range in a few hundred buckets.
+ */
+struct LatencyHistogram {
+    static constexpr size_t SubBucketBits = 3;
+    static constexpr size_t SubBucketCount = size_t(1) << SubBucketBits;
+    static constexpr size_t NumBuckets = (64 - SubBucketBits + 1) * SubBucketCount;
+
+    /**
+     * Number of samples recorded in each bucket.
+     */
+    uint64_t counts[NumBuckets];
+
+    /**
+     * Total number of samples recorded.
+     */
+    uint64_t totalCount;
+
+    /**
+     * Sum of all recorded samples, in nanoseconds.
+     */
+    uint64_t totalNanoseconds;
+
+    /**
+     * Computes the index of the bucket that holds the given value.
+     */
+    static size_t BucketIndex(const uint64_t nanoseconds) noexcept {
+        if (nanoseconds < SubBucketCount) {
+            return static_cast<size_t>(nanoseconds);
+        }
+#if defined(_MSC_VER)
+        unsigned long msb;
+        _BitScanReverse64(&msb, nanoseconds);
+#else
+        const size_t msb = 63 - __builtin_clzll(nanoseconds);
+#endif
+        const size_t shift = msb - SubBucketBits;
+        return (shift + 1) * SubBucketCount + ((nanoseconds >> shift) & (SubBucketCount - 1));
+    }
+
+    /**
+     * Computes the smallest value that falls into the bucket at the given
+     * index.
+     */
+    static constexpr uint64_t BucketLowerBound(const size_t index) noexcept {
+        if (index < SubBucketCount) {
+            return index;
+        }
+        const size_t shift = index / SubBucketCount - 1;
+        return (SubBucketCount + index % SubBucketCount) << shift;
+    }
+
+    /**
+     * Computes the largest value that falls into the bucket at the given
+     * index.
+     */
+    static constexpr uint64_t BucketUpperBound(const size_t index) noexcept {
+        return (index + 1 < NumBuckets) ? BucketLowerBound(index + 1) - 1 : UINT64_MAX;
+    }
+
+    /**
+     * Retrieves the value at the given percentile (between 0.0 and 100.0).
+     * The result is the upper bound of the bucket that contains the
+     * percentile, or zero if the histogram is empty.
+     */
+    uint64_t Percentile(const double percentile) const noexcept;
+
+    /**
+     * Computes the mean of all recorded samples, or zero if the histogram is
+     * empty.
+     */
+    uint64_t Mean() const noexcept {
+        return (totalCount == 0) ? 0 : totalNanoseconds / totalCount;
+    }
+};
+
+/**
+ * A snapshot of the statistics collected by a virtual processor.
+ */
+struct VPStatistics {
+    /**
+     * Maximum number of distinct I/O ports tracked individually.
+     */
+    static constexpr size_t MaxTrackedPorts = 64;
+
+    /**
+     * Maximum number of distinct MMIO pages tracked individually.
+     */
+    static constexpr size_t MaxTrackedMMIOPages = 64;
+
+    /**
+     * Number of VM exits, indexed by VMExitReason.
+     */
+    uint64_t exits[NumVMExitReasons];
+
+    /**
+     * Number of executions interrupted by the guest profiler to take a
+     * sample. These are not counted in exits.
+     */
+    uint64_t profilerKicks;
+
+    /**
+     * Number of PIO exits per I/O port. Only the first numPorts entries are
+     * valid.
+     */
+    struct PortCount {
+        uint16_t port;
+        uint64_t count;
+    } ports[MaxTrackedPorts];
+    size_t numPorts;
+
+    /**
+     * Number of PIO exits on ports that did not fit in the ports table.
+     */
+    uint64_t untrackedPIO;
+
+    /**
+     * Number of MMIO exits per guest physical page (4 KiB). Only the first
+     * numMMIOPages entries are valid.
+     */
+    struct MMIOPageCount {
+        uint64_t address;
+        uint64_t count;
+    } mmioPages[MaxTrackedMMIOPages];
+    size_t numMMIOPages;
+
+    /**
+     * Number of MMIO exits on pages that did not fit in the MMIO pages table.
+     */
+    uint64_t untrackedMMIO;
+
+    /**
+     * Time spent inside the hypervisor's run call on each execution, which
+     * mostly consists of time spent running guest code.
+     */
+    LatencyHistogram guestTime;
+
+    /**
+     * Time spent handling each VM exit in userspace, including I/O and MMIO
+     * callbacks.
+     */
+    LatencyHistogram handlingTime;
+
+    /**
+     * Retrieves the number of exits with the specified reason.
+     */
+    uint64_t Exits(const VMExitReason reason) const noexcept {
+        return exits[static_cast<size_t>(reason)];
+    }
+};
+
+#if defined(VIRT86_ENABLE_STATISTICS)
+
+/**
+ * Collects statistics for a single virtual processor.
+ *
+ * The recording functions must only be invoked from the thread that runs the
+ * virtual processor. They never block: every counter has a single writer and
+ * is updated with relaxed atomic operations, so snapshots may be taken from
+ * any thread at any time without stopping the virtual processor.
+ */
+class VPStatisticsCollector {
+public:
+    VPStatisticsCollector() noexcept;
+
+    /**
+     * Marks the beginning of an execution.
+     */
+    void BeginRun() noexcept {
+        m_runStart = Now();
+        m_guestEnd = 0;
+    }
+
+    /**
+     * Marks the point where the hypervisor returned control to virt86.
+     * Platforms invoke this right after their run call returns. If not
+     * invoked, the whole execution is accounted as guest time.
+     */
+    void EndGuest() noexcept {
+        m_guestEnd = Now();
+    }
+
+    /**
+     * Records a PIO exit on the given port.
+     */
+    void RecordPIO(const uint16_t port) noexcept;
+
+    /**
+     * Records an MMIO exit on the given guest physical address.
+     */
+    void RecordMMIO(const uint64_t address) noexcept;
+
+    /**
+     * Marks the end of an execution that exited for the given reason, or
+     * that was interrupted by the guest profiler if profilerKick is true.
+     */
+    void EndRun(const VMExitReason reason, const bool profilerKick = false) noexcept;
+
+    /**
+     * Copies the statistics collected since the last reset.
+     */
+    void Snapshot(VPStatistics& statistics) const noexcept;
+
+    /**
+     * Resets all statistics.
+     */
+    void Reset() noexcept;
+
+private:
+    // All counters live in a single flat array, which allows snapshots and
+    // resets to treat them uniformly. Resetting records a baseline that is
+    // subtracted from subsequent snapshots, so that the writer never has to
+    // synchronize with readers.
+    static constexpr size_t kExitsBase = 0;
+    static constexpr size_t kProfilerKicks = kExitsBase + NumVMExitReasons;
+    static constexpr size_t kPortsBase = kProfilerKicks + 1;
+    static constexpr size_t kUntrackedPIO = kPortsBase + VPStatistics::MaxTrackedPorts;
+    static constexpr size_t kMMIOBase = kUntrackedPIO + 1;
+    static constexpr size_t kUntrackedMMIO = kMMIOBase + VPStatistics::MaxTrackedMMIOPages;
+    static constexpr size_t kGuestTimeBase = kUntrackedMMIO + 1;
+    static constexpr size_t kGuestTimeSum = kGuestTimeBase + LatencyHistogram::NumBuckets;
+    static constexpr size_t kHandlingTimeBase = kGuestTimeSum + 1;
+    static constexpr size_t kHandlingTimeSum = kHandlingTimeBase + LatencyHistogram::NumBuckets;
+    static constexpr size_t kNumCounters = kHandlingTimeSum + 1;
+
+    std::atomic<uint64_t> m_counters[kNumCounters];
+
+    // Open-addressed tables mapping ports and MMIO pages to counter slots.
+    // A key of zero marks an empty slot; stored keys are offset by one.
+    std::atomic<uint32_t> m_portKeys[VPStatistics::MaxTrackedPorts];
+    std::atomic<uint64_t> m_mmioKeys[VPStatistics::MaxTrackedMMIOPages];
+
+    mutable std::mutex m_baselineMutex;
+    uint64_t m_baseline[kNumCounters];
+
+    uint64_t m_runStart = 0;
+    uint64_t m_guestEnd = 0;
+
+    void Increment(const size_t index, const uint64_t amount = 1) noexcept {
+        auto& counter = m_counters[index];
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    void RecordLatency(const size_t base, const uint64_t nanoseconds) noexcept {
+        Increment(base + LatencyHistogram::BucketIndex(nanoseconds));
+        Increment(base + LatencyHistogram::NumBuckets, nanoseconds);
+    }
+
+    void SnapshotHistogram(LatencyHistogram& histogram, const uint64_t *counters, const size_t base) const noexcept;
+
+    static uint64_t Now() noexcept {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+};
+
+#else
+
+/**
+ * Statistics collector stub used when statistics are disabled. All recording
+ * functions are no-ops that compile to nothing.
+ */
+class VPStatisticsCollector {
+public:
+    void BeginRun() noexcept {}
+    void EndGuest() noexcept {}
+    void RecordPIO(const uint16_t) noexcept {}
+    void RecordMMIO(const uint64_t) noexcept {}
+    void EndRun(const VMExitReason, const bool = false) noexcept {}
+};
+
+#endif
+
+}
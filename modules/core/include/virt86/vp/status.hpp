@@ -42,12 +42,13 @@ enum class VPOperationStatus {
     InvalidSelector,     // An invalid selector was specified
     InvalidRegister,     // An invalid register was specified
     BreakpointNeverHit,  // A breakpoint was never hit
+    Incomplete,          // The operation completed, but part of the data could not be transferred
 
     Unsupported,         // The operation is not supported
 };
 
 enum class VMExitReason {
-    Normal,              // Time slice expiration
+    Normal,              // Execution stopped for a reason handled by the hypervisor
 
     Cancelled,           // Execution was cancelled (possibly due to interrupt injection)
     Interrupt,           // An interrupt window has opened
@@ -67,6 +68,8 @@ enum class VMExitReason {
     Shutdown,            // System shutdown
     Error,               // Non-specific error
     Unhandled,           // VM exit reason returned by hypervisor is unhandled
+
+    TimeSliceExpired,    // The time slice given to RunFor() expired
 };
 
 struct VMExitInfo {
@@ -75,8 +78,18 @@ struct VMExitInfo {
 
     // Details about specific VM exits
     union {
-        // The exception code, when reason == VMExitReason::Exception
-        uint32_t exceptionCode;
+        // Exception information, when reason == VMExitReason::Exception
+        struct {
+            // The exception vector
+            uint32_t code;
+
+            // The error code pushed by the exception, if hasErrorCode is true
+            uint32_t errorCode;
+            bool hasErrorCode;
+
+            // The faulting linear address (CR2), when code is a page fault (14)
+            uint64_t cr2;
+        } exception;
 
         // MSR access information, whem VMExitReason::MSRAccess
         struct {
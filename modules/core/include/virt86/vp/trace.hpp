@@ -0,0 +1,163 @@
+/*
+Defines the VM exit trace ring, a fixed-size buffer that records the most
+recent VM exits of a virtual processor, and its binary dump format.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+
+#include "virt86/util/bitmask_enum.hpp"
+
+namespace virt86 {
+
+/**
+ * Flags describing the contents of an exit trace record.
+ */
+enum class ExitTraceFlags : uint8_t {
+    None = 0,
+
+    RIPValid = (1 << 0),      // The rip field contains the guest RIP at the time of the exit
+    AccessValid = (1 << 1),   // The address, value and size fields describe a PIO, MMIO or MSR access
+    Write = (1 << 2),         // The access is a write (OUT instruction or memory store)
+    Failed = (1 << 3),        // The execution failed; the reason field is meaningless
+    ProfilerKick = (1 << 4),  // The execution was interrupted by the guest profiler to take a sample
+};
+
+/**
+ * A single exit trace record. Records are 48 bytes long and stored in host
+ * byte order.
+ */
+struct ExitTraceRecord {
+    uint64_t tscEnter;        // Host TSC when execution was requested
+    uint64_t tscExit;         // Host TSC when the hypervisor returned control
+    uint64_t rip;             // Guest RIP at the time of the exit
+    uint64_t address;         // I/O port or MMIO address
+    uint64_t value;           // Value read or written
+    uint8_t reason;           // The VMExitReason
+    uint8_t size;             // Size of the access, in bytes
+    ExitTraceFlags flags;     // Flags describing the record
+    uint8_t reserved[5];
+};
+
+static_assert(sizeof(ExitTraceRecord) == 48, "ExitTraceRecord must be 48 bytes long");
+
+/**
+ * Header of an exit trace dump. A dump consists of this header followed by
+ * recordCount records of recordSize bytes each, in chronological order.
+ */
+struct ExitTraceDumpHeader {
+    static constexpr char kMagic[8] = { 'V', '8', '6', 'T', 'R', 'A', 'C', 'E' };
+    static constexpr uint32_t kVersion = 1;
+
+    char magic[8];            // Must match kMagic
+    uint32_t version;         // Format version; must match kVersion
+    uint32_t recordSize;      // Size of each record
+    uint32_t vcpuIndex;       // Index of the virtual processor that produced the trace
+    uint32_t reserved;
+    uint64_t firstSequence;   // Sequence number of the first record in the dump
+    uint64_t recordCount;     // Number of records in the dump
+};
+
+static_assert(sizeof(ExitTraceDumpHeader) == 40, "ExitTraceDumpHeader must be 40 bytes long");
+
+/**
+ * A fixed-size ring buffer of exit trace records that overwrites the oldest
+ * records when full.
+ *
+ * The ring has a single writer, the thread that runs the virtual processor,
+ * and never blocks it. Readers may run on any thread: every record is
+ * assigned a sequence number, and readers detect and skip records that were
+ * overwritten while being copied.
+ */
+class ExitTraceRing {
+public:
+    /**
+     * Creates a ring for the given virtual processor index. The capacity is
+     * rounded up to the next power of two.
+     */
+    ExitTraceRing(const size_t capacity, const uint32_t vcpuIndex);
+
+    /**
+     * Retrieves the maximum number of records held by the ring.
+     */
+    size_t Capacity() const noexcept { return m_mask + 1; }
+
+    /**
+     * Retrieves the index of the virtual processor traced by this ring.
+     */
+    uint32_t VCPUIndex() const noexcept { return m_vcpuIndex; }
+
+    /**
+     * Retrieves the sequence number of the next record to be written, which
+     * is also the total number of records written to the ring.
+     */
+    uint64_t Head() const noexcept { return m_published.load(std::memory_order_acquire); }
+
+    /**
+     * Appends a record to the ring, overwriting the oldest record if the ring
+     * is full. Must only be invoked by the writer.
+     */
+    void Push(const ExitTraceRecord& record) noexcept;
+
+    /**
+     * Copies up to maxRecords records starting from the sequence number in
+     * cursor, which is advanced past the copied records. Records that were
+     * overwritten before they could be read are skipped, and their number is
+     * added to dropped if specified.
+     *
+     * Returns the number of records copied.
+     */
+    size_t Read(uint64_t& cursor, ExitTraceRecord *records, const size_t maxRecords, uint64_t *dropped = nullptr) const noexcept;
+
+    /**
+     * Writes all records currently held by the ring to the given file in the
+     * exit trace dump format.
+     *
+     * Returns true if the dump was written successfully.
+     */
+    bool WriteDump(std::FILE *file) const noexcept;
+
+private:
+    static constexpr size_t kWordsPerRecord = sizeof(ExitTraceRecord) / sizeof(uint64_t);
+
+    // Records are stored as relaxed atomic words so that readers may safely
+    // copy them while the writer overwrites them. On x86 these compile to
+    // plain loads and stores.
+    std::unique_ptr<std::atomic<uint64_t>[]> m_words;
+    const size_t m_mask;
+    const uint32_t m_vcpuIndex;
+
+    // Number of records whose writes have started and completed
+    std::atomic<uint64_t> m_started;
+    std::atomic<uint64_t> m_published;
+};
+
+}
+
+ENABLE_BITMASK_OPERATORS(virt86::ExitTraceFlags)
@@ -2,12 +2,14 @@
 Defines the interface for virtual processors inside a virtual machine.
 
 The main purpose a virtual processor is to run virtualized code. A virtual
-processor enables this through two methods:
+processor enables this through three methods:
 - Run(), which runs the virtual processor until a condition causes it to exit
+- RunFor(), which does the same but also exits once a time slice expires
 - Step(), which runs a single instruction
 
 Single stepping is only supported on platforms that expose the guestDebugging
-feature.
+feature. Time sliced execution is only supported on platforms that expose the
+timeSlicedExecution feature.
 
 It's also possible to read from and write to physical or linear memory
 addresses with MemRead, MemWrite, LMemRead and LMemWrite methods.
@@ -71,10 +73,17 @@ SOFTWARE.
 #include "paging.hpp"
 #include "status.hpp"
 #include "mode.hpp"
+#include "profiler.hpp"
+#include "stats.hpp"
+#include "state.hpp"
+#include "trace.hpp"
 #include "../vm/io.hpp"
+#include "../platform/stats.hpp"
 
+#include <chrono>
 #include <cstdint>
 #include <cstring>
+#include <memory>
 #include <vector>
 #include <queue>
 #include <mutex>
@@ -118,6 +127,23 @@ public:
      */
     VPExecutionStatus Run();
 
+    /**
+     * Runs the virtual processor until interrupted or until the specified
+     * time slice expires, whichever comes first. The virtual processor exits
+     * with VMExitReason::TimeSliceExpired if the time slice expires.
+     *
+     * On KVM the time slice is enforced with a real-time signal whose handler
+     * is installed for the whole process; see
+     * KvmPlatform::SetTimeSliceSignal().
+     *
+     * If elapsed is not null, it receives the amount of time spent running
+     * the virtual processor, which can be used to enforce CPU quotas.
+     *
+     * This is an optional operation, supported by platforms that provide the
+     * time sliced execution capability.
+     */
+    VPExecutionStatus RunFor(const std::chrono::nanoseconds timeSlice, std::chrono::nanoseconds *elapsed = nullptr);
+
     /**
      * Runs one instruction on the virtual processor.
      *
@@ -309,6 +335,39 @@ public:
      */
     virtual VPOperationStatus SetVirtualTSCOffset(const uint64_t offset) noexcept;
 
+    // ----- State save and restore -------------------------------------------
+
+    /**
+     * Captures the complete state of the virtual processor into the given
+     * structure, including pending events, the multiprocessor state, the local
+     * APIC, the XSAVE area and MSRs. Must not be invoked while the virtual
+     * processor is running.
+     *
+     * Returns VPOperationStatus::Incomplete if the virtual processor has more
+     * MSRs than fit in the state. The state is otherwise complete, and the
+     * number of MSRs left out is stored in numDroppedMSRs.
+     *
+     * This is an optional operation, supported by platforms that provide the
+     * vpStateSaveRestore feature.
+     */
+    virtual VPOperationStatus SaveState(VPState& state) noexcept;
+
+    /**
+     * Applies a state previously captured with SaveState(). Only the groups
+     * present in the state are restored. MSRs that the hypervisor refuses to
+     * set in the current configuration are skipped, the rest of the state is
+     * restored, and VPOperationStatus::Incomplete is returned; if rejectedMSRs
+     * is specified, it receives the indices of the skipped MSRs. Must not be
+     * invoked while the virtual processor is running.
+     *
+     * Returns VPOperationStatus::InvalidArguments if the state has an
+     * incompatible version or size.
+     *
+     * This is an optional operation, supported by platforms that provide the
+     * vpStateSaveRestore feature.
+     */
+    virtual VPOperationStatus RestoreState(const VPState& state, VPRejectedMSRs *rejectedMSRs = nullptr) noexcept;
+
     // ----- Global Descriptor Table ------------------------------------------
 
     /**
@@ -396,6 +455,77 @@ public:
      */
     virtual VPOperationStatus GetBreakpointAddress(uint64_t *address) const noexcept;
 
+    // ----- Statistics -------------------------------------------------------
+
+    /**
+     * Retrieves a snapshot of the execution statistics collected for this
+     * virtual processor since its creation or the most recent reset. May be
+     * invoked from any thread, even while the virtual processor is running.
+     *
+     * Returns VPOperationStatus::Unsupported if virt86 was built without the
+     * VIRT86_ENABLE_STATISTICS option.
+     */
+    VPOperationStatus GetStatistics(VPStatistics& statistics) const noexcept;
+
+    /**
+     * Resets the execution statistics of this virtual processor. May be
+     * invoked from any thread, even while the virtual processor is running.
+     *
+     * Returns VPOperationStatus::Unsupported if virt86 was built without the
+     * VIRT86_ENABLE_STATISTICS option.
+     */
+    VPOperationStatus ResetStatistics() noexcept;
+
+    /**
+     * Retrieves the statistics collected by the hypervisor for this virtual
+     * processor, such as exit counts, halt polls and page faults. Reusing the
+     * same PlatformStatistics object across calls keeps periodic polling
+     * cheap. May be invoked from any thread.
+     *
+     * This is an optional operation, supported by platforms that provide the
+     * platform statistics feature.
+     */
+    virtual VPOperationStatus GetPlatformStatistics(PlatformStatistics& statistics) const noexcept;
+
+    // ----- Exit tracing -----------------------------------------------------
+
+    /**
+     * Enables tracing of VM exits into a ring buffer that holds the specified
+     * number of most recent exits (rounded up to the next power of two),
+     * replacing any existing trace. Must not be invoked while the virtual
+     * processor is running.
+     *
+     * Returns VPOperationStatus::InvalidArguments if capacity is zero.
+     */
+    VPOperationStatus EnableExitTrace(const size_t capacity) noexcept;
+
+    /**
+     * Disables tracing of VM exits and releases the trace ring. Must not be
+     * invoked while the virtual processor is running or while another thread
+     * is reading the trace ring.
+     */
+    void DisableExitTrace() noexcept;
+
+    /**
+     * Retrieves the exit trace ring, or nullptr if tracing is disabled. The
+     * ring may be read from any thread while the virtual processor runs.
+     */
+    const ExitTraceRing *GetExitTrace() const noexcept { return m_exitTrace.get(); }
+
+    // ----- Profiling --------------------------------------------------------
+
+    /**
+     * Attaches a guest profiler to this virtual processor, or detaches the
+     * current profiler if nullptr is specified. Must not be invoked while the
+     * virtual processor is running. The profiler must outlive this virtual
+     * processor or be detached before being destroyed.
+     *
+     * While a profiler is attached, on platforms that support time sliced
+     * execution, Run() interrupts the guest once every sampling period to
+     * take a sample and then resumes execution transparently.
+     */
+    void SetProfiler(GuestProfiler *profiler) noexcept;
+
     // ----- Data -------------------------------------------------------------
 
     /**
@@ -408,6 +538,11 @@ public:
      */
     const VirtualMachine& GetVirtualMachine() const noexcept { return m_vm; }
 
+    /**
+     * Retrieves the index of this virtual processor in the virtual machine.
+     */
+    uint32_t GetIndex() const noexcept { return m_index; }
+
 protected:
     VirtualProcessor(VirtualMachine& vm);
 
@@ -416,6 +551,15 @@ protected:
      */
     virtual VPExecutionStatus RunImpl() noexcept = 0;
 
+    /**
+     * Tells the hypervisor to run the virtual processor until interrupted or
+     * until the time slice expires. The time slice is always positive.
+     *
+     * This is an optional operation, supported by platforms that provide the
+     * time sliced execution capability.
+     */
+    virtual VPExecutionStatus RunForImpl(const std::chrono::nanoseconds timeSlice) noexcept;
+
     /**
      * Tells the hypervisor to run one instruction on the virtual processor.
      *
@@ -462,18 +606,53 @@ protected:
      */
     VMExitInfo m_exitInfo;
 
+    /**
+     * Execution statistics. Platforms should invoke EndGuest() as soon as the
+     * hypervisor returns from a run call and record PIO and MMIO exits as they
+     * are handled.
+     */
+    VPStatisticsCollector m_statistics;
+
+    /**
+     * The exit trace ring, if tracing is enabled. While it is not null,
+     * platforms should fill in the exit details in m_exitTraceRecord, which
+     * is appended to the ring once the execution completes.
+     */
+    std::unique_ptr<ExitTraceRing> m_exitTrace;
+
+    /**
+     * The exit trace record of the current execution.
+     */
+    ExitTraceRecord m_exitTraceRecord;
+
     // Allow VirtualMachine to access the constructor
     friend class VirtualMachine;
 
 private:
+    uint32_t m_index;
+
+    GuestProfiler *m_profiler;
+    std::chrono::steady_clock::time_point m_nextProfileSample;
+
     std::mutex m_interruptMutex;
     std::queue<uint8_t> m_pendingInterrupts;
 
     void HandleInterruptQueue();
     void InjectPendingInterrupt();
 
+    VPExecutionStatus RunProfiled();
+
+    void BeginExecution() noexcept;
+    void EndExecution(const VPExecutionStatus status, const bool kicked = false) noexcept;
+
     // ----- Helper functions -------------------------------------------------
 
+    /**
+     * Converts the given linear address into a physical address using the
+     * current paging mode.
+     */
+    bool WalkPageTables(const uint64_t laddr, uint64_t *paddr) noexcept;
+
     /**
      * Converts the given linear address into a physical address under 32-bit
      * paging mode.
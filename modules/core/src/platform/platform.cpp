@@ -37,6 +37,11 @@ Platform::~Platform() noexcept {
 }
 
 const std::optional<std::reference_wrapper<VirtualMachine>> Platform::CreateVM(const VMSpecifications& specifications) {
+    // Refuse to run the guest at the wrong TSC frequency
+    if (specifications.guestTSCFrequency != 0 && !m_features.guestTSCScaling) {
+        return std::nullopt;
+    }
+
     auto vm = CreateVMImpl(specifications);
     if (vm != nullptr) {
         return *m_vms.emplace_back(std::move(vm));
@@ -45,6 +50,25 @@ const std::optional<std::reference_wrapper<VirtualMachine>> Platform::CreateVM(c
     return std::nullopt;
 }
 
+const std::optional<std::reference_wrapper<VirtualMachine>> Platform::CloneVM(const VirtualMachine& tmpl) {
+    if (!m_features.vmCloning || std::addressof(tmpl.GetPlatform()) != this) {
+        return std::nullopt;
+    }
+
+    auto vm = CreateVMImpl(tmpl.GetSpecifications());
+    if (vm == nullptr) {
+        return std::nullopt;
+    }
+
+    // Capturing the state of the template's virtual processors does not
+    // modify them
+    if (!vm->CloneFrom(const_cast<VirtualMachine&>(tmpl))) {
+        return std::nullopt;
+    }
+
+    return *m_vms.emplace_back(std::move(vm));
+}
+
 const bool Platform::FreeVM(VirtualMachine& vm) {
     for (auto it = m_vms.cbegin(); it != m_vms.cend(); it++) {
         if (it->get() == &vm) {
@@ -56,6 +80,15 @@ const bool Platform::FreeVM(VirtualMachine& vm) {
     return false;
 }
 
+const std::vector<CPUIDResult>& Platform::GetSupportedCustomCPUIDs() const {
+    std::call_once(m_supportedCustomCPUIDsFlag, [this]() {
+        if (m_features.customCPUIDs) {
+            LoadSupportedCustomCPUIDs(m_supportedCustomCPUIDs);
+        }
+    });
+    return m_supportedCustomCPUIDs;
+}
+
 void Platform::DestroyVMs() noexcept {
     m_vms.clear();
 }
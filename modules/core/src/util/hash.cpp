@@ -0,0 +1,212 @@
+/*
+Implementation of the XXH64 hash function.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/util/hash.hpp"
+
+#include <cstring>
+
+namespace virt86 {
+
+static constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+static constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+static constexpr uint64_t kPrime3 = 0x165667B19E3779F9ull;
+static constexpr uint64_t kPrime4 = 0x85EBCA77C2B2AE63ull;
+static constexpr uint64_t kPrime5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64_t RotateLeft(const uint64_t value, const int amount) noexcept {
+    return (value << amount) | (value >> (64 - amount));
+}
+
+static inline uint64_t Read64(const uint8_t *data) noexcept {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint32_t Read32(const uint8_t *data) noexcept {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint64_t Round(uint64_t acc, const uint64_t input) noexcept {
+    acc += input * kPrime2;
+    acc = RotateLeft(acc, 31);
+    return acc * kPrime1;
+}
+
+static inline uint64_t MergeRound(uint64_t acc, const uint64_t value) noexcept {
+    acc ^= Round(0, value);
+    return acc * kPrime1 + kPrime4;
+}
+
+// Processes as many 32-byte stripes as possible and returns the number of
+// bytes consumed
+static inline size_t ProcessStripes(uint64_t acc[4], const uint8_t *data, const size_t size) noexcept {
+    size_t pos = 0;
+    for (; pos + 32 <= size; pos += 32) {
+        acc[0] = Round(acc[0], Read64(data + pos));
+        acc[1] = Round(acc[1], Read64(data + pos + 8));
+        acc[2] = Round(acc[2], Read64(data + pos + 16));
+        acc[3] = Round(acc[3], Read64(data + pos + 24));
+    }
+    return pos;
+}
+
+static uint64_t Finalize(uint64_t hash, const uint8_t *data, size_t size) noexcept {
+    while (size >= 8) {
+        hash ^= Round(0, Read64(data));
+        hash = RotateLeft(hash, 27) * kPrime1 + kPrime4;
+        data += 8;
+        size -= 8;
+    }
+    if (size >= 4) {
+        hash ^= static_cast<uint64_t>(Read32(data)) * kPrime1;
+        hash = RotateLeft(hash, 23) * kPrime2 + kPrime3;
+        data += 4;
+        size -= 4;
+    }
+    while (size > 0) {
+        hash ^= (*data) * kPrime5;
+        hash = RotateLeft(hash, 11) * kPrime1;
+        data++;
+        size--;
+    }
+
+    hash ^= hash >> 33;
+    hash *= kPrime2;
+    hash ^= hash >> 29;
+    hash *= kPrime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static inline uint64_t Converge(const uint64_t acc[4]) noexcept {
+    uint64_t hash = RotateLeft(acc[0], 1) + RotateLeft(acc[1], 7) + RotateLeft(acc[2], 12) + RotateLeft(acc[3], 18);
+    hash = MergeRound(hash, acc[0]);
+    hash = MergeRound(hash, acc[1]);
+    hash = MergeRound(hash, acc[2]);
+    hash = MergeRound(hash, acc[3]);
+    return hash;
+}
+
+uint64_t Hash64(const void *data, const size_t size, const uint64_t seed) noexcept {
+    auto bytes = static_cast<const uint8_t *>(data);
+    uint64_t hash;
+    size_t pos = 0;
+    if (size >= 32) {
+        uint64_t acc[4] = { seed + kPrime1 + kPrime2, seed + kPrime2, seed, seed - kPrime1 };
+        pos = ProcessStripes(acc, bytes, size);
+        hash = Converge(acc);
+    }
+    else {
+        hash = seed + kPrime5;
+    }
+    hash += size;
+    return Finalize(hash, bytes + pos, size - pos);
+}
+
+Hash128Value Hash128(const void *data, const size_t size) noexcept {
+    // The high half is seeded differently so that the halves are independent
+    return Hash128(data, size, { 0, kPrime3 });
+}
+
+Hash128Value Hash128(const void *data, const size_t size, const Hash128Value& seed) noexcept {
+    auto bytes = static_cast<const uint8_t *>(data);
+    uint64_t low, high;
+    size_t pos = 0;
+    if (size >= 32) {
+        // Interleave both sets of accumulators so that every stripe is loaded
+        // once and the independent multiplications overlap
+        uint64_t accLow[4] = { seed.low + kPrime1 + kPrime2, seed.low + kPrime2, seed.low, seed.low - kPrime1 };
+        uint64_t accHigh[4] = { seed.high + kPrime1 + kPrime2, seed.high + kPrime2, seed.high, seed.high - kPrime1 };
+        for (; pos + 32 <= size; pos += 32) {
+            const uint64_t lane0 = Read64(bytes + pos);
+            const uint64_t lane1 = Read64(bytes + pos + 8);
+            const uint64_t lane2 = Read64(bytes + pos + 16);
+            const uint64_t lane3 = Read64(bytes + pos + 24);
+            accLow[0] = Round(accLow[0], lane0);
+            accHigh[0] = Round(accHigh[0], lane0);
+            accLow[1] = Round(accLow[1], lane1);
+            accHigh[1] = Round(accHigh[1], lane1);
+            accLow[2] = Round(accLow[2], lane2);
+            accHigh[2] = Round(accHigh[2], lane2);
+            accLow[3] = Round(accLow[3], lane3);
+            accHigh[3] = Round(accHigh[3], lane3);
+        }
+        low = Converge(accLow);
+        high = Converge(accHigh);
+    }
+    else {
+        low = seed.low + kPrime5;
+        high = seed.high + kPrime5;
+    }
+    low += size;
+    high += size;
+    return { Finalize(low, bytes + pos, size - pos), Finalize(high, bytes + pos, size - pos) };
+}
+
+// ----- Incremental hashing --------------------------------------------------
+
+void Hasher64::Reset(const uint64_t seed) noexcept {
+    m_acc[0] = seed + kPrime1 + kPrime2;
+    m_acc[1] = seed + kPrime2;
+    m_acc[2] = seed;
+    m_acc[3] = seed - kPrime1;
+    m_seed = seed;
+    m_totalSize = 0;
+    m_bufferSize = 0;
+}
+
+void Hasher64::Update(const void *data, size_t size) noexcept {
+    auto bytes = static_cast<const uint8_t *>(data);
+    m_totalSize += size;
+
+    // Complete the pending stripe first
+    if (m_bufferSize > 0) {
+        const size_t fill = (size < 32 - m_bufferSize) ? size : 32 - m_bufferSize;
+        memcpy(m_buffer + m_bufferSize, bytes, fill);
+        m_bufferSize += fill;
+        bytes += fill;
+        size -= fill;
+        if (m_bufferSize < 32) {
+            return;
+        }
+        ProcessStripes(m_acc, m_buffer, 32);
+        m_bufferSize = 0;
+    }
+
+    const size_t consumed = ProcessStripes(m_acc, bytes, size);
+    memcpy(m_buffer, bytes + consumed, size - consumed);
+    m_bufferSize = size - consumed;
+}
+
+uint64_t Hasher64::Digest() const noexcept {
+    uint64_t hash = (m_totalSize >= 32) ? Converge(m_acc) : m_seed + kPrime5;
+    hash += m_totalSize;
+    return Finalize(hash, m_buffer, m_bufferSize);
+}
+
+}
@@ -0,0 +1,105 @@
+/*
+Implementation of the worker pool used by ParallelFor().
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/util/parallel.hpp"
+
+#include <new>
+#include <system_error>
+
+namespace virt86 {
+
+WorkerPool& WorkerPool::Instance() noexcept {
+    static WorkerPool *pool = new WorkerPool();
+    return *pool;
+}
+
+size_t WorkerPool::Run(const size_t numHelpers, void (*task)(void *), void *context) noexcept {
+    Job job{ task, context, 0, 0 };
+    size_t queued = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Grow the pool as needed, up to one thread per host processor, since
+        // the threads are kept for good. Requests for more helpers share the
+        // existing threads, and fewer helpers run if threads cannot be
+        // created.
+        while (m_numThreads < std::min(numHelpers, m_maxThreads)) {
+            try {
+                std::thread([this] { Work(); }).detach();
+            }
+            catch (const std::system_error&) {
+                break;
+            }
+            m_numThreads++;
+        }
+
+        try {
+            while (queued < std::min(numHelpers, m_numThreads)) {
+                m_queue.push_back(&job);
+                queued++;
+            }
+        }
+        catch (const std::bad_alloc&) {
+        }
+    }
+    if (queued == 1) {
+        m_wake.notify_one();
+    }
+    else if (queued > 1) {
+        m_wake.notify_all();
+    }
+
+    task(context);
+
+    // Withdraw the helpers that did not start yet; they would find no work
+    // left. Wait for the others, since the context belongs to the caller.
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_queue.erase(std::remove(m_queue.begin(), m_queue.end(), &job), m_queue.end());
+    job.done.wait(lock, [&] { return job.active == 0; });
+    return 1 + job.started;
+}
+
+void WorkerPool::Work() noexcept {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_wake.wait(lock, [this] { return !m_queue.empty(); });
+        Job *job = m_queue.front();
+        m_queue.pop_front();
+        job->active++;
+        job->started++;
+
+        lock.unlock();
+        job->task(job->context);
+        lock.lock();
+
+        // The job lives on the stack of the thread waiting for it, which
+        // cannot return before the lock is released
+        if (--job->active == 0) {
+            job->done.notify_all();
+        }
+    }
+}
+
+}
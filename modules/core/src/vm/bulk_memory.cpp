@@ -0,0 +1,329 @@
+/*
+Implementation of bulk guest memory operations.
+
+Ranges are resolved into spans of contiguous host memory, then split into
+blocks of kBulkMemoryBlockSize bytes that worker threads pick up one at a
+time. Large copies use SSE2 non-temporal stores where available.
+
+Discarding and zeroing work on the same spans, letting the platform release
+whole pages and clearing the rest in place.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/vm/vm.hpp"
+#include "virt86/util/hash.hpp"
+#include "virt86/util/parallel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define VIRT86_BULK_SSE2 1
+#endif
+
+namespace virt86 {
+
+using Clock = std::chrono::steady_clock;
+
+// Copies memory with stores that bypass the cache
+static void CopyNonTemporal(void *dest, const void *src, size_t size) noexcept {
+#if defined(VIRT86_BULK_SSE2)
+    auto d = static_cast<uint8_t *>(dest);
+    auto s = static_cast<const uint8_t *>(src);
+
+    // Streaming stores require an aligned destination
+    const size_t head = std::min<size_t>(size, (16 - (reinterpret_cast<uintptr_t>(d) & 15)) & 15);
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+
+    for (; size >= 64; d += 64, s += 64, size -= 64) {
+        const __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+        const __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 16));
+        const __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 32));
+        const __m128i v3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 48));
+        _mm_stream_si128(reinterpret_cast<__m128i *>(d), v0);
+        _mm_stream_si128(reinterpret_cast<__m128i *>(d + 16), v1);
+        _mm_stream_si128(reinterpret_cast<__m128i *>(d + 32), v2);
+        _mm_stream_si128(reinterpret_cast<__m128i *>(d + 48), v3);
+    }
+    memcpy(d, s, size);
+
+    // Make the streaming stores visible before the data is handed over
+    _mm_sfence();
+#else
+    memcpy(dest, src, size);
+#endif
+}
+
+// Invokes fn(offset, hostMemory, size) on the pieces of [offset, offset + size)
+// within the range described by spans
+template<typename Fn>
+static void ForEachSpan(const std::vector<MemoryRegion>& spans, uint64_t offset, uint64_t size, Fn&& fn) {
+    uint64_t spanOffset = 0;
+    for (auto& span : spans) {
+        if (size == 0) {
+            break;
+        }
+        if (offset < spanOffset + span.size) {
+            const uint64_t start = offset - spanOffset;
+            const uint64_t length = std::min(size, span.size - start);
+            fn(offset, static_cast<uint8_t *>(span.hostMemory) + start, length);
+            offset += length;
+            size -= length;
+        }
+        spanOffset += span.size;
+    }
+}
+
+// Determines how many threads to use for a range of the given size
+static size_t ComputeThreadCount(const BulkMemoryOptions& options, const uint64_t size) noexcept {
+    const size_t maxThreads = (options.numThreads != 0) ? options.numThreads : std::max(1u, std::thread::hardware_concurrency());
+    const uint64_t bytesPerThread = std::max<uint64_t>(options.bytesPerThread, 1);
+    return static_cast<size_t>(std::max<uint64_t>(1, std::min<uint64_t>(maxThreads, size / bytesPerThread)));
+}
+
+static void StoreStatistics(BulkMemoryStatistics *statistics, const uint64_t size, const size_t threads, const bool nonTemporal, const Clock::time_point start) noexcept {
+    if (statistics == nullptr) {
+        return;
+    }
+    statistics->bytes = size;
+    statistics->elapsedNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    statistics->bytesPerSecond = (statistics->elapsedNanos > 0) ? static_cast<uint64_t>(static_cast<double>(size) * 1e9 / statistics->elapsedNanos) : 0;
+    statistics->threads = threads;
+    statistics->nonTemporal = nonTemporal;
+}
+
+bool VirtualMachine::ResolveGuestRange(const uint64_t paddr, const uint64_t size, std::vector<MemoryRegion>& spans) const noexcept {
+    spans.clear();
+    if (paddr + size - 1 < paddr) {
+        return false;
+    }
+
+    uint64_t address = paddr;
+    uint64_t remaining = size;
+    while (remaining > 0) {
+        // Find the most recent mapping that contains the address
+        size_t index = m_memoryRegions.size();
+        while (index-- > 0) {
+            auto& region = m_memoryRegions[index];
+            if (address >= region.baseAddress && address - region.baseAddress < region.size) {
+                break;
+            }
+        }
+        if (index == SIZE_MAX) {
+            return false;
+        }
+        auto& region = m_memoryRegions[index];
+        uint64_t length = std::min(remaining, region.size - (address - region.baseAddress));
+
+        // Stop where a more recent mapping begins
+        for (size_t i = index + 1; i < m_memoryRegions.size(); i++) {
+            auto& other = m_memoryRegions[i];
+            if (other.baseAddress > address && other.baseAddress - address < length) {
+                length = other.baseAddress - address;
+            }
+        }
+
+        spans.emplace_back(address, length, static_cast<uint8_t *>(region.hostMemory) + (address - region.baseAddress), region.flags);
+        address += length;
+        remaining -= length;
+    }
+    return true;
+}
+
+BulkMemoryStatus VirtualMachine::CopyGuestRange(const uint64_t paddr, const uint64_t size, void *buffer, const BulkCopyDirection direction, const BulkMemoryOptions& options, BulkMemoryStatistics *statistics) const noexcept {
+    if (buffer == nullptr) {
+        return BulkMemoryStatus::InvalidArguments;
+    }
+    if (size == 0) {
+        return BulkMemoryStatus::EmptyRange;
+    }
+    std::vector<MemoryRegion> spans;
+    if (!ResolveGuestRange(paddr, size, spans)) {
+        return BulkMemoryStatus::InvalidRange;
+    }
+
+    const auto start = Clock::now();
+    const bool nonTemporal = size >= options.nonTemporalThreshold;
+    auto bytes = static_cast<uint8_t *>(buffer);
+    const size_t threads = ParallelFor(ComputeThreadCount(options, size), (size + kBulkMemoryBlockSize - 1) / kBulkMemoryBlockSize, 1, [&](const uint64_t begin, const uint64_t end) {
+        for (uint64_t block = begin; block < end; block++) {
+            const uint64_t offset = block * kBulkMemoryBlockSize;
+            ForEachSpan(spans, offset, std::min(kBulkMemoryBlockSize, size - offset), [&](const uint64_t pos, uint8_t *hostMemory, const uint64_t length) {
+                auto dest = (direction == BulkCopyDirection::GuestToHost) ? bytes + pos : hostMemory;
+                auto src = (direction == BulkCopyDirection::GuestToHost) ? hostMemory : bytes + pos;
+                if (nonTemporal) {
+                    CopyNonTemporal(dest, src, static_cast<size_t>(length));
+                }
+                else {
+                    memcpy(dest, src, static_cast<size_t>(length));
+                }
+            });
+        }
+    });
+
+    // The hypervisor only logs writes made by the guest. The dirty log is
+    // bookkeeping, so this does not conflict with const.
+    if (direction == BulkCopyDirection::HostToGuest) {
+        for (auto& span : spans) {
+            if (BitmaskEnum(span.flags).AnyOf(MemoryFlags::DirtyPageTracking)) {
+                const uint64_t firstPage = span.baseAddress & ~0xFFFull;
+                const_cast<VirtualMachine *>(this)->MarkDirtyPagesImpl(firstPage, ((span.baseAddress + span.size + 0xFFF) & ~0xFFFull) - firstPage);
+            }
+        }
+    }
+    StoreStatistics(statistics, size, threads, nonTemporal, start);
+    return BulkMemoryStatus::OK;
+}
+
+BulkMemoryStatus VirtualMachine::CompareGuestRange(const uint64_t paddr, const uint64_t size, const void *data, uint64_t *firstDifference, const BulkMemoryOptions& options, BulkMemoryStatistics *statistics) const noexcept {
+    if (data == nullptr || firstDifference == nullptr) {
+        return BulkMemoryStatus::InvalidArguments;
+    }
+    if (size == 0) {
+        return BulkMemoryStatus::EmptyRange;
+    }
+    std::vector<MemoryRegion> spans;
+    if (!ResolveGuestRange(paddr, size, spans)) {
+        return BulkMemoryStatus::InvalidRange;
+    }
+
+    const auto start = Clock::now();
+    auto bytes = static_cast<const uint8_t *>(data);
+    std::atomic<uint64_t> first{ size };
+    const size_t threads = ParallelFor(ComputeThreadCount(options, size), (size + kBulkMemoryBlockSize - 1) / kBulkMemoryBlockSize, 1, [&](const uint64_t begin, const uint64_t end) {
+        for (uint64_t block = begin; block < end; block++) {
+            const uint64_t offset = block * kBulkMemoryBlockSize;
+            ForEachSpan(spans, offset, std::min(kBulkMemoryBlockSize, size - offset), [&](const uint64_t pos, const uint8_t *hostMemory, const uint64_t length) {
+                // Skip pieces past a difference that was already found
+                if (pos >= first.load(std::memory_order_relaxed) || memcmp(hostMemory, bytes + pos, static_cast<size_t>(length)) == 0) {
+                    return;
+                }
+                uint64_t diff = 0;
+                while (hostMemory[diff] == bytes[pos + diff]) {
+                    diff++;
+                }
+                uint64_t current = first.load(std::memory_order_relaxed);
+                while (pos + diff < current && !first.compare_exchange_weak(current, pos + diff, std::memory_order_relaxed)) {
+                }
+            });
+        }
+    });
+    *firstDifference = first;
+    StoreStatistics(statistics, size, threads, false, start);
+    return BulkMemoryStatus::OK;
+}
+
+BulkMemoryStatus VirtualMachine::HashGuestRange(const uint64_t paddr, const uint64_t size, uint64_t *hash, const BulkMemoryOptions& options, BulkMemoryStatistics *statistics) const noexcept {
+    if (hash == nullptr) {
+        return BulkMemoryStatus::InvalidArguments;
+    }
+    if (size == 0) {
+        return BulkMemoryStatus::EmptyRange;
+    }
+    std::vector<MemoryRegion> spans;
+    if (!ResolveGuestRange(paddr, size, spans)) {
+        return BulkMemoryStatus::InvalidRange;
+    }
+
+    const auto start = Clock::now();
+    std::vector<uint64_t> blockHashes((size + kBulkMemoryBlockSize - 1) / kBulkMemoryBlockSize);
+    const size_t threads = ParallelFor(ComputeThreadCount(options, size), blockHashes.size(), 1, [&](const uint64_t begin, const uint64_t end) {
+        for (uint64_t block = begin; block < end; block++) {
+            const uint64_t offset = block * kBulkMemoryBlockSize;
+            Hasher64 hasher;
+            ForEachSpan(spans, offset, std::min(kBulkMemoryBlockSize, size - offset), [&](const uint64_t, const uint8_t *hostMemory, const uint64_t length) {
+                hasher.Update(hostMemory, static_cast<size_t>(length));
+            });
+            blockHashes[block] = hasher.Digest();
+        }
+    });
+    *hash = Hash64(blockHashes.data(), blockHashes.size() * sizeof(uint64_t));
+    StoreStatistics(statistics, size, threads, false, start);
+    return BulkMemoryStatus::OK;
+}
+
+MemoryMappingStatus VirtualMachine::DiscardGuestMemory(const uint64_t baseAddress, const uint64_t size) noexcept {
+    if (baseAddress & 0xFFF) {
+        return MemoryMappingStatus::MisalignedAddress;
+    }
+    if (size == 0) {
+        return MemoryMappingStatus::EmptyRange;
+    }
+    if (size & 0xFFF) {
+        return MemoryMappingStatus::MisalignedSize;
+    }
+    std::vector<MemoryRegion> spans;
+    if (!ResolveGuestRange(baseAddress, size, spans)) {
+        return MemoryMappingStatus::InvalidRange;
+    }
+
+    for (auto& span : spans) {
+        if (!DiscardHostMemoryImpl(span.hostMemory, span.size, false)) {
+            memset(span.hostMemory, 0, static_cast<size_t>(span.size));
+        }
+        if (BitmaskEnum(span.flags).AnyOf(MemoryFlags::DirtyPageTracking)) {
+            MarkDirtyPagesImpl(span.baseAddress, span.size);
+        }
+    }
+    return MemoryMappingStatus::OK;
+}
+
+MemoryMappingStatus VirtualMachine::ZeroGuestMemory(const uint64_t baseAddress, const uint64_t size) noexcept {
+    if (size == 0) {
+        return MemoryMappingStatus::EmptyRange;
+    }
+    std::vector<MemoryRegion> spans;
+    if (!ResolveGuestRange(baseAddress, size, spans)) {
+        return MemoryMappingStatus::InvalidRange;
+    }
+
+    for (auto& span : spans) {
+        // Regions are page-aligned in both address spaces, so the whole pages
+        // of the span are the same in guest and host terms
+        auto hostMemory = static_cast<uint8_t *>(span.hostMemory);
+        const uint64_t head = std::min(span.size, (0x1000 - (span.baseAddress & 0xFFF)) & 0xFFF);
+        const uint64_t pages = (span.size - head) & ~0xFFFull;
+        const uint64_t tail = span.size - head - pages;
+
+        memset(hostMemory, 0, static_cast<size_t>(head));
+        if (pages > 0 && !DiscardHostMemoryImpl(hostMemory + head, pages, true)) {
+            memset(hostMemory + head, 0, static_cast<size_t>(pages));
+        }
+        memset(hostMemory + head + pages, 0, static_cast<size_t>(tail));
+
+        if (BitmaskEnum(span.flags).AnyOf(MemoryFlags::DirtyPageTracking)) {
+            const uint64_t firstPage = span.baseAddress & ~0xFFFull;
+            MarkDirtyPagesImpl(firstPage, ((span.baseAddress + span.size + 0xFFF) & ~0xFFFull) - firstPage);
+        }
+    }
+    return MemoryMappingStatus::OK;
+}
+
+}
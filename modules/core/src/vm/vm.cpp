@@ -26,6 +26,10 @@ SOFTWARE.
 #include "virt86/vm/vm.hpp"
 #include "virt86/platform/platform.hpp"
 #include "virt86/util/host_info.hpp"
+#include "virt86/util/probes.hpp"
+
+#include <cstring>
+#include <memory>
 
 namespace virt86 {
 
@@ -38,12 +42,15 @@ void __nullIOWrite(void*, uint16_t, size_t, uint32_t) noexcept { }
 uint64_t __nullMMIORead(void*, uint64_t, size_t) noexcept { return 0; }
 void __nullMMIOWrite(void*, uint64_t, size_t, uint64_t) noexcept { }
 
+bool __nullMSRRead(void*, uint32_t, uint64_t *value) noexcept { *value = 0; return true; }
+bool __nullMSRWrite(void*, uint32_t, uint64_t) noexcept { return true; }
+
 // ----------------------------------------------------------------------------
 
 VirtualMachine::VirtualMachine(Platform& platform, const VMSpecifications& specifications) noexcept
     : m_specifications(specifications)
     , m_platform(platform)
-    , m_io({ __nullIORead, __nullIOWrite, __nullMMIORead, __nullMMIOWrite, nullptr })
+    , m_io({ __nullIORead, __nullIOWrite, __nullMMIORead, __nullMMIOWrite, __nullMSRRead, __nullMSRWrite, nullptr })
 {
 }
 
@@ -91,8 +98,9 @@ MemoryMappingStatus VirtualMachine::MapGuestMemory(const uint64_t baseAddress, c
 
     const auto status = MapGuestMemoryImpl(baseAddress, size, flags, memory);
     if (status == MemoryMappingStatus::OK) {
-        m_memoryRegions.emplace_back(baseAddress, size, memory);
+        m_memoryRegions.emplace_back(baseAddress, size, memory, flags);
     }
+    VIRT86_PROBE4(memory_map, this, baseAddress, size, static_cast<int>(status));
     return status;
 }
 
@@ -125,6 +133,42 @@ MemoryMappingStatus VirtualMachine::UnmapGuestMemory(const uint64_t baseAddress,
     return status;
 }
 
+MemoryMappingStatus VirtualMachine::AllocateGuestMemory(const uint64_t baseAddress, const uint64_t size, const MemoryFlags flags, void **memory) {
+    if (!m_platform.GetFeatures().guestMemoryAllocation) {
+        return MemoryMappingStatus::Unsupported;
+    }
+
+    // Base address must be page-aligned
+    if (baseAddress & 0xFFF) {
+        return MemoryMappingStatus::MisalignedAddress;
+    }
+
+    // Size must be greater than zero
+    if (size == 0) {
+        return MemoryMappingStatus::EmptyRange;
+    }
+
+    // Size must be page-aligned
+    if (size & 0xFFF) {
+        return MemoryMappingStatus::MisalignedSize;
+    }
+
+    void *hostMemory = AllocateGuestMemoryImpl(size);
+    if (hostMemory == nullptr) {
+        return MemoryMappingStatus::Failed;
+    }
+
+    const auto status = MapGuestMemory(baseAddress, size, flags, hostMemory);
+    if (status != MemoryMappingStatus::OK) {
+        FreeGuestMemoryImpl(hostMemory, size);
+        return status;
+    }
+    if (memory != nullptr) {
+        *memory = hostMemory;
+    }
+    return status;
+}
+
 MemoryMappingStatus VirtualMachine::SetGuestMemoryFlags(const uint64_t baseAddress, const uint64_t size, const MemoryFlags flags) noexcept {
     // Base address must be page-aligned
     if (baseAddress & 0xFFF) {
@@ -147,7 +191,61 @@ MemoryMappingStatus VirtualMachine::SetGuestMemoryFlags(const uint64_t baseAddre
         return MemoryMappingStatus::Unsupported;
     }
 
-    return SetGuestMemoryFlagsImpl(baseAddress, size, flags);
+    // Regions that straddle either end of the range are split in two so that
+    // the tracked flags match what the hypervisor applied. Reserve room for
+    // the new regions up front; nothing may fail once the flags are changed.
+    const uint64_t finalAddress = baseAddress + size - 1;
+    size_t numSplits = 0;
+    for (auto& memoryRegion : m_memoryRegions) {
+        const uint64_t finalRegionAddress = memoryRegion.baseAddress + memoryRegion.size - 1;
+        if (memoryRegion.baseAddress < baseAddress && finalRegionAddress >= baseAddress) {
+            numSplits++;
+        }
+        if (memoryRegion.baseAddress <= finalAddress && finalRegionAddress > finalAddress) {
+            numSplits++;
+        }
+    }
+    try {
+        m_memoryRegions.reserve(m_memoryRegions.size() + numSplits);
+    }
+    catch (std::bad_alloc&) {
+        return MemoryMappingStatus::Failed;
+    }
+
+    const auto status = SetGuestMemoryFlagsImpl(baseAddress, size, flags);
+    if (status == MemoryMappingStatus::OK) {
+        for (size_t i = 0; i < m_memoryRegions.size(); i++) {
+            auto& memoryRegion = m_memoryRegions[i];
+            const uint64_t finalRegionAddress = memoryRegion.baseAddress + memoryRegion.size - 1;
+            if (finalRegionAddress < baseAddress || memoryRegion.baseAddress > finalAddress) {
+                continue;
+            }
+
+            // Split off the part that precedes the range; the next iteration
+            // handles the remainder
+            if (memoryRegion.baseAddress < baseAddress) {
+                const uint64_t headSize = baseAddress - memoryRegion.baseAddress;
+                const MemoryRegion remainder{ baseAddress, memoryRegion.size - headSize, static_cast<uint8_t*>(memoryRegion.hostMemory) + headSize, memoryRegion.flags };
+                memoryRegion.size = headSize;
+                m_memoryRegions.insert(m_memoryRegions.begin() + i + 1, remainder);
+                continue;
+            }
+
+            // Split off the part that follows the range
+            if (finalRegionAddress > finalAddress) {
+                const uint64_t bodySize = finalAddress + 1 - memoryRegion.baseAddress;
+                const MemoryRegion tail{ finalAddress + 1, memoryRegion.size - bodySize, static_cast<uint8_t*>(memoryRegion.hostMemory) + bodySize, memoryRegion.flags };
+                memoryRegion.size = bodySize;
+                memoryRegion.flags = flags;
+                m_memoryRegions.insert(m_memoryRegions.begin() + i + 1, tail);
+                i++; // Skip the tail
+                continue;
+            }
+
+            memoryRegion.flags = flags;
+        }
+    }
+    return status;
 }
 
 DirtyPageTrackingStatus VirtualMachine::QueryDirtyPages(const uint64_t baseAddress, const uint64_t size, uint64_t *bitmap, const size_t bitmapSize) noexcept {
@@ -177,7 +275,9 @@ DirtyPageTrackingStatus VirtualMachine::QueryDirtyPages(const uint64_t baseAddre
         return DirtyPageTrackingStatus::BitmapTooSmall;
     }
 
-    return QueryDirtyPagesImpl(baseAddress, size, bitmap, bitmapSize);
+    const auto status = QueryDirtyPagesImpl(baseAddress, size, bitmap, bitmapSize);
+    VIRT86_PROBE4(dirty_query, this, baseAddress, size, static_cast<int>(status));
+    return status;
 }
 
 DirtyPageTrackingStatus VirtualMachine::ClearDirtyPages(const uint64_t baseAddress, const uint64_t size) noexcept {
@@ -199,6 +299,27 @@ DirtyPageTrackingStatus VirtualMachine::ClearDirtyPages(const uint64_t baseAddre
     return ClearDirtyPagesImpl(baseAddress, size);
 }
 
+GuestClockStatus VirtualMachine::GetGuestClock(uint64_t *nanoseconds) noexcept {
+    if (!m_platform.GetFeatures().guestClock) {
+        return GuestClockStatus::Unsupported;
+    }
+    return GetGuestClockImpl(nanoseconds);
+}
+
+GuestClockStatus VirtualMachine::SetGuestClock(const uint64_t nanoseconds) noexcept {
+    if (!m_platform.GetFeatures().guestClock) {
+        return GuestClockStatus::Unsupported;
+    }
+    return SetGuestClockImpl(nanoseconds);
+}
+
+PlatformStatisticsStatus VirtualMachine::GetPlatformStatistics(PlatformStatistics& statistics) noexcept {
+    if (!m_platform.GetFeatures().platformStatistics) {
+        return PlatformStatisticsStatus::Unsupported;
+    }
+    return GetPlatformStatisticsImpl(statistics);
+}
+
 bool VirtualMachine::MemRead(const uint64_t paddr, uint64_t size, void *value) const noexcept {
     // Go through every memory region and copy data from ranges that contain
     // the requested range.
@@ -235,6 +356,13 @@ bool VirtualMachine::MemWrite(const uint64_t paddr, uint64_t size, const void *v
             // Copy as many bytes as possible from the region
             if (size <= memoryRegion.size) {
                 memcpy(static_cast<uint8_t*>(memoryRegion.hostMemory) + paddr - memoryRegion.baseAddress, value, size);
+
+                // The hypervisor only logs writes made by the guest. The dirty
+                // log is bookkeeping, so this does not conflict with const.
+                if (BitmaskEnum(memoryRegion.flags).AnyOf(MemoryFlags::DirtyPageTracking)) {
+                    const uint64_t firstPage = paddr & ~0xFFFull;
+                    const_cast<VirtualMachine *>(this)->MarkDirtyPagesImpl(firstPage, ((paddr + size + 0xFFF) & ~0xFFFull) - firstPage);
+                }
                 return true;
             }
             // Decrement remaining size
@@ -261,6 +389,14 @@ void VirtualMachine::RegisterMMIOWriteCallback(MMIOWriteFunc_t func) noexcept {
     m_io.MMIOWriteFunc = (func == nullptr) ? __nullMMIOWrite : func;
 }
 
+void VirtualMachine::RegisterMSRReadCallback(MSRReadFunc_t func) noexcept {
+    m_io.MSRReadFunc = (func == nullptr) ? __nullMSRRead : func;
+}
+
+void VirtualMachine::RegisterMSRWriteCallback(MSRWriteFunc_t func) noexcept {
+    m_io.MSRWriteFunc = (func == nullptr) ? __nullMSRWrite : func;
+}
+
 void VirtualMachine::RegisterIOContext(void *context) noexcept {
     m_io.context = context;
 }
@@ -322,7 +458,7 @@ void VirtualMachine::SubtractMemoryRange(const uint64_t baseAddress, const uint6
             const uint64_t secondBaseAddress = finalAddress + 1;
             const uint64_t secondSize = finalRegionAddress - finalAddress;
             void *pSecondHostMemory = static_cast<uint8_t*>(memoryRegion.hostMemory) + memoryRegion.size + size;
-            it = m_memoryRegions.insert(it, MemoryRegion{ secondBaseAddress, secondSize, pSecondHostMemory });
+            it = m_memoryRegions.insert(it, MemoryRegion{ secondBaseAddress, secondSize, pSecondHostMemory, memoryRegion.flags });
             // Don't continue here, we want to skip the inserted region
         }
 
@@ -330,7 +466,69 @@ void VirtualMachine::SubtractMemoryRange(const uint64_t baseAddress, const uint6
     }
 }
 
+bool VirtualMachine::CloneFrom(VirtualMachine& source) noexcept {
+    if (m_vps.size() != source.m_vps.size()) {
+        return false;
+    }
+
+    // Recreate the memory layout. Regions backed by the same host memory
+    // share the cloned block as well.
+    struct ClonedBlock {
+        const uint8_t *sourceMemory;
+        uint64_t size;
+        uint8_t *memory;
+    };
+    std::vector<ClonedBlock> clonedBlocks;
+    for (auto& region : source.m_memoryRegions) {
+        auto sourceMemory = static_cast<const uint8_t *>(region.hostMemory);
+        uint8_t *memory = nullptr;
+        for (auto& block : clonedBlocks) {
+            if (sourceMemory >= block.sourceMemory && sourceMemory + region.size <= block.sourceMemory + block.size) {
+                memory = block.memory + (sourceMemory - block.sourceMemory);
+                break;
+            }
+        }
+
+        if (memory == nullptr) {
+            memory = static_cast<uint8_t *>(CloneGuestMemoryImpl(source, sourceMemory, region.size));
+            if (memory == nullptr) {
+                memory = static_cast<uint8_t *>(AllocateGuestMemoryImpl(region.size));
+                if (memory == nullptr) {
+                    return false;
+                }
+                memcpy(memory, sourceMemory, region.size);
+            }
+            clonedBlocks.push_back({ sourceMemory, region.size, memory });
+        }
+
+        if (MapGuestMemory(region.baseAddress, region.size, region.flags, memory) != MemoryMappingStatus::OK) {
+            return false;
+        }
+    }
+
+    // Copy the state of every virtual processor
+    auto state = std::make_unique<VPState>();
+    for (size_t i = 0; i < m_vps.size(); i++) {
+        if (source.m_vps[i]->SaveState(*state) != VPOperationStatus::OK) {
+            return false;
+        }
+        // MSRs rejected in this configuration do not prevent restoring the rest
+        // of the state
+        const auto vpStatus = m_vps[i]->RestoreState(*state);
+        if (vpStatus != VPOperationStatus::OK && vpStatus != VPOperationStatus::Incomplete) {
+            return false;
+        }
+    }
+
+    uint64_t guestClock;
+    if (source.GetGuestClock(&guestClock) == GuestClockStatus::OK) {
+        SetGuestClock(guestClock);
+    }
+    return true;
+}
+
 void VirtualMachine::RegisterVP(std::unique_ptr<VirtualProcessor> vp) {
+    vp->m_index = static_cast<uint32_t>(m_vps.size());
     m_vps.emplace_back(std::move(vp));
 }
 
@@ -356,4 +554,34 @@ DirtyPageTrackingStatus VirtualMachine::ClearDirtyPagesImpl(const uint64_t baseA
     return DirtyPageTrackingStatus::Unsupported;
 }
 
+void *VirtualMachine::AllocateGuestMemoryImpl(const uint64_t size) noexcept {
+    return nullptr;
+}
+
+void *VirtualMachine::CloneGuestMemoryImpl(const VirtualMachine& source, const void *memory, const uint64_t size) noexcept {
+    return nullptr;
+}
+
+void VirtualMachine::FreeGuestMemoryImpl(void *memory, const uint64_t size) noexcept {
+}
+
+bool VirtualMachine::DiscardHostMemoryImpl(void *memory, const uint64_t size, const bool zero) noexcept {
+    return false;
+}
+
+void VirtualMachine::MarkDirtyPagesImpl(const uint64_t baseAddress, const uint64_t size) noexcept {
+}
+
+GuestClockStatus VirtualMachine::GetGuestClockImpl(uint64_t *nanoseconds) noexcept {
+    return GuestClockStatus::Unsupported;
+}
+
+GuestClockStatus VirtualMachine::SetGuestClockImpl(const uint64_t nanoseconds) noexcept {
+    return GuestClockStatus::Unsupported;
+}
+
+PlatformStatisticsStatus VirtualMachine::GetPlatformStatisticsImpl(PlatformStatistics& statistics) noexcept {
+    return PlatformStatisticsStatus::Unsupported;
+}
+
 }
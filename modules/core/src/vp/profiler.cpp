@@ -0,0 +1,188 @@
+/*
+Implementation of the guest sampling profiler.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/vp/profiler.hpp"
+#include "virt86/vp/vp.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <map>
+#include <string>
+
+namespace virt86 {
+
+// Rounds up to the next power of two
+static size_t NextPowerOfTwo(const size_t value) noexcept {
+    size_t result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
+}
+
+GuestProfiler::GuestProfiler(const std::chrono::nanoseconds samplingPeriod, const size_t maxLocations)
+    : m_samplingPeriod(samplingPeriod.count())
+    , m_symbolizer(nullptr)
+    , m_symbolizerContext(nullptr)
+    , m_slots(NextPowerOfTwo(std::max<size_t>(maxLocations, 1) * 2))
+    , m_maxLocations(std::max<size_t>(maxLocations, 1))
+    , m_numLocations(0)
+    , m_numSamples(0)
+    , m_failedSamples(0)
+    , m_droppedSamples(0)
+    , m_kicks(0)
+    , m_samplingTime(0)
+    , m_startTime(std::chrono::steady_clock::now())
+{
+}
+
+void GuestProfiler::SetSymbolizer(const SymbolizeFunc_t func, void *context) noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_symbolizer = func;
+    m_symbolizerContext = context;
+}
+
+void GuestProfiler::Sample(VirtualProcessor& vp, const bool kicked) noexcept {
+    const auto start = std::chrono::steady_clock::now();
+
+    static constexpr Reg regs[] = { Reg::RIP, Reg::CR3, Reg::CS };
+    RegValue values[std::size(regs)];
+    const bool ok = vp.RegRead(regs, values, std::size(regs)) == VPOperationStatus::OK;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (ok) {
+        const SampleKey key = { values[1].u64, values[0].u64, static_cast<uint8_t>(values[2].segment.selector & 3) };
+        const size_t mask = m_slots.size() - 1;
+        for (size_t slot = HashKey(key) & mask;; slot = (slot + 1) & mask) {
+            auto& entry = m_slots[slot];
+            if (entry.count != 0 && entry.key == key) {
+                entry.count++;
+                m_numSamples++;
+                break;
+            }
+            if (entry.count == 0) {
+                // The table is never more than half full, so probing always
+                // ends at an empty slot
+                if (m_numLocations == m_maxLocations) {
+                    m_droppedSamples++;
+                    break;
+                }
+                entry = { key, 1 };
+                m_numLocations++;
+                m_numSamples++;
+                break;
+            }
+        }
+    }
+    else {
+        m_failedSamples++;
+    }
+    if (kicked) {
+        m_kicks++;
+    }
+    m_samplingTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+}
+
+std::vector<GuestProfileEntry> GuestProfiler::GetProfile() const {
+    std::vector<GuestProfileEntry> profile;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        profile.reserve(m_numLocations);
+        for (auto& entry : m_slots) {
+            if (entry.count != 0) {
+                profile.push_back({ entry.key.addressSpace, entry.key.rip, entry.key.cpl, entry.count });
+            }
+        }
+    }
+    std::sort(profile.begin(), profile.end(), [](const GuestProfileEntry& lhs, const GuestProfileEntry& rhs) {
+        return lhs.count > rhs.count;
+    });
+    return profile;
+}
+
+GuestProfilerStatistics GuestProfiler::GetStatistics() const noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    GuestProfilerStatistics stats;
+    stats.samples = m_numSamples;
+    stats.failedSamples = m_failedSamples;
+    stats.droppedSamples = m_droppedSamples;
+    stats.kicks = m_kicks;
+    stats.samplingTime = m_samplingTime;
+    stats.wallTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_startTime);
+    return stats;
+}
+
+void GuestProfiler::Reset() noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::fill(m_slots.begin(), m_slots.end(), SampleSlot{});
+    m_numLocations = 0;
+    m_numSamples = 0;
+    m_failedSamples = 0;
+    m_droppedSamples = 0;
+    m_kicks = 0;
+    m_samplingTime = std::chrono::nanoseconds::zero();
+    m_startTime = std::chrono::steady_clock::now();
+}
+
+bool GuestProfiler::WriteFoldedStacks(std::FILE *file) const {
+    if (file == nullptr) {
+        return false;
+    }
+
+    // Aggregate samples by symbol, since flame graphs merge identical frames
+    std::map<std::string, uint64_t> stacks;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        char frame[64];
+        for (auto& entry : m_slots) {
+            if (entry.count == 0) {
+                continue;
+            }
+            const auto& key = entry.key;
+            snprintf(frame, sizeof(frame), "cr3_%" PRIx64 ";ring%u;", key.addressSpace, key.cpl);
+            std::string stack = frame;
+
+            uint64_t offset;
+            const char *symbol = (m_symbolizer != nullptr) ? m_symbolizer(m_symbolizerContext, key.addressSpace, key.rip, &offset) : nullptr;
+            if (symbol != nullptr) {
+                stack += symbol;
+            }
+            else {
+                snprintf(frame, sizeof(frame), "0x%" PRIx64, key.rip);
+                stack += frame;
+            }
+            stacks[stack] += entry.count;
+        }
+    }
+
+    for (auto& [stack, count] : stacks) {
+        if (fprintf(file, "%s %" PRIu64 "\n", stack.c_str(), count) < 0) {
+            return false;
+        }
+    }
+    return fflush(file) == 0;
+}
+
+}
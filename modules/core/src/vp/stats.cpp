@@ -0,0 +1,185 @@
+/*
+Implementation of the virtual processor statistics collector.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/vp/stats.hpp"
+
+namespace virt86 {
+
+uint64_t LatencyHistogram::Percentile(const double percentile) const noexcept {
+    if (totalCount == 0) {
+        return 0;
+    }
+
+    // Find the first bucket where the cumulative count reaches the target
+    uint64_t target = static_cast<uint64_t>(percentile / 100.0 * totalCount + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < NumBuckets; i++) {
+        cumulative += counts[i];
+        if (cumulative >= target) {
+            return BucketUpperBound(i);
+        }
+    }
+    return BucketUpperBound(NumBuckets - 1);
+}
+
+#if defined(VIRT86_ENABLE_STATISTICS)
+
+// Fibonacci hashing spreads sequential ports and pages across the tables
+static inline size_t HashSlot(const uint64_t key, const size_t tableSize) noexcept {
+    return static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> 32) & (tableSize - 1);
+}
+
+VPStatisticsCollector::VPStatisticsCollector() noexcept {
+    for (auto& counter : m_counters) {
+        counter.store(0, std::memory_order_relaxed);
+    }
+    for (auto& key : m_portKeys) {
+        key.store(0, std::memory_order_relaxed);
+    }
+    for (auto& key : m_mmioKeys) {
+        key.store(0, std::memory_order_relaxed);
+    }
+    for (auto& value : m_baseline) {
+        value = 0;
+    }
+}
+
+void VPStatisticsCollector::RecordPIO(const uint16_t port) noexcept {
+    static_assert((VPStatistics::MaxTrackedPorts & (VPStatistics::MaxTrackedPorts - 1)) == 0, "MaxTrackedPorts must be a power of two");
+
+    const uint32_t key = static_cast<uint32_t>(port) + 1;
+    size_t slot = HashSlot(key, VPStatistics::MaxTrackedPorts);
+    for (size_t i = 0; i < VPStatistics::MaxTrackedPorts; i++) {
+        const uint32_t slotKey = m_portKeys[slot].load(std::memory_order_relaxed);
+        if (slotKey == key) {
+            Increment(kPortsBase + slot);
+            return;
+        }
+        if (slotKey == 0) {
+            // Publish the key after the counter so that readers never see
+            // a key paired with a counter from a previous owner
+            Increment(kPortsBase + slot);
+            m_portKeys[slot].store(key, std::memory_order_release);
+            return;
+        }
+        slot = (slot + 1) & (VPStatistics::MaxTrackedPorts - 1);
+    }
+    Increment(kUntrackedPIO);
+}
+
+void VPStatisticsCollector::RecordMMIO(const uint64_t address) noexcept {
+    static_assert((VPStatistics::MaxTrackedMMIOPages & (VPStatistics::MaxTrackedMMIOPages - 1)) == 0, "MaxTrackedMMIOPages must be a power of two");
+
+    const uint64_t key = (address >> 12) + 1;
+    size_t slot = HashSlot(key, VPStatistics::MaxTrackedMMIOPages);
+    for (size_t i = 0; i < VPStatistics::MaxTrackedMMIOPages; i++) {
+        const uint64_t slotKey = m_mmioKeys[slot].load(std::memory_order_relaxed);
+        if (slotKey == key) {
+            Increment(kMMIOBase + slot);
+            return;
+        }
+        if (slotKey == 0) {
+            Increment(kMMIOBase + slot);
+            m_mmioKeys[slot].store(key, std::memory_order_release);
+            return;
+        }
+        slot = (slot + 1) & (VPStatistics::MaxTrackedMMIOPages - 1);
+    }
+    Increment(kUntrackedMMIO);
+}
+
+void VPStatisticsCollector::EndRun(const VMExitReason reason, const bool profilerKick) noexcept {
+    const uint64_t end = Now();
+    const uint64_t guestEnd = (m_guestEnd != 0) ? m_guestEnd : end;
+
+    Increment(profilerKick ? kProfilerKicks : kExitsBase + static_cast<size_t>(reason));
+    RecordLatency(kGuestTimeBase, guestEnd - m_runStart);
+    RecordLatency(kHandlingTimeBase, end - guestEnd);
+}
+
+void VPStatisticsCollector::Snapshot(VPStatistics& statistics) const noexcept {
+    uint64_t counters[kNumCounters];
+    {
+        std::lock_guard<std::mutex> lock(m_baselineMutex);
+        for (size_t i = 0; i < kNumCounters; i++) {
+            counters[i] = m_counters[i].load(std::memory_order_relaxed) - m_baseline[i];
+        }
+    }
+
+    for (size_t i = 0; i < NumVMExitReasons; i++) {
+        statistics.exits[i] = counters[kExitsBase + i];
+    }
+    statistics.profilerKicks = counters[kProfilerKicks];
+
+    statistics.numPorts = 0;
+    for (size_t i = 0; i < VPStatistics::MaxTrackedPorts; i++) {
+        const uint32_t key = m_portKeys[i].load(std::memory_order_acquire);
+        const uint64_t count = counters[kPortsBase + i];
+        if (key != 0 && count != 0) {
+            auto& entry = statistics.ports[statistics.numPorts++];
+            entry.port = static_cast<uint16_t>(key - 1);
+            entry.count = count;
+        }
+    }
+    statistics.untrackedPIO = counters[kUntrackedPIO];
+
+    statistics.numMMIOPages = 0;
+    for (size_t i = 0; i < VPStatistics::MaxTrackedMMIOPages; i++) {
+        const uint64_t key = m_mmioKeys[i].load(std::memory_order_acquire);
+        const uint64_t count = counters[kMMIOBase + i];
+        if (key != 0 && count != 0) {
+            auto& entry = statistics.mmioPages[statistics.numMMIOPages++];
+            entry.address = (key - 1) << 12;
+            entry.count = count;
+        }
+    }
+    statistics.untrackedMMIO = counters[kUntrackedMMIO];
+
+    SnapshotHistogram(statistics.guestTime, counters, kGuestTimeBase);
+    SnapshotHistogram(statistics.handlingTime, counters, kHandlingTimeBase);
+}
+
+void VPStatisticsCollector::SnapshotHistogram(LatencyHistogram& histogram, const uint64_t *counters, const size_t base) const noexcept {
+    histogram.totalCount = 0;
+    for (size_t i = 0; i < LatencyHistogram::NumBuckets; i++) {
+        histogram.counts[i] = counters[base + i];
+        histogram.totalCount += histogram.counts[i];
+    }
+    histogram.totalNanoseconds = counters[base + LatencyHistogram::NumBuckets];
+}
+
+void VPStatisticsCollector::Reset() noexcept {
+    std::lock_guard<std::mutex> lock(m_baselineMutex);
+    for (size_t i = 0; i < kNumCounters; i++) {
+        m_baseline[i] = m_counters[i].load(std::memory_order_relaxed);
+    }
+}
+
+#endif
+
+}
@@ -0,0 +1,141 @@
+/*
+Implementation of the VM exit trace ring.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/vp/trace.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace virt86 {
+
+static size_t RoundUpToPowerOfTwo(const size_t value) noexcept {
+    size_t result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
+}
+
+ExitTraceRing::ExitTraceRing(const size_t capacity, const uint32_t vcpuIndex)
+    : m_mask(RoundUpToPowerOfTwo(std::max<size_t>(capacity, 1)) - 1)
+    , m_vcpuIndex(vcpuIndex)
+    , m_started(0)
+    , m_published(0)
+{
+    const size_t numWords = Capacity() * kWordsPerRecord;
+    m_words = std::make_unique<std::atomic<uint64_t>[]>(numWords);
+    for (size_t i = 0; i < numWords; i++) {
+        m_words[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void ExitTraceRing::Push(const ExitTraceRecord& record) noexcept {
+    uint64_t words[kWordsPerRecord];
+    memcpy(words, &record, sizeof(record));
+
+    // Announce the write before touching the slot, so that readers that see
+    // any of the new words also see that the slot is being overwritten
+    const uint64_t sequence = m_started.load(std::memory_order_relaxed);
+    m_started.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    std::atomic<uint64_t> *slot = &m_words[(sequence & m_mask) * kWordsPerRecord];
+    for (size_t i = 0; i < kWordsPerRecord; i++) {
+        slot[i].store(words[i], std::memory_order_relaxed);
+    }
+
+    m_published.store(sequence + 1, std::memory_order_release);
+}
+
+size_t ExitTraceRing::Read(uint64_t& cursor, ExitTraceRecord *records, const size_t maxRecords, uint64_t *dropped) const noexcept {
+    const uint64_t capacity = Capacity();
+    const uint64_t head = m_published.load(std::memory_order_acquire);
+
+    // Skip records that have already been overwritten
+    uint64_t first = cursor;
+    if (head > capacity && first < head - capacity) {
+        first = head - capacity;
+    }
+    if (first > head) {
+        first = head;
+    }
+    const size_t count = static_cast<size_t>(std::min<uint64_t>(head - first, maxRecords));
+
+    for (size_t i = 0; i < count; i++) {
+        const std::atomic<uint64_t> *slot = &m_words[((first + i) & m_mask) * kWordsPerRecord];
+        uint64_t words[kWordsPerRecord];
+        for (size_t w = 0; w < kWordsPerRecord; w++) {
+            words[w] = slot[w].load(std::memory_order_relaxed);
+        }
+        memcpy(&records[i], words, sizeof(ExitTraceRecord));
+    }
+
+    // Discard records that the writer started overwriting during the copy
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint64_t started = m_started.load(std::memory_order_relaxed);
+    size_t valid = count;
+    uint64_t validFirst = first;
+    if (started > capacity && validFirst < started - capacity) {
+        const uint64_t torn = std::min<uint64_t>(started - capacity - validFirst, count);
+        memmove(records, records + torn, static_cast<size_t>(count - torn) * sizeof(ExitTraceRecord));
+        valid -= static_cast<size_t>(torn);
+        validFirst += torn;
+    }
+
+    if (dropped != nullptr) {
+        *dropped += validFirst - std::min(cursor, validFirst);
+    }
+    cursor = validFirst + valid;
+    return valid;
+}
+
+bool ExitTraceRing::WriteDump(std::FILE *file) const noexcept {
+    if (file == nullptr) {
+        return false;
+    }
+
+    const size_t capacity = Capacity();
+    auto records = std::make_unique<ExitTraceRecord[]>(capacity);
+    uint64_t cursor = 0;
+    const size_t count = Read(cursor, records.get(), capacity);
+
+    ExitTraceDumpHeader header = {};
+    memcpy(header.magic, ExitTraceDumpHeader::kMagic, sizeof(header.magic));
+    header.version = ExitTraceDumpHeader::kVersion;
+    header.recordSize = sizeof(ExitTraceRecord);
+    header.vcpuIndex = m_vcpuIndex;
+    header.firstSequence = cursor - count;
+    header.recordCount = count;
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        return false;
+    }
+    if (count > 0 && fwrite(records.get(), sizeof(ExitTraceRecord), count, file) != count) {
+        return false;
+    }
+    return fflush(file) == 0;
+}
+
+}
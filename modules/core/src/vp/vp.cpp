@@ -26,12 +26,19 @@ SOFTWARE.
 #include "virt86/vp/vp.hpp"
 #include "virt86/vm/vm.hpp"
 #include "virt86/platform/platform.hpp"
+#include "virt86/util/probes.hpp"
+#include "virt86/util/tsc.hpp"
+
+#include <memory>
 
 namespace virt86 {
 
 VirtualProcessor::VirtualProcessor(VirtualMachine& vm)
     : m_vm(vm)
     , m_io(vm.m_io)
+    , m_exitTraceRecord()
+    , m_index(0)
+    , m_profiler(nullptr)
 {
 }
 
@@ -42,7 +49,55 @@ VirtualProcessor::~VirtualProcessor() noexcept {
 
 VPExecutionStatus VirtualProcessor::Run() {
     HandleInterruptQueue();
-    return RunImpl();
+    if (m_profiler != nullptr && m_vm.GetPlatform().GetFeatures().timeSlicedExecution) {
+        return RunProfiled();
+    }
+    BeginExecution();
+    const auto status = RunImpl();
+    EndExecution(status);
+    return status;
+}
+
+VPExecutionStatus VirtualProcessor::RunProfiled() {
+    // Kick the virtual processor out of the guest once every sampling period
+    // to take a sample, then resume execution unless the guest exited for
+    // another reason
+    for (;;) {
+        BeginExecution();
+        const auto status = RunForImpl(m_profiler->GetSamplingPeriod());
+        const bool kicked = (status == VPExecutionStatus::OK && m_exitInfo.reason == VMExitReason::TimeSliceExpired);
+        EndExecution(status, kicked);
+        if (!kicked) {
+            return status;
+        }
+        HandleInterruptQueue();
+    }
+}
+
+VPExecutionStatus VirtualProcessor::RunFor(const std::chrono::nanoseconds timeSlice, std::chrono::nanoseconds *elapsed) {
+    if (!m_vm.GetPlatform().GetFeatures().timeSlicedExecution) {
+        return VPExecutionStatus::Unsupported;
+    }
+
+    // An empty time slice expires immediately
+    if (timeSlice.count() <= 0) {
+        m_exitInfo.reason = VMExitReason::TimeSliceExpired;
+        if (elapsed != nullptr) {
+            *elapsed = std::chrono::nanoseconds::zero();
+        }
+        return VPExecutionStatus::OK;
+    }
+
+    HandleInterruptQueue();
+
+    BeginExecution();
+    const auto start = std::chrono::steady_clock::now();
+    const auto status = RunForImpl(timeSlice);
+    EndExecution(status);
+    if (elapsed != nullptr) {
+        *elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    }
+    return status;
 }
 
 VPExecutionStatus VirtualProcessor::Step() {
@@ -51,7 +106,10 @@ VPExecutionStatus VirtualProcessor::Step() {
     }
 
     HandleInterruptQueue();
-    return StepImpl();
+    BeginExecution();
+    const auto status = StepImpl();
+    EndExecution(status);
+    return status;
 }
 
 bool VirtualProcessor::EnqueueInterrupt(uint8_t vector) {
@@ -60,6 +118,97 @@ bool VirtualProcessor::EnqueueInterrupt(uint8_t vector) {
     return PrepareInterrupt(vector);
 }
 
+// ----- Statistics -----------------------------------------------------------
+
+VPOperationStatus VirtualProcessor::GetStatistics(VPStatistics& statistics) const noexcept {
+#if defined(VIRT86_ENABLE_STATISTICS)
+    m_statistics.Snapshot(statistics);
+    return VPOperationStatus::OK;
+#else
+    (void)statistics;
+    return VPOperationStatus::Unsupported;
+#endif
+}
+
+VPOperationStatus VirtualProcessor::ResetStatistics() noexcept {
+#if defined(VIRT86_ENABLE_STATISTICS)
+    m_statistics.Reset();
+    return VPOperationStatus::OK;
+#else
+    return VPOperationStatus::Unsupported;
+#endif
+}
+
+VPOperationStatus VirtualProcessor::GetPlatformStatistics(PlatformStatistics& statistics) const noexcept {
+    return VPOperationStatus::Unsupported;
+}
+
+// ----- Exit tracing ---------------------------------------------------------
+
+VPOperationStatus VirtualProcessor::EnableExitTrace(const size_t capacity) noexcept {
+    if (capacity == 0) {
+        return VPOperationStatus::InvalidArguments;
+    }
+    try {
+        m_exitTrace = std::make_unique<ExitTraceRing>(capacity, m_index);
+    }
+    catch (const std::bad_alloc&) {
+        return VPOperationStatus::Failed;
+    }
+    return VPOperationStatus::OK;
+}
+
+void VirtualProcessor::DisableExitTrace() noexcept {
+    m_exitTrace.reset();
+}
+
+// ----- Profiling ------------------------------------------------------------
+
+void VirtualProcessor::SetProfiler(GuestProfiler *profiler) noexcept {
+    m_profiler = profiler;
+    m_nextProfileSample = std::chrono::steady_clock::now();
+}
+
+// ----- Execution bookkeeping ------------------------------------------------
+
+void VirtualProcessor::BeginExecution() noexcept {
+    VIRT86_PROBE2(run_entry, std::addressof(m_vm), m_index);
+    m_statistics.BeginRun();
+    if (m_exitTrace) {
+        m_exitTraceRecord = {};
+        m_exitTraceRecord.tscEnter = ReadTSC();
+    }
+}
+
+void VirtualProcessor::EndExecution(const VPExecutionStatus status, const bool kicked) noexcept {
+    // Failed executions have no meaningful exit reason
+    const bool ok = (status == VPExecutionStatus::OK);
+    VIRT86_PROBE4(run_exit, std::addressof(m_vm), m_index, static_cast<int>(status), static_cast<int>(m_exitInfo.reason));
+    m_statistics.EndRun(ok ? m_exitInfo.reason : VMExitReason::Error, kicked);
+
+    if (m_exitTrace) {
+        if (m_exitTraceRecord.tscExit == 0) {
+            m_exitTraceRecord.tscExit = ReadTSC();
+        }
+        m_exitTraceRecord.reason = static_cast<uint8_t>(m_exitInfo.reason);
+        if (!ok) {
+            m_exitTraceRecord.flags |= ExitTraceFlags::Failed;
+        }
+        if (kicked) {
+            m_exitTraceRecord.flags |= ExitTraceFlags::ProfilerKick;
+        }
+        m_exitTrace->Push(m_exitTraceRecord);
+    }
+
+    if (m_profiler != nullptr && ok) {
+        const auto now = std::chrono::steady_clock::now();
+        if (now >= m_nextProfileSample) {
+            m_profiler->Sample(*this, kicked);
+            m_nextProfileSample = now + m_profiler->GetSamplingPeriod();
+        }
+    }
+}
+
 // ----- CPU modes ------------------------------------------------------------
 
 CPUExecutionMode VirtualProcessor::GetExecutionMode() noexcept {
@@ -168,6 +317,14 @@ bool VirtualProcessor::LinearToPhysical(const uint64_t laddr, uint64_t *paddr) n
         return false;
     }
 
+    const bool found = WalkPageTables(laddr, paddr);
+    if (!found) {
+        VIRT86_PROBE3(l2p_miss, std::addressof(m_vm), m_index, laddr);
+    }
+    return found;
+}
+
+bool VirtualProcessor::WalkPageTables(const uint64_t laddr, uint64_t *paddr) noexcept {
     // TODO: check that reserved bits are all zero
 
     // Read registers used by paging
@@ -829,6 +986,7 @@ void VirtualProcessor::InjectPendingInterrupt() {
         const uint8_t vector = m_pendingInterrupts.front();
         m_pendingInterrupts.pop();
         InjectInterrupt(vector);
+        VIRT86_PROBE3(interrupt_inject, std::addressof(m_vm), m_index, vector);
     }
 
     return;
@@ -852,6 +1010,18 @@ VPOperationStatus VirtualProcessor::GetBreakpointAddress(uint64_t *address) cons
     return VPOperationStatus::Unsupported;
 }
 
+VPOperationStatus VirtualProcessor::SaveState(VPState& state) noexcept {
+    return VPOperationStatus::Unsupported;
+}
+
+VPOperationStatus VirtualProcessor::RestoreState(const VPState& state, VPRejectedMSRs *rejectedMSRs) noexcept {
+    return VPOperationStatus::Unsupported;
+}
+
+VPExecutionStatus VirtualProcessor::RunForImpl(const std::chrono::nanoseconds timeSlice) noexcept {
+    return VPExecutionStatus::Unsupported;
+}
+
 VPExecutionStatus VirtualProcessor::StepImpl() noexcept {
     return VPExecutionStatus::Unsupported;
 }
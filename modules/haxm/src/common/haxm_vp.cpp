@@ -28,8 +28,11 @@ SOFTWARE.
 #include "haxm_helpers.hpp"
 
 #include "virt86/util/bytemanip.hpp"
+#include "virt86/util/probes.hpp"
+#include "virt86/util/tsc.hpp"
 
 #include <cassert>
+#include <memory>
 
 namespace virt86::haxm {
 
@@ -79,7 +82,12 @@ bool HaxmVirtualProcessor::Initialize() noexcept {
 VPExecutionStatus HaxmVirtualProcessor::RunImpl() noexcept {
     UpdateRegisters();
     
-    if (!m_sys->Run()) {
+    const bool result = m_sys->Run();
+    m_statistics.EndGuest();
+    if (m_exitTrace) {
+        m_exitTraceRecord.tscExit = ReadTSC();
+    }
+    if (!result) {
         return VPExecutionStatus::Failed;
     }
 
@@ -103,11 +111,11 @@ VPExecutionStatus HaxmVirtualProcessor::StepImpl() noexcept {
         return status;
     }
 
-    const auto result = HandleExecResult();
+    // RunImpl() has already handled the exit
     if (m_exitInfo.reason == VMExitReason::SoftwareBreakpoint) {
         m_exitInfo.reason = VMExitReason::Step;
     }
-    return result;
+    return status;
 }
 
 bool HaxmVirtualProcessor::SetDebug() noexcept {
@@ -182,6 +190,16 @@ VPExecutionStatus HaxmVirtualProcessor::HandleExecResult() noexcept {
 
 void HaxmVirtualProcessor::HandleIO() noexcept {
     m_exitInfo.reason = VMExitReason::PIO;
+    m_statistics.RecordPIO(m_tunnel->io._port);
+    VIRT86_PROBE5(pio, std::addressof(GetVirtualMachine()), GetIndex(), m_tunnel->io._port, m_tunnel->io._size, m_tunnel->io._direction == HAX_IO_OUT);
+    if (m_exitTrace) {
+        m_exitTraceRecord.address = m_tunnel->io._port;
+        m_exitTraceRecord.size = m_tunnel->io._size;
+        m_exitTraceRecord.flags |= ExitTraceFlags::AccessValid;
+        if (m_tunnel->io._direction == HAX_IO_OUT) {
+            m_exitTraceRecord.flags |= ExitTraceFlags::Write;
+        }
+    }
     
     uint8_t *ptr = static_cast<uint8_t *>(m_ioTunnel);
     if (m_tunnel->io._df) {
@@ -198,9 +216,15 @@ void HaxmVirtualProcessor::HandleIO() noexcept {
             default: assert(0); // should not happen
             }
             m_io.IOWrite(m_tunnel->io._port, m_tunnel->io._size, value);
+            if (m_exitTrace) {
+                m_exitTraceRecord.value = value;
+            }
         }
         else {
             uint32_t value = m_io.IORead(m_tunnel->io._port, m_tunnel->io._size);
+            if (m_exitTrace) {
+                m_exitTraceRecord.value = value;
+            }
             switch (m_tunnel->io._size) {
             case 1: *ptr = static_cast<uint8_t>(value); break;
             case 2: *reinterpret_cast<uint16_t *>(ptr) = static_cast<uint16_t>(value); break;
@@ -222,6 +246,18 @@ void HaxmVirtualProcessor::HandleFastMMIO() noexcept {
     m_exitInfo.reason = VMExitReason::MMIO;
 
     hax_fastmmio *info = static_cast<hax_fastmmio *>(m_ioTunnel);
+    m_statistics.RecordMMIO(info->gpa);
+    VIRT86_PROBE5(mmio, std::addressof(GetVirtualMachine()), GetIndex(), info->gpa, info->size, info->direction == HAX_IO_IN);
+    if (m_exitTrace) {
+        m_exitTraceRecord.address = info->gpa;
+        m_exitTraceRecord.size = info->size;
+        m_exitTraceRecord.flags |= ExitTraceFlags::AccessValid;
+        if (info->direction == HAX_IO_IN) {
+            // HAX_IO_IN denotes a guest write to MMIO
+            m_exitTraceRecord.value = info->value;
+            m_exitTraceRecord.flags |= ExitTraceFlags::Write;
+        }
+    }
 
     if (info->direction < 2) {
         if (info->direction == HAX_IO_IN) {
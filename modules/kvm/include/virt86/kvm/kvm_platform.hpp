@@ -32,6 +32,11 @@ SOFTWARE.
 
 #include "virt86/platform/platform.hpp"
 
+#include <mutex>
+#include <vector>
+
+struct kvm_cpuid_entry2;
+
 namespace virt86::kvm {
 
 class KvmPlatform : public Platform {
@@ -50,13 +55,53 @@ public:
     KvmPlatform *operator&() = delete;
     static KvmPlatform& Instance() noexcept;
 
+    /**
+     * Selects the real-time signal that interrupts virtual processors when
+     * the time slice given to VirtualProcessor::RunFor() expires. SIGRTMIN is
+     * used by default.
+     *
+     * The first call to RunFor() installs a handler for the signal for the
+     * whole process, replacing any handler the application installed. The
+     * application must not use the signal for any other purpose, and the
+     * signal can no longer be changed once the handler is installed.
+     *
+     * Returns false if the signal is not a real-time signal or a different
+     * signal is already in use.
+     */
+    static bool SetTimeSliceSignal(const int signal) noexcept;
+
 protected:
     std::unique_ptr<VirtualMachine> CreateVMImpl(const VMSpecifications& specifications) override;
+    void LoadSupportedCustomCPUIDs(std::vector<CPUIDResult>& cpuids) const override;
 
 private:
     KvmPlatform() noexcept;
    
     int m_fd;
+
+    // Supported CPUID entries, queried on first use
+    mutable std::once_flag m_supportedCPUIDsFlag;
+    mutable std::vector<kvm_cpuid_entry2> m_supportedCPUIDs;
+    mutable bool m_supportedCPUIDsValid;
+
+    /**
+     * Retrieves the CPUID entries supported by KVM as returned by
+     * KVM_GET_SUPPORTED_CPUID, querying them on the first call.
+     * Returns nullptr if the query failed.
+     */
+    const std::vector<kvm_cpuid_entry2> *SupportedCPUIDEntries() const;
+
+    // MSRs that must be saved and restored, queried on first use
+    mutable std::once_flag m_supportedMSRsFlag;
+    mutable std::vector<uint32_t> m_supportedMSRs;
+
+    /**
+     * Retrieves the list of MSRs that KVM supports saving and restoring, as
+     * returned by KVM_GET_MSR_INDEX_LIST, querying them on the first call.
+     */
+    const std::vector<uint32_t>& SupportedMSRIndices() const;
+
+    friend class KvmVirtualMachine;
 };
 
 }
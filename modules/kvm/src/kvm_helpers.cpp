@@ -70,6 +70,50 @@ void StoreTable(const RegValue& value, struct kvm_dtable *table) noexcept {
     table->limit = value.table.limit;
 }
 
+void LoadSegment(VPSegmentState& state, const struct kvm_segment *segment) noexcept {
+    state.base = segment->base;
+    state.limit = segment->limit;
+    state.selector = segment->selector;
+    state.reserved = 0;
+    state.attributes = (segment->type & 0xF)
+        | (segment->s << 4)
+        | ((segment->dpl & 0x3) << 5)
+        | (segment->present << 7)
+        | (segment->avl << 12)
+        | (segment->l << 13)
+        | (segment->db << 14)
+        | (segment->g << 15)
+        | ((segment->unusable) ? VPSegmentUnusable : 0);
+    state.reserved2 = 0;
+}
+
+void StoreSegment(const VPSegmentState& state, struct kvm_segment *segment) noexcept {
+    segment->base = state.base;
+    segment->limit = state.limit;
+    segment->selector = state.selector;
+    segment->type = state.attributes & 0xF;
+    segment->s = (state.attributes >> 4) & 1;
+    segment->dpl = (state.attributes >> 5) & 0x3;
+    segment->present = (state.attributes >> 7) & 1;
+    segment->avl = (state.attributes >> 12) & 1;
+    segment->l = (state.attributes >> 13) & 1;
+    segment->db = (state.attributes >> 14) & 1;
+    segment->g = (state.attributes >> 15) & 1;
+    segment->unusable = (state.attributes & VPSegmentUnusable) ? 1 : 0;
+    segment->padding = 0;
+}
+
+void LoadTable(VPTableState& state, const struct kvm_dtable *table) noexcept {
+    state.base = table->base;
+    state.limit = table->limit;
+    state.reserved[0] = state.reserved[1] = state.reserved[2] = 0;
+}
+
+void StoreTable(const VPTableState& state, struct kvm_dtable *table) noexcept {
+    table->base = state.base;
+    table->limit = state.limit;
+}
+
 void LoadSTRegister(RegValue& value, uint8_t index, const struct kvm_fpu& fpuRegs) noexcept {
     value.st.significand = *reinterpret_cast<const uint64_t *>(&fpuRegs.fpr[index][0]);
     value.st.exponentSign = *reinterpret_cast<const uint16_t *>(&fpuRegs.fpr[index][8]);
@@ -106,4 +150,31 @@ bool StoreXMMRegister(const RegValue& value, uint8_t index, struct kvm_fpu& fpuR
     return false;
 }
 
+KvmDisabledExit LoadDisabledExits(uint64_t flags) noexcept {
+    KvmDisabledExit exits = KvmDisabledExit::None;
+#if defined(KVM_CAP_X86_DISABLE_EXITS)
+    if (flags & KVM_X86_DISABLE_EXITS_MWAIT) exits |= KvmDisabledExit::MWAIT;
+    if (flags & KVM_X86_DISABLE_EXITS_HLT) exits |= KvmDisabledExit::HLT;
+    if (flags & KVM_X86_DISABLE_EXITS_PAUSE) exits |= KvmDisabledExit::PAUSE;
+#if defined(KVM_X86_DISABLE_EXITS_CSTATE)
+    if (flags & KVM_X86_DISABLE_EXITS_CSTATE) exits |= KvmDisabledExit::CState;
+#endif
+#endif
+    return exits;
+}
+
+uint64_t StoreDisabledExits(KvmDisabledExit exits) noexcept {
+    uint64_t flags = 0;
+    auto bmExits = BitmaskEnum(exits);
+#if defined(KVM_CAP_X86_DISABLE_EXITS)
+    if (bmExits.AnyOf(KvmDisabledExit::MWAIT)) flags |= KVM_X86_DISABLE_EXITS_MWAIT;
+    if (bmExits.AnyOf(KvmDisabledExit::HLT)) flags |= KVM_X86_DISABLE_EXITS_HLT;
+    if (bmExits.AnyOf(KvmDisabledExit::PAUSE)) flags |= KVM_X86_DISABLE_EXITS_PAUSE;
+#if defined(KVM_X86_DISABLE_EXITS_CSTATE)
+    if (bmExits.AnyOf(KvmDisabledExit::CState)) flags |= KVM_X86_DISABLE_EXITS_CSTATE;
+#endif
+#endif
+    return flags;
+}
+
 }
@@ -26,6 +26,8 @@ SOFTWARE.
 #pragma once
 
 #include "virt86/vp/regs.hpp"
+#include "virt86/vp/state.hpp"
+#include "virt86/platform/features.hpp"
 
 #include <cstddef>
 #include <cstdlib>
@@ -39,6 +41,12 @@ void StoreSegment(const RegValue& value, struct kvm_segment *segment) noexcept;
 
 void LoadTable(RegValue& value, const struct kvm_dtable *table) noexcept;
 void StoreTable(const RegValue& value, struct kvm_dtable *table) noexcept;
+
+void LoadSegment(VPSegmentState& state, const struct kvm_segment *segment) noexcept;
+void StoreSegment(const VPSegmentState& state, struct kvm_segment *segment) noexcept;
+
+void LoadTable(VPTableState& state, const struct kvm_dtable *table) noexcept;
+void StoreTable(const VPTableState& state, struct kvm_dtable *table) noexcept;
     
 void LoadSTRegister(RegValue& value, uint8_t index, const struct kvm_fpu& fpuRegs) noexcept;
 void StoreSTRegister(const RegValue& value, uint8_t index, struct kvm_fpu& fpuRegs) noexcept;
@@ -49,6 +57,9 @@ void StoreMMRegister(const RegValue& value, uint8_t index, struct kvm_fpu& fpuRe
 bool LoadXMMRegister(RegValue& value, uint8_t index, const struct kvm_fpu& fpuRegs) noexcept;
 bool StoreXMMRegister(const RegValue& value, uint8_t index, struct kvm_fpu& fpuRegs) noexcept;
 
+KvmDisabledExit LoadDisabledExits(uint64_t flags) noexcept;
+uint64_t StoreDisabledExits(KvmDisabledExit exits) noexcept;
+
 /**
  * Allocates memory for an object of type T that contains a variable-length
  * array of entries with type E.
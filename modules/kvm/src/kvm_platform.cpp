@@ -25,6 +25,7 @@ SOFTWARE.
 */
 #include "virt86/kvm/kvm_platform.hpp"
 #include "kvm_vm.hpp"
+#include "kvm_vp.hpp"
 #include "kvm_helpers.hpp"
 
 #include "virt86/util/host_info.hpp"
@@ -34,6 +35,8 @@ SOFTWARE.
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
 #include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
 #include <memory>
 
 namespace virt86::kvm {
@@ -43,9 +46,14 @@ KvmPlatform& KvmPlatform::Instance() noexcept {
     return instance;
 }
 
+bool KvmPlatform::SetTimeSliceSignal(const int signal) noexcept {
+    return KvmVirtualProcessor::SetTimeSliceSignal(signal);
+}
+
 KvmPlatform::KvmPlatform() noexcept
     : Platform("KVM")
     , m_fd(-1)
+    , m_supportedCPUIDsValid(false)
 {
     // Open the KVM module
     m_fd = open("/dev/kvm", O_RDWR);
@@ -105,27 +113,91 @@ KvmPlatform::KvmPlatform() noexcept
     m_features.unrestrictedGuest = true;
     m_features.extendedPageTables = true;
     m_features.guestDebugging = ioctl(m_fd, KVM_CAP_DEBUGREGS) != 0 && ioctl(m_fd, KVM_CAP_SET_GUEST_DEBUG) != 0;
+#if defined(KVM_CAP_IMMEDIATE_EXIT)
+    m_features.timeSlicedExecution = ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_IMMEDIATE_EXIT) > 0;
+#endif
+#if defined(KVM_CAP_DIRTY_LOG_RING)
+    // Returns the maximum ring size in bytes
+    const int dirtyRingBytes = ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_DIRTY_LOG_RING);
+    m_features.kvm.maxDirtyRingSize = (dirtyRingBytes > 0) ? static_cast<uint32_t>(dirtyRingBytes / sizeof(kvm_dirty_gfn)) : 0;
+#endif
+#if defined(KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2)
+    const int manualProtect = ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2);
+    m_features.kvm.manualDirtyLogProtect = manualProtect > 0 && (manualProtect & KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE) != 0;
+#endif
+#if defined(KVM_CAP_X86_DISABLE_EXITS)
+    // Returns the set of exits that can be disabled
+    const int disableExits = ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_X86_DISABLE_EXITS);
+    m_features.kvm.disabledExits = (disableExits > 0) ? LoadDisabledExits(static_cast<uint64_t>(disableExits)) : KvmDisabledExit::None;
+#endif
+#if defined(KVM_CAP_HALT_POLL)
+    m_features.kvm.haltPollControl = ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_HALT_POLL) > 0;
+#endif
     m_features.dirtyPageTracking = true;
-    m_features.partialDirtyBitmap = false;
+    m_features.partialDirtyBitmap = true;
     m_features.largeMemoryAllocation = true;
-    m_features.partialUnmapping = false;
+    m_features.partialUnmapping = true;
     m_features.memoryAliasing = true;
-    m_features.memoryUnmapping = false;
+    m_features.memoryUnmapping = true;
     m_features.partialMMIOInstructions = false;
     m_features.floatingPointExtensions = HostInfo.floatingPointExtensions;
     m_features.extendedControlRegisters = ExtendedControlRegister::CR8 | ExtendedControlRegister::XCR0;
     m_features.extendedVMExits = ExtendedVMExit::Exception;
-    m_features.exceptionExits = ExceptionCode::All;
+#if defined(KVM_CAP_X86_USER_SPACE_MSR) && defined(KVM_CAP_X86_MSR_FILTER)
+    // MSR access exits are filtered so that only the requested MSRs leave
+    // the kernel
+    if (ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_X86_USER_SPACE_MSR) > 0 && ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_X86_MSR_FILTER) > 0) {
+        m_features.extendedVMExits |= ExtendedVMExit::MSRAccess;
+    }
+#endif
+    // KVM only allows userspace to intercept #BP and #DB through the guest
+    // debug interface. Intercepting #DB takes over the debug registers, which
+    // disables the guest's own hardware breakpoints.
+    m_features.exceptionExits = ExceptionCode::BreakpointTrap | ExceptionCode::DebugTrapOrFault;
     m_features.customCPUIDs = ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_EXT_CPUID) != 0;
+    m_features.guestClock = ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_ADJUST_CLOCK) > 0;
+    m_features.guestTSCScaling = ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_TSC_CONTROL) > 0;
+#if defined(KVM_CAP_BINARY_STATS_FD)
+    m_features.platformStatistics = ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_BINARY_STATS_FD) > 0;
+#endif
+    m_features.vpStateSaveRestore = ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_VCPU_EVENTS) > 0
+        && ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_MP_STATE) > 0
+        && ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_DEBUGREGS) > 0
+        && ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_XSAVE) > 0
+        && ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_XCRS) > 0;
+    // Guest memory is allocated from memfds, which clones map privately
+    m_features.guestMemoryAllocation = true;
+    m_features.vmCloning = m_features.vpStateSaveRestore;
+#if defined(KVM_CAP_ENFORCE_PV_FEATURE_CPUID)
+    m_features.kvm.enforceParavirtFeatures = ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_ENFORCE_PV_FEATURE_CPUID) > 0;
+#endif
+}
+
+KvmPlatform::~KvmPlatform() noexcept {
+    DestroyVMs();
+    if (m_fd != -1) {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+std::unique_ptr<VirtualMachine> KvmPlatform::CreateVMImpl(const VMSpecifications& specifications) {
+    auto vm = std::make_unique<KvmVirtualMachine>(*this, specifications, m_fd);
+    if (!vm->Initialize()) {
+        return nullptr;
+    }
+    return vm;
+}
 
-    // Get list of supported CPUIDs
-    if (m_features.customCPUIDs) {
-        // Start with a reasonably large starting value.
+const std::vector<kvm_cpuid_entry2> *KvmPlatform::SupportedCPUIDEntries() const {
+    std::call_once(m_supportedCPUIDsFlag, [this]() {
+        // Start with the maximum number of entries KVM supports, so that the
+        // query succeeds on the first try on current kernels.
         // If the ioctl fails, check the error code:
         // - E2BIG indicates that the array is too small
         // - ENOMEM indicates that the array is too large; nent is adjusted to
         //   the correct size
-        uint32_t count = 40;
+        uint32_t count = 256;
         do {
             auto cpuid2 = allocVarEntry<kvm_cpuid2, kvm_cpuid_entry2>(count);
             cpuid2->nent = count;
@@ -143,37 +215,48 @@ KvmPlatform::KvmPlatform() noexcept
                     free(cpuid2);
                     continue;
                 }
-                // Another error occurred, fail initialization
+                // Another error occurred
                 free(cpuid2);
-                m_initStatus = PlatformInitStatus::Failed;
                 return;
             }
 
             // If we get to this point, the ioctl succeeded
-            for (size_t i = 0; i < cpuid2->nent; i++) {
-                auto &entry = cpuid2->entries[i];
-                m_features.supportedCustomCPUIDs.emplace_back(entry.function, entry.eax, entry.ebx, entry.ecx, entry.edx);
-            }
+            m_supportedCPUIDs.assign(cpuid2->entries, cpuid2->entries + cpuid2->nent);
+            m_supportedCPUIDsValid = true;
             free(cpuid2);
             break;
         } while (true);
-    }
+    });
+    return m_supportedCPUIDsValid ? &m_supportedCPUIDs : nullptr;
 }
 
-KvmPlatform::~KvmPlatform() noexcept {
-    DestroyVMs();
-    if (m_fd != -1) {
-        close(m_fd);
-        m_fd = -1;
+void KvmPlatform::LoadSupportedCustomCPUIDs(std::vector<CPUIDResult>& cpuids) const {
+    auto entries = SupportedCPUIDEntries();
+    if (entries == nullptr) {
+        return;
+    }
+    cpuids.reserve(entries->size());
+    for (auto& entry : *entries) {
+        cpuids.emplace_back(entry.function, entry.eax, entry.ebx, entry.ecx, entry.edx);
     }
 }
 
-std::unique_ptr<VirtualMachine> KvmPlatform::CreateVMImpl(const VMSpecifications& specifications) {
-    auto vm = std::make_unique<KvmVirtualMachine>(*this, specifications, m_fd);
-    if (!vm->Initialize()) {
-        return nullptr;
-    }
-    return vm;
+const std::vector<uint32_t>& KvmPlatform::SupportedMSRIndices() const {
+    std::call_once(m_supportedMSRsFlag, [this]() {
+        // The first call fails with E2BIG and reports the number of MSRs
+        kvm_msr_list probe = { 0 };
+        if (ioctl(m_fd, KVM_GET_MSR_INDEX_LIST, &probe) < 0 && errno != E2BIG) {
+            return;
+        }
+
+        auto msrList = allocVarEntry<kvm_msr_list, __u32>(probe.nmsrs);
+        msrList->nmsrs = probe.nmsrs;
+        if (ioctl(m_fd, KVM_GET_MSR_INDEX_LIST, msrList) >= 0) {
+            m_supportedMSRs.assign(msrList->indices, msrList->indices + msrList->nmsrs);
+        }
+        free(msrList);
+    });
+    return m_supportedMSRs;
 }
 
 }
@@ -0,0 +1,131 @@
+/*
+Implementation of the reader for KVM's binary statistics file descriptors.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "kvm_stats.hpp"
+
+#include <linux/kvm.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+namespace virt86::kvm {
+
+KvmStatisticsReader::~KvmStatisticsReader() noexcept {
+    if (m_statsFD != -1) {
+        close(m_statsFD);
+        m_statsFD = -1;
+    }
+}
+
+bool KvmStatisticsReader::Read(const int fd, PlatformStatistics& statistics) noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_statsFD == -1 && !Open(fd)) {
+        return false;
+    }
+
+    // Only reallocate the values when switching schemas
+    if (statistics.schema != m_schema) {
+        statistics.schema = m_schema;
+        statistics.values.assign(m_numValues, 0);
+    }
+
+    const size_t size = m_numValues * sizeof(uint64_t);
+    return pread(m_statsFD, statistics.values.data(), size, m_dataOffset) == static_cast<ssize_t>(size);
+}
+
+bool KvmStatisticsReader::Open(const int fd) noexcept {
+#if defined(KVM_CAP_BINARY_STATS_FD)
+    const int statsFD = ioctl(fd, KVM_GET_STATS_FD, nullptr);
+    if (statsFD < 0) {
+        return false;
+    }
+
+    kvm_stats_header header;
+    if (pread(statsFD, &header, sizeof(header), 0) != sizeof(header)) {
+        close(statsFD);
+        return false;
+    }
+
+    // Each descriptor is immediately followed by its name
+    const size_t descriptorSize = sizeof(kvm_stats_desc) + header.name_size;
+    std::vector<uint8_t> descriptors(descriptorSize * header.num_desc);
+    if (pread(statsFD, descriptors.data(), descriptors.size(), header.desc_offset) != static_cast<ssize_t>(descriptors.size())) {
+        close(statsFD);
+        return false;
+    }
+
+    auto schema = std::make_shared<std::vector<PlatformStatisticDescriptor>>();
+    schema->reserve(header.num_desc);
+    size_t numValues = 0;
+    for (uint32_t i = 0; i < header.num_desc; i++) {
+        auto desc = reinterpret_cast<const kvm_stats_desc *>(&descriptors[i * descriptorSize]);
+        PlatformStatisticDescriptor descriptor;
+        descriptor.name.assign(desc->name, strnlen(desc->name, header.name_size));
+
+        switch (desc->flags & KVM_STATS_TYPE_MASK) {
+        case KVM_STATS_TYPE_INSTANT:     descriptor.type = PlatformStatisticType::Instant;         break;
+        case KVM_STATS_TYPE_PEAK:        descriptor.type = PlatformStatisticType::Peak;            break;
+#if defined(KVM_STATS_TYPE_LINEAR_HIST)
+        case KVM_STATS_TYPE_LINEAR_HIST: descriptor.type = PlatformStatisticType::LinearHistogram; break;
+        case KVM_STATS_TYPE_LOG_HIST:    descriptor.type = PlatformStatisticType::LogHistogram;    break;
+#endif
+        default:                         descriptor.type = PlatformStatisticType::Cumulative;      break;
+        }
+
+        switch (desc->flags & KVM_STATS_UNIT_MASK) {
+        case KVM_STATS_UNIT_BYTES:   descriptor.unit = PlatformStatisticUnit::Bytes;   break;
+        case KVM_STATS_UNIT_SECONDS: descriptor.unit = PlatformStatisticUnit::Seconds; break;
+        case KVM_STATS_UNIT_CYCLES:  descriptor.unit = PlatformStatisticUnit::Cycles;  break;
+#if defined(KVM_STATS_UNIT_BOOLEAN)
+        case KVM_STATS_UNIT_BOOLEAN: descriptor.unit = PlatformStatisticUnit::Boolean; break;
+#endif
+        default:                     descriptor.unit = PlatformStatisticUnit::None;    break;
+        }
+
+        descriptor.base = ((desc->flags & KVM_STATS_BASE_MASK) == KVM_STATS_BASE_POW2) ? 2 : 10;
+        descriptor.exponent = desc->exponent;
+        descriptor.index = desc->offset / sizeof(uint64_t);
+        descriptor.count = desc->size;
+#if defined(KVM_STATS_TYPE_LINEAR_HIST)
+        descriptor.bucketSize = desc->bucket_size;
+#else
+        descriptor.bucketSize = 0;
+#endif
+        numValues = std::max(numValues, descriptor.index + descriptor.count);
+        schema->push_back(std::move(descriptor));
+    }
+
+    m_statsFD = statsFD;
+    m_dataOffset = header.data_offset;
+    m_numValues = numValues;
+    m_schema = std::move(schema);
+    return true;
+#else
+    return false;
+#endif
+}
+
+}
@@ -0,0 +1,68 @@
+/*
+Declares the reader for KVM's binary statistics file descriptors.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/platform/stats.hpp"
+
+#include <sys/types.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace virt86::kvm {
+
+/**
+ * Reads the statistics of a KVM virtual machine or VCPU from the file
+ * descriptor returned by KVM_GET_STATS_FD.
+ *
+ * The file descriptor is opened and the schema is decoded on the first read.
+ * Subsequent reads fetch all values with a single pread.
+ */
+class KvmStatisticsReader {
+public:
+    KvmStatisticsReader() noexcept = default;
+    ~KvmStatisticsReader() noexcept;
+
+    // Prevent copy construction and copy assignment
+    KvmStatisticsReader(const KvmStatisticsReader&) = delete;
+    KvmStatisticsReader& operator=(const KvmStatisticsReader&) = delete;
+
+    /**
+     * Reads the statistics of the VM or VCPU with the given file descriptor.
+     */
+    bool Read(const int fd, PlatformStatistics& statistics) noexcept;
+
+private:
+    std::mutex m_mutex;
+    int m_statsFD = -1;
+    off_t m_dataOffset = 0;
+    size_t m_numValues = 0;
+    std::shared_ptr<const std::vector<PlatformStatisticDescriptor>> m_schema;
+
+    bool Open(const int fd) noexcept;
+};
+
+}
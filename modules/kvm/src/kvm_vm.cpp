@@ -27,19 +27,110 @@ SOFTWARE.
 #include "kvm_vp.hpp"
 #include "kvm_helpers.hpp"
 
+#include "virt86/util/parallel.hpp"
+
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <linux/kvm.h>
+#include <linux/kvm_para.h>
 #include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
 #include <functional>
+#include <iterator>
 #include <memory>
 
 namespace virt86::kvm {
 
-// Checks if the memory region exactly matches the given memory address range
-static bool regionEquals(kvm_userspace_memory_region& rgn, const uint64_t baseAddress, const uint64_t size) noexcept {
-    return rgn.guest_phys_addr == baseAddress && rgn.memory_size == size;
+// The number of memory slots guaranteed by every version of KVM, used if the
+// limit cannot be queried
+static constexpr uint32_t kDefaultMaxSlots = 32;
+
+// ----- Bitmap helpers -------------------------------------------------------
+
+// Number of 64-bit words needed to hold one bit per page of the given size
+static size_t bitmapWords(const uint64_t size) noexcept {
+    return static_cast<size_t>((size / PAGE_SIZE + 63) / 64);
+}
+
+// Builds a mask of count bits (1 to 64) starting at the given bit
+static uint64_t bitMask(const uint64_t bit, const uint64_t count) noexcept {
+    const uint64_t mask = (count >= 64) ? ~0ull : ((1ull << count) - 1);
+    return mask << bit;
+}
+
+// Invokes func(wordIndex, mask) for each word covering the given bit range
+template<typename Func>
+static void forEachBitmapWord(const uint64_t offset, const uint64_t count, Func&& func) noexcept {
+    uint64_t bit = offset;
+    const uint64_t end = offset + count;
+    while (bit < end) {
+        const uint64_t shift = bit % 64;
+        const uint64_t n = std::min<uint64_t>(64 - shift, end - bit);
+        func(static_cast<size_t>(bit / 64), bitMask(shift, n));
+        bit += n;
+    }
+}
+
+static void clearBits(uint64_t *bitmap, const uint64_t offset, const uint64_t count) noexcept {
+    forEachBitmapWord(offset, count, [=](size_t word, uint64_t mask) { bitmap[word] &= ~mask; });
+}
+
+static void setBits(uint64_t *bitmap, const uint64_t offset, const uint64_t count) noexcept {
+    forEachBitmapWord(offset, count, [=](size_t word, uint64_t mask) { bitmap[word] |= mask; });
+}
+
+// Sets bits in a bitmap that other threads may update at the same time
+static void atomicSetBits(uint64_t *bitmap, const uint64_t offset, const uint64_t count) noexcept {
+    forEachBitmapWord(offset, count, [=](size_t word, uint64_t mask) { __atomic_fetch_or(&bitmap[word], mask, __ATOMIC_RELEASE); });
+}
+
+// Clears bits in a bitmap that other threads may update at the same time
+static void atomicClearBits(uint64_t *bitmap, const uint64_t offset, const uint64_t count) noexcept {
+    forEachBitmapWord(offset, count, [=](size_t word, uint64_t mask) { __atomic_fetch_and(&bitmap[word], ~mask, __ATOMIC_ACQ_REL); });
+}
+
+// ORs the low count bits (1 to 64) of value into the bitmap at the given bit
+static void orBits(uint64_t *bitmap, const uint64_t bit, const uint64_t value, const uint64_t count) noexcept {
+    const size_t word = static_cast<size_t>(bit / 64);
+    const uint64_t shift = bit % 64;
+    bitmap[word] |= value << shift;
+    if (shift != 0 && shift + count > 64) {
+        bitmap[word + 1] |= value >> (64 - shift);
+    }
+}
+
+// Atomically clears count bits from src starting at srcOffset and ORs them
+// into dst starting at dstOffset, so that bits set concurrently in src are
+// either taken or kept for later
+static void takeBits(uint64_t *dst, const uint64_t dstOffset, uint64_t *src, const uint64_t srcOffset, const uint64_t count) noexcept {
+    forEachBitmapWord(srcOffset, count, [&](size_t word, uint64_t mask) {
+        const uint64_t taken = __atomic_fetch_and(&src[word], ~mask, __ATOMIC_ACQ_REL) & mask;
+        if (taken != 0) {
+            const uint64_t shift = __builtin_ctzll(mask);
+            orBits(dst, dstOffset + word * 64 + shift - srcOffset, taken >> shift, __builtin_popcountll(mask));
+        }
+    });
+}
+
+// ORs count bits from src starting at srcOffset into dst starting at dstOffset
+static void copyBits(uint64_t *dst, const uint64_t dstOffset, const uint64_t *src, const uint64_t srcOffset, const uint64_t count) noexcept {
+    uint64_t srcBit = srcOffset;
+    forEachBitmapWord(dstOffset, count, [&](size_t word, uint64_t mask) {
+        const uint64_t dstShift = __builtin_ctzll(mask);
+        const uint64_t n = __builtin_popcountll(mask);
+        const size_t srcWord = static_cast<size_t>(srcBit / 64);
+        const uint64_t srcShift = srcBit % 64;
+        uint64_t value = src[srcWord] >> srcShift;
+        if (srcShift != 0 && srcShift + n > 64) {
+            value |= src[srcWord + 1] << (64 - srcShift);
+        }
+        dst[word] |= (value << dstShift) & mask;
+        srcBit += n;
+    });
 }
 
 KvmVirtualMachine::KvmVirtualMachine(KvmPlatform& platform, const VMSpecifications& specifications, int fdKVM) noexcept
@@ -47,7 +138,12 @@ KvmVirtualMachine::KvmVirtualMachine(KvmPlatform& platform, const VMSpecificatio
     , m_platform(platform)
     , m_fdKVM(fdKVM)
     , m_fd(-1)
-    , m_memSlot(0)
+    , m_vcpuMmapSize(0)
+    , m_syncRegsAvailable(false)
+    , m_nextSlot(0)
+    , m_maxSlots(kDefaultMaxSlots)
+    , m_dirtyLogMode(DirtyLogMode::Bitmap)
+    , m_dirtyRingSize(0)
 {
 }
 
@@ -57,6 +153,12 @@ KvmVirtualMachine::~KvmVirtualMachine() noexcept {
         close(m_fd);
         m_fd = -1;
     }
+    for (auto& block : m_ownedMemory) {
+        munmap(block.memory, block.size);
+        if (block.shareable) {
+            close(block.fd);
+        }
+    }
 }
 
 bool KvmVirtualMachine::Initialize() {
@@ -74,89 +176,976 @@ bool KvmVirtualMachine::Initialize() {
         return false;
     }
 
-    // Create virtual processors
-    for (uint32_t id = 0; id < m_specifications.numProcessors; id++) {
-        auto vp = std::make_unique<KvmVirtualProcessor>(*this, id);
-        if (!vp->Initialize()) {
-            return false;
+    // Disable the requested VM exits. This must also be done before any VCPUs
+    // are created.
+    if (!ConfigureExits()) {
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    // Configure MSR accesses that exit to userspace
+    if (!ConfigureMSRExits()) {
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    // Query the number of memory slots available to the VM
+    const int maxSlots = ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_NR_MEMSLOTS);
+    if (maxSlots > 0) {
+        m_maxSlots = static_cast<uint32_t>(maxSlots);
+    }
+    m_freeSlots.reserve(m_maxSlots);
+
+    // Select the dirty page logging mode. The dirty ring must be enabled
+    // before any VCPUs are created. If it is not requested or cannot be
+    // enabled, try manual dirty log protection, which allows subranges of the
+    // dirty bitmaps to be cleared. Plain dirty bitmaps are used as a last
+    // resort.
+    if (EnableDirtyRing()) {
+        m_dirtyLogMode = DirtyLogMode::Ring;
+    }
+    else if (EnableManualDirtyLogProtect()) {
+        m_dirtyLogMode = DirtyLogMode::ManualProtect;
+    }
+
+    // Query the VCPU properties once for all VCPUs
+    m_vcpuMmapSize = ioctl(m_fdKVM, KVM_GET_VCPU_MMAP_SIZE, 0);
+    if (m_vcpuMmapSize < 0) {
+        return false;
+    }
+#if defined(KVM_CAP_SYNC_REGS)
+    // Check if general purpose registers can be synced through kvmRun, which
+    // allows exit traces to record RIP without additional ioctls
+    const int syncRegs = ioctl(m_fd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+    m_syncRegsAvailable = syncRegs > 0 && (syncRegs & KVM_SYNC_X86_REGS) != 0;
+#endif
+    if (m_platform.GetFeatures().customCPUIDs && !BuildCPUIDTemplate()) {
+        return false;
+    }
+
+    return CreateVirtualProcessors();
+}
+
+bool KvmVirtualMachine::BuildCPUIDTemplate() {
+    // Build unordered map from custom CPUID entries
+    std::unordered_map<uint64_t, CPUIDResult> custom_cpuids;
+    auto& cpuids = m_specifications.CPUIDResults;
+    uint64_t leaf_index = 0;
+    uint32_t last_func = 0xFFFFFFFF;
+    for (auto it = cpuids.cbegin(); it != cpuids.cend(); it++) {
+        if (it->function == last_func) {
+            leaf_index++;
+        }
+        else {
+            leaf_index = 0;
+            last_func = it->function;
+        }
+        custom_cpuids[(it->function) | (leaf_index << 32ull)] = *it;
+    }
+
+    // Build list of CPUID responses based on default and custom values
+    auto cpuid_defaults_ptr = m_platform.SupportedCPUIDEntries();
+    if (cpuid_defaults_ptr == nullptr) {
+        return false;
+    }
+    auto& cpuid_defaults = *cpuid_defaults_ptr;
+    auto& paravirtFeatures = m_specifications.kvm.paravirtFeatures;
+    const bool hideParavirtLeaves = paravirtFeatures && *paravirtFeatures == KvmParavirtFeature::None;
+    m_cpuidTemplate.clear();
+    m_cpuidTemplate.reserve(cpuid_defaults.size());
+    leaf_index = 0;
+    last_func = 0xFFFFFFFF;
+    for (auto& entry : cpuid_defaults) {
+        if (entry.function == last_func) {
+            leaf_index++;
+        }
+        else {
+            leaf_index = 0;
+            last_func = entry.function;
+        }
+        if (hideParavirtLeaves && (entry.function & 0xFFFFFF00) == KVM_CPUID_SIGNATURE) {
+            continue;
+        }
+
+        // Start from KVM's entry, which carries the correct index and flags
+        kvm_cpuid_entry2 cpuid = entry;
+
+        uint64_t custom_key = (entry.function) | (leaf_index << 32ull);
+        auto custom_entry = custom_cpuids.find(custom_key);
+        if (custom_entry != custom_cpuids.end()) {
+            cpuid.eax = custom_entry->second.eax;
+            cpuid.ebx = custom_entry->second.ebx;
+            cpuid.ecx = custom_entry->second.ecx;
+            cpuid.edx = custom_entry->second.edx;
+        }
+        else if (entry.function == KVM_CPUID_FEATURES && paravirtFeatures) {
+            cpuid.eax &= static_cast<uint32_t>(*paravirtFeatures);
         }
+        m_cpuidTemplate.push_back(cpuid);
+    }
+    return true;
+}
+
+const std::vector<uint32_t>& KvmVirtualMachine::StateMSRs(const int vcpuFD) noexcept {
+    std::call_once(m_stateMSRsFlag, [&]() {
+        // KVM_GET_MSRS stops at the first MSR that cannot be read and returns
+        // the number of MSRs read so far. Skip over unreadable MSRs and keep
+        // reading from the following MSR until the list is exhausted.
+        auto& candidates = m_platform.SupportedMSRIndices();
+        auto msrData = allocVarEntry<kvm_msrs, kvm_msr_entry>(candidates.size());
+        size_t pos = 0;
+        while (pos < candidates.size()) {
+            const size_t count = candidates.size() - pos;
+            for (size_t i = 0; i < count; i++) {
+                msrData->entries[i].index = candidates[pos + i];
+            }
+            msrData->nmsrs = static_cast<__u32>(count);
+            const int numRead = ioctl(vcpuFD, KVM_GET_MSRS, msrData);
+            if (numRead < 0) {
+                break;
+            }
+            m_stateMSRs.insert(m_stateMSRs.end(), candidates.begin() + pos, candidates.begin() + pos + numRead);
+            pos += numRead + 1;
+        }
+        free(msrData);
+    });
+    return m_stateMSRs;
+}
+
+bool KvmVirtualMachine::CreateVirtualProcessors() {
+    const uint32_t numProcessors = m_specifications.numProcessors;
+    std::vector<std::unique_ptr<KvmVirtualProcessor>> vps;
+    vps.reserve(numProcessors);
+    for (uint32_t id = 0; id < numProcessors; id++) {
+        vps.push_back(std::make_unique<KvmVirtualProcessor>(*this, id));
+    }
+
+    // Most of the work done by each VCPU, such as mapping its shared pages
+    // and configuring CPUIDs, is independent from other VCPUs, so spread the
+    // VCPUs across the shared worker pool, which falls back to fewer threads
+    // if the host cannot create more
+    std::atomic<bool> failed{ false };
+    ParallelFor(0, numProcessors, 1, [&](const uint64_t begin, const uint64_t end) {
+        for (uint64_t id = begin; id < end && !failed; id++) {
+            if (!vps[id]->Initialize()) {
+                failed = true;
+            }
+        }
+    });
+    if (failed) {
+        return false;
+    }
+
+    // Register the VCPUs in order so that their indices match their IDs
+    for (auto& vp : vps) {
         RegisterVP(std::move(vp));
     }
+    return true;
+}
+
+bool KvmVirtualMachine::ConfigureExits() noexcept {
+    const auto& features = m_platform.GetFeatures().kvm;
+
+#if defined(KVM_CAP_X86_DISABLE_EXITS)
+    // Exits not supported by the host are left enabled
+    const auto disabledExits = m_specifications.kvm.disabledExits & features.disabledExits;
+    if (disabledExits != KvmDisabledExit::None) {
+        kvm_enable_cap cap = { 0 };
+        cap.cap = KVM_CAP_X86_DISABLE_EXITS;
+        cap.args[0] = StoreDisabledExits(disabledExits);
+        if (ioctl(m_fd, KVM_ENABLE_CAP, &cap) < 0) {
+            return false;
+        }
+    }
+#endif
+
+#if defined(KVM_CAP_HALT_POLL)
+    if (m_specifications.kvm.haltPollNanoseconds && features.haltPollControl) {
+        kvm_enable_cap cap = { 0 };
+        cap.cap = KVM_CAP_HALT_POLL;
+        cap.args[0] = *m_specifications.kvm.haltPollNanoseconds;
+        if (ioctl(m_fd, KVM_ENABLE_CAP, &cap) < 0) {
+            return false;
+        }
+    }
+#endif
 
     return true;
 }
 
+bool KvmVirtualMachine::ConfigureMSRExits() {
+#if defined(KVM_CAP_X86_USER_SPACE_MSR) && defined(KVM_CAP_X86_MSR_FILTER)
+    const auto enabledVMExits = BitmaskEnum(m_specifications.extendedVMExits & m_platform.GetFeatures().extendedVMExits);
+    if (enabledVMExits.NoneOf(ExtendedVMExit::MSRAccess)) {
+        return true;
+    }
+
+    // Only exit on accesses denied by the MSR filter
+    kvm_enable_cap cap = { 0 };
+    cap.cap = KVM_CAP_X86_USER_SPACE_MSR;
+    cap.args[0] = KVM_MSR_EXIT_REASON_FILTER;
+    if (ioctl(m_fd, KVM_ENABLE_CAP, &cap) < 0) {
+        return false;
+    }
+
+    // Merge overlapping and adjacent ranges to make the most out of the
+    // limited number of filter ranges
+    std::vector<MSRRange> ranges;
+    for (auto& range : m_specifications.vmExitMSRs) {
+        if (range.count > 0) {
+            ranges.push_back(range);
+        }
+    }
+    std::sort(ranges.begin(), ranges.end(), [](const MSRRange& lhs, const MSRRange& rhs) { return lhs.base < rhs.base; });
+    size_t numRanges = 0;
+    for (auto& range : ranges) {
+        if (numRanges > 0) {
+            auto& last = ranges[numRanges - 1];
+            const uint64_t lastEnd = static_cast<uint64_t>(last.base) + last.count;
+            if (range.base <= lastEnd) {
+                const uint64_t end = std::max<uint64_t>(lastEnd, static_cast<uint64_t>(range.base) + range.count);
+                last.count = static_cast<uint32_t>(end - last.base);
+                continue;
+            }
+        }
+        ranges[numRanges++] = range;
+    }
+
+    // A cleared bit denies access to the MSR, causing it to exit to
+    // userspace. KVM copies the bitmaps, so a single zeroed bitmap is shared
+    // by all ranges.
+    static uint8_t denyBitmap[KVM_MSR_FILTER_MAX_BITMAP_SIZE] = { 0 };
+    constexpr uint32_t maxMSRsPerRange = KVM_MSR_FILTER_MAX_BITMAP_SIZE * 8;
+
+    kvm_msr_filter filter = { 0 };
+    if (numRanges == 0) {
+        // Deny every MSR by default. KVM rejects a deny-by-default filter
+        // without ranges, so add one that denies its MSR as well.
+        filter.flags = KVM_MSR_FILTER_DEFAULT_DENY;
+        filter.ranges[0].flags = KVM_MSR_FILTER_READ | KVM_MSR_FILTER_WRITE;
+        filter.ranges[0].base = 0;
+        filter.ranges[0].nmsrs = 1;
+        filter.ranges[0].bitmap = denyBitmap;
+    }
+    else {
+        filter.flags = KVM_MSR_FILTER_DEFAULT_ALLOW;
+        size_t filterIndex = 0;
+        for (size_t i = 0; i < numRanges; i++) {
+            uint64_t base = ranges[i].base;
+            uint64_t remaining = ranges[i].count;
+            while (remaining > 0) {
+                if (filterIndex >= KVM_MSR_FILTER_MAX_RANGES) {
+                    return false;
+                }
+                auto& filterRange = filter.ranges[filterIndex++];
+                filterRange.flags = KVM_MSR_FILTER_READ | KVM_MSR_FILTER_WRITE;
+                filterRange.base = static_cast<uint32_t>(base);
+                filterRange.nmsrs = static_cast<uint32_t>(std::min<uint64_t>(remaining, maxMSRsPerRange));
+                filterRange.bitmap = denyBitmap;
+                base += filterRange.nmsrs;
+                remaining -= filterRange.nmsrs;
+            }
+        }
+    }
+
+    return ioctl(m_fd, KVM_X86_SET_MSR_FILTER, &filter) >= 0;
+#else
+    return true;
+#endif
+}
+
+bool KvmVirtualMachine::AllocateSlot(uint32_t& slot) noexcept {
+    if (!m_freeSlots.empty()) {
+        slot = m_freeSlots.back();
+        m_freeSlots.pop_back();
+        return true;
+    }
+    if (m_nextSlot >= m_maxSlots) {
+        return false;
+    }
+    slot = m_nextSlot++;
+    return true;
+}
+
+void KvmVirtualMachine::FreeSlot(const uint32_t slot) noexcept {
+    // Never reallocates since the capacity is reserved for all slots
+    m_freeSlots.push_back(slot);
+}
+
+size_t KvmVirtualMachine::AvailableSlots() const noexcept {
+    return m_freeSlots.size() + (m_maxSlots - m_nextSlot);
+}
+
+KvmVirtualMachine::MemoryRegionMap::iterator KvmVirtualMachine::FindFirstOverlap(const uint64_t address) noexcept {
+    // Find the region containing the address or, failing that, the first
+    // region past the address
+    auto it = m_memoryRegions.upper_bound(address);
+    if (it != m_memoryRegions.begin()) {
+        auto prev = std::prev(it);
+        if (prev->second.guest_phys_addr + prev->second.memory_size > address) {
+            return prev;
+        }
+    }
+    return it;
+}
+
+bool KvmVirtualMachine::EnableDirtyRing() noexcept {
+#if defined(KVM_CAP_DIRTY_LOG_RING)
+    const uint32_t ringSize = m_specifications.kvm.dirtyRingSize;
+    if (ringSize == 0 || (ringSize & (ringSize - 1)) != 0) {
+        return false;
+    }
+    if (ringSize > m_platform.GetFeatures().kvm.maxDirtyRingSize) {
+        return false;
+    }
+
+    kvm_enable_cap cap = { 0 };
+    cap.cap = KVM_CAP_DIRTY_LOG_RING;
+    cap.args[0] = ringSize * sizeof(kvm_dirty_gfn);
+    if (ioctl(m_fd, KVM_ENABLE_CAP, &cap) < 0) {
+        return false;
+    }
+    m_dirtyRingSize = ringSize;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool KvmVirtualMachine::EnableManualDirtyLogProtect() noexcept {
+#if defined(KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2)
+    if (!m_platform.GetFeatures().kvm.manualDirtyLogProtect) {
+        return false;
+    }
+
+    // Pages start out clean, as with regular dirty logging
+    kvm_enable_cap cap = { 0 };
+    cap.cap = KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2;
+    cap.args[0] = KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE;
+    return ioctl(m_fd, KVM_ENABLE_CAP, &cap) >= 0;
+#else
+    return false;
+#endif
+}
+
+bool KvmVirtualMachine::HarvestDirtyRings() noexcept {
+    // The caller must hold m_dirtyLogMutex
+    size_t harvested = 0;
+    for (size_t i = 0; i < GetVirtualProcessorCount(); i++) {
+        auto& vp = static_cast<KvmVirtualProcessor&>(GetVirtualProcessor(i)->get());
+        harvested += vp.HarvestDirtyRing();
+    }
+
+#if defined(KVM_CAP_DIRTY_LOG_RING)
+    // Let KVM recycle the harvested entries and write-protect the pages again
+    if (harvested > 0) {
+        if (ioctl(m_fd, KVM_RESET_DIRTY_RINGS, 0) < 0) {
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+void KvmVirtualMachine::MarkDirtyPage(const uint32_t slot, const uint64_t pageOffset) {
+    auto it = m_dirtyBitmaps.find(slot);
+    if (it == m_dirtyBitmaps.end()) {
+        return;
+    }
+    auto& bitmap = it->second;
+    const uint64_t index = pageOffset / 64;
+    if (index < bitmap.size()) {
+        __atomic_fetch_or(&bitmap[index], 1ull << (pageOffset % 64), __ATOMIC_RELEASE);
+    }
+}
+
+void KvmVirtualMachine::UpdateDirtyLogBuffers(const kvm_userspace_memory_region& memoryRegion) {
+    // The caller must hold m_dirtyLogMutex
+    if ((memoryRegion.flags & KVM_MEM_LOG_DIRTY_PAGES) == 0) {
+        m_dirtyBitmaps.erase(memoryRegion.slot);
+        return;
+    }
+
+    // Every tracked slot gets a bitmap up front, even with manual protection,
+    // so that pages written by the host can be marked without allocating
+    const size_t words = bitmapWords(memoryRegion.memory_size);
+    m_dirtyBitmaps[memoryRegion.slot].assign(words, 0);
+    if (m_dirtyLogMode != DirtyLogMode::Ring && m_dirtyLogBuffer.size() < words) {
+        m_dirtyLogBuffer.resize(words);
+    }
+}
+
+bool KvmVirtualMachine::GetDirtyLog(const kvm_userspace_memory_region& memoryRegion) noexcept {
+    // The caller must hold m_dirtyLogMutex
+    kvm_dirty_log dirtyLog = { 0 };
+    dirtyLog.slot = memoryRegion.slot;
+    dirtyLog.dirty_bitmap = m_dirtyLogBuffer.data();
+    if (ioctl(m_fd, KVM_GET_DIRTY_LOG, &dirtyLog) < 0) {
+        return false;
+    }
+
+    // Without manual protection, KVM clears its bitmap on every read, so
+    // accumulate the dirty pages in case only part of the slot is consumed
+    if (m_dirtyLogMode == DirtyLogMode::Bitmap) {
+        auto slotBitmap = m_dirtyBitmaps.find(memoryRegion.slot);
+        if (slotBitmap != m_dirtyBitmaps.end()) {
+            for (size_t i = 0; i < slotBitmap->second.size(); i++) {
+                if (m_dirtyLogBuffer[i] != 0) {
+                    __atomic_fetch_or(&slotBitmap->second[i], m_dirtyLogBuffer[i], __ATOMIC_RELEASE);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool KvmVirtualMachine::ClearDirtyLog(const kvm_userspace_memory_region& memoryRegion, const uint64_t firstPage, const uint64_t numPages) noexcept {
+    // The caller must hold m_dirtyLogMutex and have set the bits of the pages
+    // to clear in m_dirtyLogBuffer
+#if defined(KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2)
+    // KVM requires the range to be aligned to 64 pages, except at the end of
+    // the slot. Bits outside of the requested range must be zero.
+    const uint64_t slotPages = memoryRegion.memory_size / PAGE_SIZE;
+    const uint64_t alignedFirst = firstPage & ~63ull;
+    const uint64_t alignedEnd = std::min<uint64_t>((firstPage + numPages + 63) & ~63ull, slotPages);
+    clearBits(m_dirtyLogBuffer.data(), alignedFirst, firstPage - alignedFirst);
+    clearBits(m_dirtyLogBuffer.data(), firstPage + numPages, alignedEnd - firstPage - numPages);
+
+    kvm_clear_dirty_log clearLog = { 0 };
+    clearLog.slot = memoryRegion.slot;
+    clearLog.first_page = alignedFirst;
+    clearLog.num_pages = static_cast<uint32_t>(alignedEnd - alignedFirst);
+    clearLog.dirty_bitmap = &m_dirtyLogBuffer[alignedFirst / 64];
+    return ioctl(m_fd, KVM_CLEAR_DIRTY_LOG, &clearLog) >= 0;
+#else
+    return false;
+#endif
+}
+
+template<typename Func>
+DirtyPageTrackingStatus KvmVirtualMachine::ForEachDirtyLogRegion(const uint64_t baseAddress, const uint64_t size, Func&& func) noexcept {
+    // Every page in the range must belong to a slot with dirty page logging
+    // enabled. Slots never overlap, so the range is fully covered if the
+    // overlapping portions add up to its size.
+    const uint64_t endAddress = baseAddress + size;
+    const auto first = FindFirstOverlap(baseAddress);
+    const auto last = m_memoryRegions.lower_bound(endAddress);
+    uint64_t nextAddress = baseAddress;
+    for (auto it = first; it != last; it++) {
+        auto& memoryRegion = it->second;
+        if (memoryRegion.guest_phys_addr > nextAddress || (memoryRegion.flags & KVM_MEM_LOG_DIRTY_PAGES) == 0) {
+            return DirtyPageTrackingStatus::InvalidRange;
+        }
+        nextAddress = memoryRegion.guest_phys_addr + memoryRegion.memory_size;
+    }
+    if (nextAddress < endAddress) {
+        return DirtyPageTrackingStatus::InvalidRange;
+    }
+
+    for (auto it = first; it != last; it++) {
+        auto& memoryRegion = it->second;
+        const uint64_t start = std::max<uint64_t>(memoryRegion.guest_phys_addr, baseAddress);
+        const uint64_t end = std::min<uint64_t>(memoryRegion.guest_phys_addr + memoryRegion.memory_size, endAddress);
+        const uint64_t firstPage = (start - memoryRegion.guest_phys_addr) / PAGE_SIZE;
+        const uint64_t numPages = (end - start) / PAGE_SIZE;
+        const uint64_t bitmapOffset = (start - baseAddress) / PAGE_SIZE;
+        if (!func(memoryRegion, firstPage, numPages, bitmapOffset)) {
+            return DirtyPageTrackingStatus::Failed;
+        }
+    }
+    return DirtyPageTrackingStatus::OK;
+}
+
 MemoryMappingStatus KvmVirtualMachine::MapGuestMemoryImpl(const uint64_t baseAddress, const uint64_t size, const MemoryFlags flags, void *memory) noexcept {
-    kvm_userspace_memory_region& memoryRegion = m_memoryRegions.emplace_back();
+    kvm_userspace_memory_region memoryRegion = { 0 };
+    if (!AllocateSlot(memoryRegion.slot)) {
+        return MemoryMappingStatus::Failed;
+    }
     memoryRegion.guest_phys_addr = baseAddress;
     memoryRegion.memory_size = size;
     memoryRegion.userspace_addr = (uint64_t)memory;
-    memoryRegion.slot = m_memSlot++;
     memoryRegion.flags = 0;
     auto flagsBM = BitmaskEnum(flags);
     if (flagsBM.NoneOf(MemoryFlags::Write)) memoryRegion.flags |= KVM_MEM_READONLY;
     if (flagsBM.AnyOf(MemoryFlags::DirtyPageTracking)) memoryRegion.flags |= KVM_MEM_LOG_DIRTY_PAGES;
 
     if (ioctl(m_fd, KVM_SET_USER_MEMORY_REGION, &memoryRegion) < 0) {
-        for (auto it = m_memoryRegions.begin(); it != m_memoryRegions.end(); it++) {
-            if (it->slot == memoryRegion.slot) {
-                m_memoryRegions.erase(it);
-                break;
-            }
+        FreeSlot(memoryRegion.slot);
+        return MemoryMappingStatus::Failed;
+    }
+    m_memoryRegions[baseAddress] = memoryRegion;
+
+    if (memoryRegion.flags & KVM_MEM_LOG_DIRTY_PAGES) {
+        std::lock_guard<std::mutex> lock(m_dirtyLogMutex);
+        UpdateDirtyLogBuffers(memoryRegion);
+    }
+
+    return MemoryMappingStatus::OK;
+}
+
+MemoryMappingStatus KvmVirtualMachine::UnmapGuestMemoryImpl(const uint64_t baseAddress, const uint64_t size) noexcept {
+    // The range must be entirely mapped. Regions that extend past both ends
+    // of the range are split in two, which takes an additional slot.
+    const uint64_t endAddress = baseAddress + size;
+    auto it = FindFirstOverlap(baseAddress);
+    const auto last = m_memoryRegions.lower_bound(endAddress);
+    if (it == last) {
+        return MemoryMappingStatus::InvalidRange;
+    }
+    uint64_t nextAddress = baseAddress;
+    size_t slotsNeeded = 0;
+    for (auto rgn = it; rgn != last; rgn++) {
+        const uint64_t start = rgn->second.guest_phys_addr;
+        const uint64_t end = start + rgn->second.memory_size;
+        if (start > nextAddress) {
+            return MemoryMappingStatus::InvalidRange;
         }
+        if (start < baseAddress && end > endAddress) {
+            slotsNeeded++;
+        }
+        nextAddress = end;
+    }
+    if (nextAddress < endAddress) {
+        return MemoryMappingStatus::InvalidRange;
+    }
+    if (slotsNeeded > AvailableSlots()) {
+        return MemoryMappingStatus::Failed;
+    }
+
+    std::lock_guard<std::mutex> lock(m_dirtyLogMutex);
+
+    // Collect the pages logged by the dirty rings before the slots go away
+    if (m_dirtyLogMode == DirtyLogMode::Ring && !HarvestDirtyRings()) {
         return MemoryMappingStatus::Failed;
     }
 
+    // Keep the original regions so that they can be put back if KVM fails
+    // to apply any of the changes
+    std::vector<kvm_userspace_memory_region> originalRegions;
+    try {
+        for (auto rgn = it; rgn != last; rgn++) {
+            originalRegions.push_back(rgn->second);
+        }
+    }
+    catch (const std::bad_alloc&) {
+        return MemoryMappingStatus::Failed;
+    }
+
+    while (it != last) {
+        auto next = std::next(it);
+        if (!RemoveMemoryRegion(it, baseAddress, size)) {
+            RestoreMemoryRegions(originalRegions);
+            return MemoryMappingStatus::Failed;
+        }
+        it = next;
+    }
     return MemoryMappingStatus::OK;
 }
 
+void KvmVirtualMachine::RestoreMemoryRegions(const std::vector<kvm_userspace_memory_region>& originalRegions) noexcept {
+    // The caller must hold m_dirtyLogMutex
+    for (auto& originalRegion : originalRegions) {
+        const uint64_t start = originalRegion.guest_phys_addr;
+        const uint64_t end = start + originalRegion.memory_size;
+
+        // Drop whatever replaced the region: the remaining portions of a
+        // split or nothing at all. Regions that were not touched yet stay.
+        auto it = m_memoryRegions.find(start);
+        if (it != m_memoryRegions.end() && it->second.slot == originalRegion.slot && it->second.memory_size == originalRegion.memory_size) {
+            continue;
+        }
+        it = m_memoryRegions.lower_bound(start);
+        while (it != m_memoryRegions.end() && it->first < end) {
+            kvm_userspace_memory_region deletedRegion = it->second;
+            deletedRegion.memory_size = 0;
+            ioctl(m_fd, KVM_SET_USER_MEMORY_REGION, &deletedRegion);
+            m_dirtyBitmaps.erase(deletedRegion.slot);
+            FreeSlot(deletedRegion.slot);
+            it = m_memoryRegions.erase(it);
+        }
+
+        kvm_userspace_memory_region restoredRegion = originalRegion;
+        if (!AllocateSlot(restoredRegion.slot)) {
+            continue;
+        }
+        if (ioctl(m_fd, KVM_SET_USER_MEMORY_REGION, &restoredRegion) < 0) {
+            FreeSlot(restoredRegion.slot);
+            continue;
+        }
+        m_memoryRegions[start] = restoredRegion;
+
+        // The dirty pages of the region may have been lost along the way, so
+        // report all of them
+        if (restoredRegion.flags & KVM_MEM_LOG_DIRTY_PAGES) {
+            UpdateDirtyLogBuffers(restoredRegion);
+            auto& slotBitmap = m_dirtyBitmaps[restoredRegion.slot];
+            slotBitmap.assign(bitmapWords(restoredRegion.memory_size), 0);
+            setBits(slotBitmap.data(), 0, restoredRegion.memory_size / PAGE_SIZE);
+        }
+    }
+}
+
+bool KvmVirtualMachine::RemoveMemoryRegion(MemoryRegionMap::iterator it, const uint64_t baseAddress, const uint64_t size) noexcept {
+    // The caller must hold m_dirtyLogMutex
+    const kvm_userspace_memory_region memoryRegion = it->second;
+    const uint64_t regionEnd = memoryRegion.guest_phys_addr + memoryRegion.memory_size;
+    const uint64_t endAddress = baseAddress + size;
+    const bool logDirtyPages = (memoryRegion.flags & KVM_MEM_LOG_DIRTY_PAGES) != 0;
+
+    // Gather the dirty pages of the slot so that they can be carried over to
+    // the remaining portions of the region
+    std::vector<uint64_t> dirtyPages;
+    if (logDirtyPages && (memoryRegion.guest_phys_addr < baseAddress || regionEnd > endAddress)) {
+        if (m_dirtyLogMode != DirtyLogMode::Ring && !GetDirtyLog(memoryRegion)) {
+            return false;
+        }
+        const size_t words = bitmapWords(memoryRegion.memory_size);
+        dirtyPages.assign(words, 0);
+        if (m_dirtyLogMode == DirtyLogMode::ManualProtect) {
+            std::copy_n(m_dirtyLogBuffer.begin(), words, dirtyPages.begin());
+        }
+        auto slotBitmap = m_dirtyBitmaps.find(memoryRegion.slot);
+        if (slotBitmap != m_dirtyBitmaps.end()) {
+            for (size_t i = 0; i < words; i++) {
+                dirtyPages[i] |= slotBitmap->second[i];
+            }
+        }
+    }
+
+    // Delete the slot. KVM cannot resize slots, so the remaining portions of
+    // the region are mapped into new slots.
+    kvm_userspace_memory_region deletedRegion = memoryRegion;
+    deletedRegion.memory_size = 0;
+    if (ioctl(m_fd, KVM_SET_USER_MEMORY_REGION, &deletedRegion) < 0) {
+        return false;
+    }
+    m_dirtyBitmaps.erase(memoryRegion.slot);
+    m_memoryRegions.erase(it);
+    FreeSlot(memoryRegion.slot);
+
+    auto remap = [&](const uint64_t start, const uint64_t end) {
+        kvm_userspace_memory_region remainder = memoryRegion;
+        if (!AllocateSlot(remainder.slot)) {
+            return false;
+        }
+        remainder.guest_phys_addr = start;
+        remainder.memory_size = end - start;
+        remainder.userspace_addr = memoryRegion.userspace_addr + (start - memoryRegion.guest_phys_addr);
+        if (ioctl(m_fd, KVM_SET_USER_MEMORY_REGION, &remainder) < 0) {
+            FreeSlot(remainder.slot);
+            return false;
+        }
+        m_memoryRegions[start] = remainder;
+        if (logDirtyPages) {
+            UpdateDirtyLogBuffers(remainder);
+            auto& slotBitmap = m_dirtyBitmaps[remainder.slot];
+            slotBitmap.assign(bitmapWords(remainder.memory_size), 0);
+            copyBits(slotBitmap.data(), 0, dirtyPages.data(), (start - memoryRegion.guest_phys_addr) / PAGE_SIZE, remainder.memory_size / PAGE_SIZE);
+        }
+        return true;
+    };
+    if (memoryRegion.guest_phys_addr < baseAddress && !remap(memoryRegion.guest_phys_addr, baseAddress)) {
+        return false;
+    }
+    if (regionEnd > endAddress && !remap(endAddress, regionEnd)) {
+        return false;
+    }
+    return true;
+}
+
 MemoryMappingStatus KvmVirtualMachine::SetGuestMemoryFlagsImpl(const uint64_t baseAddress, const uint64_t size, const MemoryFlags flags) noexcept {
     // Find memory range that corresponds to the specified address range
-    auto memoryRegion = std::find_if(m_memoryRegions.begin(), m_memoryRegions.end(),
-        [=](kvm_userspace_memory_region& memRgn) { return regionEquals(memRgn, baseAddress, size); });
-    if (memoryRegion == m_memoryRegions.end()) {
+    auto it = m_memoryRegions.find(baseAddress);
+    if (it == m_memoryRegions.end() || it->second.memory_size != size) {
         return MemoryMappingStatus::InvalidRange;
     }
+    auto& memoryRegion = it->second;
 
     // Update flags
-    memoryRegion->flags = 0;
+    memoryRegion.flags = 0;
     auto flagsBM = BitmaskEnum(flags);
-    if (flagsBM.NoneOf(MemoryFlags::Write)) memoryRegion->flags |= KVM_MEM_READONLY;
-    if (flagsBM.AnyOf(MemoryFlags::DirtyPageTracking)) memoryRegion->flags |= KVM_MEM_LOG_DIRTY_PAGES;
+    if (flagsBM.NoneOf(MemoryFlags::Write)) memoryRegion.flags |= KVM_MEM_READONLY;
+    if (flagsBM.AnyOf(MemoryFlags::DirtyPageTracking)) memoryRegion.flags |= KVM_MEM_LOG_DIRTY_PAGES;
     if (ioctl(m_fd, KVM_SET_USER_MEMORY_REGION, &memoryRegion) < 0) {
         return MemoryMappingStatus::Failed;
     }
 
+    std::lock_guard<std::mutex> lock(m_dirtyLogMutex);
+    UpdateDirtyLogBuffers(memoryRegion);
+
     return MemoryMappingStatus::OK;
 }
 
 DirtyPageTrackingStatus KvmVirtualMachine::QueryDirtyPagesImpl(const uint64_t baseAddress, const uint64_t size, uint64_t *bitmap, const size_t bitmapSize) noexcept {
-    // Find memory range that corresponds to the specified address range
-    auto memoryRegion = std::find_if(m_memoryRegions.begin(), m_memoryRegions.end(),
-        [=](kvm_userspace_memory_region& memRgn) { return regionEquals(memRgn, baseAddress, size); });
-    if (memoryRegion == m_memoryRegions.end()) {
-        return DirtyPageTrackingStatus::InvalidRange;
-    }
+    std::fill_n(bitmap, bitmapWords(size), 0);
 
-    // Get dirty bitmap for the entire slot
-    kvm_dirty_log dirtyLog = { 0 };
-    dirtyLog.slot = memoryRegion->slot;
-    dirtyLog.dirty_bitmap = bitmap;
-    if (ioctl(m_fd, KVM_GET_DIRTY_LOG, &dirtyLog) < 0) {
+    std::lock_guard<std::mutex> lock(m_dirtyLogMutex);
+
+    // Collect the pages logged by all VCPUs into the slot bitmaps. Pages
+    // dirtied by a VCPU that is currently running may only show up on a
+    // later query.
+    if (m_dirtyLogMode == DirtyLogMode::Ring && !HarvestDirtyRings()) {
         return DirtyPageTrackingStatus::Failed;
     }
 
-    return DirtyPageTrackingStatus::OK;
+    return ForEachDirtyLogRegion(baseAddress, size,
+        [&](const kvm_userspace_memory_region& memoryRegion, uint64_t firstPage, uint64_t numPages, uint64_t bitmapOffset) {
+            if (m_dirtyLogMode == DirtyLogMode::Bitmap || m_dirtyLogMode == DirtyLogMode::ManualProtect) {
+                if (!GetDirtyLog(memoryRegion)) {
+                    return false;
+                }
+            }
+
+            // With manual protection, hand over the bits read from KVM and
+            // clear exactly those pages, so that pages dirtied in the
+            // meantime are kept for the next query
+            if (m_dirtyLogMode == DirtyLogMode::ManualProtect) {
+                copyBits(bitmap, bitmapOffset, m_dirtyLogBuffer.data(), firstPage, numPages);
+                if (!ClearDirtyLog(memoryRegion, firstPage, numPages)) {
+                    return false;
+                }
+            }
+
+            // Consume the accumulated bits, which host writes may be setting
+            // concurrently
+            auto slotBitmap = m_dirtyBitmaps.find(memoryRegion.slot);
+            if (slotBitmap != m_dirtyBitmaps.end()) {
+                takeBits(bitmap, bitmapOffset, slotBitmap->second.data(), firstPage, numPages);
+            }
+            return true;
+        });
 }
 
 DirtyPageTrackingStatus KvmVirtualMachine::ClearDirtyPagesImpl(const uint64_t baseAddress, const uint64_t size) noexcept {
-    // Delegate to QueryDirtyPagesImpl as it will clear the dirty bitmap for
-    // the memory slot
-    const size_t bitmapSize = (size / PAGE_SIZE + sizeof(uint64_t) - 1) / sizeof(uint64_t);
-    auto bitmap = new uint64_t[bitmapSize];
-    auto status = QueryDirtyPagesImpl(baseAddress, size, bitmap, bitmapSize);
-    delete[] bitmap;
-    return status;
+    std::lock_guard<std::mutex> lock(m_dirtyLogMutex);
+
+    if (m_dirtyLogMode == DirtyLogMode::Ring && !HarvestDirtyRings()) {
+        return DirtyPageTrackingStatus::Failed;
+    }
+
+    return ForEachDirtyLogRegion(baseAddress, size,
+        [&](const kvm_userspace_memory_region& memoryRegion, uint64_t firstPage, uint64_t numPages, uint64_t) {
+            switch (m_dirtyLogMode) {
+            case DirtyLogMode::ManualProtect:
+                setBits(m_dirtyLogBuffer.data(), firstPage, numPages);
+                if (!ClearDirtyLog(memoryRegion, firstPage, numPages)) {
+                    return false;
+                }
+                break;
+            case DirtyLogMode::Bitmap:
+                // Pull the dirty bits out of KVM before discarding them
+                if (!GetDirtyLog(memoryRegion)) {
+                    return false;
+                }
+                break;
+            default:
+                break;
+            }
+            auto slotBitmap = m_dirtyBitmaps.find(memoryRegion.slot);
+            if (slotBitmap != m_dirtyBitmaps.end()) {
+                atomicClearBits(slotBitmap->second.data(), firstPage, numPages);
+            }
+            return true;
+        });
+}
+
+void KvmVirtualMachine::MarkDirtyPagesImpl(const uint64_t baseAddress, const uint64_t size) noexcept {
+    // KVM only logs writes made by the guest, so record the pages in the
+    // slot bitmaps, which are merged into every query. The bitmaps are sized
+    // when the slots are mapped and the memory layout does not change during
+    // host writes, so the bits are set atomically without taking the dirty
+    // log lock.
+    ForEachDirtyLogRegion(baseAddress, size,
+        [&](const kvm_userspace_memory_region& memoryRegion, uint64_t firstPage, uint64_t numPages, uint64_t) {
+            auto slotBitmap = m_dirtyBitmaps.find(memoryRegion.slot);
+            if (slotBitmap != m_dirtyBitmaps.end()) {
+                atomicSetBits(slotBitmap->second.data(), firstPage, numPages);
+            }
+            return true;
+        });
+}
+
+GuestClockStatus KvmVirtualMachine::GetGuestClockImpl(uint64_t *nanoseconds) noexcept {
+    kvm_clock_data clock = { 0 };
+    if (ioctl(m_fd, KVM_GET_CLOCK, &clock) < 0) {
+        return GuestClockStatus::Failed;
+    }
+    *nanoseconds = clock.clock;
+    return GuestClockStatus::OK;
+}
+
+GuestClockStatus KvmVirtualMachine::SetGuestClockImpl(const uint64_t nanoseconds) noexcept {
+    kvm_clock_data clock = { 0 };
+    clock.clock = nanoseconds;
+    if (ioctl(m_fd, KVM_SET_CLOCK, &clock) < 0) {
+        return GuestClockStatus::Failed;
+    }
+    return GuestClockStatus::OK;
+}
+
+PlatformStatisticsStatus KvmVirtualMachine::GetPlatformStatisticsImpl(PlatformStatistics& statistics) noexcept {
+    if (!m_platformStatistics.Read(m_fd, statistics)) {
+        return PlatformStatisticsStatus::Failed;
+    }
+    return PlatformStatisticsStatus::OK;
+}
+
+// ----- Owned guest memory ---------------------------------------------------
+
+// Kinds of host mappings that guest memory can be discarded from
+enum class HostMappingKind {
+    Unknown,            // Not mapped or covered by mappings of different kinds
+    PrivateAnonymous,   // Discarded pages read as zeros
+    PrivateFile,        // Discarded pages revert to the contents of the file
+    Shared,             // Discarded pages are removed from the backing file or shared memory
+};
+
+// Determines the kind of the host mappings covering the given range from
+// /proc/self/maps
+static HostMappingKind hostMappingKind(const void *memory, const uint64_t size) noexcept {
+    FILE *maps = fopen("/proc/self/maps", "re");
+    if (maps == nullptr) {
+        return HostMappingKind::Unknown;
+    }
+
+    const uint64_t start = reinterpret_cast<uintptr_t>(memory);
+    const uint64_t end = start + size;
+    uint64_t nextAddress = start;
+    HostMappingKind kind = HostMappingKind::Unknown;
+
+    // Paths can be arbitrarily long; read whole lines so that the remainder
+    // of a long one is never parsed as a mapping of its own
+    char *line = nullptr;
+    size_t lineSize = 0;
+    while (nextAddress < end && getline(&line, &lineSize, maps) != -1) {
+        unsigned long long vmaStart, vmaEnd, inode;
+        char perms[5];
+        int pathOffset = 0;
+        if (sscanf(line, "%llx-%llx %4s %*s %*s %llu %n", &vmaStart, &vmaEnd, perms, &inode, &pathOffset) < 4) {
+            break;
+        }
+        if (vmaEnd <= nextAddress) {
+            continue;
+        }
+        if (vmaStart > nextAddress) {
+            kind = HostMappingKind::Unknown;
+            break;
+        }
+
+        // Anonymous mappings have no inode; named ones such as [heap] and
+        // [stack] are anonymous as well
+        const char *path = line + pathOffset;
+        HostMappingKind vmaKind;
+        if (perms[3] == 's') {
+            vmaKind = HostMappingKind::Shared;
+        }
+        else if (inode == 0 && (*path == '\n' || *path == '[' || *path == '\0')) {
+            vmaKind = HostMappingKind::PrivateAnonymous;
+        }
+        else {
+            vmaKind = HostMappingKind::PrivateFile;
+        }
+        if (nextAddress != start && vmaKind != kind) {
+            kind = HostMappingKind::Unknown;
+            break;
+        }
+        kind = vmaKind;
+        nextAddress = vmaEnd;
+    }
+    free(line);
+    fclose(maps);
+    return (nextAddress >= end) ? kind : HostMappingKind::Unknown;
+}
+
+void *KvmVirtualMachine::AllocateGuestMemoryImpl(const uint64_t size) noexcept {
+    const int fd = memfd_create("virt86-guest-memory", MFD_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    if (ftruncate(fd, static_cast<off_t>(size)) < 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (memory == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+    }
+
+    m_ownedMemory.push_back({ static_cast<uint8_t *>(memory), size, fd, true });
+    return memory;
+}
+
+void *KvmVirtualMachine::CloneGuestMemoryImpl(const VirtualMachine& source, const void *memory, const uint64_t size) noexcept {
+    const auto& kvmSource = static_cast<const KvmVirtualMachine&>(source);
+    const auto sourceMemory = static_cast<const uint8_t *>(memory);
+    for (auto& block : kvmSource.m_ownedMemory) {
+        if (!block.shareable || sourceMemory < block.memory || sourceMemory + size > block.memory + block.size) {
+            continue;
+        }
+
+        // Pages are shared with the template until the clone writes to them
+        const uint64_t offset = static_cast<uint64_t>(sourceMemory - block.memory);
+        void *clonedMemory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, block.fd, static_cast<off_t>(offset));
+        if (clonedMemory == MAP_FAILED) {
+            return nullptr;
+        }
+        m_ownedMemory.push_back({ static_cast<uint8_t *>(clonedMemory), size, -1, false });
+        return clonedMemory;
+    }
+    return nullptr;
+}
+
+void KvmVirtualMachine::FreeGuestMemoryImpl(void *memory, const uint64_t size) noexcept {
+    for (auto it = m_ownedMemory.begin(); it != m_ownedMemory.end(); it++) {
+        if (it->memory == memory && it->size == size) {
+            munmap(it->memory, it->size);
+            if (it->shareable) {
+                close(it->fd);
+            }
+            m_ownedMemory.erase(it);
+            return;
+        }
+    }
+}
+
+bool KvmVirtualMachine::DiscardHostMemoryImpl(void *memory, const uint64_t size, const bool zero) noexcept {
+    // KVM drops its own mappings of the discarded pages through the MMU
+    // notifiers, so the guest sees the new contents on its next access
+    const auto hostMemory = static_cast<uint8_t *>(memory);
+    for (auto& block : m_ownedMemory) {
+        if (hostMemory < block.memory || hostMemory + size > block.memory + block.size) {
+            continue;
+        }
+
+        // Punch a hole in the memfd. Clones see zeros in the pages they have
+        // not copied yet, just as they see any other write to the template.
+        if (block.shareable) {
+            const off_t offset = static_cast<off_t>(hostMemory - block.memory);
+            return fallocate(block.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, static_cast<off_t>(size)) == 0;
+        }
+
+        // Dropping the private copies of a clone reverts them to the
+        // template; replace the mapping to get zeros instead
+        if (!zero) {
+            return madvise(memory, size, MADV_DONTNEED) == 0;
+        }
+        return mmap(memory, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) != MAP_FAILED;
+    }
+
+    switch (hostMappingKind(memory, size)) {
+    case HostMappingKind::PrivateAnonymous:
+        return madvise(memory, size, MADV_DONTNEED) == 0;
+    case HostMappingKind::PrivateFile:
+        return !zero && madvise(memory, size, MADV_DONTNEED) == 0;
+    case HostMappingKind::Shared:
+        return madvise(memory, size, MADV_REMOVE) == 0;
+    default:
+        return false;
+    }
 }
 
 }
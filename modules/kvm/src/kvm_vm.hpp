@@ -27,8 +27,12 @@ SOFTWARE.
 
 #include "virt86/vm/vm.hpp"
 #include "virt86/kvm/kvm_platform.hpp"
+#include "kvm_stats.hpp"
 
 #include <linux/kvm.h>
+#include <map>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
 namespace virt86::kvm {
@@ -51,27 +55,128 @@ public:
 
     const int FileDescriptor() const noexcept { return m_fd; }
     const int KVMFileDescriptor() const noexcept { return m_fdKVM; }
+    const uint32_t DirtyRingSize() const noexcept { return m_dirtyRingSize; }
+    const int VCPUMmapSize() const noexcept { return m_vcpuMmapSize; }
+    const bool SyncRegsAvailable() const noexcept { return m_syncRegsAvailable; }
+    const std::vector<kvm_cpuid_entry2>& CPUIDTemplate() const noexcept { return m_cpuidTemplate; }
+
+    /**
+     * Retrieves the MSRs included in virtual processor states: the MSRs that
+     * KVM supports saving and restoring and that can be read on this VM's
+     * VCPUs. The list is probed on the first call using the given VCPU.
+     */
+    const std::vector<uint32_t>& StateMSRs(const int vcpuFD) noexcept;
 
 protected:
     MemoryMappingStatus MapGuestMemoryImpl(const uint64_t baseAddress, const uint64_t size, const MemoryFlags flags, void *memory) noexcept override;
+    MemoryMappingStatus UnmapGuestMemoryImpl(const uint64_t baseAddress, const uint64_t size) noexcept override;
     MemoryMappingStatus SetGuestMemoryFlagsImpl(const uint64_t baseAddress, const uint64_t size, const MemoryFlags flags) noexcept override;
 
     DirtyPageTrackingStatus QueryDirtyPagesImpl(const uint64_t baseAddress, const uint64_t size, uint64_t *bitmap, const size_t bitmapSize) noexcept override;
     DirtyPageTrackingStatus ClearDirtyPagesImpl(const uint64_t baseAddress, const uint64_t size) noexcept override;
 
+    GuestClockStatus GetGuestClockImpl(uint64_t *nanoseconds) noexcept override;
+    GuestClockStatus SetGuestClockImpl(const uint64_t nanoseconds) noexcept override;
+
+    PlatformStatisticsStatus GetPlatformStatisticsImpl(PlatformStatistics& statistics) noexcept override;
+
+    void *AllocateGuestMemoryImpl(const uint64_t size) noexcept override;
+    void *CloneGuestMemoryImpl(const VirtualMachine& source, const void *memory, const uint64_t size) noexcept override;
+    void FreeGuestMemoryImpl(void *memory, const uint64_t size) noexcept override;
+    bool DiscardHostMemoryImpl(void *memory, const uint64_t size, const bool zero) noexcept override;
+
+    void MarkDirtyPagesImpl(const uint64_t baseAddress, const uint64_t size) noexcept override;
+
 private:
+    using MemoryRegionMap = std::map<uint64_t, kvm_userspace_memory_region>;
+
     bool Initialize();
+    bool BuildCPUIDTemplate();
+    bool CreateVirtualProcessors();
+    bool ConfigureExits() noexcept;
+    bool ConfigureMSRExits();
+
+    bool AllocateSlot(uint32_t& slot) noexcept;
+    void FreeSlot(const uint32_t slot) noexcept;
+    size_t AvailableSlots() const noexcept;
+
+    MemoryRegionMap::iterator FindFirstOverlap(const uint64_t address) noexcept;
+    bool RemoveMemoryRegion(MemoryRegionMap::iterator memoryRegion, const uint64_t baseAddress, const uint64_t size) noexcept;
+    void RestoreMemoryRegions(const std::vector<kvm_userspace_memory_region>& originalRegions) noexcept;
+
+    enum class DirtyLogMode {
+        Bitmap,         // KVM_GET_DIRTY_LOG reads and clears the whole slot
+        ManualProtect,  // Dirty pages are cleared with KVM_CLEAR_DIRTY_LOG
+        Ring,           // Dirty pages are harvested from the VCPU dirty rings
+    };
+
+    bool EnableDirtyRing() noexcept;
+    bool EnableManualDirtyLogProtect() noexcept;
+    bool HarvestDirtyRings() noexcept;
+    void MarkDirtyPage(const uint32_t slot, const uint64_t pageOffset);
+
+    void UpdateDirtyLogBuffers(const kvm_userspace_memory_region& memoryRegion);
+    bool GetDirtyLog(const kvm_userspace_memory_region& memoryRegion) noexcept;
+    bool ClearDirtyLog(const kvm_userspace_memory_region& memoryRegion, const uint64_t firstPage, const uint64_t numPages) noexcept;
+
+    template<typename Func>
+    DirtyPageTrackingStatus ForEachDirtyLogRegion(const uint64_t baseAddress, const uint64_t size, Func&& func) noexcept;
 
     KvmPlatform& m_platform;
     int m_fdKVM;
     int m_fd;
 
-    uint32_t m_memSlot;
-
-    std::vector<kvm_userspace_memory_region> m_memoryRegions;
+    // VCPU properties shared by all VCPUs, computed once before they are
+    // created. The CPUID template merges the supported and custom CPUIDs;
+    // each VCPU patches in its own APIC ID.
+    int m_vcpuMmapSize;
+    bool m_syncRegsAvailable;
+    std::vector<kvm_cpuid_entry2> m_cpuidTemplate;
+
+    // MSRs included in VCPU states, probed on first use
+    std::once_flag m_stateMSRsFlag;
+    std::vector<uint32_t> m_stateMSRs;
+
+    // Memory regions indexed by guest physical address. Slots are recycled
+    // through the free list when regions are unmapped, and new slots are
+    // handed out until the limit reported by KVM is reached.
+    MemoryRegionMap m_memoryRegions;
+    std::vector<uint32_t> m_freeSlots;
+    uint32_t m_nextSlot;
+    uint32_t m_maxSlots;
+
+    // Dirty page logging state. The per-slot bitmaps, indexed by memory slot,
+    // hold dirty pages that KVM no longer tracks: pages read from the dirty
+    // bitmaps or rings, so that portions of a slot can be queried
+    // independently, and pages carried over from slots that were split by
+    // partial unmapping. The dirty log buffer receives the bitmaps read from
+    // KVM and is reused across queries. Host writes set bits in the slot
+    // bitmaps atomically without holding the lock; everything else, including
+    // adding and removing bitmaps, requires it.
+    DirtyLogMode m_dirtyLogMode;
+    uint32_t m_dirtyRingSize;
+    std::mutex m_dirtyLogMutex;
+    std::unordered_map<uint32_t, std::vector<uint64_t>> m_dirtyBitmaps;
+    std::vector<uint64_t> m_dirtyLogBuffer;
+
+    KvmStatisticsReader m_platformStatistics;
+
+    // Host memory owned by this VM. Blocks allocated by the VM are shared
+    // mappings of a memfd that clones map privately; blocks of clones are
+    // private mappings, whose copied pages cannot be shared any further.
+    struct OwnedMemory {
+        uint8_t *memory;
+        uint64_t size;
+        int fd;
+        bool shareable;
+    };
+    std::vector<OwnedMemory> m_ownedMemory;
 
     // Allow KvmPlatform to access the constructor and Initialize()
     friend class KvmPlatform;
+
+    // Allow KvmVirtualProcessor to harvest the dirty rings
+    friend class KvmVirtualProcessor;
 };
 
 }
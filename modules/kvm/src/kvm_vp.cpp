@@ -30,40 +30,146 @@ SOFTWARE.
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <malloc.h>
 #include <linux/kvm.h>
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
 #include <memory>
-#include <unordered_map>
+#include <mutex>
+#include <vector>
 
 #include "virt86/util/bytemanip.hpp"
+#include "virt86/util/probes.hpp"
+#include "virt86/util/tsc.hpp"
 
 #ifndef BIT
 #define BIT(n) (1 << (n))
 #endif
 
+// Older C libraries do not expose this field of struct sigevent by name
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 namespace virt86::kvm {
 
+// ----- Time slices ----------------------------------------------------------
+// RunFor() arms a per-thread timer that delivers a signal to the thread
+// running the virtual processor. The signal handler requests an immediate exit
+// so that the time slice is honored even if the signal arrives right before
+// KVM_RUN, and the signal itself interrupts KVM_RUN if it is already running.
+
+#if defined(KVM_CAP_IMMEDIATE_EXIT)
+
+// The kvm_run structure of the virtual processor being run with a time slice
+// on the current thread
+static thread_local struct kvm_run *t_timeSliceRun = nullptr;
+
+// Whether the time slice of the current thread has expired
+static thread_local volatile sig_atomic_t t_timeSliceExpired = 0;
+
+// The signal selected with KvmPlatform::SetTimeSliceSignal(), or 0 to use
+// SIGRTMIN. The handler is installed once for the whole process, after which
+// the signal can no longer change.
+static std::atomic<int> g_timeSliceSignal{ 0 };
+static std::atomic<bool> g_timeSliceHandlerInstalled{ false };
+static std::mutex g_timeSliceSignalMutex;
+
+static int TimeSliceSignal() noexcept {
+    const int signal = g_timeSliceSignal.load(std::memory_order_relaxed);
+    return (signal != 0) ? signal : SIGRTMIN;
+}
+
+static void TimeSliceSignalHandler(int) noexcept {
+    t_timeSliceExpired = 1;
+    if (t_timeSliceRun != nullptr) {
+        t_timeSliceRun->immediate_exit = 1;
+    }
+}
+
+static bool InstallTimeSliceSignalHandler() noexcept {
+    if (g_timeSliceHandlerInstalled.load(std::memory_order_acquire)) {
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(g_timeSliceSignalMutex);
+    if (g_timeSliceHandlerInstalled.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    struct sigaction action = {};
+    action.sa_handler = TimeSliceSignalHandler;
+    sigemptyset(&action.sa_mask);
+    // SA_RESTART must not be specified, otherwise KVM_RUN is restarted
+    action.sa_flags = 0;
+    if (sigaction(TimeSliceSignal(), &action, nullptr) < 0) {
+        return false;
+    }
+    g_timeSliceHandlerInstalled.store(true, std::memory_order_release);
+    return true;
+}
+
+#endif
+
+bool KvmVirtualProcessor::SetTimeSliceSignal(const int signal) noexcept {
+#if defined(KVM_CAP_IMMEDIATE_EXIT)
+    if (signal < SIGRTMIN || signal > SIGRTMAX) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(g_timeSliceSignalMutex);
+    if (g_timeSliceHandlerInstalled.load(std::memory_order_relaxed)) {
+        return signal == TimeSliceSignal();
+    }
+    g_timeSliceSignal.store(signal, std::memory_order_relaxed);
+    return true;
+#else
+    return false;
+#endif
+}
+
 KvmVirtualProcessor::KvmVirtualProcessor(KvmVirtualMachine& vm, uint32_t vcpuID)
     : VirtualProcessor(vm)
     , m_vm(vm)
     , m_vcpuID(vcpuID)
     , m_fd(-1)
-    , m_regsDirty(false)
+    , m_regsDirty(true)
     , m_regsChanged(false)
     , m_sregsChanged(false)
     , m_debugRegsChanged(false)
     , m_fpuRegsChanged(false)
     , m_regs({ 0 })
     , m_sregs({ 0 })
+    , m_debugRegs({ 0 })
     , m_fpuRegs({ 0 })
     , m_kvmRun(nullptr)
     , m_kvmRunMmapSize(0)
+    , m_syncRegsAvailable(false)
+    , m_tscOffsetControl(false)
+#if defined(KVM_CAP_DIRTY_LOG_RING)
+    , m_dirtyRing(nullptr)
+    , m_dirtyRingFetchIndex(0)
+#endif
     , m_debug({ 0 })
+    , m_softwareBreakpoints(false)
+    , m_hardwareBreakpoints(false)
+    , m_exceptionExits(ExceptionCode::None)
+    , m_timeSliceTimer()
+    , m_timeSliceThread(0)
 {
 }
 
 KvmVirtualProcessor::~KvmVirtualProcessor() noexcept {
+    if (m_timeSliceThread != 0) {
+        timer_delete(m_timeSliceTimer);
+        m_timeSliceThread = 0;
+    }
+#if defined(KVM_CAP_DIRTY_LOG_RING)
+    if (m_dirtyRing != nullptr) {
+        munmap(m_dirtyRing, m_vm.DirtyRingSize() * sizeof(kvm_dirty_gfn));
+        m_dirtyRing = nullptr;
+    }
+#endif
     if (m_fd != -1) {
         close(m_fd);
         m_fd = -1;
@@ -77,91 +183,94 @@ bool KvmVirtualProcessor::Initialize() noexcept {
         return false;
     }
 
-    // Get the kvmRun struct size
-    m_kvmRunMmapSize = ioctl(m_vm.KVMFileDescriptor(), KVM_GET_VCPU_MMAP_SIZE, 0);
-    if (m_kvmRunMmapSize < 0) {
-        close(m_fd);
-        m_fd = -1;
-        return false;
-    }
-
     // mmap kvmRun to the VCPU file
+    m_kvmRunMmapSize = m_vm.VCPUMmapSize();
     m_kvmRun = (struct kvm_run*)mmap(nullptr, (size_t)m_kvmRunMmapSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
-    if (m_kvmRun < 0) {
+    if (m_kvmRun == MAP_FAILED) {
+        m_kvmRun = nullptr;
         close(m_fd);
         m_fd = -1;
         return false;
     }
 
-    // Configure the custom CPUIDs if supported
-    if (m_vm.GetPlatform().GetFeatures().customCPUIDs) {
-        // Allocate memory for CPUID responses
-        auto& cpuid_defaults = m_vm.GetPlatform().GetFeatures().supportedCustomCPUIDs;
-        size_t count = cpuid_defaults.size();
-        auto cpuid = allocVarEntry<kvm_cpuid2, kvm_cpuid_entry2>(count);
-        cpuid->nent = static_cast<__u32>(count);
-
-        // Build unordered map from custom CPUID entries
-        std::unordered_map<uint64_t, CPUIDResult> custom_cpuids;
-        auto& cpuids = m_vm.GetSpecifications().CPUIDResults;
-        uint64_t leaf_index = 0;
-        uint32_t last_func = 0xFFFFFFFF;
-        for (auto it = cpuids.cbegin(); it != cpuids.cend(); it++) {
-            if (it->function == last_func) {
-                leaf_index++;
-            }
-            else {
-                leaf_index = 0;
-                last_func = it->function;
-            }
-            custom_cpuids[(it->function) | (leaf_index << 32ull)] = *it;
+#if defined(KVM_CAP_DIRTY_LOG_RING)
+    // mmap the dirty ring if enabled on the VM
+    if (m_vm.DirtyRingSize() != 0) {
+        const off_t offset = KVM_DIRTY_LOG_PAGE_OFFSET * sysconf(_SC_PAGESIZE);
+        void *ring = mmap(nullptr, m_vm.DirtyRingSize() * sizeof(kvm_dirty_gfn), PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, offset);
+        if (ring == MAP_FAILED) {
+            return false;
         }
+        m_dirtyRing = static_cast<struct kvm_dirty_gfn*>(ring);
+    }
+#endif
 
-        // Build list of CPUID responses based on default and custom values
-        leaf_index = 0;
-        last_func = 0xFFFFFFFF;
-        for (size_t i = 0; i < count; i++) {
-            const auto &entry = cpuid_defaults[i];
-            if (entry.function == last_func) {
-                leaf_index++;
-            }
-            else {
-                leaf_index = 0;
-                last_func = entry.function;
-            }
+    m_syncRegsAvailable = m_vm.SyncRegsAvailable();
 
-            cpuid->entries[i].function = entry.function;
-            cpuid->entries[i].index = leaf_index;
-            cpuid->entries[i].flags = 0;
-            if (entry.function == 0x4 || entry.function == 0x7 || entry.function == 0xb || entry.function == 0xd) {
-                cpuid->entries[i].flags |= KVM_CPUID_FLAG_SIGNIFCANT_INDEX;
-            }
+    // Set the guest TSC frequency if requested. KVM takes the frequency in
+    // kHz. Platform::CreateVM already rejected nonzero frequencies on hosts
+    // without TSC scaling.
+    const uint64_t tscFrequency = m_vm.GetSpecifications().guestTSCFrequency;
+    if (tscFrequency != 0 && m_vm.GetPlatform().GetFeatures().guestTSCScaling) {
+        if (ioctl(m_fd, KVM_SET_TSC_KHZ, static_cast<unsigned long>(tscFrequency / 1000)) < 0) {
+            return false;
+        }
+    }
 
-            uint64_t custom_key = (entry.function) | (leaf_index << 32ull);
-            if (custom_cpuids.count(custom_key)) {
-                const auto& custom_entry = custom_cpuids[custom_key];
-                cpuid->entries[i].eax = custom_entry.eax;
-                cpuid->entries[i].ebx = custom_entry.ebx;
-                cpuid->entries[i].ecx = custom_entry.ecx;
-                cpuid->entries[i].edx = custom_entry.edx;
-            }
-            else {
-                cpuid->entries[i].eax = entry.eax;
-                cpuid->entries[i].ebx = entry.ebx;
-                cpuid->entries[i].ecx = entry.ecx;
-                cpuid->entries[i].edx = entry.edx;
+#if defined(KVM_VCPU_TSC_CTRL)
+    // Check if the TSC offset can be controlled directly
+    kvm_device_attr tscOffsetAttr = { 0 };
+    tscOffsetAttr.group = KVM_VCPU_TSC_CTRL;
+    tscOffsetAttr.attr = KVM_VCPU_TSC_OFFSET;
+    m_tscOffsetControl = ioctl(m_fd, KVM_HAS_DEVICE_ATTR, &tscOffsetAttr) == 0;
+#endif
+
+    // Configure the custom CPUIDs if supported
+    if (m_vm.GetPlatform().GetFeatures().customCPUIDs) {
+        // Copy the VM's CPUID template into a buffer reused by all VCPUs
+        // initialized on this thread and patch in this VCPU's APIC ID
+        auto& cpuidTemplate = m_vm.CPUIDTemplate();
+        thread_local std::vector<uint8_t> t_cpuidBuffer;
+        t_cpuidBuffer.resize(sizeof(kvm_cpuid2) + cpuidTemplate.size() * sizeof(kvm_cpuid_entry2));
+        auto cpuid = reinterpret_cast<kvm_cpuid2 *>(t_cpuidBuffer.data());
+        cpuid->nent = static_cast<__u32>(cpuidTemplate.size());
+        cpuid->padding = 0;
+        memcpy(cpuid->entries, cpuidTemplate.data(), cpuidTemplate.size() * sizeof(kvm_cpuid_entry2));
+        for (__u32 i = 0; i < cpuid->nent; i++) {
+            auto& entry = cpuid->entries[i];
+            switch (entry.function) {
+            case 0x1:   // Initial APIC ID
+                entry.ebx = (entry.ebx & 0x00FFFFFF) | (m_vcpuID << 24);
+                break;
+            case 0xB:   // x2APIC ID
+            case 0x1F:
+                entry.edx = m_vcpuID;
+                break;
             }
         }
 
         // Apply changes
-        int result = ioctl(m_fd, KVM_SET_CPUID2, cpuid);
-        if (result < 0) {
+        if (ioctl(m_fd, KVM_SET_CPUID2, cpuid) < 0) {
             close(m_fd);
             m_fd = -1;
-            free(cpuid);
             return false;
         }
-        free(cpuid);
+
+#if defined(KVM_CAP_ENFORCE_PV_FEATURE_CPUID)
+        // Make accesses to MSRs of hidden paravirtual features raise #GP
+        if (m_vm.GetSpecifications().kvm.paravirtFeatures && m_vm.GetPlatform().GetFeatures().kvm.enforceParavirtFeatures) {
+            kvm_enable_cap cap = { 0 };
+            cap.cap = KVM_CAP_ENFORCE_PV_FEATURE_CPUID;
+            cap.args[0] = 1;
+            if (ioctl(m_fd, KVM_ENABLE_CAP, &cap) < 0) {
+                return false;
+            }
+        }
+#endif
+    }
+
+    if (!ConfigureExceptionExits()) {
+        return false;
     }
 
     return true;
@@ -173,11 +282,47 @@ VPExecutionStatus KvmVirtualProcessor::RunImpl() noexcept {
         return VPExecutionStatus::Failed;
     }
 
-    if (ioctl(m_fd, KVM_RUN, 0) < 0) {
+    PrepareExitTrace();
+    const int result = ioctl(m_fd, KVM_RUN, 0);
+    m_statistics.EndGuest();
+    TraceGuestExit();
+    if (result < 0) {
+        return VPExecutionStatus::Failed;
+    }
+
+    return HandleExecResult();
+}
+
+VPExecutionStatus KvmVirtualProcessor::RunForImpl(const std::chrono::nanoseconds timeSlice) noexcept {
+#if defined(KVM_CAP_IMMEDIATE_EXIT)
+    if (!UpdateRegisters()) {
+        return VPExecutionStatus::Failed;
+    }
+
+    if (!ArmTimeSlice(timeSlice)) {
+        return VPExecutionStatus::Failed;
+    }
+    PrepareExitTrace();
+    const int result = ioctl(m_fd, KVM_RUN, 0);
+    const int error = errno;
+    m_statistics.EndGuest();
+    TraceGuestExit();
+    const bool expired = DisarmTimeSlice();
+
+    if (result < 0) {
+        // KVM_RUN is interrupted with EINTR when the time slice expires
+        if (error == EINTR && expired) {
+            m_regsDirty = true;
+            m_exitInfo.reason = VMExitReason::TimeSliceExpired;
+            return VPExecutionStatus::OK;
+        }
         return VPExecutionStatus::Failed;
     }
 
     return HandleExecResult();
+#else
+    return VPExecutionStatus::Unsupported;
+#endif
 }
 
 VPExecutionStatus KvmVirtualProcessor::StepImpl() noexcept {
@@ -197,11 +342,91 @@ VPExecutionStatus KvmVirtualProcessor::StepImpl() noexcept {
         return status;
     }
 
-    auto result = HandleExecResult();
+    // RunImpl() has already handled the exit
     if (m_exitInfo.reason == VMExitReason::SoftwareBreakpoint) {
         m_exitInfo.reason = VMExitReason::Step;
     }
-    return result;
+    return status;
+}
+
+void KvmVirtualProcessor::PrepareExitTrace() noexcept {
+#if defined(KVM_CAP_SYNC_REGS)
+    if (m_syncRegsAvailable) {
+        m_kvmRun->kvm_valid_regs = (m_exitTrace) ? KVM_SYNC_X86_REGS : 0;
+    }
+#endif
+}
+
+void KvmVirtualProcessor::TraceGuestExit() noexcept {
+    if (!m_exitTrace) {
+        return;
+    }
+    m_exitTraceRecord.tscExit = ReadTSC();
+#if defined(KVM_CAP_SYNC_REGS)
+    if (m_syncRegsAvailable) {
+        m_exitTraceRecord.rip = m_kvmRun->s.regs.regs.rip;
+        m_exitTraceRecord.flags |= ExitTraceFlags::RIPValid;
+    }
+#endif
+}
+
+bool KvmVirtualProcessor::ArmTimeSlice(const std::chrono::nanoseconds timeSlice) noexcept {
+#if defined(KVM_CAP_IMMEDIATE_EXIT)
+    if (!InstallTimeSliceSignalHandler()) {
+        return false;
+    }
+
+    // The timer signals a specific thread, so it must be recreated if the
+    // virtual processor is now being run by a different thread
+    const pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+    if (m_timeSliceThread != tid) {
+        if (m_timeSliceThread != 0) {
+            timer_delete(m_timeSliceTimer);
+            m_timeSliceThread = 0;
+        }
+
+        struct sigevent event = {};
+        event.sigev_notify = SIGEV_THREAD_ID;
+        event.sigev_signo = TimeSliceSignal();
+        event.sigev_notify_thread_id = tid;
+        if (timer_create(CLOCK_MONOTONIC, &event, &m_timeSliceTimer) < 0) {
+            return false;
+        }
+        m_timeSliceThread = tid;
+    }
+
+    t_timeSliceExpired = 0;
+    t_timeSliceRun = m_kvmRun;
+
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = static_cast<time_t>(timeSlice.count() / 1000000000);
+    spec.it_value.tv_nsec = static_cast<long>(timeSlice.count() % 1000000000);
+    if (timer_settime(m_timeSliceTimer, 0, &spec, nullptr) < 0) {
+        t_timeSliceRun = nullptr;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool KvmVirtualProcessor::DisarmTimeSlice() noexcept {
+#if defined(KVM_CAP_IMMEDIATE_EXIT)
+    // Any signal generated before the timer is disarmed is delivered by the
+    // time timer_settime returns
+    struct itimerspec spec = {};
+    timer_settime(m_timeSliceTimer, 0, &spec, nullptr);
+
+    t_timeSliceRun = nullptr;
+    m_kvmRun->immediate_exit = 0;
+
+    const bool expired = t_timeSliceExpired != 0;
+    t_timeSliceExpired = 0;
+    return expired;
+#else
+    return false;
+#endif
 }
 
 bool KvmVirtualProcessor::SetDebug() noexcept {
@@ -216,6 +441,30 @@ bool KvmVirtualProcessor::SetDebug() noexcept {
     return ioctl(m_fd, KVM_SET_GUEST_DEBUG, &m_debug) >= 0;
 }
 
+bool KvmVirtualProcessor::ConfigureExceptionExits() noexcept {
+    const auto enabledVMExits = BitmaskEnum(m_vm.GetSpecifications().extendedVMExits & m_vm.GetPlatform().GetFeatures().extendedVMExits);
+    if (enabledVMExits.NoneOf(ExtendedVMExit::Exception)) {
+        return true;
+    }
+
+    m_exceptionExits = m_vm.GetSpecifications().vmExitExceptions & m_vm.GetPlatform().GetFeatures().exceptionExits;
+    if (m_exceptionExits == ExceptionCode::None) {
+        return true;
+    }
+
+    // Guest debugging with software breakpoints intercepts #BP, while
+    // hardware breakpoints intercept #DB. The debug registers are left
+    // cleared so that only exceptions raised by the guest cause exits.
+    const auto exceptionExits = BitmaskEnum(m_exceptionExits);
+    if (exceptionExits.AnyOf(ExceptionCode::BreakpointTrap)) {
+        m_debug.control |= KVM_GUESTDBG_USE_SW_BP;
+    }
+    if (exceptionExits.AnyOf(ExceptionCode::DebugTrapOrFault)) {
+        m_debug.control |= KVM_GUESTDBG_USE_HW_BP;
+    }
+    return SetDebug();
+}
+
 bool KvmVirtualProcessor::UpdateRegisters() noexcept {
     // Update CPU state if registers were modified
     if (m_regsChanged) {
@@ -265,6 +514,31 @@ bool KvmVirtualProcessor::RefreshRegisters() noexcept {
     return true;
 }
 
+size_t KvmVirtualProcessor::HarvestDirtyRing() noexcept {
+    // The caller must hold the VM's dirty ring mutex
+    size_t harvested = 0;
+#if defined(KVM_CAP_DIRTY_LOG_RING)
+    if (m_dirtyRing == nullptr) {
+        return 0;
+    }
+    const uint32_t mask = m_vm.DirtyRingSize() - 1;
+    for (;;) {
+        auto& gfn = m_dirtyRing[m_dirtyRingFetchIndex & mask];
+        // KVM publishes the entry by setting the dirty flag last
+        if ((__atomic_load_n(&gfn.flags, __ATOMIC_ACQUIRE) & KVM_DIRTY_GFN_F_DIRTY) == 0) {
+            break;
+        }
+        // The upper 16 bits of the slot contain the address space ID, which
+        // is always zero for regular memory
+        m_vm.MarkDirtyPage(gfn.slot & 0xFFFF, gfn.offset);
+        __atomic_store_n(&gfn.flags, KVM_DIRTY_GFN_F_RESET, __ATOMIC_RELEASE);
+        m_dirtyRingFetchIndex++;
+        harvested++;
+    }
+#endif
+    return harvested;
+}
+
 VPExecutionStatus KvmVirtualProcessor::HandleExecResult() noexcept {
     // Mark registers as dirty
     m_regsDirty = true;
@@ -279,17 +553,24 @@ VPExecutionStatus KvmVirtualProcessor::HandleExecResult() noexcept {
         case KVM_EXIT_UNKNOWN:         m_exitInfo.reason = VMExitReason::Error;     break;  // VM exited for an unknown reason
         case KVM_EXIT_IO:              HandleIO();                                  break;  // I/O (in / out instructions)
         case KVM_EXIT_MMIO:            HandleMMIO();                                break;  // MMIO
-        case KVM_EXIT_DEBUG:                                                                // A breakpoint was hit
+#if defined(KVM_CAP_X86_USER_SPACE_MSR)
+        case KVM_EXIT_X86_RDMSR:       HandleMSRAccess(false);                      break;  // MSR read
+        case KVM_EXIT_X86_WRMSR:       HandleMSRAccess(true);                       break;  // MSR write
+#endif
+#if defined(KVM_CAP_DIRTY_LOG_RING)
+        case KVM_EXIT_DIRTY_RING_FULL:                                                      // The dirty ring is full
         {
-            // Determine if it was a software or hardware breakpoint
-            if (m_kvmRun->debug.arch.dr6 & 0xf) {
-                m_exitInfo.reason = VMExitReason::HardwareBreakpoint;
-            }
-            else {
-                m_exitInfo.reason = VMExitReason::SoftwareBreakpoint;
+            // Harvest the rings so that the VCPU can be resumed
+            std::lock_guard<std::mutex> lock(m_vm.m_dirtyLogMutex);
+            if (!m_vm.HarvestDirtyRings()) {
+                m_exitInfo.reason = VMExitReason::Error;
+                break;
             }
+            m_exitInfo.reason = VMExitReason::Normal;
             break;
         }
+#endif
+        case KVM_EXIT_DEBUG:           HandleDebug();                               break;  // A breakpoint was hit or #BP/#DB was intercepted
         default: m_exitInfo.reason = VMExitReason::Unhandled; break;   // Unknown reason (possibly new reason from a newer KVM)
     }
 
@@ -297,12 +578,73 @@ VPExecutionStatus KvmVirtualProcessor::HandleExecResult() noexcept {
 }
 
 void KvmVirtualProcessor::HandleException() noexcept {
+    SetExceptionExitInfo(m_kvmRun->ex.exception, m_kvmRun->ex.error_code);
+}
+
+void KvmVirtualProcessor::HandleDebug() noexcept {
+    const auto exceptionExits = BitmaskEnum(m_exceptionExits);
+    if (m_kvmRun->debug.arch.exception == 3) {
+        // #BP is reported as a software breakpoint unless it was only
+        // intercepted through the exception exit bitmap
+        if (m_softwareBreakpoints || exceptionExits.NoneOf(ExceptionCode::BreakpointTrap)) {
+            m_exitInfo.reason = VMExitReason::SoftwareBreakpoint;
+        }
+        else {
+            SetExceptionExitInfo(3, 0);
+        }
+        return;
+    }
+
+    // Determine if it was a software or hardware breakpoint
+    if (m_kvmRun->debug.arch.dr6 & 0xf) {
+        if (m_hardwareBreakpoints || exceptionExits.NoneOf(ExceptionCode::DebugTrapOrFault)) {
+            m_exitInfo.reason = VMExitReason::HardwareBreakpoint;
+            return;
+        }
+    }
+    else if ((m_debug.control & KVM_GUESTDBG_SINGLESTEP) || exceptionExits.NoneOf(ExceptionCode::DebugTrapOrFault)) {
+        m_exitInfo.reason = VMExitReason::SoftwareBreakpoint;
+        return;
+    }
+
+    // #DB raised by the guest itself
+    SetExceptionExitInfo(1, 0);
+}
+
+void KvmVirtualProcessor::SetExceptionExitInfo(const uint32_t vector, const uint32_t errorCode) noexcept {
     m_exitInfo.reason = VMExitReason::Exception;
-    m_exitInfo.exceptionCode = m_kvmRun->ex.exception;
+    m_exitInfo.exception.code = vector;
+
+    // #DF, #TS, #NP, #SS, #GP, #PF, #AC and #CP push an error code
+    switch (vector) {
+    case 8: case 10: case 11: case 12: case 13: case 14: case 17: case 21:
+        m_exitInfo.exception.errorCode = errorCode;
+        m_exitInfo.exception.hasErrorCode = true;
+        break;
+    default:
+        m_exitInfo.exception.errorCode = 0;
+        m_exitInfo.exception.hasErrorCode = false;
+        break;
+    }
+
+    m_exitInfo.exception.cr2 = 0;
+    if (vector == 14 && RefreshRegisters()) {
+        m_exitInfo.exception.cr2 = m_sregs.cr2;
+    }
 }
 
 void KvmVirtualProcessor::HandleIO() noexcept {
     m_exitInfo.reason = VMExitReason::PIO;
+    m_statistics.RecordPIO(m_kvmRun->io.port);
+    VIRT86_PROBE5(pio, std::addressof(GetVirtualMachine()), GetIndex(), m_kvmRun->io.port, m_kvmRun->io.size, m_kvmRun->io.direction == KVM_EXIT_IO_OUT);
+    if (m_exitTrace) {
+        m_exitTraceRecord.address = m_kvmRun->io.port;
+        m_exitTraceRecord.size = m_kvmRun->io.size;
+        m_exitTraceRecord.flags |= ExitTraceFlags::AccessValid;
+        if (m_kvmRun->io.direction == KVM_EXIT_IO_OUT) {
+            m_exitTraceRecord.flags |= ExitTraceFlags::Write;
+        }
+    }
 
     uint8_t *ptr = reinterpret_cast<uint8_t*>(reinterpret_cast<uint64_t>(m_kvmRun) + m_kvmRun->io.data_offset);
 
@@ -316,9 +658,15 @@ void KvmVirtualProcessor::HandleIO() noexcept {
                 default: assert(0); // should not happen
             }
             m_io.IOWrite(m_kvmRun->io.port, m_kvmRun->io.size, value);
+            if (m_exitTrace) {
+                m_exitTraceRecord.value = value;
+            }
         }
         else {
             uint32_t value = m_io.IORead(m_kvmRun->io.port, m_kvmRun->io.size);
+            if (m_exitTrace) {
+                m_exitTraceRecord.value = value;
+            }
             switch (m_kvmRun->io.size) {
                 case 1: *ptr = static_cast<uint8_t>(value); break;
                 case 2: *reinterpret_cast<uint16_t *>(ptr) = static_cast<uint16_t>(value); break;
@@ -331,13 +679,62 @@ void KvmVirtualProcessor::HandleIO() noexcept {
     }
 }
 
+void KvmVirtualProcessor::HandleMSRAccess(const bool isWrite) noexcept {
+#if defined(KVM_CAP_X86_USER_SPACE_MSR)
+    auto& msr = m_kvmRun->msr;
+    m_exitInfo.reason = VMExitReason::MSRAccess;
+    m_exitInfo.msr.isWrite = isWrite;
+    m_exitInfo.msr.msrNumber = msr.index;
+
+    // KVM completes the instruction when the VCPU is resumed, injecting a
+    // general protection fault if the access failed
+    bool success;
+    if (isWrite) {
+        success = m_io.MSRWrite(msr.index, msr.data);
+    }
+    else {
+        uint64_t value = 0;
+        success = m_io.MSRRead(msr.index, &value);
+        msr.data = value;
+    }
+    msr.error = success ? 0 : 1;
+    m_exitInfo.msr.rax = msr.data & 0xFFFFFFFF;
+    m_exitInfo.msr.rdx = msr.data >> 32;
+
+    if (m_exitTrace) {
+        m_exitTraceRecord.address = msr.index;
+        m_exitTraceRecord.size = sizeof(uint64_t);
+        m_exitTraceRecord.value = msr.data;
+        m_exitTraceRecord.flags |= ExitTraceFlags::AccessValid;
+        if (isWrite) {
+            m_exitTraceRecord.flags |= ExitTraceFlags::Write;
+        }
+    }
+#endif
+}
+
 void KvmVirtualProcessor::HandleMMIO() noexcept {
     m_exitInfo.reason = VMExitReason::MMIO;
+    m_statistics.RecordMMIO(m_kvmRun->mmio.phys_addr);
+    VIRT86_PROBE5(mmio, std::addressof(GetVirtualMachine()), GetIndex(), m_kvmRun->mmio.phys_addr, m_kvmRun->mmio.len, m_kvmRun->mmio.is_write);
+    if (m_exitTrace) {
+        m_exitTraceRecord.address = m_kvmRun->mmio.phys_addr;
+        m_exitTraceRecord.size = static_cast<uint8_t>(m_kvmRun->mmio.len);
+        m_exitTraceRecord.flags |= ExitTraceFlags::AccessValid;
+    }
 
     if (m_kvmRun->mmio.is_write) {
         m_io.MMIOWrite(m_kvmRun->mmio.phys_addr, m_kvmRun->mmio.len, *reinterpret_cast<uint64_t*>(m_kvmRun->mmio.data));
+        if (m_exitTrace) {
+            const uint64_t mask = (m_kvmRun->mmio.len >= 8) ? ~0ull : ((1ull << (m_kvmRun->mmio.len * 8)) - 1);
+            m_exitTraceRecord.value = *reinterpret_cast<uint64_t*>(m_kvmRun->mmio.data) & mask;
+            m_exitTraceRecord.flags |= ExitTraceFlags::Write;
+        }
     } else {
         uint64_t value = m_io.MMIORead(m_kvmRun->mmio.phys_addr, m_kvmRun->mmio.len);
+        if (m_exitTrace) {
+            m_exitTraceRecord.value = value;
+        }
         switch (m_kvmRun->mmio.len) {
             case 1: *reinterpret_cast<uint8_t *>(m_kvmRun->mmio.data) = static_cast<uint8_t>(value); break;
             case 2: *reinterpret_cast<uint16_t *>(m_kvmRun->mmio.data) = static_cast<uint16_t>(value); break;
@@ -792,10 +1189,57 @@ VPOperationStatus KvmVirtualProcessor::SetMSRs(const uint64_t msrs[], const uint
     return VPOperationStatus::OK;
 }
 
+// ----- Virtual TSC offset ---------------------------------------------------
+
+VPOperationStatus KvmVirtualProcessor::GetVirtualTSCOffset(uint64_t& offset) noexcept {
+#if defined(KVM_VCPU_TSC_CTRL)
+    if (m_tscOffsetControl) {
+        kvm_device_attr attr = { 0 };
+        attr.group = KVM_VCPU_TSC_CTRL;
+        attr.attr = KVM_VCPU_TSC_OFFSET;
+        attr.addr = reinterpret_cast<uint64_t>(&offset);
+        if (ioctl(m_fd, KVM_GET_DEVICE_ATTR, &attr) < 0) {
+            return VPOperationStatus::Failed;
+        }
+        return VPOperationStatus::OK;
+    }
+#endif
+
+    // Derive the offset from the guest's TSC. This is only exact when the
+    // guest TSC runs at the host's frequency.
+    uint64_t guestTSC;
+    const auto status = GetMSR(0x10, guestTSC);
+    if (status != VPOperationStatus::OK) {
+        return status;
+    }
+    offset = guestTSC - ReadTSC();
+    return VPOperationStatus::OK;
+}
+
+VPOperationStatus KvmVirtualProcessor::SetVirtualTSCOffset(const uint64_t offset) noexcept {
+#if defined(KVM_VCPU_TSC_CTRL)
+    if (m_tscOffsetControl) {
+        uint64_t value = offset;
+        kvm_device_attr attr = { 0 };
+        attr.group = KVM_VCPU_TSC_CTRL;
+        attr.attr = KVM_VCPU_TSC_OFFSET;
+        attr.addr = reinterpret_cast<uint64_t>(&value);
+        if (ioctl(m_fd, KVM_SET_DEVICE_ATTR, &attr) < 0) {
+            return VPOperationStatus::Failed;
+        }
+        return VPOperationStatus::OK;
+    }
+#endif
+
+    // Fall back to writing the guest's TSC, which KVM converts into an offset
+    return SetMSR(0x10, ReadTSC() + offset);
+}
+
 // ----- Breakpoints ----------------------------------------------------------
 
 VPOperationStatus KvmVirtualProcessor::EnableSoftwareBreakpoints(bool enable) noexcept {
-    if (enable) {
+    m_softwareBreakpoints = enable;
+    if (enable || BitmaskEnum(m_exceptionExits).AnyOf(ExceptionCode::BreakpointTrap)) {
         m_debug.control |= KVM_GUESTDBG_USE_SW_BP;
     }
     else {
@@ -821,6 +1265,7 @@ VPOperationStatus KvmVirtualProcessor::SetHardwareBreakpoints(HardwareBreakpoint
         return ClearHardwareBreakpoints();
     }
 
+    m_hardwareBreakpoints = true;
     m_debug.control |= KVM_GUESTDBG_USE_HW_BP;
     for (int i = 0; i < 4; i++) {
         m_debug.arch.debugreg[i] = breakpoints.bp[i].address;
@@ -838,7 +1283,10 @@ VPOperationStatus KvmVirtualProcessor::SetHardwareBreakpoints(HardwareBreakpoint
 }
 
 VPOperationStatus KvmVirtualProcessor::ClearHardwareBreakpoints() noexcept {
-    m_debug.control &= ~KVM_GUESTDBG_USE_HW_BP;
+    m_hardwareBreakpoints = false;
+    if (BitmaskEnum(m_exceptionExits).NoneOf(ExceptionCode::DebugTrapOrFault)) {
+        m_debug.control &= ~KVM_GUESTDBG_USE_HW_BP;
+    }
     memset(m_debug.arch.debugreg, 0, 8 * sizeof(uint64_t));
     if (!SetDebug()) {
         return VPOperationStatus::Failed;
@@ -865,4 +1313,366 @@ VPOperationStatus KvmVirtualProcessor::GetBreakpointAddress(uint64_t *address) c
     return VPOperationStatus::OK;
 }
 
+// ----- Platform statistics --------------------------------------------------
+
+VPOperationStatus KvmVirtualProcessor::GetPlatformStatistics(PlatformStatistics& statistics) const noexcept {
+    if (!m_vm.GetPlatform().GetFeatures().platformStatistics) {
+        return VPOperationStatus::Unsupported;
+    }
+    if (!m_platformStatistics.Read(m_fd, statistics)) {
+        return VPOperationStatus::Failed;
+    }
+    return VPOperationStatus::OK;
+}
+
+// ----- State save and restore -----------------------------------------------
+
+// Batch of MSRs large enough for a full VCPU state, kept on the stack so that
+// saving and restoring states does not allocate
+struct StateMSRBatch {
+    alignas(kvm_msrs) uint8_t buffer[sizeof(kvm_msrs) + VPState::MaxMSRs * sizeof(kvm_msr_entry)];
+
+    kvm_msrs *operator->() noexcept { return reinterpret_cast<kvm_msrs *>(buffer); }
+    kvm_msrs *get() noexcept { return reinterpret_cast<kvm_msrs *>(buffer); }
+};
+
+VPOperationStatus KvmVirtualProcessor::SaveState(VPState& state) noexcept {
+    if (!m_vm.GetPlatform().GetFeatures().vpStateSaveRestore) {
+        return VPOperationStatus::Unsupported;
+    }
+
+    // Apply pending register changes, then read the registers if the cached
+    // copies are stale
+    if (!UpdateRegisters() || !RefreshRegisters()) {
+        return VPOperationStatus::Failed;
+    }
+
+    state.version = VPState::CurrentVersion;
+    state.size = sizeof(VPState);
+    state.groups = VPStateGroup::None;
+    state.numMSRs = 0;
+
+    // General purpose registers
+    state.gpr[0] = m_regs.rax;
+    state.gpr[1] = m_regs.rcx;
+    state.gpr[2] = m_regs.rdx;
+    state.gpr[3] = m_regs.rbx;
+    state.gpr[4] = m_regs.rsp;
+    state.gpr[5] = m_regs.rbp;
+    state.gpr[6] = m_regs.rsi;
+    state.gpr[7] = m_regs.rdi;
+    state.gpr[8] = m_regs.r8;
+    state.gpr[9] = m_regs.r9;
+    state.gpr[10] = m_regs.r10;
+    state.gpr[11] = m_regs.r11;
+    state.gpr[12] = m_regs.r12;
+    state.gpr[13] = m_regs.r13;
+    state.gpr[14] = m_regs.r14;
+    state.gpr[15] = m_regs.r15;
+    state.rip = m_regs.rip;
+    state.rflags = m_regs.rflags;
+    state.groups |= VPStateGroup::Registers;
+
+    // System registers
+    LoadSegment(state.segments[0], &m_sregs.es);
+    LoadSegment(state.segments[1], &m_sregs.cs);
+    LoadSegment(state.segments[2], &m_sregs.ss);
+    LoadSegment(state.segments[3], &m_sregs.ds);
+    LoadSegment(state.segments[4], &m_sregs.fs);
+    LoadSegment(state.segments[5], &m_sregs.gs);
+    LoadSegment(state.segments[6], &m_sregs.ldt);
+    LoadSegment(state.segments[7], &m_sregs.tr);
+    LoadTable(state.gdtr, &m_sregs.gdt);
+    LoadTable(state.idtr, &m_sregs.idt);
+    state.cr0 = m_sregs.cr0;
+    state.cr2 = m_sregs.cr2;
+    state.cr3 = m_sregs.cr3;
+    state.cr4 = m_sregs.cr4;
+    state.cr8 = m_sregs.cr8;
+    state.efer = m_sregs.efer;
+    state.apicBase = m_sregs.apic_base;
+    state.groups |= VPStateGroup::SystemRegisters;
+
+    // Debug registers
+    for (int i = 0; i < 4; i++) {
+        state.dr[i] = m_debugRegs.db[i];
+    }
+    state.dr6 = m_debugRegs.dr6;
+    state.dr7 = m_debugRegs.dr7;
+    state.groups |= VPStateGroup::DebugRegisters;
+
+    // XSAVE area
+    static_assert(sizeof(kvm_xsave::region) == VPState::XSAVESize, "XSAVE area size mismatch");
+    if (ioctl(m_fd, KVM_GET_XSAVE, reinterpret_cast<kvm_xsave *>(state.xsave)) < 0) {
+        return VPOperationStatus::Failed;
+    }
+    state.groups |= VPStateGroup::XSAVE;
+
+    // Extended control registers
+    kvm_xcrs xcrs = { 0 };
+    if (ioctl(m_fd, KVM_GET_XCRS, &xcrs) < 0) {
+        return VPOperationStatus::Failed;
+    }
+    state.xcr0 = 0;
+    for (__u32 i = 0; i < xcrs.nr_xcrs; i++) {
+        if (xcrs.xcrs[i].xcr == 0) {
+            state.xcr0 = xcrs.xcrs[i].value;
+        }
+    }
+    state.groups |= VPStateGroup::XCRs;
+
+    // Pending events
+    kvm_vcpu_events events = { 0 };
+    if (ioctl(m_fd, KVM_GET_VCPU_EVENTS, &events) < 0) {
+        return VPOperationStatus::Failed;
+    }
+    state.events = {};
+    state.events.exceptionInjected = events.exception.injected;
+    state.events.exceptionVector = events.exception.nr;
+    state.events.exceptionHasErrorCode = events.exception.has_error_code;
+    state.events.exceptionPending = events.exception.pending;
+    state.events.exceptionErrorCode = events.exception.error_code;
+    state.events.interruptInjected = events.interrupt.injected;
+    state.events.interruptVector = events.interrupt.nr;
+    state.events.interruptSoft = events.interrupt.soft;
+    state.events.interruptShadow = events.interrupt.shadow;
+    state.events.nmiInjected = events.nmi.injected;
+    state.events.nmiPending = events.nmi.pending;
+    state.events.nmiMasked = events.nmi.masked;
+    state.events.sipiVector = events.sipi_vector;
+#if defined(KVM_VCPUEVENT_VALID_SMM)
+    if (events.flags & KVM_VCPUEVENT_VALID_SMM) {
+        state.events.smmValid = 1;
+        state.events.smm = events.smi.smm;
+        state.events.smiPending = events.smi.pending;
+        state.events.smmInsideNMI = events.smi.smm_inside_nmi;
+        state.events.latchedInit = events.smi.latched_init;
+    }
+#endif
+    state.groups |= VPStateGroup::Events;
+
+    // Multiprocessor state
+    kvm_mp_state mpState = { 0 };
+    if (ioctl(m_fd, KVM_GET_MP_STATE, &mpState) < 0) {
+        return VPOperationStatus::Failed;
+    }
+    state.mpState = static_cast<VPMPState>(mpState.mp_state);
+    state.numDroppedMSRs = 0;
+    state.groups |= VPStateGroup::MPState;
+
+    // Local APIC; only available with an in-kernel APIC
+    static_assert(sizeof(kvm_lapic_state::regs) == VPState::LAPICSize, "LAPIC page size mismatch");
+    if (ioctl(m_fd, KVM_GET_LAPIC, reinterpret_cast<kvm_lapic_state *>(state.lapic)) == 0) {
+        state.groups |= VPStateGroup::LAPIC;
+    }
+
+    // MSRs; those that do not fit in the state are left out and counted so
+    // that the caller can tell the state is incomplete
+    auto& stateMSRs = m_vm.StateMSRs(m_fd);
+    const size_t numMSRs = std::min(stateMSRs.size(), VPState::MaxMSRs);
+    StateMSRBatch msrData;
+    msrData->nmsrs = static_cast<__u32>(numMSRs);
+    msrData->pad = 0;
+    for (size_t i = 0; i < numMSRs; i++) {
+        msrData->entries[i].index = stateMSRs[i];
+        msrData->entries[i].reserved = 0;
+    }
+    if (ioctl(m_fd, KVM_GET_MSRS, msrData.get()) != static_cast<int>(numMSRs)) {
+        return VPOperationStatus::Failed;
+    }
+    for (size_t i = 0; i < numMSRs; i++) {
+        state.msrs[i].index = msrData->entries[i].index;
+        state.msrs[i].reserved = 0;
+        state.msrs[i].value = msrData->entries[i].data;
+    }
+    state.numMSRs = static_cast<uint32_t>(numMSRs);
+    state.numDroppedMSRs = static_cast<uint32_t>(stateMSRs.size() - numMSRs);
+    state.groups |= VPStateGroup::MSRs;
+
+    if (state.numDroppedMSRs != 0) {
+        return VPOperationStatus::Incomplete;
+    }
+    return VPOperationStatus::OK;
+}
+
+VPOperationStatus KvmVirtualProcessor::RestoreState(const VPState& state, VPRejectedMSRs *rejectedMSRs) noexcept {
+    if (!m_vm.GetPlatform().GetFeatures().vpStateSaveRestore) {
+        return VPOperationStatus::Unsupported;
+    }
+    if (state.version != VPState::CurrentVersion || state.size != sizeof(VPState) || state.numMSRs > VPState::MaxMSRs) {
+        return VPOperationStatus::InvalidArguments;
+    }
+
+    // The restored state supersedes any pending register changes; fetch the
+    // registers again on the next access
+    m_regsChanged = m_sregsChanged = m_debugRegsChanged = m_fpuRegsChanged = false;
+    m_regsDirty = true;
+
+    // Groups are restored in dependency order: the LAPIC must be restored
+    // after the APIC base and before MSRs that depend on its mode (such as
+    // the TSC deadline), and pending events go last
+    const auto groups = BitmaskEnum(state.groups);
+    if (groups.AnyOf(VPStateGroup::Registers)) {
+        kvm_regs regs;
+        regs.rax = state.gpr[0];
+        regs.rcx = state.gpr[1];
+        regs.rdx = state.gpr[2];
+        regs.rbx = state.gpr[3];
+        regs.rsp = state.gpr[4];
+        regs.rbp = state.gpr[5];
+        regs.rsi = state.gpr[6];
+        regs.rdi = state.gpr[7];
+        regs.r8 = state.gpr[8];
+        regs.r9 = state.gpr[9];
+        regs.r10 = state.gpr[10];
+        regs.r11 = state.gpr[11];
+        regs.r12 = state.gpr[12];
+        regs.r13 = state.gpr[13];
+        regs.r14 = state.gpr[14];
+        regs.r15 = state.gpr[15];
+        regs.rip = state.rip;
+        regs.rflags = state.rflags;
+        if (ioctl(m_fd, KVM_SET_REGS, &regs) < 0) {
+            return VPOperationStatus::Failed;
+        }
+    }
+
+    if (groups.AnyOf(VPStateGroup::XSAVE)) {
+        if (ioctl(m_fd, KVM_SET_XSAVE, reinterpret_cast<const kvm_xsave *>(state.xsave)) < 0) {
+            return VPOperationStatus::Failed;
+        }
+    }
+
+    if (groups.AnyOf(VPStateGroup::XCRs)) {
+        kvm_xcrs xcrs = { 0 };
+        xcrs.nr_xcrs = 1;
+        xcrs.xcrs[0].xcr = 0;
+        xcrs.xcrs[0].value = state.xcr0;
+        if (ioctl(m_fd, KVM_SET_XCRS, &xcrs) < 0) {
+            return VPOperationStatus::Failed;
+        }
+    }
+
+    if (groups.AnyOf(VPStateGroup::SystemRegisters)) {
+        // Pending interrupts are restored through the events; leave the
+        // interrupt bitmap clear
+        kvm_sregs sregs = { 0 };
+        StoreSegment(state.segments[0], &sregs.es);
+        StoreSegment(state.segments[1], &sregs.cs);
+        StoreSegment(state.segments[2], &sregs.ss);
+        StoreSegment(state.segments[3], &sregs.ds);
+        StoreSegment(state.segments[4], &sregs.fs);
+        StoreSegment(state.segments[5], &sregs.gs);
+        StoreSegment(state.segments[6], &sregs.ldt);
+        StoreSegment(state.segments[7], &sregs.tr);
+        StoreTable(state.gdtr, &sregs.gdt);
+        StoreTable(state.idtr, &sregs.idt);
+        sregs.cr0 = state.cr0;
+        sregs.cr2 = state.cr2;
+        sregs.cr3 = state.cr3;
+        sregs.cr4 = state.cr4;
+        sregs.cr8 = state.cr8;
+        sregs.efer = state.efer;
+        sregs.apic_base = state.apicBase;
+        if (ioctl(m_fd, KVM_SET_SREGS, &sregs) < 0) {
+            return VPOperationStatus::Failed;
+        }
+    }
+
+    if (groups.AnyOf(VPStateGroup::LAPIC)) {
+        if (ioctl(m_fd, KVM_SET_LAPIC, reinterpret_cast<const kvm_lapic_state *>(state.lapic)) < 0) {
+            return VPOperationStatus::Failed;
+        }
+    }
+
+    if (rejectedMSRs != nullptr) {
+        rejectedMSRs->count = 0;
+    }
+    bool msrsRejected = false;
+    if (groups.AnyOf(VPStateGroup::MSRs)) {
+        // KVM_SET_MSRS stops at the first MSR it rejects, which happens with
+        // MSRs that can be read but not written in the current configuration
+        // (for instance, MSRs that require an in-kernel APIC). Skip over them,
+        // recording their indices, and keep writing from the following MSR.
+        StateMSRBatch msrData;
+        uint32_t pos = 0;
+        while (pos < state.numMSRs) {
+            const uint32_t count = state.numMSRs - pos;
+            msrData->nmsrs = count;
+            msrData->pad = 0;
+            for (uint32_t i = 0; i < count; i++) {
+                msrData->entries[i].index = state.msrs[pos + i].index;
+                msrData->entries[i].reserved = 0;
+                msrData->entries[i].data = state.msrs[pos + i].value;
+            }
+            const int numWritten = ioctl(m_fd, KVM_SET_MSRS, msrData.get());
+            if (numWritten < 0) {
+                return VPOperationStatus::Failed;
+            }
+            pos += numWritten;
+            if (pos < state.numMSRs) {
+                if (rejectedMSRs != nullptr) {
+                    rejectedMSRs->indices[rejectedMSRs->count++] = state.msrs[pos].index;
+                }
+                msrsRejected = true;
+                pos++;
+            }
+        }
+    }
+
+    if (groups.AnyOf(VPStateGroup::MPState)) {
+        kvm_mp_state mpState = { static_cast<__u32>(state.mpState) };
+        if (ioctl(m_fd, KVM_SET_MP_STATE, &mpState) < 0) {
+            return VPOperationStatus::Failed;
+        }
+    }
+
+    if (groups.AnyOf(VPStateGroup::Events)) {
+        kvm_vcpu_events events = { 0 };
+        events.exception.injected = state.events.exceptionInjected;
+        events.exception.nr = state.events.exceptionVector;
+        events.exception.has_error_code = state.events.exceptionHasErrorCode;
+        events.exception.pending = state.events.exceptionPending;
+        events.exception.error_code = state.events.exceptionErrorCode;
+        events.interrupt.injected = state.events.interruptInjected;
+        events.interrupt.nr = state.events.interruptVector;
+        events.interrupt.soft = state.events.interruptSoft;
+        events.interrupt.shadow = state.events.interruptShadow;
+        events.nmi.injected = state.events.nmiInjected;
+        events.nmi.pending = state.events.nmiPending;
+        events.nmi.masked = state.events.nmiMasked;
+        events.sipi_vector = state.events.sipiVector;
+        events.flags = KVM_VCPUEVENT_VALID_NMI_PENDING | KVM_VCPUEVENT_VALID_SIPI_VECTOR | KVM_VCPUEVENT_VALID_SHADOW;
+#if defined(KVM_VCPUEVENT_VALID_SMM)
+        if (state.events.smmValid) {
+            events.flags |= KVM_VCPUEVENT_VALID_SMM;
+            events.smi.smm = state.events.smm;
+            events.smi.pending = state.events.smiPending;
+            events.smi.smm_inside_nmi = state.events.smmInsideNMI;
+            events.smi.latched_init = state.events.latchedInit;
+        }
+#endif
+        if (ioctl(m_fd, KVM_SET_VCPU_EVENTS, &events) < 0) {
+            return VPOperationStatus::Failed;
+        }
+    }
+
+    if (groups.AnyOf(VPStateGroup::DebugRegisters)) {
+        kvm_debugregs debugRegs = { 0 };
+        for (int i = 0; i < 4; i++) {
+            debugRegs.db[i] = state.dr[i];
+        }
+        debugRegs.dr6 = state.dr6;
+        debugRegs.dr7 = state.dr7;
+        if (ioctl(m_fd, KVM_SET_DEBUGREGS, &debugRegs) < 0) {
+            return VPOperationStatus::Failed;
+        }
+    }
+
+    if (msrsRejected) {
+        return VPOperationStatus::Incomplete;
+    }
+    return VPOperationStatus::OK;
+}
+
 }
@@ -28,8 +28,11 @@ SOFTWARE.
 
 #include "virt86/vp/vp.hpp"
 #include "kvm_helpers.hpp"
+#include "kvm_stats.hpp"
 
 #include <linux/kvm.h>
+#include <signal.h>
+#include <time.h>
 
 namespace virt86::kvm {
 
@@ -51,7 +54,11 @@ public:
     // Disallow taking the address
     KvmVirtualProcessor *operator&() = delete;
 
+    // See KvmPlatform::SetTimeSliceSignal()
+    static bool SetTimeSliceSignal(const int signal) noexcept;
+
     VPExecutionStatus RunImpl() noexcept override;
+    VPExecutionStatus RunForImpl(const std::chrono::nanoseconds timeSlice) noexcept override;
     VPExecutionStatus StepImpl() noexcept override;
 
     bool PrepareInterrupt(uint8_t vector) noexcept override;
@@ -78,11 +85,19 @@ public:
     VPOperationStatus GetMSRs(const uint64_t msrs[], uint64_t values[], const size_t numRegs) noexcept override;
     VPOperationStatus SetMSRs(const uint64_t msrs[], const uint64_t values[], const size_t numRegs) noexcept override;
 
+    VPOperationStatus GetVirtualTSCOffset(uint64_t& offset) noexcept override;
+    VPOperationStatus SetVirtualTSCOffset(const uint64_t offset) noexcept override;
+
     VPOperationStatus EnableSoftwareBreakpoints(bool enable) noexcept override;
     VPOperationStatus SetHardwareBreakpoints(HardwareBreakpoints breakpoints) noexcept override;
     VPOperationStatus ClearHardwareBreakpoints() noexcept override;
     VPOperationStatus GetBreakpointAddress(uint64_t *address) const noexcept override;
 
+    VPOperationStatus GetPlatformStatistics(PlatformStatistics& statistics) const noexcept override;
+
+    VPOperationStatus SaveState(VPState& state) noexcept override;
+    VPOperationStatus RestoreState(const VPState& state, VPRejectedMSRs *rejectedMSRs = nullptr) noexcept override;
+
 private:
     KvmVirtualMachine& m_vm;
     uint32_t m_vcpuID;
@@ -102,19 +117,46 @@ private:
 
     struct kvm_run* m_kvmRun;
     int m_kvmRunMmapSize;
+    bool m_syncRegsAvailable;
+    bool m_tscOffsetControl;
+
+#if defined(KVM_CAP_DIRTY_LOG_RING)
+    struct kvm_dirty_gfn* m_dirtyRing;
+    uint32_t m_dirtyRingFetchIndex;
+#endif
 
     struct kvm_guest_debug m_debug;
 
+    mutable KvmStatisticsReader m_platformStatistics;
+    bool m_softwareBreakpoints;
+    bool m_hardwareBreakpoints;
+    ExceptionCode m_exceptionExits;
+
+    timer_t m_timeSliceTimer;
+    pid_t m_timeSliceThread;
+
     bool Initialize() noexcept;
 
+    bool ArmTimeSlice(const std::chrono::nanoseconds timeSlice) noexcept;
+    bool DisarmTimeSlice() noexcept;
+
+    size_t HarvestDirtyRing() noexcept;
+
+    void PrepareExitTrace() noexcept;
+    void TraceGuestExit() noexcept;
+
     bool UpdateRegisters() noexcept;
     bool SetDebug() noexcept;
+    bool ConfigureExceptionExits() noexcept;
     bool RefreshRegisters() noexcept;
 
     VPExecutionStatus HandleExecResult() noexcept;
     void HandleException() noexcept;
+    void HandleDebug() noexcept;
+    void SetExceptionExitInfo(const uint32_t vector, const uint32_t errorCode) noexcept;
     void HandleIO() noexcept;
     void HandleMMIO() noexcept;
+    void HandleMSRAccess(const bool isWrite) noexcept;
 
     VPOperationStatus KvmRegRead(const Reg reg, RegValue& value) noexcept;
     VPOperationStatus KvmRegWrite(const Reg reg, const RegValue& value) noexcept;
@@ -0,0 +1,117 @@
+/*
+Defines the layout of virt86 snapshot files.
+
+A snapshot file contains the following blocks, in order:
+- the header, padded to a full page;
+- the region table, one entry per guest memory region;
+- the state of every virtual processor, as VPState structures;
+- the hot page table, listing guest physical addresses of pages that are
+  likely to be accessed soon after restoring, in ascending order;
+- the contents of every guest memory region (an extent), each starting on a
+  page boundary so that it can be mapped directly as guest memory.
+
+All values are stored in the host's native byte order. The header is written
+last, so a partially written snapshot is never considered valid.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/vm/mem.hpp"
+#include "virt86/util/bitmask_enum.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace virt86::snapshot {
+
+/**
+ * The magic value at the start of every snapshot file.
+ */
+constexpr char kSnapshotMagic[8] = { 'V', 'I', 'R', 'T', '8', '6', 'S', 'S' };
+
+/**
+ * The current version of the snapshot file format.
+ */
+constexpr uint32_t kSnapshotVersion = 2;
+
+/**
+ * The alignment of blocks in the file. Extents aligned to this value can be
+ * mapped directly with mmap().
+ */
+constexpr uint64_t kSnapshotAlignment = 0x1000;
+
+/**
+ * Flags describing the contents of a snapshot file.
+ */
+enum class SnapshotFileFlags : uint32_t {
+    None = 0,
+
+    Checksums = (1 << 0),    // Extents have checksums
+    GuestClock = (1 << 1),   // The guest clock value is valid
+};
+
+/**
+ * The snapshot file header, located at offset 0.
+ */
+struct SnapshotHeader {
+    char magic[8];                 // Must be kSnapshotMagic
+    uint32_t version;              // Must be kSnapshotVersion
+    uint32_t headerSize;           // Must be sizeof(SnapshotHeader)
+    SnapshotFileFlags flags;
+    uint32_t numRegions;           // Number of entries in the region table
+    uint32_t numProcessors;        // Number of VPState structures
+    uint32_t vpStateSize;          // Must be sizeof(VPState)
+    uint32_t numHotPages;          // Number of entries in the hot page table
+    uint32_t reserved;
+
+    uint64_t regionTableOffset;    // File offset of the region table
+    uint64_t vpStateOffset;        // File offset of the VPState array
+    uint64_t hotPageTableOffset;   // File offset of the hot page table
+    uint64_t dataOffset;           // File offset of the first extent
+    uint64_t fileSize;             // Total size of the file
+
+    uint64_t guestClock;           // Guest clock in nanoseconds, if SnapshotFileFlags::GuestClock is set
+
+    uint64_t regionTableChecksum;  // Hash64() of the region table
+    uint64_t vpStateChecksum;      // Hash64() of the VPState array
+    uint64_t hotPageTableChecksum; // Hash64() of the hot page table
+    uint64_t headerChecksum;       // Hash64() of all preceding fields
+};
+
+/**
+ * An entry in the region table, describing one guest memory region and the
+ * extent that holds its contents.
+ */
+struct SnapshotRegionEntry {
+    uint64_t baseAddress;   // Guest physical address of the region
+    uint64_t size;          // Size of the region and its extent in bytes
+    uint64_t fileOffset;    // File offset of the extent, aligned to kSnapshotAlignment
+    MemoryFlags flags;      // Flags the region was mapped with
+    uint32_t reserved;
+    uint64_t checksum;      // Hash64() of the extent, if SnapshotFileFlags::Checksums is set
+};
+
+}
+
+ENABLE_BITMASK_OPERATORS(virt86::snapshot::SnapshotFileFlags)
@@ -0,0 +1,280 @@
+/*
+Moves running virtual machines between processes with pre-copy migration.
+
+A MigrationSender streams a running virtual machine through a pipe or a Unix
+socket. It first sends all guest memory while the guest keeps running, then
+keeps sending the pages the guest wrote to in the meantime, as reported by
+dirty page tracking, until few enough of them are left. Only then is the
+virtual machine stopped to send the remaining dirty pages and the state of the
+virtual processors, which keeps the downtime short regardless of the amount of
+guest memory.
+
+A MigrationReceiver creates a new virtual machine from the stream.
+
+Guest memory regions must be mapped with the MemoryFlags::DirtyPageTracking
+flag to be sent while the guest is running; other regions are sent in full
+while the virtual machine is stopped. The stream uses the host's native byte
+order and is meant for migration between processes on the same host.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/platform/platform.hpp"
+#include "virt86/vm/vm.hpp"
+#include "virt86/vp/state.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+
+namespace virt86::snapshot {
+
+// ----- Stream format --------------------------------------------------------
+
+/**
+ * The magic value at the start of every migration stream.
+ */
+constexpr char kMigrationMagic[8] = { 'V', 'I', 'R', 'T', '8', '6', 'M', 'G' };
+
+/**
+ * The current version of the migration stream format.
+ */
+constexpr uint32_t kMigrationVersion = 1;
+
+/**
+ * The maximum number of entries in the region table of a migration stream.
+ * Receivers reject streams that declare more.
+ */
+constexpr uint32_t kMaxMigrationRegions = 65536;
+
+/**
+ * The header at the start of a migration stream, followed by the region table.
+ */
+struct MigrationStreamHeader {
+    char magic[8];             // Must be kMigrationMagic
+    uint32_t version;          // Must be kMigrationVersion
+    uint32_t numRegions;       // Number of entries in the region table
+    uint32_t numProcessors;    // Number of virtual processors
+    uint32_t vpStateSize;      // Must be sizeof(VPState)
+};
+
+/**
+ * An entry in the region table of a migration stream.
+ */
+struct MigrationRegionEntry {
+    uint64_t baseAddress;   // Guest physical address of the region
+    uint64_t size;          // Size of the region in bytes
+    MemoryFlags flags;      // Flags the region was mapped with
+    uint32_t reserved;
+};
+
+/**
+ * Types of records that follow the region table.
+ */
+enum class MigrationRecordType : uint32_t {
+    Pages,        // count pages starting at address follow the record
+    Stop,         // The virtual machine was stopped; the final pages follow
+    VPStates,     // count VPState structures follow the record
+    GuestClock,   // address holds the guest clock in nanoseconds
+    End,          // The stream is complete
+};
+
+/**
+ * A record of a migration stream.
+ */
+struct MigrationRecord {
+    MigrationRecordType type;
+    uint32_t count;
+    uint64_t address;
+};
+
+// ----- Migration ------------------------------------------------------------
+
+enum class MigrationStatus {
+    OK,
+
+    Unsupported,           // The platform cannot save or restore the state of virtual processors
+    IOError,               // Failed to read from or write to the stream
+    InvalidStream,         // The stream is malformed or was created by an incompatible version of virt86
+    IncompatibleVM,        // The specifications do not match the migrated virtual machine
+    CreateVMFailed,        // Failed to create the virtual machine
+    MappingFailed,         // Failed to allocate or map guest memory
+    DirtyTrackingFailed,   // Failed to query or clear dirty pages
+    VPStateFailed,         // Failed to save or restore the state of a virtual processor
+};
+
+/**
+ * Options for sending virtual machines.
+ */
+struct MigrationOptions {
+    /**
+     * Stop the virtual machine once at most this many pages are dirty.
+     */
+    uint64_t convergenceThreshold = 256;
+
+    /**
+     * Stop the virtual machine after this many passes over dirty pages even
+     * if the guest dirties pages faster than they can be sent.
+     */
+    uint32_t maxIterations = 30;
+
+    /**
+     * The largest number of consecutive pages sent in one record.
+     */
+    uint32_t maxPagesPerRecord = 256;
+};
+
+/**
+ * Information about the last migration performed by a MigrationSender.
+ */
+struct MigrationSendStatistics {
+    uint32_t iterations = 0;        // Passes over guest memory while the guest was running
+    uint64_t pagesSent = 0;         // Pages sent, including those sent more than once
+    uint64_t finalPages = 0;        // Pages sent while the virtual machine was stopped
+    uint64_t bytesSent = 0;         // Total size of the stream
+    uint64_t bytesPerSecond = 0;    // Average throughput
+    uint64_t elapsedNanos = 0;      // Time taken to send the virtual machine
+    uint64_t downtimeNanos = 0;     // Time between stopping the virtual machine and the end of the stream
+};
+
+/**
+ * Sends running virtual machines through a stream.
+ */
+class MigrationSender {
+public:
+    explicit MigrationSender(const MigrationOptions& options = {}) noexcept;
+
+    /**
+     * Sends the virtual machine through the file descriptor, which can be
+     * a pipe, a socket or any other blocking stream.
+     *
+     * The virtual processors may be running when this method is invoked.
+     * Once the set of dirty pages is small enough, stopVM is invoked and
+     * must return only after all virtual processors stopped running. They
+     * must not run again until this method returns. The memory layout of the
+     * virtual machine must not change during the migration.
+     *
+     * Pages are resent when the guest writes to them, or when the host does
+     * through VirtualMachine::MemWrite() and the bulk memory operations. The
+     * host must not write to guest memory through pointers to its host
+     * memory, as device models often do, until stopVM is invoked: such
+     * writes are not tracked and may never reach the destination.
+     */
+    MigrationStatus Send(VirtualMachine& vm, const int fd, const std::function<void()>& stopVM) noexcept;
+
+    /**
+     * Retrieves information about the last migration.
+     */
+    const MigrationSendStatistics& GetStatistics() const noexcept { return m_statistics; }
+
+private:
+    struct TrackedRegion {
+        const MemoryRegion *region;
+        std::vector<uint64_t> bitmap;
+    };
+
+    MigrationStatus SendPages(const int fd, const MemoryRegion& region, uint64_t firstPage, uint64_t numPages) noexcept;
+    MigrationStatus SendDirtyPages(const int fd, const TrackedRegion& tracked, uint64_t& pagesSent) noexcept;
+    MigrationStatus SendRecord(const int fd, const MigrationRecord& record, const void *data, const size_t size) noexcept;
+    MigrationStatus QueryDirtyPages(VirtualMachine& vm, std::vector<TrackedRegion>& trackedRegions, const bool accumulate, uint64_t& numDirtyPages) noexcept;
+
+    MigrationOptions m_options;
+    MigrationSendStatistics m_statistics;
+};
+
+/**
+ * Information about the last migration performed by a MigrationReceiver.
+ */
+struct MigrationReceiveStatistics {
+    uint64_t pagesReceived = 0;     // Pages received, including those received more than once
+    uint64_t bytesReceived = 0;     // Total size of the stream
+    uint64_t bytesPerSecond = 0;    // Average throughput
+    uint64_t elapsedNanos = 0;      // Time taken to receive the virtual machine
+    uint64_t downtimeNanos = 0;     // Time between the source stopping and the virtual machine being ready to run
+};
+
+/**
+ * Creates virtual machines from migration streams.
+ *
+ * Guest memory is allocated with VirtualMachine::AllocateGuestMemory() if the
+ * platform supports it. Otherwise it belongs to the receiver, which must
+ * outlive the virtual machine.
+ */
+class MigrationReceiver {
+public:
+    MigrationReceiver() noexcept = default;
+    ~MigrationReceiver() noexcept;
+
+    // Prevent copy construction and copy assignment
+    MigrationReceiver(const MigrationReceiver&) = delete;
+    MigrationReceiver& operator=(const MigrationReceiver&) = delete;
+
+    // Prevent move construction and move assignment
+    MigrationReceiver(MigrationReceiver&&) = delete;
+    MigrationReceiver&& operator=(MigrationReceiver&&) = delete;
+
+    /**
+     * Creates a virtual machine with the given specifications through the
+     * platform and loads it from the file descriptor. The specifications
+     * must have the same number of virtual processors as the migrated
+     * virtual machine and must outlive it, as with Platform::CreateVM().
+     *
+     * The virtual machine is destroyed if the migration fails.
+     */
+    MigrationStatus Receive(Platform& platform, const VMSpecifications& specifications, const int fd) noexcept;
+
+    /**
+     * Retrieves the virtual machine created by the last successful call to
+     * Receive().
+     */
+    const std::optional<std::reference_wrapper<VirtualMachine>> GetVirtualMachine() const noexcept;
+
+    /**
+     * Retrieves information about the last migration.
+     */
+    const MigrationReceiveStatistics& GetStatistics() const noexcept { return m_statistics; }
+
+private:
+    struct Mapping {
+        void *address;
+        size_t size;
+    };
+
+    struct Region {
+        uint64_t baseAddress;
+        uint64_t size;
+        uint8_t *hostMemory;
+    };
+
+    MigrationStatus ReceiveRecords(const int fd, std::vector<Region>& regions) noexcept;
+    MigrationStatus Fail(Platform& platform, const MigrationStatus status) noexcept;
+
+    VirtualMachine *m_vm = nullptr;
+    std::vector<Mapping> m_mappings;
+    MigrationReceiveStatistics m_statistics;
+};
+
+}
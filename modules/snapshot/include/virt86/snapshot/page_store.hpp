@@ -0,0 +1,345 @@
+/*
+Stores deduplicated snapshots of virtual machines in a content-addressed page
+store.
+
+A PageStore is a directory holding every distinct 4 KiB page of guest memory
+saved into it exactly once, identified by the 128-bit hash of its contents.
+Pages filled with zeros are never stored. Snapshots are small manifest files
+that list the state of the virtual processors and, for every page of guest
+memory, the slot in the store that holds its contents. Snapshots of similar
+virtual machines share the pages they have in common.
+
+Incremental snapshots only hash and store the pages written by the guest since
+the previous snapshot, as reported by dirty page tracking, and take all other
+pages from the manifest of the previous snapshot. Their manifests are
+complete, so restoring a snapshot never requires its ancestors.
+
+Pages are hashed, stored and restored on multiple threads.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/snapshot/format.hpp"
+#include "virt86/snapshot/snapshot.hpp"
+#include "virt86/util/hash.hpp"
+#include "virt86/vm/vm.hpp"
+#include "virt86/vp/state.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace virt86::snapshot {
+
+// ----- File formats ---------------------------------------------------------
+
+/**
+ * The magic value at the start of every page store manifest.
+ */
+constexpr char kPageManifestMagic[8] = { 'V', 'I', 'R', 'T', '8', '6', 'P', 'M' };
+
+/**
+ * The current version of the page store formats.
+ */
+constexpr uint32_t kPageStoreVersion = 1;
+
+/**
+ * The slot value that denotes a page filled with zeros.
+ */
+constexpr uint64_t kZeroPageSlot = ~0ull;
+
+/**
+ * An entry of the index file of a page store, mapping the hash of a page to
+ * the slot that holds it in the pages file. Entries are appended as pages
+ * are stored.
+ */
+struct PageStoreIndexEntry {
+    Hash128Value hash;   // Hash128() of the page, keyed with the store key
+    uint64_t slot;       // Index of the page in the pages file
+    uint64_t checksum;   // Hash64() of the preceding fields
+};
+
+/**
+ * The header of a manifest, followed by the region table, the states of the
+ * virtual processors and the page table, which holds the slot of every page
+ * of every region in order.
+ */
+struct PageManifestHeader {
+    char magic[8];              // Must be kPageManifestMagic
+    uint32_t version;           // Must be kPageStoreVersion
+    uint32_t headerSize;        // Must be sizeof(PageManifestHeader)
+    SnapshotFileFlags flags;    // Only SnapshotFileFlags::GuestClock is used
+    uint32_t numRegions;        // Number of entries in the region table
+    uint32_t numProcessors;     // Number of VPState structures
+    uint32_t vpStateSize;       // Must be sizeof(VPState)
+    uint64_t numPages;          // Number of entries in the page table
+
+    uint64_t id;                // Hash64() of everything following the header, identifies the snapshot
+    uint64_t parentId;          // The id of the snapshot this one is based on, or 0
+    uint64_t guestClock;        // Guest clock in nanoseconds, if SnapshotFileFlags::GuestClock is set
+
+    uint64_t headerChecksum;    // Hash64() of all preceding fields
+};
+
+/**
+ * An entry in the region table of a manifest.
+ */
+struct PageManifestRegion {
+    uint64_t baseAddress;   // Guest physical address of the region
+    uint64_t size;          // Size of the region in bytes
+    MemoryFlags flags;      // Flags the region was mapped with
+    uint32_t reserved;
+    uint64_t firstPage;     // Index of the first page of the region in the page table
+};
+
+// ----- Page store -----------------------------------------------------------
+
+/**
+ * A directory of deduplicated guest memory pages.
+ *
+ * Pages are looked up by a 128-bit hash of their contents, keyed with a
+ * random secret that is generated when the store is created and kept in the
+ * store directory. Without the key, a guest cannot craft pages whose hashes
+ * collide with those of other pages to make one snapshot see the contents of
+ * another.
+ *
+ * The store may be shared by any number of writers and snapshots within a
+ * process; it is locked against use by other processes while open.
+ */
+class PageStore {
+public:
+    PageStore() noexcept = default;
+    ~PageStore() noexcept;
+
+    // Prevent copy construction and copy assignment
+    PageStore(const PageStore&) = delete;
+    PageStore& operator=(const PageStore&) = delete;
+
+    // Prevent move construction and move assignment
+    PageStore(PageStore&&) = delete;
+    PageStore&& operator=(PageStore&&) = delete;
+
+    /**
+     * Opens the page store in the specified directory, creating it if it
+     * does not exist yet.
+     */
+    SnapshotStatus Open(const char *directory) noexcept;
+
+    /**
+     * Closes the page store.
+     */
+    void Close() noexcept;
+
+    /**
+     * Retrieves the number of distinct pages in the store.
+     */
+    uint64_t GetPageCount() noexcept;
+
+private:
+    struct HashKey {
+        size_t operator()(const Hash128Value& hash) const noexcept { return static_cast<size_t>(hash.low); }
+    };
+
+    bool LoadKey(const std::string& path, bool& created) noexcept;
+
+    int m_pagesFd = -1;
+    int m_indexFd = -1;
+    Hash128Value m_key = {};
+
+    // Serializes writers, so that pages reserved by one writer are stored
+    // before another writer can refer to them
+    std::mutex m_writeMutex;
+
+    // Guards the index and the sizes of the files
+    std::mutex m_mutex;
+    std::unordered_map<Hash128Value, uint64_t, HashKey> m_index;
+    uint64_t m_numPages = 0;
+    uint64_t m_indexSize = 0;
+
+    // Allow writers and snapshots to access the files and the index
+    friend class PageStoreWriter;
+    friend class PageStoreSnapshot;
+};
+
+/**
+ * Options for writing snapshots to a page store.
+ */
+struct PageStoreWriterOptions {
+    /**
+     * The number of threads that hash and store pages. 0 uses one thread per
+     * host processor.
+     */
+    size_t numThreads = 0;
+
+    /**
+     * Flush the pages and the index to storage before writing the manifest,
+     * so that a manifest always refers to durable pages.
+     */
+    bool sync = false;
+};
+
+/**
+ * Information about the last snapshot written by a PageStoreWriter.
+ */
+struct PageStoreWriteStatistics {
+    uint64_t totalPages = 0;        // Pages of guest memory covered by the snapshot
+    uint64_t scannedPages = 0;      // Pages inspected; all pages of full snapshots, dirty pages of incremental snapshots
+    uint64_t zeroPages = 0;         // Scanned pages filled with zeros
+    uint64_t duplicatePages = 0;    // Scanned pages already present in the store
+    uint64_t newPages = 0;          // Scanned pages added to the store
+    uint64_t bytesPerSecond = 0;    // Guest memory scanned per second
+    uint64_t elapsedNanos = 0;      // Time taken to write the snapshot
+};
+
+class PageStoreSnapshot;
+
+/**
+ * Writes snapshots of virtual machines into a page store.
+ */
+class PageStoreWriter {
+public:
+    explicit PageStoreWriter(PageStore& store, const PageStoreWriterOptions& options = {}) noexcept;
+
+    /**
+     * Writes a full snapshot of the virtual machine, storing the manifest at
+     * the specified path. The dirty page state of regions with dirty page
+     * tracking is cleared, so that an incremental snapshot written next only
+     * contains the pages written after this one.
+     *
+     * The virtual processors of the virtual machine must not be running.
+     */
+    SnapshotStatus Write(VirtualMachine& vm, const char *manifestPath) noexcept;
+
+    /**
+     * Writes an incremental snapshot of the virtual machine on top of the
+     * parent snapshot, which must be the last snapshot written for this
+     * virtual machine. Only the pages reported dirty by regions with dirty
+     * page tracking are inspected; all pages of other regions are scanned.
+     * The memory layout must match that of the parent.
+     *
+     * The virtual processors of the virtual machine must not be running.
+     */
+    SnapshotStatus WriteIncremental(VirtualMachine& vm, const PageStoreSnapshot& parent, const char *manifestPath) noexcept;
+
+    /**
+     * Retrieves information about the last snapshot written.
+     */
+    const PageStoreWriteStatistics& GetStatistics() const noexcept { return m_statistics; }
+
+private:
+    struct ScanPage {
+        uint64_t index;              // Index in the page table
+        const uint8_t *hostMemory;
+    };
+
+    SnapshotStatus WriteManifest(VirtualMachine& vm, const PageStoreSnapshot *parent, const char *manifestPath) noexcept;
+    bool StorePages(const std::vector<ScanPage>& pages, std::vector<uint64_t>& pageTable) noexcept;
+
+    PageStore& m_store;
+    PageStoreWriterOptions m_options;
+    PageStoreWriteStatistics m_statistics;
+};
+
+/**
+ * A snapshot opened from a page store for restoring.
+ *
+ * Guest memory is allocated with VirtualMachine::AllocateGuestMemory() if the
+ * platform supports it. Otherwise it belongs to this object, which must
+ * outlive the virtual machines restored from it.
+ */
+class PageStoreSnapshot {
+public:
+    PageStoreSnapshot() noexcept = default;
+    ~PageStoreSnapshot() noexcept;
+
+    // Prevent copy construction and copy assignment
+    PageStoreSnapshot(const PageStoreSnapshot&) = delete;
+    PageStoreSnapshot& operator=(const PageStoreSnapshot&) = delete;
+
+    // Prevent move construction and move assignment
+    PageStoreSnapshot(PageStoreSnapshot&&) = delete;
+    PageStoreSnapshot&& operator=(PageStoreSnapshot&&) = delete;
+
+    /**
+     * Opens and validates the manifest at the specified path, whose pages
+     * are in the given store.
+     */
+    SnapshotStatus Open(PageStore& store, const char *manifestPath) noexcept;
+
+    /**
+     * Closes the manifest and releases guest memory owned by this object.
+     */
+    void Close() noexcept;
+
+    /**
+     * Retrieves the header of the manifest.
+     */
+    const PageManifestHeader& GetHeader() const noexcept { return m_header; }
+
+    /**
+     * Retrieves the region table of the manifest.
+     */
+    const std::vector<PageManifestRegion>& GetRegions() const noexcept { return m_regions; }
+
+    /**
+     * Retrieves the saved states of the virtual processors.
+     */
+    const std::vector<VPState>& GetVPStates() const noexcept { return m_vpStates; }
+
+    /**
+     * Retrieves the page table of the manifest.
+     */
+    const std::vector<uint64_t>& GetPageTable() const noexcept { return m_pageTable; }
+
+    /**
+     * Restores the snapshot into the virtual machine, which must have the
+     * same number of virtual processors as the one that was saved and must
+     * not have guest memory mapped at the addresses of the saved regions.
+     *
+     * numThreads is the number of threads that read pages from the store;
+     * 0 uses one thread per host processor.
+     */
+    SnapshotStatus Restore(VirtualMachine& vm, const size_t numThreads = 0) noexcept;
+
+private:
+    struct Mapping {
+        void *address;
+        size_t size;
+    };
+
+    PageStore *m_store = nullptr;
+    PageManifestHeader m_header = {};
+    std::vector<PageManifestRegion> m_regions;
+    std::vector<VPState> m_vpStates;
+    std::vector<uint64_t> m_pageTable;
+    std::vector<Mapping> m_mappings;
+
+    // Allow writers to check the store of parent snapshots
+    friend class PageStoreWriter;
+};
+
+}
@@ -0,0 +1,375 @@
+/*
+Saves virtual machines to snapshot files and restores them.
+
+SnapshotWriter streams the guest memory and the state of every virtual
+processor of a virtual machine to a file. Snapshot opens a snapshot file and
+restores it into a freshly created virtual machine by mapping the memory
+extents of the file directly as guest memory with private copy-on-write
+mappings, so that restoring a virtual machine of any size takes roughly the
+same time and guest memory is only read from the file as the guest touches it.
+
+Live snapshots only pause the virtual machine while the state of its virtual
+processors is captured and its memory is write-protected. Guest memory is then
+written in the background while the virtual machine keeps running, preserving
+the original contents of every page the guest writes to before it is saved.
+
+Snapshots require the vpStateSaveRestore platform feature.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/snapshot/format.hpp"
+#include "virt86/snapshot/userfault.hpp"
+#include "virt86/vm/vm.hpp"
+#include "virt86/vp/state.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace virt86::snapshot {
+
+enum class SnapshotStatus {
+    OK,
+
+    Unsupported,          // The platform cannot save or restore the state of virtual processors
+    IOError,              // Failed to read from or write to the file
+    InvalidFile,          // The file is not a valid snapshot or is truncated
+    UnsupportedVersion,   // The file was created by an incompatible version of virt86
+    ChecksumMismatch,     // The contents of the file are corrupted
+    IncompatibleVM,       // The virtual machine does not match the snapshot
+    MappingFailed,        // Failed to map guest memory
+    DirtyTrackingFailed,  // Failed to query or clear dirty pages
+    UserfaultFailed,      // Failed to set up lazy loading of guest memory with userfaultfd
+    VPStateFailed,        // Failed to save or restore the state of a virtual processor
+    Busy,                 // A live snapshot is still being written
+};
+
+/**
+ * Options for writing snapshots.
+ */
+struct SnapshotWriterOptions {
+    /**
+     * Compute a checksum for every extent. Checksums are computed while the
+     * data is being written and can be checked with Snapshot::Verify().
+     */
+    bool checksums = true;
+
+    /**
+     * Flush the file to storage before writing the header and once again
+     * after, so that a valid header always refers to durable data.
+     */
+    bool sync = false;
+
+    /**
+     * The amount of data transferred by each write, in bytes. Large values
+     * reduce the number of system calls.
+     */
+    size_t chunkSize = 8 * 1024 * 1024;
+
+    /**
+     * Record the pages written by the guest since dirty pages were last
+     * queried or cleared as hot pages, in addition to those specified with
+     * SnapshotWriter::SetHotPages(). Only regions mapped with the
+     * MemoryFlags::DirtyPageTracking flag are inspected, and their dirty
+     * page state is consumed in the process.
+     */
+    bool recordDirtyPagesAsHot = false;
+};
+
+/**
+ * Information about the last snapshot written by a SnapshotWriter.
+ */
+struct SnapshotWriteStatistics {
+    uint64_t memoryBytes = 0;      // Bytes of guest memory written
+    uint64_t copiedBytes = 0;      // Bytes of guest memory copied in the kernel with copy_file_range()
+    uint64_t preservedPages = 0;   // Pages written by the guest during a live snapshot before they were saved
+    uint64_t fileSize = 0;         // Total size of the file
+    uint64_t pauseNanos = 0;       // Time during which the virtual machine had to be paused
+    uint64_t elapsedNanos = 0;     // Time taken to write the snapshot
+};
+
+/**
+ * Writes snapshots of virtual machines.
+ */
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(const SnapshotWriterOptions& options = {}) noexcept;
+    ~SnapshotWriter() noexcept;
+
+    // Prevent copy construction and copy assignment
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    // Prevent move construction and move assignment
+    SnapshotWriter(SnapshotWriter&&) = delete;
+    SnapshotWriter&& operator=(SnapshotWriter&&) = delete;
+
+    /**
+     * Declares that the host memory block starting at hostMemory with the
+     * given size is a shared mapping of the file descriptor fd starting at
+     * offset. Guest memory backed by this block is copied from the file
+     * descriptor with copy_file_range(), which avoids copying data through
+     * user space and may share blocks on filesystems that support it.
+     *
+     * The file descriptor must remain open while snapshots are written.
+     */
+    void AddMemorySource(void *hostMemory, const uint64_t size, const int fd, const uint64_t offset);
+
+    /**
+     * Specifies the guest physical addresses of pages that are likely to be
+     * accessed soon after the snapshot is restored. Lazy restores populate
+     * these pages ahead of the guest. Addresses outside of the mapped guest
+     * memory are ignored.
+     */
+    void SetHotPages(std::vector<uint64_t> addresses);
+
+    /**
+     * Writes a snapshot of the virtual machine to the specified path,
+     * replacing any existing file. The snapshot is written to a temporary
+     * file in the same directory, which is renamed over the path once it is
+     * complete, so an existing file is left intact if the snapshot cannot be
+     * written and virtual machines restored from it are not disturbed.
+     *
+     * The virtual processors of the virtual machine must not be running.
+     */
+    SnapshotStatus Write(VirtualMachine& vm, const char *path) noexcept;
+
+    /**
+     * Writes a snapshot of the virtual machine to the file descriptor, which
+     * must be open for writing and support pwrite(). The snapshot starts at
+     * offset 0 and the file is truncated to the size of the snapshot.
+     *
+     * The virtual processors of the virtual machine must not be running.
+     */
+    SnapshotStatus Write(VirtualMachine& vm, const int fd) noexcept;
+
+    /**
+     * Starts writing a live snapshot of the virtual machine to the specified
+     * path, replacing any existing file. As with Write(), the snapshot is
+     * written to a temporary file that FinishLive() renames over the path
+     * once it is complete.
+     *
+     * The virtual processors of the virtual machine must not be running when
+     * this method is invoked. It captures their state, write-protects guest
+     * memory with userfaultfd and returns, after which the virtual processors
+     * may resume while guest memory is written on a background thread. The
+     * first write to each page that was not saved yet is held until a copy of
+     * the page is preserved, so the snapshot reflects the virtual machine as
+     * it was when this method was invoked.
+     *
+     * Guest memory must be anonymous or shared memory, such as memory
+     * allocated with VirtualMachine::AllocateGuestMemory(); memory mapped from
+     * regular files, including memory restored from snapshots, cannot be
+     * write-protected. Memory sources are not used. The memory layout of the
+     * virtual machine must not change and guest memory must not be discarded
+     * or zeroed until FinishLive() returns, since discarded pages bypass the
+     * write protection.
+     */
+    SnapshotStatus StartLive(VirtualMachine& vm, const char *path) noexcept;
+
+    /**
+     * Starts writing a live snapshot of the virtual machine to the file
+     * descriptor, which must be open for writing and support pwrite(). See
+     * StartLive(VirtualMachine&, const char *).
+     */
+    SnapshotStatus StartLive(VirtualMachine& vm, const int fd) noexcept;
+
+    /**
+     * Waits until the live snapshot is completely written and returns the
+     * result of the operation. Returns SnapshotStatus::OK if no live
+     * snapshot was started.
+     */
+    SnapshotStatus FinishLive() noexcept;
+
+    /**
+     * Retrieves information about the last snapshot written. Live snapshots
+     * are reported once FinishLive() returns.
+     */
+    const SnapshotWriteStatistics& GetStatistics() const noexcept { return m_statistics; }
+
+private:
+    // The metadata of a snapshot being written
+    struct Layout {
+        SnapshotHeader header;
+        std::vector<SnapshotRegionEntry> regionTable;
+        std::vector<VPState> vpStates;
+        std::vector<uint64_t> hotPages;
+    };
+
+    // The state of a live snapshot being written in the background
+    struct LiveWrite;
+
+    struct MemorySource {
+        const uint8_t *hostMemory;
+        uint64_t size;
+        int fd;
+        uint64_t offset;
+    };
+
+    SnapshotStatus WriteSnapshot(VirtualMachine& vm, const int fd, const bool truncate) noexcept;
+    SnapshotStatus Prepare(VirtualMachine& vm, const int fd, const bool truncate, Layout& layout) noexcept;
+    SnapshotStatus Finish(const int fd, Layout& layout) noexcept;
+    SnapshotStatus WriteExtent(const int fd, const MemoryRegion& region, uint64_t fileOffset, uint64_t& checksum) noexcept;
+    SnapshotStatus BeginLive(VirtualMachine& vm, const int fd, const char *path, const char *tempPath) noexcept;
+    void StreamLive() noexcept;
+    const MemorySource *FindMemorySource(const uint8_t *hostMemory, const uint64_t size) const noexcept;
+
+    std::vector<uint64_t> CollectHotPages(VirtualMachine& vm) const;
+
+    SnapshotWriterOptions m_options;
+    std::vector<MemorySource> m_memorySources;
+    std::vector<uint64_t> m_hotPages;
+    SnapshotWriteStatistics m_statistics;
+    std::unique_ptr<LiveWrite> m_live;
+};
+
+/**
+ * Options for restoring snapshots.
+ */
+struct SnapshotRestoreOptions {
+    /**
+     * Read all guest memory from the file while restoring instead of loading
+     * it on demand as the guest touches it. Ignored by lazy restores.
+     */
+    bool populate = false;
+
+    /**
+     * Back guest memory with anonymous memory that is populated from the
+     * file with userfaultfd as the guest touches it, instead of mapping the
+     * file. Pages are copied into memory owned by the process rather than
+     * shared with the page cache. The hot pages recorded in the snapshot are
+     * prefetched in the background.
+     *
+     * Since pages are read after Restore() returns, read errors cannot be
+     * reported by it. Pages that fail to load read as zeros; check
+     * Snapshot::GetLazyRestoreStatus() before trusting the guest's state.
+     */
+    bool lazy = false;
+
+    /**
+     * Check the checksums of all extents before restoring.
+     */
+    bool verify = false;
+};
+
+/**
+ * A snapshot file opened for restoring.
+ *
+ * Guest memory mapped by Restore() belongs to this object, which must outlive
+ * the virtual machines restored from it.
+ */
+class Snapshot {
+public:
+    Snapshot() noexcept = default;
+    ~Snapshot() noexcept;
+
+    // Prevent copy construction and copy assignment
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    // Prevent move construction and move assignment
+    Snapshot(Snapshot&&) = delete;
+    Snapshot&& operator=(Snapshot&&) = delete;
+
+    /**
+     * Opens and validates the snapshot file at the specified path. The
+     * contents of the extents are not read.
+     */
+    SnapshotStatus Open(const char *path) noexcept;
+
+    /**
+     * Closes the file and unmaps all guest memory mapped from it.
+     */
+    void Close() noexcept;
+
+    /**
+     * Retrieves the header of the snapshot.
+     */
+    const SnapshotHeader& GetHeader() const noexcept { return m_header; }
+
+    /**
+     * Retrieves the region table of the snapshot.
+     */
+    const std::vector<SnapshotRegionEntry>& GetRegions() const noexcept { return m_regions; }
+
+    /**
+     * Retrieves the saved states of the virtual processors.
+     */
+    const std::vector<VPState>& GetVPStates() const noexcept { return m_vpStates; }
+
+    /**
+     * Retrieves the hot pages recorded in the snapshot.
+     */
+    const std::vector<uint64_t>& GetHotPages() const noexcept { return m_hotPages; }
+
+    /**
+     * Retrieves the counters of the lazy restores performed so far.
+     */
+    UserfaultStatistics GetLazyRestoreStatistics() const noexcept;
+
+    /**
+     * Returns SnapshotStatus::IOError if any page of a lazy restore could not
+     * be read from the file so far, or SnapshotStatus::OK otherwise.
+     */
+    SnapshotStatus GetLazyRestoreStatus() const noexcept;
+
+    /**
+     * Checks the checksums of all extents. Returns SnapshotStatus::OK if the
+     * snapshot was written without checksums.
+     */
+    SnapshotStatus Verify() const noexcept;
+
+    /**
+     * Restores the snapshot into the virtual machine, which must have the
+     * same number of virtual processors as the one that was saved and must
+     * not have guest memory mapped at the addresses of the saved regions.
+     *
+     * Guest memory is mapped from the file with private copy-on-write
+     * mappings or, with SnapshotRestoreOptions::lazy, loaded on demand with
+     * userfaultfd; changes made by the guest are never written back to the
+     * file.
+     */
+    SnapshotStatus Restore(VirtualMachine& vm, const SnapshotRestoreOptions& options = {}) noexcept;
+
+private:
+    struct Mapping {
+        void *address;
+        size_t size;
+    };
+
+    SnapshotStatus RestoreLazily(VirtualMachine& vm) noexcept;
+
+    int m_fd = -1;
+    SnapshotHeader m_header = {};
+    std::vector<SnapshotRegionEntry> m_regions;
+    std::vector<VPState> m_vpStates;
+    std::vector<uint64_t> m_hotPages;
+    std::vector<Mapping> m_mappings;
+    std::vector<std::unique_ptr<FilePageSource>> m_pageSources;
+    std::vector<std::unique_ptr<UserfaultPopulator>> m_populators;
+};
+
+}
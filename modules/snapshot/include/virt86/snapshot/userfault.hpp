@@ -0,0 +1,332 @@
+/*
+Populates and tracks guest memory with userfaultfd.
+
+A UserfaultPopulator takes ownership of the missing-page faults of blocks of
+anonymous host memory that back guest memory. Pages start out unpopulated and
+are filled on a handler thread from a PageSource the first time the guest, the
+hypervisor or the host application touches them, so that only the pages that
+are actually used are ever read from the source. A list of pages expected to
+be used early can be prefetched in the background.
+
+A UserfaultWriteProtector write-protects blocks of host memory and lets a
+handler inspect every page right before it is first written to.
+
+Both require a userfaultfd that receives faults raised in kernel mode, since
+the hypervisor accesses guest memory from the kernel. Unless the
+vm.unprivileged_userfaultfd sysctl is set to 1, the process needs the
+CAP_SYS_PTRACE capability; otherwise registration fails with
+UserfaultStatus::Unsupported.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace virt86::snapshot {
+
+/**
+ * Supplies the original contents of a block of guest memory.
+ *
+ * Implementations may read from a file, decompress from a compressed store or
+ * point into an in-memory baseline. ReadPages() is invoked from the handler
+ * and prefetch threads of the UserfaultPopulator, possibly concurrently.
+ */
+class PageSource {
+public:
+    virtual ~PageSource() noexcept = default;
+
+    /**
+     * Retrieves size bytes of the block starting at offset. Both values are
+     * multiples of the page size.
+     *
+     * Implementations either fill the buffer, which holds size bytes, and
+     * return it, or return a pointer to data that remains valid until the
+     * next call. Returns nullptr on failure.
+     */
+    virtual const void *ReadPages(const uint64_t offset, void *buffer, const size_t size) noexcept = 0;
+};
+
+/**
+ * Reads pages from a file at a fixed offset. The file descriptor is not owned.
+ */
+class FilePageSource : public PageSource {
+public:
+    FilePageSource(const int fd, const uint64_t fileOffset) noexcept
+        : m_fd(fd)
+        , m_fileOffset(fileOffset)
+    {}
+
+    const void *ReadPages(const uint64_t offset, void *buffer, const size_t size) noexcept override;
+
+private:
+    const int m_fd;
+    const uint64_t m_fileOffset;
+};
+
+/**
+ * Reads pages from a block of memory, such as a baseline image of guest
+ * memory shared by several virtual machines. The memory is not owned.
+ */
+class MemoryPageSource : public PageSource {
+public:
+    explicit MemoryPageSource(const void *baseline) noexcept
+        : m_baseline(static_cast<const uint8_t *>(baseline))
+    {}
+
+    const void *ReadPages(const uint64_t offset, void *buffer, const size_t size) noexcept override;
+
+private:
+    const uint8_t *m_baseline;
+};
+
+enum class UserfaultStatus {
+    OK,
+
+    Unsupported,        // userfaultfd is not available to this process (see vm.unprivileged_userfaultfd)
+    InvalidArguments,   // The memory block is misaligned or empty
+    RegisterFailed,     // Failed to register the memory block with userfaultfd
+    AlreadyStarted,     // Memory blocks cannot be registered after Start()
+    Failed,             // Failed to start the handler threads
+    SourceFailed,       // Some pages could not be read from their source and were zero-filled
+};
+
+/**
+ * Counters collected by a UserfaultPopulator.
+ */
+struct UserfaultStatistics {
+    uint64_t faults = 0;            // Missing-page faults resolved
+    uint64_t faultedPages = 0;      // Pages populated in response to faults
+    uint64_t prefetchedPages = 0;   // Pages populated by the prefetcher
+    uint64_t failedPages = 0;       // Pages that could not be read from their source and were zero-filled
+};
+
+/**
+ * Resolves missing-page faults on registered blocks of memory.
+ *
+ * A faulting thread cannot be left waiting, so pages that cannot be read from
+ * their source are filled with zeros. This corrupts guest memory: check
+ * GetStatus() or install a failure handler before trusting the contents.
+ *
+ * The populator must outlive every use of the registered memory, including
+ * the virtual machines that map it as guest memory: once it is destroyed, any
+ * page that was not populated yet reads as zeros.
+ *
+ * Pages discarded with madvise(), as done by
+ * VirtualMachine::DiscardGuestMemory() and VirtualMachine::ZeroGuestMemory(),
+ * read as zeros from then on instead of being populated from the source
+ * again. The handler thread must be running while memory is discarded. This
+ * relies on removal events (UFFD_FEATURE_EVENT_REMOVE, Linux 4.11); on
+ * kernels without them, Register() fails with UserfaultStatus::Unsupported.
+ */
+class UserfaultPopulator {
+public:
+    /**
+     * Invoked with the guest physical address and size of pages that could
+     * not be read from their source and were zero-filled. Runs on the handler
+     * or prefetch thread and must not touch registered memory.
+     */
+    using FailureHandler = std::function<void(uint64_t address, uint64_t size)>;
+
+    /**
+     * The number of bytes populated at once when resolving a fault, if none
+     * of the surrounding pages were populated yet.
+     */
+    static constexpr size_t kFaultBlockSize = 64 * 1024;
+
+    UserfaultPopulator() noexcept = default;
+    ~UserfaultPopulator() noexcept;
+
+    // Prevent copy construction and copy assignment
+    UserfaultPopulator(const UserfaultPopulator&) = delete;
+    UserfaultPopulator& operator=(const UserfaultPopulator&) = delete;
+
+    // Prevent move construction and move assignment
+    UserfaultPopulator(UserfaultPopulator&&) = delete;
+    UserfaultPopulator&& operator=(UserfaultPopulator&&) = delete;
+
+    /**
+     * Registers a block of private anonymous memory that backs the guest
+     * physical range starting at baseAddress. The memory must not be
+     * populated yet; pages that were already touched are not taken from the
+     * source. The source must outlive the populator.
+     */
+    UserfaultStatus Register(const uint64_t baseAddress, void *hostMemory, const uint64_t size, PageSource& source) noexcept;
+
+    /**
+     * Starts handling faults. The guest physical addresses in hotPages are
+     * populated in the given order on a background thread.
+     */
+    UserfaultStatus Start(std::vector<uint64_t> hotPages = {}) noexcept;
+
+    /**
+     * Sets the handler invoked when pages cannot be read from their source.
+     * Must be invoked before Start().
+     */
+    UserfaultStatus SetFailureHandler(FailureHandler handler) noexcept;
+
+    /**
+     * Returns UserfaultStatus::SourceFailed if any page could not be read
+     * from its source so far, or UserfaultStatus::OK otherwise. May be
+     * invoked from any thread.
+     */
+    UserfaultStatus GetStatus() const noexcept;
+
+    /**
+     * Stops the handler threads. Pages that were not populated read as zeros
+     * from then on.
+     */
+    void Stop() noexcept;
+
+    /**
+     * Retrieves the counters collected so far. May be invoked from any
+     * thread.
+     */
+    UserfaultStatistics GetStatistics() const noexcept;
+
+private:
+    struct Range {
+        uint64_t baseAddress;
+        uint8_t *hostMemory;
+        uint64_t size;
+        PageSource *source;
+        std::vector<uint64_t> removed;   // One bit per page discarded since registration
+    };
+
+    bool Open() noexcept;
+    void HandleFaults() noexcept;
+    void Prefetch() noexcept;
+    void MarkRemoved(const uint8_t *start, const uint8_t *end) noexcept;
+    const Range *FindHostRange(const uint8_t *hostAddress) const noexcept;
+    const Range *FindGuestRange(const uint64_t address) const noexcept;
+    // Copies pages from the source; exists is set if some of them are already
+    // present or were discarded
+    bool Populate(const Range& range, uint64_t offset, size_t size, void *buffer, bool& exists) noexcept;
+    bool ZeroFill(const Range& range, uint64_t offset, size_t size, bool& exists) noexcept;
+
+    int m_uffd = -1;
+    int m_stopEvent = -1;
+    std::vector<Range> m_ranges;
+
+    // Held while removal events are read and recorded and while pages are
+    // checked for removal and copied in, but not while the source is read,
+    // so that pages are never populated from the source after being
+    // discarded
+    std::mutex m_mutex;
+    std::vector<uint64_t> m_hotPages;
+    FailureHandler m_failureHandler;
+
+    std::thread m_handlerThread;
+    std::thread m_prefetchThread;
+    std::atomic<bool> m_stopping{ false };
+
+    std::atomic<uint64_t> m_faults{ 0 };
+    std::atomic<uint64_t> m_faultedPages{ 0 };
+    std::atomic<uint64_t> m_prefetchedPages{ 0 };
+    std::atomic<uint64_t> m_failedPages{ 0 };
+};
+
+/**
+ * Intercepts the first write to every page of registered blocks of memory.
+ *
+ * Once started, every registered page is write-protected. The first write to
+ * a page blocks the writing thread and invokes the write handler with the
+ * address of the page on the handler thread, while the page still holds its
+ * original contents. The page is then unprotected and the writer resumes.
+ * Reads are never intercepted.
+ *
+ * Only private anonymous memory and shared memory, such as memfds, can be
+ * write-protected; memory mapped from regular files cannot.
+ */
+class UserfaultWriteProtector {
+public:
+    using WriteHandler = std::function<void(const uint8_t *page)>;
+
+    UserfaultWriteProtector() noexcept = default;
+    ~UserfaultWriteProtector() noexcept;
+
+    // Prevent copy construction and copy assignment
+    UserfaultWriteProtector(const UserfaultWriteProtector&) = delete;
+    UserfaultWriteProtector& operator=(const UserfaultWriteProtector&) = delete;
+
+    // Prevent move construction and move assignment
+    UserfaultWriteProtector(UserfaultWriteProtector&&) = delete;
+    UserfaultWriteProtector&& operator=(UserfaultWriteProtector&&) = delete;
+
+    /**
+     * Registers a block of host memory to be write-protected.
+     */
+    UserfaultStatus Register(void *hostMemory, const uint64_t size) noexcept;
+
+    /**
+     * Write-protects all registered memory and starts invoking the handler on
+     * writes.
+     */
+    UserfaultStatus Start(WriteHandler handler) noexcept;
+
+    /**
+     * Removes write protection from part of the registered memory. Writes to
+     * the range are no longer intercepted. May be invoked from any thread.
+     */
+    void Unprotect(const void *hostMemory, const uint64_t size) noexcept;
+
+    /**
+     * Stops the handler thread, removes write protection from all registered
+     * memory and unregisters it.
+     */
+    void Stop() noexcept;
+
+    /**
+     * Retrieves the number of writes intercepted so far. May be invoked from
+     * any thread.
+     */
+    uint64_t GetWriteFaults() const noexcept { return m_writeFaults.load(std::memory_order_relaxed); }
+
+private:
+    struct Range {
+        uint8_t *hostMemory;
+        uint64_t size;
+    };
+
+    bool Open() noexcept;
+    void HandleFaults() noexcept;
+
+    int m_uffd = -1;
+    int m_stopEvent = -1;
+    bool m_protectsUnpopulated = false;
+    std::vector<Range> m_ranges;
+    WriteHandler m_handler;
+
+    std::thread m_handlerThread;
+    std::atomic<bool> m_stopping{ false };
+
+    std::atomic<uint64_t> m_writeFaults{ 0 };
+};
+
+}
@@ -0,0 +1,194 @@
+/*
+Helpers for reading and writing whole blocks of snapshot files.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/snapshot/format.hpp"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <new>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace virt86::snapshot {
+
+// Writes the entire block to the file descriptor at the given offset,
+// retrying on short writes and interruptions
+inline bool WriteFully(const int fd, const void *data, size_t size, uint64_t offset) noexcept {
+    auto bytes = static_cast<const uint8_t *>(data);
+    while (size > 0) {
+        const ssize_t written = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (written == 0) {
+            return false;
+        }
+        bytes += written;
+        size -= static_cast<size_t>(written);
+        offset += static_cast<uint64_t>(written);
+    }
+    return true;
+}
+
+// Reads the entire block from the file descriptor at the given offset,
+// retrying on short reads and interruptions. Fails on end of file.
+inline bool ReadFully(const int fd, void *data, size_t size, uint64_t offset) noexcept {
+    auto bytes = static_cast<uint8_t *>(data);
+    while (size > 0) {
+        const ssize_t read = pread(fd, bytes, size, static_cast<off_t>(offset));
+        if (read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (read == 0) {
+            return false;
+        }
+        bytes += read;
+        size -= static_cast<size_t>(read);
+        offset += static_cast<uint64_t>(read);
+    }
+    return true;
+}
+
+// Writes the entire block to a stream, such as a pipe or a socket, retrying
+// on short writes and interruptions. Sockets whose peer went away fail the
+// write instead of raising SIGPIPE.
+inline bool WriteStream(const int fd, const void *data, size_t size) noexcept {
+    auto bytes = static_cast<const uint8_t *>(data);
+    while (size > 0) {
+        ssize_t written = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (written < 0 && errno == ENOTSOCK) {
+            written = write(fd, bytes, size);
+        }
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (written == 0) {
+            return false;
+        }
+        bytes += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+// Reads the entire block from a stream, retrying on short reads and
+// interruptions. Fails on end of stream.
+inline bool ReadStream(const int fd, void *data, size_t size) noexcept {
+    auto bytes = static_cast<uint8_t *>(data);
+    while (size > 0) {
+        const ssize_t read = ::read(fd, bytes, size);
+        if (read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (read == 0) {
+            return false;
+        }
+        bytes += read;
+        size -= static_cast<size_t>(read);
+    }
+    return true;
+}
+
+// Creates a file next to the given path under a unique temporary name, so
+// that it can be written completely before ReplaceFile() moves it over the
+// path. Returns the file descriptor, or -1 on failure.
+inline int CreateTempFile(const char *path, std::string& tempPath) noexcept {
+    for (int attempt = 0; attempt < 16; attempt++) {
+        uint64_t suffix;
+        if (getrandom(&suffix, sizeof(suffix), 0) != static_cast<ssize_t>(sizeof(suffix))) {
+            return -1;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), ".%016llx.tmp", static_cast<unsigned long long>(suffix));
+        try {
+            tempPath = path;
+            tempPath += name;
+        }
+        catch (const std::bad_alloc&) {
+            return -1;
+        }
+        const int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd >= 0 || errno != EEXIST) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// Atomically replaces the file at the given path with a file created by
+// CreateTempFile(). Files open or mapped from the old path keep their
+// contents. If sync is set, the rename is made durable as well.
+inline bool ReplaceFile(const char *tempPath, const char *path, const bool sync) noexcept {
+    if (rename(tempPath, path) < 0) {
+        return false;
+    }
+    if (!sync) {
+        return true;
+    }
+
+    int dirFD;
+    try {
+        const std::string pathStr = path;
+        const size_t slash = pathStr.rfind('/');
+        const std::string dir = (slash == std::string::npos) ? "." : (slash == 0) ? "/" : pathStr.substr(0, slash);
+        dirFD = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    catch (const std::bad_alloc&) {
+        return false;
+    }
+    if (dirFD < 0) {
+        return false;
+    }
+    const bool synced = fsync(dirFD) == 0;
+    close(dirFD);
+    return synced;
+}
+
+// Rounds the value up to the snapshot block alignment
+inline constexpr uint64_t AlignUp(const uint64_t value) noexcept {
+    return (value + kSnapshotAlignment - 1) & ~(kSnapshotAlignment - 1);
+}
+
+}
@@ -0,0 +1,249 @@
+/*
+Implementation of live snapshots, written while the virtual machine runs.
+
+Guest memory is write-protected with userfaultfd while the virtual machine is
+paused. A background thread then copies guest memory into a buffer in small
+pieces, advances its position and removes write protection from the pieces it
+copied, before writing the buffer to the file. When the guest writes to a page
+that was not copied yet, the write handler preserves the original contents of
+the page, which the background thread uses in place of the modified page.
+
+Both threads synchronize on a mutex so that a page is never unprotected before
+its original contents were either copied or preserved.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/snapshot/snapshot.hpp"
+#include "virt86/platform/platform.hpp"
+#include "virt86/util/hash.hpp"
+
+#include "file_io.hpp"
+#include "live_write.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace virt86::snapshot {
+
+SnapshotWriter::~SnapshotWriter() noexcept {
+    FinishLive();
+}
+
+SnapshotStatus SnapshotWriter::StartLive(VirtualMachine& vm, const char *path) noexcept {
+    if (m_live) {
+        return SnapshotStatus::Busy;
+    }
+
+    // Write to a new file that replaces the path once complete; see
+    // Write(VirtualMachine&, const char *)
+    std::string tempPath;
+    const int fd = CreateTempFile(path, tempPath);
+    if (fd < 0) {
+        return SnapshotStatus::IOError;
+    }
+
+    const auto status = BeginLive(vm, fd, path, tempPath.c_str());
+    if (status != SnapshotStatus::OK) {
+        close(fd);
+        unlink(tempPath.c_str());
+    }
+    return status;
+}
+
+SnapshotStatus SnapshotWriter::StartLive(VirtualMachine& vm, const int fd) noexcept {
+    if (m_live) {
+        return SnapshotStatus::Busy;
+    }
+    return BeginLive(vm, fd, nullptr, nullptr);
+}
+
+SnapshotStatus SnapshotWriter::BeginLive(VirtualMachine& vm, const int fd, const char *path, const char *tempPath) noexcept {
+    if (!vm.GetPlatform().GetFeatures().vpStateSaveRestore) {
+        return SnapshotStatus::Unsupported;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    m_statistics = {};
+
+    auto live = std::make_unique<LiveWrite>();
+    live->fd = fd;
+    if (path != nullptr) {
+        live->path = path;
+        live->tempPath = tempPath;
+    }
+    live->start = start;
+    live->regions = vm.GetMemoryRegions();
+
+    auto status = Prepare(vm, fd, path == nullptr, live->layout);
+    if (status != SnapshotStatus::OK) {
+        return status;
+    }
+
+    // Protect guest memory before the virtual processors resume
+    for (auto& region : live->regions) {
+        if (live->protector.Register(region.hostMemory, region.size) != UserfaultStatus::OK) {
+            return SnapshotStatus::UserfaultFailed;
+        }
+    }
+    LiveWrite *livePtr = live.get();
+    if (live->protector.Start([livePtr](const uint8_t *page) { livePtr->OnWrite(page); }) != UserfaultStatus::OK) {
+        return SnapshotStatus::UserfaultFailed;
+    }
+    live->statistics.pauseNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    m_live = std::move(live);
+    try {
+        m_live->thread = std::thread([this] { StreamLive(); });
+    }
+    catch (const std::system_error&) {
+        m_live.reset();
+        return SnapshotStatus::UserfaultFailed;
+    }
+    return SnapshotStatus::OK;
+}
+
+SnapshotStatus SnapshotWriter::FinishLive() noexcept {
+    if (!m_live) {
+        return SnapshotStatus::OK;
+    }
+
+    m_live->thread.join();
+    auto status = m_live->status;
+    if (!m_live->path.empty()) {
+        if (close(m_live->fd) < 0 && status == SnapshotStatus::OK) {
+            status = SnapshotStatus::IOError;
+        }
+        if (status == SnapshotStatus::OK && !ReplaceFile(m_live->tempPath.c_str(), m_live->path.c_str(), m_options.sync)) {
+            status = SnapshotStatus::IOError;
+        }
+        if (status != SnapshotStatus::OK) {
+            unlink(m_live->tempPath.c_str());
+        }
+    }
+
+    if (status == SnapshotStatus::OK) {
+        m_statistics = m_live->statistics;
+    }
+    m_live.reset();
+    return status;
+}
+
+void SnapshotWriter::StreamLive() noexcept {
+    auto& live = *m_live;
+    const int fd = live.fd;
+
+    std::unique_ptr<uint8_t[]> buffer(new (std::nothrow) uint8_t[m_options.chunkSize]);
+    if (buffer == nullptr) {
+        live.status = SnapshotStatus::IOError;
+    }
+
+    for (size_t i = 0; i < live.regions.size() && live.status == SnapshotStatus::OK; i++) {
+        auto& region = live.regions[i];
+        auto hostMemory = static_cast<const uint8_t *>(region.hostMemory);
+        const uint64_t fileOffset = live.layout.regionTable[i].fileOffset;
+        Hasher64 hasher;
+
+        for (uint64_t pos = 0; pos < region.size && live.status == SnapshotStatus::OK;) {
+            const size_t len = static_cast<size_t>(std::min<uint64_t>(m_options.chunkSize, region.size - pos));
+
+            // Copy the chunk in small pieces, taking preserved pages in place
+            // of those that were written to since the snapshot started
+            for (uint64_t piece = 0; piece < len; piece += kLiveCopySize) {
+                const uint64_t pieceSize = std::min<uint64_t>(kLiveCopySize, len - piece);
+                auto src = hostMemory + pos + piece;
+                auto dst = buffer.get() + piece;
+                bool shared = false;
+                {
+                    std::lock_guard<std::mutex> lock(live.mutex);
+                    if (live.preservedPages.empty()) {
+                        memcpy(dst, src, pieceSize);
+                    }
+                    else {
+                        for (uint64_t page = 0; page < pieceSize; page += kPageSize) {
+                            auto it = live.preservedPages.find(src + page);
+                            memcpy(dst + page, (it != live.preservedPages.end()) ? it->second.get() : src + page, kPageSize);
+                        }
+                    }
+
+                    // Move past the piece and release preserved pages that
+                    // no other region needs
+                    live.region = i;
+                    live.offset = pos + piece + pieceSize;
+                    if (live.offset == region.size) {
+                        live.region = i + 1;
+                        live.offset = 0;
+                    }
+                    for (uint64_t page = 0; page < pieceSize && !live.preservedPages.empty(); page += kPageSize) {
+                        auto it = live.preservedPages.find(src + page);
+                        if (it != live.preservedPages.end() && !live.IsPending(src + page)) {
+                            live.preservedPages.erase(it);
+                        }
+                    }
+                    for (size_t j = live.region; j < live.regions.size() && !shared; j++) {
+                        auto otherMemory = static_cast<const uint8_t *>(live.regions[j].hostMemory);
+                        shared = src < otherMemory + live.regions[j].size && otherMemory < src + pieceSize;
+                    }
+                }
+
+                // Let the guest write to the piece freely, unless another
+                // region that maps the same memory still has to be saved
+                if (!shared) {
+                    live.protector.Unprotect(src, pieceSize);
+                }
+            }
+
+            if (!WriteFully(fd, buffer.get(), len, fileOffset + pos)) {
+                live.status = SnapshotStatus::IOError;
+                break;
+            }
+            if (m_options.checksums) {
+                hasher.Update(buffer.get(), len);
+            }
+            pos += len;
+            live.statistics.memoryBytes += len;
+        }
+        live.layout.regionTable[i].checksum = m_options.checksums ? hasher.Digest() : 0;
+    }
+
+    // Release any pages still protected, including those left behind on
+    // failure, so that the guest never stalls
+    live.protector.Stop();
+    live.preservedPages.clear();
+    if (live.preserveFailed && live.status == SnapshotStatus::OK) {
+        live.status = SnapshotStatus::IOError;
+    }
+
+    if (live.status == SnapshotStatus::OK) {
+        live.status = Finish(fd, live.layout);
+    }
+    live.statistics.fileSize = live.layout.header.fileSize;
+    live.statistics.elapsedNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - live.start).count();
+}
+
+}
@@ -0,0 +1,110 @@
+/*
+Defines the state of a live snapshot being written in the background.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "virt86/snapshot/snapshot.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace virt86::snapshot {
+
+static constexpr uint64_t kPageSize = 0x1000;
+
+// The amount of guest memory copied while holding the lock. Writers that
+// fault on pages being copied wait for at most this much memory to be copied.
+static constexpr uint64_t kLiveCopySize = 256 * 1024;
+
+struct SnapshotWriter::LiveWrite {
+    int fd = -1;
+    std::string path;       // Set if the file was created by StartLive()
+    std::string tempPath;   // The file written in its place until FinishLive()
+
+    Layout layout;
+    std::vector<MemoryRegion> regions;
+
+    // Guards the position of the background thread, the preserved pages and
+    // the preservation failure flag
+    std::mutex mutex;
+    size_t region = 0;
+    uint64_t offset = 0;
+    std::unordered_map<const uint8_t *, std::unique_ptr<uint8_t[]>> preservedPages;
+    bool preserveFailed = false;
+
+    std::thread thread;
+    SnapshotStatus status = SnapshotStatus::OK;
+    SnapshotWriteStatistics statistics;
+    std::chrono::steady_clock::time_point start;
+
+    // Declared last so that the handler thread stops before anything it uses
+    // is destroyed
+    UserfaultWriteProtector protector;
+
+    // Determines if the host page still has to be saved for any region that
+    // maps it. Must be invoked with the mutex held.
+    bool IsPending(const uint8_t *page) const noexcept {
+        for (size_t i = region; i < regions.size(); i++) {
+            auto hostMemory = static_cast<const uint8_t *>(regions[i].hostMemory);
+            if (page >= hostMemory && page < hostMemory + regions[i].size) {
+                if (i > region || static_cast<uint64_t>(page - hostMemory) >= offset) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Preserves the original contents of a page about to be written to
+    void OnWrite(const uint8_t *page) noexcept {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!IsPending(page) || preservedPages.count(page)) {
+            return;
+        }
+        std::unique_ptr<uint8_t[]> copy(new (std::nothrow) uint8_t[kPageSize]);
+        if (copy == nullptr) {
+            // The page will be saved with the contents written by the guest
+            preserveFailed = true;
+            return;
+        }
+        memcpy(copy.get(), page, kPageSize);
+        try {
+            preservedPages.emplace(page, std::move(copy));
+        }
+        catch (const std::bad_alloc&) {
+            preserveFailed = true;
+            return;
+        }
+        statistics.preservedPages++;
+    }
+};
+
+}
@@ -0,0 +1,455 @@
+/*
+Implementation of pre-copy migration.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/snapshot/migration.hpp"
+
+#include "file_io.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
+
+#include <sys/mman.h>
+
+namespace virt86::snapshot {
+
+static constexpr uint64_t kPageSize = 0x1000;
+
+using Clock = std::chrono::steady_clock;
+
+static uint64_t ElapsedNanos(const Clock::time_point start) noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+static uint64_t BytesPerSecond(const uint64_t bytes, const uint64_t nanos) noexcept {
+    return (nanos == 0) ? 0 : static_cast<uint64_t>(static_cast<double>(bytes) * 1e9 / static_cast<double>(nanos));
+}
+
+// ----- Sender ---------------------------------------------------------------
+
+MigrationSender::MigrationSender(const MigrationOptions& options) noexcept
+    : m_options(options)
+{
+    if (m_options.maxPagesPerRecord == 0) {
+        m_options.maxPagesPerRecord = 1;
+    }
+}
+
+MigrationStatus MigrationSender::Send(VirtualMachine& vm, const int fd, const std::function<void()>& stopVM) noexcept {
+    const auto& features = vm.GetPlatform().GetFeatures();
+    if (!features.vpStateSaveRestore) {
+        return MigrationStatus::Unsupported;
+    }
+
+    const auto start = Clock::now();
+    m_statistics = {};
+
+    const auto& memoryRegions = vm.GetMemoryRegions();
+    const size_t numProcessors = vm.GetVirtualProcessorCount();
+
+    // Send the header and the memory layout
+    MigrationStreamHeader header = {};
+    memcpy(header.magic, kMigrationMagic, sizeof(header.magic));
+    header.version = kMigrationVersion;
+    header.numRegions = static_cast<uint32_t>(memoryRegions.size());
+    header.numProcessors = static_cast<uint32_t>(numProcessors);
+    header.vpStateSize = sizeof(VPState);
+
+    std::vector<MigrationRegionEntry> regionTable(memoryRegions.size());
+    for (size_t i = 0; i < memoryRegions.size(); i++) {
+        regionTable[i].baseAddress = memoryRegions[i].baseAddress;
+        regionTable[i].size = memoryRegions[i].size;
+        regionTable[i].flags = memoryRegions[i].flags;
+    }
+    const size_t regionTableSize = regionTable.size() * sizeof(MigrationRegionEntry);
+    if (!WriteStream(fd, &header, sizeof(header)) || !WriteStream(fd, regionTable.data(), regionTableSize)) {
+        return MigrationStatus::IOError;
+    }
+    m_statistics.bytesSent += sizeof(header) + regionTableSize;
+
+    // Only regions with dirty page tracking can be sent while the guest runs
+    std::vector<TrackedRegion> trackedRegions;
+    std::vector<const MemoryRegion *> untrackedRegions;
+    for (auto& region : memoryRegions) {
+        if (features.dirtyPageTracking && BitmaskEnum(region.flags).AnyOf(MemoryFlags::DirtyPageTracking)) {
+            trackedRegions.push_back({ &region, std::vector<uint64_t>((region.size / kPageSize + 63) / 64) });
+        }
+        else {
+            untrackedRegions.push_back(&region);
+        }
+    }
+
+    // Start tracking writes, then send the tracked regions in full
+    for (auto& tracked : trackedRegions) {
+        if (vm.ClearDirtyPages(tracked.region->baseAddress, tracked.region->size) != DirtyPageTrackingStatus::OK) {
+            return MigrationStatus::DirtyTrackingFailed;
+        }
+    }
+    MigrationStatus status;
+    for (auto& tracked : trackedRegions) {
+        status = SendPages(fd, *tracked.region, 0, tracked.region->size / kPageSize);
+        if (status != MigrationStatus::OK) {
+            return status;
+        }
+    }
+    m_statistics.iterations = 1;
+
+    // Keep sending the pages written to in the meantime until few enough are
+    // left or the guest dirties them faster than they can be sent
+    uint64_t numDirtyPages = 0;
+    while (!trackedRegions.empty()) {
+        status = QueryDirtyPages(vm, trackedRegions, false, numDirtyPages);
+        if (status != MigrationStatus::OK) {
+            return status;
+        }
+        if (numDirtyPages <= m_options.convergenceThreshold || m_statistics.iterations >= m_options.maxIterations) {
+            break;
+        }
+        for (auto& tracked : trackedRegions) {
+            uint64_t pagesSent;
+            status = SendDirtyPages(fd, tracked, pagesSent);
+            if (status != MigrationStatus::OK) {
+                return status;
+            }
+        }
+        m_statistics.iterations++;
+    }
+
+    // Stop the virtual machine and send everything that is left
+    const auto stopTime = Clock::now();
+    stopVM();
+    status = SendRecord(fd, { MigrationRecordType::Stop, 0, 0 }, nullptr, 0);
+    if (status != MigrationStatus::OK) {
+        return status;
+    }
+
+    if (!trackedRegions.empty()) {
+        // The pages found dirty by the last query were not sent yet
+        status = QueryDirtyPages(vm, trackedRegions, true, numDirtyPages);
+        if (status != MigrationStatus::OK) {
+            return status;
+        }
+    }
+    for (auto& tracked : trackedRegions) {
+        uint64_t pagesSent;
+        status = SendDirtyPages(fd, tracked, pagesSent);
+        if (status != MigrationStatus::OK) {
+            return status;
+        }
+        m_statistics.finalPages += pagesSent;
+    }
+    for (auto region : untrackedRegions) {
+        status = SendPages(fd, *region, 0, region->size / kPageSize);
+        if (status != MigrationStatus::OK) {
+            return status;
+        }
+        m_statistics.finalPages += region->size / kPageSize;
+    }
+
+    std::vector<VPState> vpStates(numProcessors);
+    for (size_t i = 0; i < numProcessors; i++) {
+        auto& vp = vm.GetVirtualProcessor(i)->get();
+        if (vp.SaveState(vpStates[i]) != VPOperationStatus::OK) {
+            return MigrationStatus::VPStateFailed;
+        }
+    }
+    status = SendRecord(fd, { MigrationRecordType::VPStates, static_cast<uint32_t>(numProcessors), 0 }, vpStates.data(), vpStates.size() * sizeof(VPState));
+    if (status != MigrationStatus::OK) {
+        return status;
+    }
+
+    uint64_t guestClock;
+    if (features.guestClock && vm.GetGuestClock(&guestClock) == GuestClockStatus::OK) {
+        status = SendRecord(fd, { MigrationRecordType::GuestClock, 0, guestClock }, nullptr, 0);
+        if (status != MigrationStatus::OK) {
+            return status;
+        }
+    }
+
+    status = SendRecord(fd, { MigrationRecordType::End, 0, 0 }, nullptr, 0);
+    if (status != MigrationStatus::OK) {
+        return status;
+    }
+
+    m_statistics.downtimeNanos = ElapsedNanos(stopTime);
+    m_statistics.elapsedNanos = ElapsedNanos(start);
+    m_statistics.bytesPerSecond = BytesPerSecond(m_statistics.bytesSent, m_statistics.elapsedNanos);
+    return MigrationStatus::OK;
+}
+
+MigrationStatus MigrationSender::SendPages(const int fd, const MemoryRegion& region, uint64_t firstPage, uint64_t numPages) noexcept {
+    auto hostMemory = static_cast<const uint8_t *>(region.hostMemory);
+    while (numPages > 0) {
+        const uint32_t count = static_cast<uint32_t>(std::min<uint64_t>(numPages, m_options.maxPagesPerRecord));
+        const MigrationRecord record = { MigrationRecordType::Pages, count, region.baseAddress + firstPage * kPageSize };
+        const auto status = SendRecord(fd, record, hostMemory + firstPage * kPageSize, count * kPageSize);
+        if (status != MigrationStatus::OK) {
+            return status;
+        }
+        m_statistics.pagesSent += count;
+        firstPage += count;
+        numPages -= count;
+    }
+    return MigrationStatus::OK;
+}
+
+MigrationStatus MigrationSender::SendDirtyPages(const int fd, const TrackedRegion& tracked, uint64_t& pagesSent) noexcept {
+    pagesSent = 0;
+
+    // Send runs of consecutive dirty pages
+    const uint64_t numPages = tracked.region->size / kPageSize;
+    uint64_t page = 0;
+    while (page < numPages) {
+        const uint64_t word = tracked.bitmap[page / 64] >> (page % 64);
+        if (word == 0) {
+            page = (page | 63) + 1;
+            continue;
+        }
+        if ((word & 1) == 0) {
+            page++;
+            continue;
+        }
+
+        uint64_t end = page + 1;
+        while (end < numPages && (tracked.bitmap[end / 64] & (1ull << (end % 64)))) {
+            end++;
+        }
+        const auto status = SendPages(fd, *tracked.region, page, end - page);
+        if (status != MigrationStatus::OK) {
+            return status;
+        }
+        pagesSent += end - page;
+        page = end;
+    }
+    return MigrationStatus::OK;
+}
+
+MigrationStatus MigrationSender::SendRecord(const int fd, const MigrationRecord& record, const void *data, const size_t size) noexcept {
+    if (!WriteStream(fd, &record, sizeof(record)) || !WriteStream(fd, data, size)) {
+        return MigrationStatus::IOError;
+    }
+    m_statistics.bytesSent += sizeof(record) + size;
+    return MigrationStatus::OK;
+}
+
+MigrationStatus MigrationSender::QueryDirtyPages(VirtualMachine& vm, std::vector<TrackedRegion>& trackedRegions, const bool accumulate, uint64_t& numDirtyPages) noexcept {
+    numDirtyPages = 0;
+
+    std::vector<uint64_t> bitmap;
+    for (auto& tracked : trackedRegions) {
+        bitmap.assign(tracked.bitmap.size(), 0);
+        if (vm.QueryDirtyPages(tracked.region->baseAddress, tracked.region->size, bitmap.data(), bitmap.size() * sizeof(uint64_t)) != DirtyPageTrackingStatus::OK) {
+            return MigrationStatus::DirtyTrackingFailed;
+        }
+
+        // Ignore bits past the end of the region
+        const uint64_t numPages = tracked.region->size / kPageSize;
+        if (numPages % 64) {
+            bitmap.back() &= (1ull << (numPages % 64)) - 1;
+        }
+
+        for (size_t i = 0; i < bitmap.size(); i++) {
+            tracked.bitmap[i] = accumulate ? (tracked.bitmap[i] | bitmap[i]) : bitmap[i];
+            numDirtyPages += static_cast<uint64_t>(__builtin_popcountll(tracked.bitmap[i]));
+        }
+    }
+    return MigrationStatus::OK;
+}
+
+// ----- Receiver -------------------------------------------------------------
+
+MigrationReceiver::~MigrationReceiver() noexcept {
+    for (auto& mapping : m_mappings) {
+        munmap(mapping.address, mapping.size);
+    }
+}
+
+const std::optional<std::reference_wrapper<VirtualMachine>> MigrationReceiver::GetVirtualMachine() const noexcept {
+    if (m_vm == nullptr) {
+        return std::nullopt;
+    }
+    return *m_vm;
+}
+
+MigrationStatus MigrationReceiver::Receive(Platform& platform, const VMSpecifications& specifications, const int fd) noexcept {
+    if (!platform.GetFeatures().vpStateSaveRestore) {
+        return MigrationStatus::Unsupported;
+    }
+
+    const auto start = Clock::now();
+    m_statistics = {};
+    m_vm = nullptr;
+
+    MigrationStreamHeader header;
+    if (!ReadStream(fd, &header, sizeof(header))) {
+        return MigrationStatus::IOError;
+    }
+    if (memcmp(header.magic, kMigrationMagic, sizeof(header.magic)) != 0 || header.version != kMigrationVersion || header.vpStateSize != sizeof(VPState)) {
+        return MigrationStatus::InvalidStream;
+    }
+    if (header.numProcessors != specifications.numProcessors) {
+        return MigrationStatus::IncompatibleVM;
+    }
+
+    // Bound the region table before allocating it; the count comes from the
+    // peer
+    if (header.numRegions > kMaxMigrationRegions) {
+        return MigrationStatus::InvalidStream;
+    }
+    std::vector<MigrationRegionEntry> regionTable(header.numRegions);
+    const size_t regionTableSize = regionTable.size() * sizeof(MigrationRegionEntry);
+    if (!ReadStream(fd, regionTable.data(), regionTableSize)) {
+        return MigrationStatus::IOError;
+    }
+    m_statistics.bytesReceived += sizeof(header) + regionTableSize;
+
+    auto opt_vm = platform.CreateVM(specifications);
+    if (!opt_vm) {
+        return MigrationStatus::CreateVMFailed;
+    }
+    m_vm = std::addressof(opt_vm->get());
+
+    // Recreate the memory layout
+    const bool allocate = platform.GetFeatures().guestMemoryAllocation;
+    std::vector<Region> regions;
+    for (auto& entry : regionTable) {
+        if ((entry.baseAddress & (kPageSize - 1)) || (entry.size & (kPageSize - 1)) || entry.size == 0) {
+            return Fail(platform, MigrationStatus::InvalidStream);
+        }
+
+        void *memory;
+        if (allocate) {
+            if (m_vm->AllocateGuestMemory(entry.baseAddress, entry.size, entry.flags, &memory) != MemoryMappingStatus::OK) {
+                return Fail(platform, MigrationStatus::MappingFailed);
+            }
+        }
+        else {
+            memory = mmap(nullptr, entry.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (memory == MAP_FAILED) {
+                return Fail(platform, MigrationStatus::MappingFailed);
+            }
+            m_mappings.push_back({ memory, entry.size });
+            if (m_vm->MapGuestMemory(entry.baseAddress, entry.size, entry.flags, memory) != MemoryMappingStatus::OK) {
+                return Fail(platform, MigrationStatus::MappingFailed);
+            }
+        }
+        regions.push_back({ entry.baseAddress, entry.size, static_cast<uint8_t *>(memory) });
+    }
+
+    const auto status = ReceiveRecords(fd, regions);
+    if (status != MigrationStatus::OK) {
+        return Fail(platform, status);
+    }
+
+    m_statistics.elapsedNanos = ElapsedNanos(start);
+    m_statistics.bytesPerSecond = BytesPerSecond(m_statistics.bytesReceived, m_statistics.elapsedNanos);
+    return MigrationStatus::OK;
+}
+
+MigrationStatus MigrationReceiver::ReceiveRecords(const int fd, std::vector<Region>& regions) noexcept {
+    Clock::time_point stopTime;
+    bool stopped = false;
+    std::vector<VPState> vpStates;
+
+    for (;;) {
+        MigrationRecord record;
+        if (!ReadStream(fd, &record, sizeof(record))) {
+            return MigrationStatus::IOError;
+        }
+        m_statistics.bytesReceived += sizeof(record);
+
+        switch (record.type) {
+        case MigrationRecordType::Pages: {
+            // Read the pages straight into guest memory
+            const uint64_t size = static_cast<uint64_t>(record.count) * kPageSize;
+            auto region = std::find_if(regions.begin(), regions.end(), [&](const Region& region) {
+                return record.address >= region.baseAddress && record.address - region.baseAddress < region.size
+                    && size <= region.size - (record.address - region.baseAddress);
+            });
+            if (region == regions.end() || (record.address & (kPageSize - 1))) {
+                return MigrationStatus::InvalidStream;
+            }
+            if (!ReadStream(fd, region->hostMemory + (record.address - region->baseAddress), size)) {
+                return MigrationStatus::IOError;
+            }
+            m_statistics.bytesReceived += size;
+            m_statistics.pagesReceived += record.count;
+            break;
+        }
+        case MigrationRecordType::Stop:
+            stopTime = Clock::now();
+            stopped = true;
+            break;
+        case MigrationRecordType::VPStates: {
+            if (record.count != m_vm->GetVirtualProcessorCount()) {
+                return MigrationStatus::InvalidStream;
+            }
+            vpStates.resize(record.count);
+            if (!ReadStream(fd, vpStates.data(), vpStates.size() * sizeof(VPState))) {
+                return MigrationStatus::IOError;
+            }
+            m_statistics.bytesReceived += vpStates.size() * sizeof(VPState);
+            for (size_t i = 0; i < vpStates.size(); i++) {
+                auto& vp = m_vm->GetVirtualProcessor(i)->get();
+                // MSRs rejected in this configuration do not prevent restoring the rest
+                // of the state
+                const auto vpStatus = vp.RestoreState(vpStates[i]);
+                if (vpStatus != VPOperationStatus::OK && vpStatus != VPOperationStatus::Incomplete) {
+                    return MigrationStatus::VPStateFailed;
+                }
+            }
+            break;
+        }
+        case MigrationRecordType::GuestClock:
+            if (m_vm->GetPlatform().GetFeatures().guestClock) {
+                m_vm->SetGuestClock(record.address);
+            }
+            break;
+        case MigrationRecordType::End:
+            if (!stopped || vpStates.empty()) {
+                return MigrationStatus::InvalidStream;
+            }
+            m_statistics.downtimeNanos = ElapsedNanos(stopTime);
+            return MigrationStatus::OK;
+        default:
+            return MigrationStatus::InvalidStream;
+        }
+    }
+}
+
+MigrationStatus MigrationReceiver::Fail(Platform& platform, const MigrationStatus status) noexcept {
+    if (m_vm != nullptr) {
+        platform.FreeVM(*m_vm);
+        m_vm = nullptr;
+    }
+    for (auto& mapping : m_mappings) {
+        munmap(mapping.address, mapping.size);
+    }
+    m_mappings.clear();
+    return status;
+}
+
+}
@@ -0,0 +1,615 @@
+/*
+Implementation of the content-addressed page store.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/snapshot/page_store.hpp"
+#include "virt86/platform/platform.hpp"
+#include "virt86/util/parallel.hpp"
+
+#include "file_io.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace virt86::snapshot {
+
+static constexpr uint64_t kPageSize = 0x1000;
+
+// The number of pages hashed and stored by a thread at a time
+static constexpr uint64_t kStoreBatchPages = 256;
+
+// The number of pages restored by a thread at a time
+static constexpr uint64_t kRestoreBatchPages = 1024;
+
+// The largest number of buffers passed to pwritev()
+static constexpr size_t kMaxIOVecs = 1024;
+
+static bool IsZeroPage(const uint8_t *page) noexcept {
+    auto words = reinterpret_cast<const uint64_t *>(page);
+    for (size_t i = 0; i < kPageSize / sizeof(uint64_t); i += 8) {
+        if (words[i] | words[i + 1] | words[i + 2] | words[i + 3] | words[i + 4] | words[i + 5] | words[i + 6] | words[i + 7]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ----- Page store -----------------------------------------------------------
+
+PageStore::~PageStore() noexcept {
+    Close();
+}
+
+SnapshotStatus PageStore::Open(const char *directory) noexcept {
+    Close();
+
+    if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+        return SnapshotStatus::IOError;
+    }
+    const std::string path(directory);
+    m_pagesFd = open((path + "/pages").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    m_indexFd = open((path + "/index").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (m_pagesFd < 0 || m_indexFd < 0 || flock(m_indexFd, LOCK_EX | LOCK_NB) < 0) {
+        Close();
+        return SnapshotStatus::IOError;
+    }
+
+    struct stat pagesStat, indexStat;
+    if (fstat(m_pagesFd, &pagesStat) < 0 || fstat(m_indexFd, &indexStat) < 0) {
+        Close();
+        return SnapshotStatus::IOError;
+    }
+    m_numPages = static_cast<uint64_t>(pagesStat.st_size) / kPageSize;
+    m_indexSize = static_cast<uint64_t>(indexStat.st_size) / sizeof(PageStoreIndexEntry) * sizeof(PageStoreIndexEntry);
+
+    // Pages are hashed with a secret key generated when the store is created,
+    // so that guests cannot craft pages whose hashes collide with those of
+    // other pages. An index written under another key is of no use.
+    bool newKey;
+    if (!LoadKey(path + "/key", newKey)) {
+        Close();
+        return SnapshotStatus::IOError;
+    }
+    if (newKey) {
+        return SnapshotStatus::OK;
+    }
+
+    // Load the index, skipping entries that were not completely written or
+    // that refer to pages that never made it to the pages file
+    std::vector<PageStoreIndexEntry> entries(static_cast<uint64_t>(indexStat.st_size) / sizeof(PageStoreIndexEntry));
+    if (!ReadFully(m_indexFd, entries.data(), entries.size() * sizeof(PageStoreIndexEntry), 0)) {
+        Close();
+        return SnapshotStatus::IOError;
+    }
+    m_index.reserve(entries.size());
+    for (auto& entry : entries) {
+        if (entry.checksum == Hash64(&entry, offsetof(PageStoreIndexEntry, checksum)) && entry.slot < m_numPages) {
+            m_index.emplace(entry.hash, entry.slot);
+        }
+    }
+    return SnapshotStatus::OK;
+}
+
+bool PageStore::LoadKey(const std::string& path, bool& created) noexcept {
+    created = false;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        const bool read = ReadFully(fd, &m_key, sizeof(m_key), 0);
+        close(fd);
+        return read;
+    }
+    if (errno != ENOENT) {
+        return false;
+    }
+
+    // The store is locked, so no other process creates the key concurrently
+    if (getrandom(&m_key, sizeof(m_key), 0) != static_cast<ssize_t>(sizeof(m_key))) {
+        return false;
+    }
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    const bool written = WriteFully(fd, &m_key, sizeof(m_key), 0) && fsync(fd) == 0;
+    if (close(fd) < 0 || !written) {
+        unlink(path.c_str());
+        return false;
+    }
+    created = true;
+    return true;
+}
+
+void PageStore::Close() noexcept {
+    if (m_pagesFd >= 0) {
+        close(m_pagesFd);
+        m_pagesFd = -1;
+    }
+    if (m_indexFd >= 0) {
+        close(m_indexFd);
+        m_indexFd = -1;
+    }
+    m_index.clear();
+    m_numPages = 0;
+    m_indexSize = 0;
+    m_key = {};
+}
+
+uint64_t PageStore::GetPageCount() noexcept {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_index.size();
+}
+
+// ----- Writer ---------------------------------------------------------------
+
+PageStoreWriter::PageStoreWriter(PageStore& store, const PageStoreWriterOptions& options) noexcept
+    : m_store(store)
+    , m_options(options)
+{
+}
+
+SnapshotStatus PageStoreWriter::Write(VirtualMachine& vm, const char *manifestPath) noexcept {
+    return WriteManifest(vm, nullptr, manifestPath);
+}
+
+SnapshotStatus PageStoreWriter::WriteIncremental(VirtualMachine& vm, const PageStoreSnapshot& parent, const char *manifestPath) noexcept {
+    return WriteManifest(vm, &parent, manifestPath);
+}
+
+SnapshotStatus PageStoreWriter::WriteManifest(VirtualMachine& vm, const PageStoreSnapshot *parent, const char *manifestPath) noexcept {
+    const auto& features = vm.GetPlatform().GetFeatures();
+    if (!features.vpStateSaveRestore) {
+        return SnapshotStatus::Unsupported;
+    }
+    if (m_store.m_pagesFd < 0) {
+        return SnapshotStatus::IOError;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    m_statistics = {};
+
+    const auto& memoryRegions = vm.GetMemoryRegions();
+    const size_t numProcessors = vm.GetVirtualProcessorCount();
+
+    // An incremental snapshot must describe the same virtual machine as its
+    // parent and take its pages from the same store
+    if (parent != nullptr) {
+        const auto& parentRegions = parent->GetRegions();
+        if (parent->m_store != &m_store || parentRegions.size() != memoryRegions.size() || parent->GetVPStates().size() != numProcessors) {
+            return SnapshotStatus::IncompatibleVM;
+        }
+        for (size_t i = 0; i < memoryRegions.size(); i++) {
+            if (parentRegions[i].baseAddress != memoryRegions[i].baseAddress || parentRegions[i].size != memoryRegions[i].size) {
+                return SnapshotStatus::IncompatibleVM;
+            }
+        }
+    }
+
+    std::vector<VPState> vpStates(numProcessors);
+    for (size_t i = 0; i < numProcessors; i++) {
+        auto& vp = vm.GetVirtualProcessor(i)->get();
+        if (vp.SaveState(vpStates[i]) != VPOperationStatus::OK) {
+            return SnapshotStatus::VPStateFailed;
+        }
+    }
+
+    PageManifestHeader header = {};
+    memcpy(header.magic, kPageManifestMagic, sizeof(header.magic));
+    header.version = kPageStoreVersion;
+    header.headerSize = sizeof(PageManifestHeader);
+    header.numRegions = static_cast<uint32_t>(memoryRegions.size());
+    header.numProcessors = static_cast<uint32_t>(numProcessors);
+    header.vpStateSize = sizeof(VPState);
+    header.parentId = (parent != nullptr) ? parent->GetHeader().id : 0;
+    if (features.guestClock && vm.GetGuestClock(&header.guestClock) == GuestClockStatus::OK) {
+        header.flags |= SnapshotFileFlags::GuestClock;
+    }
+
+    std::vector<PageManifestRegion> regionTable(memoryRegions.size());
+    for (size_t i = 0; i < memoryRegions.size(); i++) {
+        regionTable[i].baseAddress = memoryRegions[i].baseAddress;
+        regionTable[i].size = memoryRegions[i].size;
+        regionTable[i].flags = memoryRegions[i].flags;
+        regionTable[i].firstPage = header.numPages;
+        header.numPages += memoryRegions[i].size / kPageSize;
+    }
+
+    // Decide which pages to scan. Incremental snapshots only scan the pages
+    // of tracked regions that were written to; full snapshots scan every page
+    // and start tracking writes anew.
+    std::vector<uint64_t> pageTable = (parent != nullptr) ? parent->GetPageTable() : std::vector<uint64_t>(header.numPages, kZeroPageSlot);
+    std::vector<ScanPage> scanPages;
+    std::vector<uint64_t> bitmap;
+    for (size_t i = 0; i < memoryRegions.size(); i++) {
+        auto& region = memoryRegions[i];
+        auto hostMemory = static_cast<const uint8_t *>(region.hostMemory);
+        const uint64_t numPages = region.size / kPageSize;
+        const bool tracked = features.dirtyPageTracking && BitmaskEnum(region.flags).AnyOf(MemoryFlags::DirtyPageTracking);
+
+        if (parent != nullptr && tracked) {
+            bitmap.assign((numPages + 63) / 64, 0);
+            if (vm.QueryDirtyPages(region.baseAddress, region.size, bitmap.data(), bitmap.size() * sizeof(uint64_t)) != DirtyPageTrackingStatus::OK) {
+                return SnapshotStatus::DirtyTrackingFailed;
+            }
+            for (uint64_t page = 0; page < numPages; page++) {
+                if (bitmap[page / 64] & (1ull << (page % 64))) {
+                    scanPages.push_back({ regionTable[i].firstPage + page, hostMemory + page * kPageSize });
+                }
+            }
+            continue;
+        }
+
+        if (tracked && vm.ClearDirtyPages(region.baseAddress, region.size) != DirtyPageTrackingStatus::OK) {
+            return SnapshotStatus::DirtyTrackingFailed;
+        }
+        for (uint64_t page = 0; page < numPages; page++) {
+            scanPages.push_back({ regionTable[i].firstPage + page, hostMemory + page * kPageSize });
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_store.m_writeMutex);
+        if (!StorePages(scanPages, pageTable)) {
+            return SnapshotStatus::IOError;
+        }
+        if (m_options.sync && (fdatasync(m_store.m_pagesFd) < 0 || fdatasync(m_store.m_indexFd) < 0)) {
+            return SnapshotStatus::IOError;
+        }
+    }
+
+    // Write the manifest, header last
+    const size_t regionTableSize = regionTable.size() * sizeof(PageManifestRegion);
+    const size_t vpStatesSize = vpStates.size() * sizeof(VPState);
+    const size_t pageTableSize = pageTable.size() * sizeof(uint64_t);
+    Hasher64 hasher;
+    hasher.Update(regionTable.data(), regionTableSize);
+    hasher.Update(vpStates.data(), vpStatesSize);
+    hasher.Update(pageTable.data(), pageTableSize);
+    header.id = hasher.Digest();
+    header.headerChecksum = Hash64(&header, offsetof(PageManifestHeader, headerChecksum));
+
+    const int fd = open(manifestPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return SnapshotStatus::IOError;
+    }
+    uint64_t offset = sizeof(PageManifestHeader);
+    bool written = WriteFully(fd, regionTable.data(), regionTableSize, offset);
+    offset += regionTableSize;
+    written = written && WriteFully(fd, vpStates.data(), vpStatesSize, offset);
+    offset += vpStatesSize;
+    written = written && WriteFully(fd, pageTable.data(), pageTableSize, offset);
+    written = written && (!m_options.sync || fdatasync(fd) == 0);
+    written = written && WriteFully(fd, &header, sizeof(header), 0);
+    written = written && (!m_options.sync || fdatasync(fd) == 0);
+    if (close(fd) < 0 || !written) {
+        unlink(manifestPath);
+        return SnapshotStatus::IOError;
+    }
+
+    m_statistics.totalPages = header.numPages;
+    m_statistics.scannedPages = scanPages.size();
+    m_statistics.elapsedNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    if (m_statistics.elapsedNanos > 0) {
+        m_statistics.bytesPerSecond = static_cast<uint64_t>(static_cast<double>(m_statistics.scannedPages * kPageSize) * 1e9 / m_statistics.elapsedNanos);
+    }
+    return SnapshotStatus::OK;
+}
+
+bool PageStoreWriter::StorePages(const std::vector<ScanPage>& pages, std::vector<uint64_t>& pageTable) noexcept {
+    std::atomic<bool> failed{ false };
+    std::atomic<uint64_t> zeroPages{ 0 };
+    std::atomic<uint64_t> duplicatePages{ 0 };
+    std::atomic<uint64_t> newPages{ 0 };
+
+    ParallelFor(m_options.numThreads, pages.size(), kStoreBatchPages, [&](const uint64_t begin, const uint64_t end) {
+        if (failed) {
+            return;
+        }
+
+        // Hash the pages of the batch without holding the lock
+        Hash128Value hashes[kStoreBatchPages];
+        bool zero[kStoreBatchPages];
+        uint64_t numZero = 0;
+        for (uint64_t i = begin; i < end; i++) {
+            zero[i - begin] = IsZeroPage(pages[i].hostMemory);
+            if (zero[i - begin]) {
+                pageTable[pages[i].index] = kZeroPageSlot;
+                numZero++;
+            }
+            else {
+                hashes[i - begin] = Hash128(pages[i].hostMemory, kPageSize, m_store.m_key);
+            }
+        }
+
+        // Look up the pages and reserve consecutive slots for the new ones
+        PageStoreIndexEntry entries[kStoreBatchPages];
+        iovec iovecs[kStoreBatchPages];
+        size_t numNew = 0;
+        uint64_t firstSlot;
+        uint64_t indexOffset;
+        {
+            std::lock_guard<std::mutex> lock(m_store.m_mutex);
+            firstSlot = m_store.m_numPages;
+            for (uint64_t i = begin; i < end; i++) {
+                if (zero[i - begin]) {
+                    continue;
+                }
+                auto result = m_store.m_index.try_emplace(hashes[i - begin], m_store.m_numPages);
+                if (result.second) {
+                    auto& entry = entries[numNew];
+                    entry.hash = hashes[i - begin];
+                    entry.slot = m_store.m_numPages++;
+                    entry.checksum = Hash64(&entry, offsetof(PageStoreIndexEntry, checksum));
+                    iovecs[numNew].iov_base = const_cast<uint8_t *>(pages[i].hostMemory);
+                    iovecs[numNew].iov_len = kPageSize;
+                    numNew++;
+                }
+                pageTable[pages[i].index] = result.first->second;
+            }
+            indexOffset = m_store.m_indexSize;
+            m_store.m_indexSize += numNew * sizeof(PageStoreIndexEntry);
+        }
+
+        // Store the new pages, then record them in the index
+        bool ok = true;
+        for (size_t i = 0; i < numNew && ok; i += kMaxIOVecs) {
+            const size_t count = std::min(numNew - i, kMaxIOVecs);
+            const ssize_t expected = static_cast<ssize_t>(count * kPageSize);
+            const off_t offset = static_cast<off_t>((firstSlot + i) * kPageSize);
+            ssize_t written = pwritev(m_store.m_pagesFd, &iovecs[i], static_cast<int>(count), offset);
+            if (written >= 0 && written < expected) {
+                // Finish short writes one page at a time
+                for (size_t page = static_cast<size_t>(written) / kPageSize; page < count && ok; page++) {
+                    ok = WriteFully(m_store.m_pagesFd, iovecs[i + page].iov_base, kPageSize, (firstSlot + i + page) * kPageSize);
+                }
+            }
+            else {
+                ok = (written == expected);
+            }
+        }
+        ok = ok && WriteFully(m_store.m_indexFd, entries, numNew * sizeof(PageStoreIndexEntry), indexOffset);
+        if (!ok) {
+            // Forget the pages so that no other snapshot refers to them
+            std::lock_guard<std::mutex> lock(m_store.m_mutex);
+            for (size_t i = 0; i < numNew; i++) {
+                m_store.m_index.erase(entries[i].hash);
+            }
+            failed = true;
+            return;
+        }
+
+        zeroPages.fetch_add(numZero, std::memory_order_relaxed);
+        newPages.fetch_add(numNew, std::memory_order_relaxed);
+        duplicatePages.fetch_add((end - begin) - numZero - numNew, std::memory_order_relaxed);
+    });
+    m_statistics.zeroPages = zeroPages;
+    m_statistics.duplicatePages = duplicatePages;
+    m_statistics.newPages = newPages;
+    return !failed;
+}
+
+// ----- Snapshot -------------------------------------------------------------
+
+PageStoreSnapshot::~PageStoreSnapshot() noexcept {
+    Close();
+}
+
+SnapshotStatus PageStoreSnapshot::Open(PageStore& store, const char *manifestPath) noexcept {
+    Close();
+
+    const int fd = open(manifestPath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return SnapshotStatus::IOError;
+    }
+
+    auto fail = [&](const SnapshotStatus status) {
+        close(fd);
+        Close();
+        return status;
+    };
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return fail(SnapshotStatus::IOError);
+    }
+    const uint64_t fileSize = static_cast<uint64_t>(st.st_size);
+
+    if (fileSize < sizeof(PageManifestHeader) || !ReadFully(fd, &m_header, sizeof(m_header), 0)
+        || memcmp(m_header.magic, kPageManifestMagic, sizeof(m_header.magic)) != 0) {
+        return fail(SnapshotStatus::InvalidFile);
+    }
+    if (m_header.version != kPageStoreVersion || m_header.headerSize != sizeof(PageManifestHeader) || m_header.vpStateSize != sizeof(VPState)) {
+        return fail(SnapshotStatus::UnsupportedVersion);
+    }
+    if (m_header.headerChecksum != Hash64(&m_header, offsetof(PageManifestHeader, headerChecksum))) {
+        return fail(SnapshotStatus::ChecksumMismatch);
+    }
+
+    const uint64_t regionTableSize = static_cast<uint64_t>(m_header.numRegions) * sizeof(PageManifestRegion);
+    const uint64_t vpStatesSize = static_cast<uint64_t>(m_header.numProcessors) * sizeof(VPState);
+    if (m_header.numPages > fileSize / sizeof(uint64_t)
+        || sizeof(PageManifestHeader) + regionTableSize + vpStatesSize + m_header.numPages * sizeof(uint64_t) != fileSize) {
+        return fail(SnapshotStatus::InvalidFile);
+    }
+
+    m_regions.resize(m_header.numRegions);
+    m_vpStates.resize(m_header.numProcessors);
+    m_pageTable.resize(m_header.numPages);
+    uint64_t offset = sizeof(PageManifestHeader);
+    bool read = ReadFully(fd, m_regions.data(), regionTableSize, offset);
+    offset += regionTableSize;
+    read = read && ReadFully(fd, m_vpStates.data(), vpStatesSize, offset);
+    offset += vpStatesSize;
+    read = read && ReadFully(fd, m_pageTable.data(), m_pageTable.size() * sizeof(uint64_t), offset);
+    if (!read) {
+        return fail(SnapshotStatus::IOError);
+    }
+    close(fd);
+
+    Hasher64 hasher;
+    hasher.Update(m_regions.data(), regionTableSize);
+    hasher.Update(m_vpStates.data(), vpStatesSize);
+    hasher.Update(m_pageTable.data(), m_pageTable.size() * sizeof(uint64_t));
+    if (hasher.Digest() != m_header.id) {
+        Close();
+        return SnapshotStatus::ChecksumMismatch;
+    }
+
+    // The regions must cover the page table exactly and every page must be
+    // in the store
+    uint64_t numPages = 0;
+    for (auto& region : m_regions) {
+        if ((region.baseAddress & (kPageSize - 1)) || (region.size & (kPageSize - 1)) || region.size == 0 || region.firstPage != numPages) {
+            Close();
+            return SnapshotStatus::InvalidFile;
+        }
+        numPages += region.size / kPageSize;
+    }
+    if (numPages != m_header.numPages) {
+        Close();
+        return SnapshotStatus::InvalidFile;
+    }
+    {
+        std::lock_guard<std::mutex> lock(store.m_mutex);
+        for (auto slot : m_pageTable) {
+            if (slot != kZeroPageSlot && slot >= store.m_numPages) {
+                Close();
+                return SnapshotStatus::InvalidFile;
+            }
+        }
+    }
+
+    m_store = &store;
+    return SnapshotStatus::OK;
+}
+
+void PageStoreSnapshot::Close() noexcept {
+    for (auto& mapping : m_mappings) {
+        munmap(mapping.address, mapping.size);
+    }
+    m_mappings.clear();
+    m_regions.clear();
+    m_vpStates.clear();
+    m_pageTable.clear();
+    m_header = {};
+    m_store = nullptr;
+}
+
+SnapshotStatus PageStoreSnapshot::Restore(VirtualMachine& vm, const size_t numThreads) noexcept {
+    if (m_store == nullptr) {
+        return SnapshotStatus::InvalidFile;
+    }
+    const auto& features = vm.GetPlatform().GetFeatures();
+    if (!features.vpStateSaveRestore) {
+        return SnapshotStatus::Unsupported;
+    }
+    if (vm.GetVirtualProcessorCount() != m_vpStates.size()) {
+        return SnapshotStatus::IncompatibleVM;
+    }
+
+    // Allocate zero-filled guest memory; zero pages need no further work
+    std::vector<uint8_t *> hostMemory(m_regions.size());
+    for (size_t i = 0; i < m_regions.size(); i++) {
+        auto& region = m_regions[i];
+        void *memory;
+        if (features.guestMemoryAllocation) {
+            if (vm.AllocateGuestMemory(region.baseAddress, region.size, region.flags, &memory) != MemoryMappingStatus::OK) {
+                return SnapshotStatus::MappingFailed;
+            }
+        }
+        else {
+            memory = mmap(nullptr, region.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (memory == MAP_FAILED) {
+                return SnapshotStatus::MappingFailed;
+            }
+            m_mappings.push_back({ memory, region.size });
+            if (vm.MapGuestMemory(region.baseAddress, region.size, region.flags, memory) != MemoryMappingStatus::OK) {
+                return SnapshotStatus::MappingFailed;
+            }
+        }
+        hostMemory[i] = static_cast<uint8_t *>(memory);
+    }
+
+    // Read runs of pages that are consecutive both in guest memory and in
+    // the store with a single read
+    std::atomic<bool> failed{ false };
+    const int pagesFd = m_store->m_pagesFd;
+    ParallelFor(numThreads, m_pageTable.size(), kRestoreBatchPages, [&](const uint64_t begin, const uint64_t end) {
+        auto region = std::upper_bound(m_regions.begin(), m_regions.end(), begin, [](const uint64_t page, const PageManifestRegion& region) {
+            return page < region.firstPage;
+        }) - 1;
+        uint64_t page = begin;
+        while (page < end && !failed) {
+            const uint64_t regionEnd = region->firstPage + region->size / kPageSize;
+            if (page >= regionEnd) {
+                ++region;
+                continue;
+            }
+            const uint64_t slot = m_pageTable[page];
+            if (slot == kZeroPageSlot) {
+                page++;
+                continue;
+            }
+
+            uint64_t count = 1;
+            while (page + count < std::min(end, regionEnd) && m_pageTable[page + count] == slot + count) {
+                count++;
+            }
+            auto dest = hostMemory[region - m_regions.begin()] + (page - region->firstPage) * kPageSize;
+            if (!ReadFully(pagesFd, dest, count * kPageSize, slot * kPageSize)) {
+                failed = true;
+            }
+            page += count;
+        }
+    });
+    if (failed) {
+        return SnapshotStatus::IOError;
+    }
+
+    for (size_t i = 0; i < m_vpStates.size(); i++) {
+        auto& vp = vm.GetVirtualProcessor(i)->get();
+        // MSRs rejected in this configuration do not prevent restoring the rest
+        // of the state
+        const auto vpStatus = vp.RestoreState(m_vpStates[i]);
+        if (vpStatus != VPOperationStatus::OK && vpStatus != VPOperationStatus::Incomplete) {
+            return SnapshotStatus::VPStateFailed;
+        }
+    }
+    if (BitmaskEnum(m_header.flags).AnyOf(SnapshotFileFlags::GuestClock) && features.guestClock) {
+        vm.SetGuestClock(m_header.guestClock);
+    }
+    return SnapshotStatus::OK;
+}
+
+}
@@ -0,0 +1,274 @@
+/*
+Implementation of the snapshot reader.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/snapshot/snapshot.hpp"
+#include "virt86/platform/platform.hpp"
+#include "virt86/util/hash.hpp"
+
+#include "file_io.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace virt86::snapshot {
+
+Snapshot::~Snapshot() noexcept {
+    Close();
+}
+
+SnapshotStatus Snapshot::Open(const char *path) noexcept {
+    Close();
+
+    m_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (m_fd < 0) {
+        return SnapshotStatus::IOError;
+    }
+
+    struct stat st;
+    if (fstat(m_fd, &st) < 0) {
+        Close();
+        return SnapshotStatus::IOError;
+    }
+    const uint64_t actualFileSize = static_cast<uint64_t>(st.st_size);
+
+    // Read and validate the header
+    if (actualFileSize < sizeof(SnapshotHeader) || !ReadFully(m_fd, &m_header, sizeof(m_header), 0)) {
+        Close();
+        return SnapshotStatus::InvalidFile;
+    }
+    if (memcmp(m_header.magic, kSnapshotMagic, sizeof(m_header.magic)) != 0) {
+        Close();
+        return SnapshotStatus::InvalidFile;
+    }
+    if (m_header.version != kSnapshotVersion || m_header.headerSize != sizeof(SnapshotHeader) || m_header.vpStateSize != sizeof(VPState)) {
+        Close();
+        return SnapshotStatus::UnsupportedVersion;
+    }
+    if (m_header.headerChecksum != Hash64(&m_header, offsetof(SnapshotHeader, headerChecksum))) {
+        Close();
+        return SnapshotStatus::ChecksumMismatch;
+    }
+
+    // The tables and extents must lie within the file
+    const uint64_t regionTableSize = static_cast<uint64_t>(m_header.numRegions) * sizeof(SnapshotRegionEntry);
+    const uint64_t vpStatesSize = static_cast<uint64_t>(m_header.numProcessors) * sizeof(VPState);
+    const uint64_t hotPageTableSize = static_cast<uint64_t>(m_header.numHotPages) * sizeof(uint64_t);
+    if (m_header.fileSize > actualFileSize
+        || m_header.regionTableOffset + regionTableSize > m_header.fileSize
+        || m_header.vpStateOffset + vpStatesSize > m_header.fileSize
+        || m_header.hotPageTableOffset + hotPageTableSize > m_header.fileSize
+        || m_header.dataOffset > m_header.fileSize) {
+        Close();
+        return SnapshotStatus::InvalidFile;
+    }
+
+    // Read the region table, the virtual processor states and the hot pages
+    m_regions.resize(m_header.numRegions);
+    m_vpStates.resize(m_header.numProcessors);
+    m_hotPages.resize(m_header.numHotPages);
+    if (!ReadFully(m_fd, m_regions.data(), regionTableSize, m_header.regionTableOffset)
+        || !ReadFully(m_fd, m_vpStates.data(), vpStatesSize, m_header.vpStateOffset)
+        || !ReadFully(m_fd, m_hotPages.data(), hotPageTableSize, m_header.hotPageTableOffset)) {
+        Close();
+        return SnapshotStatus::IOError;
+    }
+    if (m_header.regionTableChecksum != Hash64(m_regions.data(), regionTableSize)
+        || m_header.vpStateChecksum != Hash64(m_vpStates.data(), vpStatesSize)
+        || m_header.hotPageTableChecksum != Hash64(m_hotPages.data(), hotPageTableSize)) {
+        Close();
+        return SnapshotStatus::ChecksumMismatch;
+    }
+
+    for (auto& region : m_regions) {
+        if ((region.fileOffset & (kSnapshotAlignment - 1)) || (region.size & (kSnapshotAlignment - 1)) || region.size == 0
+            || region.fileOffset < m_header.dataOffset || region.fileOffset + region.size > m_header.fileSize) {
+            Close();
+            return SnapshotStatus::InvalidFile;
+        }
+    }
+
+    return SnapshotStatus::OK;
+}
+
+void Snapshot::Close() noexcept {
+    // Stop resolving faults before the memory and the file go away
+    m_populators.clear();
+    m_pageSources.clear();
+    for (auto& mapping : m_mappings) {
+        munmap(mapping.address, mapping.size);
+    }
+    m_mappings.clear();
+    m_regions.clear();
+    m_vpStates.clear();
+    m_hotPages.clear();
+    m_header = {};
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+SnapshotStatus Snapshot::Verify() const noexcept {
+    if (m_fd < 0) {
+        return SnapshotStatus::InvalidFile;
+    }
+    if (BitmaskEnum(m_header.flags).NoneOf(SnapshotFileFlags::Checksums)) {
+        return SnapshotStatus::OK;
+    }
+
+    for (auto& region : m_regions) {
+        void *extent = mmap(nullptr, region.size, PROT_READ, MAP_PRIVATE, m_fd, static_cast<off_t>(region.fileOffset));
+        if (extent == MAP_FAILED) {
+            return SnapshotStatus::IOError;
+        }
+        madvise(extent, region.size, MADV_SEQUENTIAL);
+        const uint64_t checksum = Hash64(extent, region.size);
+        munmap(extent, region.size);
+        if (checksum != region.checksum) {
+            return SnapshotStatus::ChecksumMismatch;
+        }
+    }
+    return SnapshotStatus::OK;
+}
+
+SnapshotStatus Snapshot::Restore(VirtualMachine& vm, const SnapshotRestoreOptions& options) noexcept {
+    if (m_fd < 0) {
+        return SnapshotStatus::InvalidFile;
+    }
+    if (!vm.GetPlatform().GetFeatures().vpStateSaveRestore) {
+        return SnapshotStatus::Unsupported;
+    }
+    if (vm.GetVirtualProcessorCount() != m_vpStates.size()) {
+        return SnapshotStatus::IncompatibleVM;
+    }
+    if (options.verify) {
+        const auto status = Verify();
+        if (status != SnapshotStatus::OK) {
+            return status;
+        }
+    }
+
+    if (options.lazy) {
+        const auto status = RestoreLazily(vm);
+        if (status != SnapshotStatus::OK) {
+            return status;
+        }
+    }
+    else {
+        // Map the extents as guest memory. The host kernel loads pages from
+        // the file as they are touched and copies them on the first write.
+        const int populate = options.populate ? MAP_POPULATE : 0;
+        for (auto& region : m_regions) {
+            void *memory = mmap(nullptr, region.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | populate, m_fd, static_cast<off_t>(region.fileOffset));
+            if (memory == MAP_FAILED) {
+                return SnapshotStatus::MappingFailed;
+            }
+            m_mappings.push_back({ memory, region.size });
+
+            if (vm.MapGuestMemory(region.baseAddress, region.size, region.flags, memory) != MemoryMappingStatus::OK) {
+                return SnapshotStatus::MappingFailed;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < m_vpStates.size(); i++) {
+        auto& vp = vm.GetVirtualProcessor(i)->get();
+        // MSRs rejected in this configuration do not prevent restoring the rest
+        // of the state
+        const auto vpStatus = vp.RestoreState(m_vpStates[i]);
+        if (vpStatus != VPOperationStatus::OK && vpStatus != VPOperationStatus::Incomplete) {
+            return SnapshotStatus::VPStateFailed;
+        }
+    }
+
+    if (BitmaskEnum(m_header.flags).AnyOf(SnapshotFileFlags::GuestClock) && vm.GetPlatform().GetFeatures().guestClock) {
+        vm.SetGuestClock(m_header.guestClock);
+    }
+
+    return SnapshotStatus::OK;
+}
+
+SnapshotStatus Snapshot::RestoreLazily(VirtualMachine& vm) noexcept {
+    auto populator = std::make_unique<UserfaultPopulator>();
+
+    // Reserve unpopulated anonymous memory for every region and let the
+    // populator fill it from the extents on demand
+    for (auto& region : m_regions) {
+        void *memory = mmap(nullptr, region.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (memory == MAP_FAILED) {
+            return SnapshotStatus::MappingFailed;
+        }
+        m_mappings.push_back({ memory, region.size });
+
+        m_pageSources.push_back(std::make_unique<FilePageSource>(m_fd, region.fileOffset));
+        if (populator->Register(region.baseAddress, memory, region.size, *m_pageSources.back()) != UserfaultStatus::OK) {
+            return SnapshotStatus::UserfaultFailed;
+        }
+    }
+
+    // Start resolving faults before the hypervisor gets a chance to touch
+    // the memory
+    if (populator->Start(m_hotPages) != UserfaultStatus::OK) {
+        return SnapshotStatus::UserfaultFailed;
+    }
+    m_populators.push_back(std::move(populator));
+
+    size_t index = m_mappings.size() - m_regions.size();
+    for (auto& region : m_regions) {
+        if (vm.MapGuestMemory(region.baseAddress, region.size, region.flags, m_mappings[index++].address) != MemoryMappingStatus::OK) {
+            return SnapshotStatus::MappingFailed;
+        }
+    }
+    return SnapshotStatus::OK;
+}
+
+UserfaultStatistics Snapshot::GetLazyRestoreStatistics() const noexcept {
+    UserfaultStatistics total;
+    for (auto& populator : m_populators) {
+        const auto statistics = populator->GetStatistics();
+        total.faults += statistics.faults;
+        total.faultedPages += statistics.faultedPages;
+        total.prefetchedPages += statistics.prefetchedPages;
+        total.failedPages += statistics.failedPages;
+    }
+    return total;
+}
+
+SnapshotStatus Snapshot::GetLazyRestoreStatus() const noexcept {
+    for (auto& populator : m_populators) {
+        if (populator->GetStatus() != UserfaultStatus::OK) {
+            return SnapshotStatus::IOError;
+        }
+    }
+    return SnapshotStatus::OK;
+}
+
+}
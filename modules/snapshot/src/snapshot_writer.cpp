@@ -0,0 +1,319 @@
+/*
+Implementation of the snapshot writer.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/snapshot/snapshot.hpp"
+#include "virt86/platform/platform.hpp"
+#include "virt86/util/hash.hpp"
+
+#include "file_io.hpp"
+#include "live_write.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace virt86::snapshot {
+
+SnapshotWriter::SnapshotWriter(const SnapshotWriterOptions& options) noexcept
+    : m_options(options)
+{
+    if (m_options.chunkSize < kSnapshotAlignment) {
+        m_options.chunkSize = kSnapshotAlignment;
+    }
+}
+
+void SnapshotWriter::AddMemorySource(void *hostMemory, const uint64_t size, const int fd, const uint64_t offset) {
+    m_memorySources.push_back({ static_cast<const uint8_t *>(hostMemory), size, fd, offset });
+}
+
+void SnapshotWriter::SetHotPages(std::vector<uint64_t> addresses) {
+    m_hotPages = std::move(addresses);
+}
+
+SnapshotStatus SnapshotWriter::Write(VirtualMachine& vm, const char *path) noexcept {
+    // Write to a new file and move it into place only once it is complete.
+    // Truncating the existing file instead would destroy the previous
+    // snapshot on failure and pull the pages from under virtual machines
+    // restored from it, whose memory is mapped from the file.
+    std::string tempPath;
+    const int fd = CreateTempFile(path, tempPath);
+    if (fd < 0) {
+        return SnapshotStatus::IOError;
+    }
+
+    auto status = WriteSnapshot(vm, fd, false);
+    if (close(fd) < 0 && status == SnapshotStatus::OK) {
+        status = SnapshotStatus::IOError;
+    }
+    if (status == SnapshotStatus::OK && !ReplaceFile(tempPath.c_str(), path, m_options.sync)) {
+        status = SnapshotStatus::IOError;
+    }
+    if (status != SnapshotStatus::OK) {
+        unlink(tempPath.c_str());
+    }
+    return status;
+}
+
+SnapshotStatus SnapshotWriter::Write(VirtualMachine& vm, const int fd) noexcept {
+    return WriteSnapshot(vm, fd, true);
+}
+
+SnapshotStatus SnapshotWriter::WriteSnapshot(VirtualMachine& vm, const int fd, const bool truncate) noexcept {
+    if (m_live) {
+        return SnapshotStatus::Busy;
+    }
+    if (!vm.GetPlatform().GetFeatures().vpStateSaveRestore) {
+        return SnapshotStatus::Unsupported;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    m_statistics = {};
+
+    Layout layout;
+    auto status = Prepare(vm, fd, truncate, layout);
+    if (status != SnapshotStatus::OK) {
+        return status;
+    }
+
+    // Write the extents
+    const auto& memoryRegions = vm.GetMemoryRegions();
+    for (size_t i = 0; i < memoryRegions.size(); i++) {
+        status = WriteExtent(fd, memoryRegions[i], layout.regionTable[i].fileOffset, layout.regionTable[i].checksum);
+        if (status != SnapshotStatus::OK) {
+            return status;
+        }
+        m_statistics.memoryBytes += memoryRegions[i].size;
+    }
+
+    status = Finish(fd, layout);
+    if (status != SnapshotStatus::OK) {
+        return status;
+    }
+
+    m_statistics.fileSize = layout.header.fileSize;
+    m_statistics.elapsedNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    m_statistics.pauseNanos = m_statistics.elapsedNanos;
+    return SnapshotStatus::OK;
+}
+
+SnapshotStatus SnapshotWriter::Prepare(VirtualMachine& vm, const int fd, const bool truncate, Layout& layout) noexcept {
+    const auto& memoryRegions = vm.GetMemoryRegions();
+    const size_t numProcessors = vm.GetVirtualProcessorCount();
+
+    // Capture the state of all virtual processors first
+    layout.vpStates.resize(numProcessors);
+    for (size_t i = 0; i < numProcessors; i++) {
+        auto& vp = vm.GetVirtualProcessor(i)->get();
+        if (vp.SaveState(layout.vpStates[i]) != VPOperationStatus::OK) {
+            return SnapshotStatus::VPStateFailed;
+        }
+    }
+
+    auto& header = layout.header;
+    header = {};
+    memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+    header.version = kSnapshotVersion;
+    header.headerSize = sizeof(SnapshotHeader);
+    header.numRegions = static_cast<uint32_t>(memoryRegions.size());
+    header.numProcessors = static_cast<uint32_t>(numProcessors);
+    header.vpStateSize = sizeof(VPState);
+    if (m_options.checksums) {
+        header.flags |= SnapshotFileFlags::Checksums;
+    }
+    if (vm.GetPlatform().GetFeatures().guestClock && vm.GetGuestClock(&header.guestClock) == GuestClockStatus::OK) {
+        header.flags |= SnapshotFileFlags::GuestClock;
+    }
+
+    layout.hotPages = CollectHotPages(vm);
+    header.numHotPages = static_cast<uint32_t>(layout.hotPages.size());
+
+    // Lay out the file
+    header.regionTableOffset = AlignUp(sizeof(SnapshotHeader));
+    header.vpStateOffset = AlignUp(header.regionTableOffset + memoryRegions.size() * sizeof(SnapshotRegionEntry));
+    header.hotPageTableOffset = AlignUp(header.vpStateOffset + numProcessors * sizeof(VPState));
+    header.dataOffset = AlignUp(header.hotPageTableOffset + layout.hotPages.size() * sizeof(uint64_t));
+
+    layout.regionTable.assign(memoryRegions.size(), {});
+    uint64_t fileOffset = header.dataOffset;
+    for (size_t i = 0; i < memoryRegions.size(); i++) {
+        auto& entry = layout.regionTable[i];
+        entry.baseAddress = memoryRegions[i].baseAddress;
+        entry.size = memoryRegions[i].size;
+        entry.fileOffset = fileOffset;
+        entry.flags = memoryRegions[i].flags;
+        fileOffset = AlignUp(fileOffset + entry.size);
+    }
+    header.fileSize = fileOffset;
+
+    // Discard any previous contents of a caller-provided file, including a
+    // valid header, then size the file so that the extents are written
+    // sequentially into allocated space. Files created for a path are new and
+    // only need to be sized.
+    if ((truncate && ftruncate(fd, 0) < 0) || ftruncate(fd, static_cast<off_t>(header.fileSize)) < 0) {
+        return SnapshotStatus::IOError;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return SnapshotStatus::OK;
+}
+
+SnapshotStatus SnapshotWriter::Finish(const int fd, Layout& layout) noexcept {
+    auto& header = layout.header;
+
+    // Write the region table, the virtual processor states and the hot pages
+    const size_t regionTableSize = layout.regionTable.size() * sizeof(SnapshotRegionEntry);
+    const size_t vpStatesSize = layout.vpStates.size() * sizeof(VPState);
+    const size_t hotPageTableSize = layout.hotPages.size() * sizeof(uint64_t);
+    header.regionTableChecksum = Hash64(layout.regionTable.data(), regionTableSize);
+    header.vpStateChecksum = Hash64(layout.vpStates.data(), vpStatesSize);
+    header.hotPageTableChecksum = Hash64(layout.hotPages.data(), hotPageTableSize);
+    if (!WriteFully(fd, layout.regionTable.data(), regionTableSize, header.regionTableOffset)) {
+        return SnapshotStatus::IOError;
+    }
+    if (!WriteFully(fd, layout.vpStates.data(), vpStatesSize, header.vpStateOffset)) {
+        return SnapshotStatus::IOError;
+    }
+    if (!WriteFully(fd, layout.hotPages.data(), hotPageTableSize, header.hotPageTableOffset)) {
+        return SnapshotStatus::IOError;
+    }
+
+    // Make everything durable before the header validates it
+    if (m_options.sync && fdatasync(fd) < 0) {
+        return SnapshotStatus::IOError;
+    }
+
+    header.headerChecksum = Hash64(&header, offsetof(SnapshotHeader, headerChecksum));
+    if (!WriteFully(fd, &header, sizeof(header), 0)) {
+        return SnapshotStatus::IOError;
+    }
+    if (m_options.sync && fdatasync(fd) < 0) {
+        return SnapshotStatus::IOError;
+    }
+    return SnapshotStatus::OK;
+}
+
+SnapshotStatus SnapshotWriter::WriteExtent(const int fd, const MemoryRegion& region, uint64_t fileOffset, uint64_t& checksum) noexcept {
+    const auto hostMemory = static_cast<const uint8_t *>(region.hostMemory);
+    Hasher64 hasher;
+    uint64_t pos = 0;
+
+    // Copy within the kernel if the region is backed by a known file
+    if (auto source = FindMemorySource(hostMemory, region.size)) {
+        loff_t offsetIn = static_cast<loff_t>(source->offset + (hostMemory - source->hostMemory));
+        loff_t offsetOut = static_cast<loff_t>(fileOffset);
+        while (pos < region.size) {
+            const size_t len = static_cast<size_t>(std::min<uint64_t>(m_options.chunkSize, region.size - pos));
+            const ssize_t copied = copy_file_range(source->fd, &offsetIn, fd, &offsetOut, len, 0);
+            if (copied <= 0) {
+                if (copied < 0 && errno == EINTR) {
+                    continue;
+                }
+                // Not supported between these files; write the rest normally
+                break;
+            }
+            if (m_options.checksums) {
+                hasher.Update(hostMemory + pos, static_cast<size_t>(copied));
+            }
+            pos += static_cast<uint64_t>(copied);
+            m_statistics.copiedBytes += static_cast<uint64_t>(copied);
+        }
+    }
+
+    // Stream the remainder in large sequential writes, hashing each chunk
+    // while it is still in cache
+    while (pos < region.size) {
+        const size_t len = static_cast<size_t>(std::min<uint64_t>(m_options.chunkSize, region.size - pos));
+        if (!WriteFully(fd, hostMemory + pos, len, fileOffset + pos)) {
+            return SnapshotStatus::IOError;
+        }
+        if (m_options.checksums) {
+            hasher.Update(hostMemory + pos, len);
+        }
+        pos += len;
+    }
+
+    checksum = m_options.checksums ? hasher.Digest() : 0;
+    return SnapshotStatus::OK;
+}
+
+std::vector<uint64_t> SnapshotWriter::CollectHotPages(VirtualMachine& vm) const {
+    const auto& memoryRegions = vm.GetMemoryRegions();
+    std::vector<uint64_t> hotPages;
+
+    auto isMapped = [&](const uint64_t address) {
+        for (auto& region : memoryRegions) {
+            if (address >= region.baseAddress && address - region.baseAddress < region.size) {
+                return true;
+            }
+        }
+        return false;
+    };
+    for (auto address : m_hotPages) {
+        address &= ~(kSnapshotAlignment - 1);
+        if (isMapped(address)) {
+            hotPages.push_back(address);
+        }
+    }
+
+    if (m_options.recordDirtyPagesAsHot && vm.GetPlatform().GetFeatures().dirtyPageTracking) {
+        std::vector<uint64_t> bitmap;
+        for (auto& region : memoryRegions) {
+            if (BitmaskEnum(region.flags).NoneOf(MemoryFlags::DirtyPageTracking)) {
+                continue;
+            }
+            const uint64_t numPages = region.size / kSnapshotAlignment;
+            bitmap.assign((numPages + 63) / 64, 0);
+            if (vm.QueryDirtyPages(region.baseAddress, region.size, bitmap.data(), bitmap.size() * sizeof(uint64_t)) != DirtyPageTrackingStatus::OK) {
+                continue;
+            }
+            for (uint64_t page = 0; page < numPages; page++) {
+                if (bitmap[page / 64] & (1ull << (page % 64))) {
+                    hotPages.push_back(region.baseAddress + page * kSnapshotAlignment);
+                }
+            }
+        }
+    }
+
+    // Store pages in ascending order so that they are prefetched with
+    // sequential reads
+    std::sort(hotPages.begin(), hotPages.end());
+    hotPages.erase(std::unique(hotPages.begin(), hotPages.end()), hotPages.end());
+    return hotPages;
+}
+
+const SnapshotWriter::MemorySource *SnapshotWriter::FindMemorySource(const uint8_t *hostMemory, const uint64_t size) const noexcept {
+    for (auto& source : m_memorySources) {
+        if (hostMemory >= source.hostMemory && hostMemory + size <= source.hostMemory + source.size) {
+            return &source;
+        }
+    }
+    return nullptr;
+}
+
+}
@@ -0,0 +1,644 @@
+/*
+Implementation of lazy guest memory population with userfaultfd.
+-------------------------------------------------------------------------------
+MIT License
+
+Copyright (c) 2019 Ivan Roberto de Oliveira
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "virt86/snapshot/userfault.hpp"
+
+#include "file_io.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <system_error>
+
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Introduced in Linux 6.4; the value is part of the kernel ABI
+#ifndef UFFD_FEATURE_WP_UNPOPULATED
+#  define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+#endif
+
+namespace virt86::snapshot {
+
+static constexpr uint64_t kPageSize = 0x1000;
+
+// Buffer used by the handler threads to stage pages read from a source
+struct alignas(kPageSize) PageBuffer {
+    uint8_t data[UserfaultPopulator::kFaultBlockSize];
+};
+
+// Opens a userfaultfd and enables the requested features. If
+// supportedFeatures is not null, it receives the features supported by the
+// kernel. Returns -1 on failure.
+//
+// UFFD_USER_MODE_ONLY is deliberately not used as a fallback when the kernel
+// refuses unprivileged access (EPERM): KVM reaches guest memory through
+// get_user_pages(), so its faults are kernel-mode faults that such a
+// descriptor never reports, and KVM_RUN would fail with EFAULT instead.
+static int OpenUserfaultfd(const uint64_t features, uint64_t *supportedFeatures = nullptr) noexcept {
+    const int uffd = static_cast<int>(syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK));
+    if (uffd < 0) {
+        return -1;
+    }
+
+    uffdio_api api = {};
+    api.api = UFFD_API;
+    api.features = features;
+    if (ioctl(uffd, UFFDIO_API, &api) < 0 || (api.features & features) != features) {
+        close(uffd);
+        return -1;
+    }
+    if (supportedFeatures != nullptr) {
+        *supportedFeatures = api.features;
+    }
+    return uffd;
+}
+
+// Checks if any of the given pages is set in a bitmap
+static bool AnyPageSet(const std::vector<uint64_t>& bitmap, const uint64_t firstPage, const uint64_t numPages) noexcept {
+    for (uint64_t page = firstPage; page < firstPage + numPages; page++) {
+        if (bitmap[page / 64] & (1ull << (page % 64))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// ----- Page sources ---------------------------------------------------------
+
+const void *FilePageSource::ReadPages(const uint64_t offset, void *buffer, const size_t size) noexcept {
+    return ReadFully(m_fd, buffer, size, m_fileOffset + offset) ? buffer : nullptr;
+}
+
+const void *MemoryPageSource::ReadPages(const uint64_t offset, void *buffer, const size_t size) noexcept {
+    return m_baseline + offset;
+}
+
+// ----- Populator ------------------------------------------------------------
+
+UserfaultPopulator::~UserfaultPopulator() noexcept {
+    Stop();
+}
+
+bool UserfaultPopulator::Open() noexcept {
+    if (m_uffd >= 0) {
+        return true;
+    }
+
+    // Removal events let the handler tell discarded pages apart from pages
+    // that were never populated. Without them, discarded pages would be
+    // populated from the source again instead of reading as zeros, so
+    // refuse to work on kernels that cannot report them.
+    m_uffd = OpenUserfaultfd(UFFD_FEATURE_EVENT_REMOVE);
+    if (m_uffd < 0) {
+        return false;
+    }
+
+    m_stopEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_stopEvent < 0) {
+        close(m_uffd);
+        m_uffd = -1;
+        return false;
+    }
+    return true;
+}
+
+UserfaultStatus UserfaultPopulator::Register(const uint64_t baseAddress, void *hostMemory, const uint64_t size, PageSource& source) noexcept {
+    if (m_handlerThread.joinable()) {
+        return UserfaultStatus::AlreadyStarted;
+    }
+    if (size == 0 || (size & (kPageSize - 1)) || (reinterpret_cast<uintptr_t>(hostMemory) & (kPageSize - 1)) || (baseAddress & (kPageSize - 1))) {
+        return UserfaultStatus::InvalidArguments;
+    }
+    if (!Open()) {
+        return UserfaultStatus::Unsupported;
+    }
+
+    uffdio_register reg = {};
+    reg.range.start = reinterpret_cast<uintptr_t>(hostMemory);
+    reg.range.len = size;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(m_uffd, UFFDIO_REGISTER, &reg) < 0) {
+        return UserfaultStatus::RegisterFailed;
+    }
+    if ((reg.ioctls & (1ull << _UFFDIO_COPY)) == 0) {
+        uffdio_range range = reg.range;
+        ioctl(m_uffd, UFFDIO_UNREGISTER, &range);
+        return UserfaultStatus::RegisterFailed;
+    }
+
+    m_ranges.push_back({ baseAddress, static_cast<uint8_t *>(hostMemory), size, &source, std::vector<uint64_t>((size / kPageSize + 63) / 64, 0) });
+    return UserfaultStatus::OK;
+}
+
+UserfaultStatus UserfaultPopulator::SetFailureHandler(FailureHandler handler) noexcept {
+    if (m_handlerThread.joinable()) {
+        return UserfaultStatus::AlreadyStarted;
+    }
+    m_failureHandler = std::move(handler);
+    return UserfaultStatus::OK;
+}
+
+UserfaultStatus UserfaultPopulator::Start(std::vector<uint64_t> hotPages) noexcept {
+    if (m_handlerThread.joinable()) {
+        return UserfaultStatus::AlreadyStarted;
+    }
+    if (m_ranges.empty()) {
+        return UserfaultStatus::InvalidArguments;
+    }
+
+    m_hotPages = std::move(hotPages);
+    m_stopping = false;
+    try {
+        m_handlerThread = std::thread([this] { HandleFaults(); });
+        if (!m_hotPages.empty()) {
+            m_prefetchThread = std::thread([this] { Prefetch(); });
+        }
+    }
+    catch (const std::system_error&) {
+        Stop();
+        return UserfaultStatus::Failed;
+    }
+    return UserfaultStatus::OK;
+}
+
+void UserfaultPopulator::Stop() noexcept {
+    m_stopping = true;
+    if (m_stopEvent >= 0) {
+        const uint64_t value = 1;
+        [[maybe_unused]] auto result = write(m_stopEvent, &value, sizeof(value));
+    }
+    if (m_prefetchThread.joinable()) {
+        m_prefetchThread.join();
+    }
+    if (m_handlerThread.joinable()) {
+        m_handlerThread.join();
+    }
+
+    // Closing the descriptor unregisters all ranges and wakes up any thread
+    // still waiting on a fault
+    if (m_uffd >= 0) {
+        close(m_uffd);
+        m_uffd = -1;
+    }
+    if (m_stopEvent >= 0) {
+        close(m_stopEvent);
+        m_stopEvent = -1;
+    }
+    m_ranges.clear();
+    m_hotPages.clear();
+}
+
+UserfaultStatus UserfaultPopulator::GetStatus() const noexcept {
+    return (m_failedPages.load(std::memory_order_relaxed) != 0) ? UserfaultStatus::SourceFailed : UserfaultStatus::OK;
+}
+
+UserfaultStatistics UserfaultPopulator::GetStatistics() const noexcept {
+    UserfaultStatistics statistics;
+    statistics.faults = m_faults.load(std::memory_order_relaxed);
+    statistics.faultedPages = m_faultedPages.load(std::memory_order_relaxed);
+    statistics.prefetchedPages = m_prefetchedPages.load(std::memory_order_relaxed);
+    statistics.failedPages = m_failedPages.load(std::memory_order_relaxed);
+    return statistics;
+}
+
+void UserfaultPopulator::HandleFaults() noexcept {
+    auto buffer = std::make_unique<PageBuffer>();
+
+    pollfd fds[2];
+    fds[0].fd = m_uffd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_stopEvent;
+    fds[1].events = POLLIN;
+
+    uffd_msg msgs[16];
+    while (!m_stopping) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+
+        // The pages are dropped once a removal event is read, and copies into
+        // them fail with EAGAIN until then. Record removals before releasing
+        // the lock so that the prefetcher never populates them afterwards.
+        ssize_t bytesRead;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            bytesRead = read(m_uffd, msgs, sizeof(msgs));
+            for (ssize_t i = 0; i < bytesRead / static_cast<ssize_t>(sizeof(uffd_msg)); i++) {
+                if (msgs[i].event == UFFD_EVENT_REMOVE) {
+                    MarkRemoved(reinterpret_cast<const uint8_t *>(static_cast<uintptr_t>(msgs[i].arg.remove.start)),
+                        reinterpret_cast<const uint8_t *>(static_cast<uintptr_t>(msgs[i].arg.remove.end)));
+                }
+            }
+        }
+        if (bytesRead < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        // Removal bits are only set by this thread, so they can be read here
+        // without the lock
+        const size_t numMsgs = static_cast<size_t>(bytesRead) / sizeof(uffd_msg);
+        for (size_t i = 0; i < numMsgs; i++) {
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT) {
+                continue;
+            }
+
+            auto address = reinterpret_cast<const uint8_t *>(static_cast<uintptr_t>(msgs[i].arg.pagefault.address & ~(kPageSize - 1)));
+            auto range = FindHostRange(address);
+            if (range == nullptr) {
+                continue;
+            }
+            m_faults.fetch_add(1, std::memory_order_relaxed);
+
+            // Populate the whole surrounding block to save on faults during
+            // sequential accesses, then fall back to the faulting page alone
+            // if part of the block is already present
+            const uint64_t offset = address - range->hostMemory;
+            const uint64_t blockOffset = offset & ~static_cast<uint64_t>(kFaultBlockSize - 1);
+            const size_t blockSize = static_cast<size_t>(std::min<uint64_t>(kFaultBlockSize, range->size - blockOffset));
+            bool exists = false;
+            if (AnyPageSet(range->removed, blockOffset / kPageSize, blockSize / kPageSize)) {
+                // Discarded pages must not be populated from the source again
+                const bool resolved = AnyPageSet(range->removed, offset / kPageSize, 1)
+                    ? ZeroFill(*range, offset, kPageSize, exists)
+                    : Populate(*range, offset, kPageSize, buffer->data, exists);
+                if (resolved) {
+                    m_faultedPages.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+            }
+            else if (Populate(*range, blockOffset, blockSize, buffer->data, exists)) {
+                m_faultedPages.fetch_add(blockSize / kPageSize, std::memory_order_relaxed);
+                continue;
+            }
+            else if (exists && Populate(*range, offset, kPageSize, buffer->data, exists)) {
+                m_faultedPages.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+
+            // The page was populated by someone else in the meantime; make
+            // sure the faulting thread is not left waiting
+            uffdio_range wake = {};
+            wake.start = reinterpret_cast<uintptr_t>(address);
+            wake.len = kPageSize;
+            ioctl(m_uffd, UFFDIO_WAKE, &wake);
+        }
+    }
+}
+
+void UserfaultPopulator::Prefetch() noexcept {
+    auto buffer = std::make_unique<PageBuffer>();
+
+    size_t index = 0;
+    while (index < m_hotPages.size() && !m_stopping) {
+        const uint64_t address = m_hotPages[index] & ~(kPageSize - 1);
+        auto range = FindGuestRange(address);
+        if (range == nullptr) {
+            index++;
+            continue;
+        }
+
+        // Coalesce consecutive hot pages of the same range into one copy
+        const uint64_t offset = address - range->baseAddress;
+        size_t size = kPageSize;
+        size_t count = 1;
+        while (index + count < m_hotPages.size() && size < kFaultBlockSize
+            && (m_hotPages[index + count] & ~(kPageSize - 1)) == address + size
+            && offset + size < range->size) {
+            size += kPageSize;
+            count++;
+        }
+
+        bool exists = false;
+        if (Populate(*range, offset, size, buffer->data, exists)) {
+            m_prefetchedPages.fetch_add(size / kPageSize, std::memory_order_relaxed);
+        }
+        else if (exists && size > kPageSize) {
+            // Some pages of the run are present or were discarded; copy the
+            // others one by one and leave discarded pages to the handler
+            for (uint64_t pageOffset = offset; pageOffset < offset + size && !m_stopping; pageOffset += kPageSize) {
+                if (Populate(*range, pageOffset, kPageSize, buffer->data, exists)) {
+                    m_prefetchedPages.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        }
+        index += count;
+    }
+}
+
+void UserfaultPopulator::MarkRemoved(const uint8_t *start, const uint8_t *end) noexcept {
+    // The caller must hold m_mutex
+    for (auto& range : m_ranges) {
+        const uint8_t *removedStart = std::max<const uint8_t *>(start, range.hostMemory);
+        const uint8_t *removedEnd = std::min<const uint8_t *>(end, range.hostMemory + range.size);
+        if (removedStart >= removedEnd) {
+            continue;
+        }
+        const uint64_t endPage = (removedEnd - range.hostMemory + kPageSize - 1) / kPageSize;
+        for (uint64_t page = (removedStart - range.hostMemory) / kPageSize; page < endPage; page++) {
+            range.removed[page / 64] |= 1ull << (page % 64);
+        }
+    }
+}
+
+const UserfaultPopulator::Range *UserfaultPopulator::FindHostRange(const uint8_t *hostAddress) const noexcept {
+    for (auto& range : m_ranges) {
+        if (hostAddress >= range.hostMemory && hostAddress < range.hostMemory + range.size) {
+            return &range;
+        }
+    }
+    return nullptr;
+}
+
+const UserfaultPopulator::Range *UserfaultPopulator::FindGuestRange(const uint64_t address) const noexcept {
+    for (auto& range : m_ranges) {
+        if (address >= range.baseAddress && address - range.baseAddress < range.size) {
+            return &range;
+        }
+    }
+    return nullptr;
+}
+
+bool UserfaultPopulator::Populate(const Range& range, uint64_t offset, size_t size, void *buffer, bool& exists) noexcept {
+    exists = false;
+
+    const void *data = range.source->ReadPages(offset, buffer, size);
+    if (data == nullptr) {
+        // Never leave the faulting thread stuck; hand it zeros instead and
+        // report the loss
+        if (!ZeroFill(range, offset, size, exists)) {
+            return false;
+        }
+        m_failedPages.fetch_add(size / kPageSize, std::memory_order_relaxed);
+        if (m_failureHandler) {
+            m_failureHandler(range.baseAddress + offset, size);
+        }
+        return true;
+    }
+
+    // The source is read without the lock, so check for pages discarded in
+    // the meantime. Discards whose events were not read yet make the copy
+    // fail with EAGAIN; the pages are then left to the next fault.
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (AnyPageSet(range.removed, offset / kPageSize, size / kPageSize)) {
+        exists = true;
+        return false;
+    }
+
+    uffdio_copy copy = {};
+    copy.dst = reinterpret_cast<uintptr_t>(range.hostMemory + offset);
+    copy.src = reinterpret_cast<uintptr_t>(data);
+    copy.len = size;
+    copy.mode = 0;
+    if (ioctl(m_uffd, UFFDIO_COPY, &copy) < 0) {
+        exists = (errno == EEXIST);
+        return false;
+    }
+    return true;
+}
+
+bool UserfaultPopulator::ZeroFill(const Range& range, uint64_t offset, size_t size, bool& exists) noexcept {
+    exists = false;
+
+    uffdio_zeropage zeropage = {};
+    zeropage.range.start = reinterpret_cast<uintptr_t>(range.hostMemory + offset);
+    zeropage.range.len = size;
+    if (ioctl(m_uffd, UFFDIO_ZEROPAGE, &zeropage) < 0) {
+        exists = (errno == EEXIST);
+        return false;
+    }
+    return true;
+}
+
+// ----- Write protector ------------------------------------------------------
+
+UserfaultWriteProtector::~UserfaultWriteProtector() noexcept {
+    Stop();
+}
+
+bool UserfaultWriteProtector::Open() noexcept {
+    if (m_uffd >= 0) {
+        return true;
+    }
+
+    // The features that can be enabled depend on the kernel, which only
+    // reports them on a descriptor whose API was negotiated without them
+    uint64_t supportedFeatures = 0;
+    const int probe = OpenUserfaultfd(0, &supportedFeatures);
+    if (probe < 0) {
+        return false;
+    }
+    close(probe);
+    if ((supportedFeatures & UFFD_FEATURE_PAGEFAULT_FLAG_WP) == 0) {
+        return false;
+    }
+
+    // Shared memory can be write-protected since Linux 5.19. Protecting
+    // pages that were never touched requires Linux 6.4; older kernels need
+    // them to be populated first.
+    const uint64_t features = supportedFeatures & (UFFD_FEATURE_PAGEFAULT_FLAG_WP | UFFD_FEATURE_WP_HUGETLBFS_SHMEM | UFFD_FEATURE_WP_UNPOPULATED);
+    m_uffd = OpenUserfaultfd(features);
+    if (m_uffd < 0) {
+        return false;
+    }
+    m_protectsUnpopulated = (features & UFFD_FEATURE_WP_UNPOPULATED) != 0;
+
+    m_stopEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_stopEvent < 0) {
+        close(m_uffd);
+        m_uffd = -1;
+        return false;
+    }
+    return true;
+}
+
+UserfaultStatus UserfaultWriteProtector::Register(void *hostMemory, const uint64_t size) noexcept {
+    if (m_handlerThread.joinable()) {
+        return UserfaultStatus::AlreadyStarted;
+    }
+    if (size == 0 || (size & (kPageSize - 1)) || (reinterpret_cast<uintptr_t>(hostMemory) & (kPageSize - 1))) {
+        return UserfaultStatus::InvalidArguments;
+    }
+    if (!Open()) {
+        return UserfaultStatus::Unsupported;
+    }
+
+    uffdio_register reg = {};
+    reg.range.start = reinterpret_cast<uintptr_t>(hostMemory);
+    reg.range.len = size;
+    reg.mode = UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(m_uffd, UFFDIO_REGISTER, &reg) < 0) {
+        return UserfaultStatus::RegisterFailed;
+    }
+    if ((reg.ioctls & (1ull << _UFFDIO_WRITEPROTECT)) == 0) {
+        uffdio_range range = reg.range;
+        ioctl(m_uffd, UFFDIO_UNREGISTER, &range);
+        return UserfaultStatus::RegisterFailed;
+    }
+
+    m_ranges.push_back({ static_cast<uint8_t *>(hostMemory), size });
+    return UserfaultStatus::OK;
+}
+
+UserfaultStatus UserfaultWriteProtector::Start(WriteHandler handler) noexcept {
+    if (m_handlerThread.joinable()) {
+        return UserfaultStatus::AlreadyStarted;
+    }
+    if (m_ranges.empty()) {
+        return UserfaultStatus::InvalidArguments;
+    }
+
+    for (auto& range : m_ranges) {
+        // Pages that are not mapped yet cannot be protected on older kernels
+        if (!m_protectsUnpopulated && madvise(range.hostMemory, range.size, MADV_POPULATE_READ) < 0) {
+            Stop();
+            return UserfaultStatus::Failed;
+        }
+
+        uffdio_writeprotect wp = {};
+        wp.range.start = reinterpret_cast<uintptr_t>(range.hostMemory);
+        wp.range.len = range.size;
+        wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+        if (ioctl(m_uffd, UFFDIO_WRITEPROTECT, &wp) < 0) {
+            Stop();
+            return UserfaultStatus::Failed;
+        }
+    }
+
+    m_handler = std::move(handler);
+    m_stopping = false;
+    try {
+        m_handlerThread = std::thread([this] { HandleFaults(); });
+    }
+    catch (const std::system_error&) {
+        Stop();
+        return UserfaultStatus::Failed;
+    }
+    return UserfaultStatus::OK;
+}
+
+void UserfaultWriteProtector::Unprotect(const void *hostMemory, const uint64_t size) noexcept {
+    if (m_uffd < 0) {
+        return;
+    }
+
+    // Also wakes up writers that are waiting on the range
+    uffdio_writeprotect wp = {};
+    wp.range.start = reinterpret_cast<uintptr_t>(hostMemory);
+    wp.range.len = size;
+    wp.mode = 0;
+    ioctl(m_uffd, UFFDIO_WRITEPROTECT, &wp);
+}
+
+void UserfaultWriteProtector::Stop() noexcept {
+    m_stopping = true;
+    if (m_stopEvent >= 0) {
+        const uint64_t value = 1;
+        [[maybe_unused]] auto result = write(m_stopEvent, &value, sizeof(value));
+    }
+    if (m_handlerThread.joinable()) {
+        m_handlerThread.join();
+    }
+
+    // Release any writer still waiting before letting go of the memory
+    if (m_uffd >= 0) {
+        for (auto& range : m_ranges) {
+            Unprotect(range.hostMemory, range.size);
+            uffdio_range unregister = {};
+            unregister.start = reinterpret_cast<uintptr_t>(range.hostMemory);
+            unregister.len = range.size;
+            ioctl(m_uffd, UFFDIO_UNREGISTER, &unregister);
+        }
+        close(m_uffd);
+        m_uffd = -1;
+    }
+    if (m_stopEvent >= 0) {
+        close(m_stopEvent);
+        m_stopEvent = -1;
+    }
+    m_ranges.clear();
+    m_handler = nullptr;
+}
+
+void UserfaultWriteProtector::HandleFaults() noexcept {
+    pollfd fds[2];
+    fds[0].fd = m_uffd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_stopEvent;
+    fds[1].events = POLLIN;
+
+    uffd_msg msgs[16];
+    while (!m_stopping) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+
+        const ssize_t bytesRead = read(m_uffd, msgs, sizeof(msgs));
+        if (bytesRead < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        const size_t numMsgs = static_cast<size_t>(bytesRead) / sizeof(uffd_msg);
+        for (size_t i = 0; i < numMsgs; i++) {
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT) {
+                continue;
+            }
+
+            // Let the handler see the page before the writer modifies it
+            auto page = reinterpret_cast<const uint8_t *>(static_cast<uintptr_t>(msgs[i].arg.pagefault.address & ~(kPageSize - 1)));
+            if (msgs[i].arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) {
+                m_writeFaults.fetch_add(1, std::memory_order_relaxed);
+                m_handler(page);
+            }
+            Unprotect(page, kPageSize);
+        }
+    }
+}
+
+}
@@ -27,8 +27,10 @@ SOFTWARE.
 
 #include <elf.h>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <vector>
 
 #include "util.h"
 
@@ -58,6 +60,19 @@ public:
      */
     virtual void *GetSectionData(const char *sectionName, size_t *size) noexcept = 0;
 
+    /**
+     * Looks up the function or object symbol that contains the specified
+     * address, using the symbol table (.symtab) or, if the file is stripped,
+     * the dynamic symbol table (.dynsym). Returns the name of the symbol and
+     * writes the offset of the address from the start of the symbol to the
+     * offset pointer, if specified. Returns nullptr if no symbol contains the
+     * address.
+     *
+     * The symbol index is built on the first lookup. This method is not
+     * thread-safe.
+     */
+    const char *LookupSymbol(const uint64_t address, uint64_t *offset = nullptr) noexcept;
+
 protected:
     Elf(const char *data, const size_t size, bool swapEndianness) noexcept;
 
@@ -65,6 +80,22 @@ protected:
     const size_t m_size;
     bool m_swapEndianness;
 
+    struct Symbol {
+        uint64_t address;
+        uint64_t size;
+        const char *name;
+    };
+
+    std::vector<Symbol> m_symbols;
+    bool m_symbolsLoaded;
+
+    /**
+     * Adds all function and object symbols from the given symbol and string
+     * tables to the symbol index.
+     */
+    template<typename Sym>
+    void LoadSymbols(const char *symbolTableName, const char *stringTableName) noexcept;
+
     template<typename T>
     T enSwap(T data) { return endianSwap(data, m_swapEndianness); }
 };
@@ -25,8 +25,10 @@ SOFTWARE.
 */
 #include "virt86/sys/linux/Elf.h"
 
+#include <algorithm>
+
 Elf::Elf(const char *data, const size_t size, bool swapEndianness) noexcept
-        : m_size(size), m_swapEndianness(swapEndianness) {
+        : m_size(size), m_swapEndianness(swapEndianness), m_symbolsLoaded(false) {
     m_data = (char *) malloc(size);
     memcpy(m_data, data, size);
 }
@@ -63,6 +65,69 @@ Elf *Elf::Load(const char *data, const size_t size) noexcept {
     }
 }
 
+const char *Elf::LookupSymbol(const uint64_t address, uint64_t *offset) noexcept {
+    if (!m_symbolsLoaded) {
+        if (m_data[EI_CLASS] == ELFCLASS32) {
+            LoadSymbols<Elf32_Sym>(".symtab", ".strtab");
+            if (m_symbols.empty()) {
+                LoadSymbols<Elf32_Sym>(".dynsym", ".dynstr");
+            }
+        } else {
+            LoadSymbols<Elf64_Sym>(".symtab", ".strtab");
+            if (m_symbols.empty()) {
+                LoadSymbols<Elf64_Sym>(".dynsym", ".dynstr");
+            }
+        }
+        std::sort(m_symbols.begin(), m_symbols.end(), [](const Symbol &lhs, const Symbol &rhs) {
+            return lhs.address < rhs.address;
+        });
+        m_symbolsLoaded = true;
+    }
+
+    // Find the last symbol that starts at or before the address
+    auto it = std::upper_bound(m_symbols.begin(), m_symbols.end(), address, [](const uint64_t addr, const Symbol &symbol) {
+        return addr < symbol.address;
+    });
+    if (it == m_symbols.begin()) {
+        return nullptr;
+    }
+    --it;
+
+    // Symbols without size extend up to the next symbol
+    if (it->size != 0 && address >= it->address + it->size) {
+        return nullptr;
+    }
+    if (offset != nullptr) {
+        *offset = address - it->address;
+    }
+    return it->name;
+}
+
+template<typename Sym>
+void Elf::LoadSymbols(const char *symbolTableName, const char *stringTableName) noexcept {
+    size_t symbolTableSize;
+    size_t stringTableSize;
+    auto symbols = (Sym *) GetSectionData(symbolTableName, &symbolTableSize);
+    auto strings = (const char *) GetSectionData(stringTableName, &stringTableSize);
+    if (symbols == nullptr || strings == nullptr) {
+        return;
+    }
+
+    const size_t count = symbolTableSize / sizeof(Sym);
+    for (size_t i = 0; i < count; i++) {
+        const auto &symbol = symbols[i];
+        const auto type = ELF64_ST_TYPE(symbol.st_info);
+        if (type != STT_FUNC && type != STT_OBJECT) {
+            continue;
+        }
+        const auto nameIndex = enSwap(symbol.st_name);
+        if (symbol.st_shndx == SHN_UNDEF || nameIndex >= stringTableSize) {
+            continue;
+        }
+        m_symbols.push_back({ enSwap(symbol.st_value), enSwap(symbol.st_size), &strings[nameIndex] });
+    }
+}
+
 // ----- Elf32 ----------------------------------------------------------------
 
 Elf32::Elf32(const char *data, const size_t size, bool swapEndianness) noexcept
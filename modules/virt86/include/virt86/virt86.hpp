@@ -57,6 +57,12 @@ SOFTWARE.
 #  include "virt86/hvf/hvf_platform.hpp"
 #endif
 
+#if defined(VIRT86_SNAPSHOT_AVAILABLE)
+#  include "virt86/snapshot/migration.hpp"
+#  include "virt86/snapshot/page_store.hpp"
+#  include "virt86/snapshot/snapshot.hpp"
+#endif
+
 namespace virt86 {
 
 using PlatformFactory = Platform& (*)();
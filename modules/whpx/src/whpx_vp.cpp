@@ -28,7 +28,10 @@ SOFTWARE.
 #include "whpx_regs.hpp"
 #include "whpx_dispatch.hpp"
 
+#include "virt86/util/tsc.hpp"
+
 #include <cassert>
+#include <cstring>
 #include <new>
 
 #include <Windows.h>
@@ -112,9 +115,15 @@ bool WhpxVirtualProcessor::Initialize() noexcept {
 
 VPExecutionStatus WhpxVirtualProcessor::RunImpl() noexcept {
     const HRESULT hr = m_dispatch.WHvRunVirtualProcessor(m_vm.Handle(), m_id, &m_exitContext, sizeof(m_exitContext));
+    m_statistics.EndGuest();
     if (S_OK != hr) {
         return VPExecutionStatus::Failed;
     }
+    if (m_exitTrace) {
+        m_exitTraceRecord.tscExit = ReadTSC();
+        m_exitTraceRecord.rip = m_exitContext.VpContext.Rip;
+        m_exitTraceRecord.flags |= ExitTraceFlags::RIPValid;
+    }
     switch (m_exitContext.ExitReason) {
     case WHvRunVpExitReasonX64Halt:                  m_exitInfo.reason = VMExitReason::HLT;       break;  // HLT instruction
     case WHvRunVpExitReasonX64MsrAccess:             HandleMSRAccess();                           break;  // MSR access
@@ -542,6 +551,7 @@ HRESULT WhpxVirtualProcessor::MemoryCallback(VOID *Context, WHV_EMULATOR_MEMORY_
 }
 
 HRESULT WhpxVirtualProcessor::HandleIO(WHV_EMULATOR_IO_ACCESS_INFO *IoAccess) noexcept {
+    m_statistics.RecordPIO(IoAccess->Port);
     if (IoAccess->Direction == WHV_IO_IN) {
         IoAccess->Data = m_io.IORead(IoAccess->Port, IoAccess->AccessSize);
     }
@@ -549,10 +559,30 @@ HRESULT WhpxVirtualProcessor::HandleIO(WHV_EMULATOR_IO_ACCESS_INFO *IoAccess) no
         m_io.IOWrite(IoAccess->Port, IoAccess->AccessSize, IoAccess->Data);
     }
 
+    if (m_exitTrace) {
+        m_exitTraceRecord.address = IoAccess->Port;
+        m_exitTraceRecord.size = static_cast<uint8_t>(IoAccess->AccessSize);
+        m_exitTraceRecord.value = IoAccess->Data;
+        m_exitTraceRecord.flags |= ExitTraceFlags::AccessValid;
+        if (IoAccess->Direction != WHV_IO_IN) {
+            m_exitTraceRecord.flags |= ExitTraceFlags::Write;
+        }
+    }
+
     return S_OK;
 }
 
 HRESULT WhpxVirtualProcessor::HandleMMIO(WHV_EMULATOR_MEMORY_ACCESS_INFO *MemoryAccess) noexcept {
+    m_statistics.RecordMMIO(MemoryAccess->GpaAddress);
+    if (m_exitTrace) {
+        m_exitTraceRecord.address = MemoryAccess->GpaAddress;
+        m_exitTraceRecord.size = MemoryAccess->AccessSize;
+        m_exitTraceRecord.flags |= ExitTraceFlags::AccessValid;
+        if (MemoryAccess->Direction != WHV_IO_IN) {
+            m_exitTraceRecord.flags |= ExitTraceFlags::Write;
+        }
+    }
+
     if (MemoryAccess->Direction == WHV_IO_IN) {
         uint64_t value = m_io.MMIORead(MemoryAccess->GpaAddress, MemoryAccess->AccessSize);
         switch (MemoryAccess->AccessSize) {
@@ -573,6 +603,12 @@ HRESULT WhpxVirtualProcessor::HandleMMIO(WHV_EMULATOR_MEMORY_ACCESS_INFO *Memory
         }
     }
     
+    if (m_exitTrace) {
+        uint64_t value = 0;
+        memcpy(&value, MemoryAccess->Data, MemoryAccess->AccessSize);
+        m_exitTraceRecord.value = value;
+    }
+
     return S_OK;
 }
 